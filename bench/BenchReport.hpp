@@ -0,0 +1,118 @@
+/*
+Machine-readable results of the benchmark programs. Each program fills a
+BenchReport alongside its console table and, given -J FILE, writes it out as
+one JSON object:
+
+    {"benchmark": "ring_bench", "version": "v1.2-14-gabcdef0",
+     "build": "Release", "flags": "-O3 -DNDEBUG",
+     "time": "2026-10-16T09:30:00Z", "host": "rig-2",
+     "params": {"frames": 1000000, "capacity": 256},
+     "results": [{"name": "spsc batch", "mfps": 41.2, "p99_ns": 900}, ...]}
+
+Results are keyed by benchmark and result name, so runs of different
+releases can be lined up; metric names carry their unit. 'version' is `git
+describe` of the tree the benchmarks were configured from, 'build' and
+'flags' the CMAKE_BUILD_TYPE and C++ compiler flags they were built with.
+*/
+#ifndef BENCH_REPORT_H
+#define BENCH_REPORT_H
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+#ifndef VIDEOCAP_VERSION
+#define VIDEOCAP_VERSION "unknown"
+#endif
+#ifndef VIDEOCAP_BUILD_TYPE
+#define VIDEOCAP_BUILD_TYPE ""
+#endif
+#ifndef VIDEOCAP_BUILD_FLAGS
+#define VIDEOCAP_BUILD_FLAGS ""
+#endif
+
+class BenchReport
+{
+public:
+    typedef std::vector<std::pair<std::string, double>> Metrics;
+
+    explicit BenchReport(const std::string &benchmark) : benchmark(benchmark) {}
+
+    void param(const std::string &key, double value)
+    {
+        params.push_back(key + "\": " + number(value));
+    }
+    void param(const std::string &key, const std::string &value)
+    {
+        params.push_back(key + "\": " + quote(value));
+    }
+    void result(const std::string &name, const Metrics &metrics)
+    {
+        std::string r = "{\"name\": " + quote(name);
+        for (const auto &m : metrics)
+            r += ", " + quote(m.first) + ": " + number(m.second);
+        results.push_back(r + "}");
+    }
+
+    bool write(const std::string &path) const
+    {
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f) {
+            perror(path.c_str());
+            return false;
+        }
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        char when[32];
+        time_t now = time(NULL);
+        strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        fprintf(f, "{\"benchmark\": %s, \"version\": %s, \"build\": %s, "
+                "\"flags\": %s, \"time\": %s, \"host\": %s,\n "
+                "\"params\": {", quote(benchmark).c_str(),
+                quote(VIDEOCAP_VERSION).c_str(),
+                quote(VIDEOCAP_BUILD_TYPE).c_str(),
+                quote(VIDEOCAP_BUILD_FLAGS).c_str(), quote(when).c_str(),
+                quote(host).c_str());
+        for (size_t i = 0; i < params.size(); ++i)
+            fprintf(f, "%s\"%s", i ? ", " : "", params[i].c_str());
+        fprintf(f, "},\n \"results\": [");
+        for (size_t i = 0; i < results.size(); ++i)
+            fprintf(f, "%s\n  %s", i ? "," : "", results[i].c_str());
+        fprintf(f, "\n]}\n");
+        return fclose(f) == 0;
+    }
+
+private:
+    std::string benchmark;
+    std::vector<std::string> params; // 'key": value', opening quote added.
+    std::vector<std::string> results; // Complete objects.
+
+    static std::string quote(const std::string &s)
+    {
+        std::string q = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\')
+                q += '\\';
+            if (static_cast<unsigned char>(c) >= 0x20)
+                q += c;
+        }
+        return q + "\"";
+    }
+    static std::string number(double v)
+    {
+        if (v != v)
+            return "null"; // NaN isn't JSON.
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.6g", v);
+        return buf;
+    }
+};
+
+#endif // BENCH_REPORT_H
@@ -0,0 +1,231 @@
+/*
+Compares the ways frames can reach the disk: cv::imwrite of one .pgm per
+frame (the original write path), plain fwrite() of the same files and of one
+stream (the floor any container has to beat), and the recording container on
+each DiskBackend. For each it reports sustained MB/s, including the final
+sync and close, and the p50/p99/max latency of a single write call as seen
+by the writer thread.
+
+    disk_bench [-d DIR] [-n FRAMES] [-s WxH] [-q DEPTH] [-D] [-J FILE]
+
+Run it on the disk that recordings go to, and on tmpfs (/dev/shm) to see how
+much of that is the writer's own overhead.
+*/
+#include <Recording.hpp>
+
+#include "BenchReport.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <getopt.h>
+#include <unistd.h>
+}
+
+#include <opencv2/imgcodecs.hpp>
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Result {
+    std::string name;
+    double mb_per_s;
+    double p50_us, p99_us, max_us;
+};
+
+static double percentile(std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0;
+    size_t i = static_cast<size_t>(p * (v.size() - 1));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static Result summarize(const std::string &name, std::vector<double> &lat,
+                        double bytes, double seconds)
+{
+    Result r;
+    r.name = name;
+    r.mb_per_s = bytes / seconds / (1 << 20);
+    r.p50_us = percentile(lat, 0.50);
+    r.p99_us = percentile(lat, 0.99);
+    r.max_us = lat.empty() ? 0 : *std::max_element(lat.begin(), lat.end());
+    return r;
+}
+
+static std::vector<Frame> make_frames(int width, int height)
+{
+    // A few distinct frames so nothing can be deduplicated along the way.
+    std::vector<Frame> frames(8);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].image = cv::Mat(height, width, CV_8U);
+        for (int r = 0; r < height; ++r)
+            for (int c = 0; c < width; ++c)
+                frames[i].image.ptr(r)[c] = static_cast<uchar>(c + r + 31 * i);
+    }
+    return frames;
+}
+
+static Result bench_imwrite(const std::string &dir, std::vector<Frame> &frames,
+                            unsigned int n)
+{
+    std::vector<double> lat;
+    double bytes = 0;
+    auto start = bench_clock::now();
+    for (unsigned int i = 0; i < n; ++i) {
+        const cv::Mat &image = frames[i % frames.size()].image;
+        std::string name = dir + "/bench_" + std::to_string(i) + ".pgm";
+        auto t0 = bench_clock::now();
+        cv::imwrite(name, image);
+        auto t1 = bench_clock::now();
+        lat.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        bytes += image.total();
+    }
+    sync();
+    double secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    for (unsigned int i = 0; i < n; ++i)
+        unlink((dir + "/bench_" + std::to_string(i) + ".pgm").c_str());
+    return summarize("imwrite", lat, bytes, secs);
+}
+
+static Result bench_fwrite(const std::string &dir, std::vector<Frame> &frames,
+                           unsigned int n, bool one_file)
+{
+    // Per-frame files carry the same PGM header imwrite() writes.
+    std::vector<double> lat;
+    double bytes = 0;
+    std::string stream = dir + "/bench_stream.raw";
+    FILE *out = one_file ? fopen(stream.c_str(), "wb") : NULL;
+    if (one_file && !out) {
+        perror(stream.c_str());
+        return summarize("fwrite stream", lat, 0, 1);
+    }
+    auto start = bench_clock::now();
+    for (unsigned int i = 0; i < n; ++i) {
+        const cv::Mat &image = frames[i % frames.size()].image;
+        auto t0 = bench_clock::now();
+        if (one_file) {
+            fwrite(image.data, 1, image.total(), out);
+        } else {
+            std::string name = dir + "/bench_" + std::to_string(i) + ".pgm";
+            FILE *f = fopen(name.c_str(), "wb");
+            if (!f) {
+                perror(name.c_str());
+                break;
+            }
+            fprintf(f, "P5\n%d %d\n255\n", image.cols, image.rows);
+            fwrite(image.data, 1, image.total(), f);
+            fclose(f);
+        }
+        auto t1 = bench_clock::now();
+        lat.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+        bytes += image.total();
+    }
+    if (out)
+        fclose(out);
+    sync();
+    double secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    if (one_file)
+        unlink(stream.c_str());
+    else
+        for (unsigned int i = 0; i < n; ++i)
+            unlink((dir + "/bench_" + std::to_string(i) + ".pgm").c_str());
+    return summarize(one_file ? "fwrite stream" : "fwrite files", lat, bytes,
+                     secs);
+}
+
+static Result bench_backend(const std::string &dir, std::vector<Frame> &frames,
+                            unsigned int n, disk_backend backend,
+                            unsigned int depth, bool direct)
+{
+    static const char *names[] = {"vcap-sync", "vcap-threads", "vcap-uring"};
+    RecordingConfig config;
+    config.base = dir + "/bench_" + names[backend];
+    config.backend = backend;
+    config.io_depth = depth;
+    config.direct_io = direct;
+
+    std::vector<double> lat;
+    auto start = bench_clock::now();
+    uint64_t bytes;
+    unsigned int segments;
+    {
+        RecordWriter writer(config);
+        for (unsigned int i = 0; i < n; ++i) {
+            auto t0 = bench_clock::now();
+            writer.append(frames[i % frames.size()], i);
+            auto t1 = bench_clock::now();
+            lat.push_back(
+                std::chrono::duration<double, std::micro>(t1 - t0).count());
+        }
+        writer.close();
+        bytes = writer.bytes_written();
+    }
+    double secs = std::chrono::duration<double>(bench_clock::now() - start).count();
+    segments = static_cast<unsigned int>(bytes / config.segment_bytes) + 1;
+    for (unsigned int s = 0; s < segments; ++s)
+        unlink(segment_path(config.base, s).c_str());
+    unlink(index_path(config.base).c_str());
+    return summarize(names[backend], lat, static_cast<double>(bytes), secs);
+}
+
+int main(int argc, char *argv[])
+{
+    std::string dir = ".";
+    unsigned int n = 2000, depth = 4;
+    int width = 1280, height = 480;
+    bool direct = false;
+    std::string json;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:n:s:q:DJ:h")) != -1) {
+        switch (c) {
+        case 'd': dir = optarg; break;
+        case 'n': n = strtoul(optarg, NULL, 10); break;
+        case 's': sscanf(optarg, "%dx%d", &width, &height); break;
+        case 'q': depth = strtoul(optarg, NULL, 10); break;
+        case 'D': direct = true; break;
+        case 'J': json = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-d DIR] [-n FRAMES] [-s WxH] "
+                    "[-q DEPTH] [-D] [-J FILE]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    std::vector<Frame> frames = make_frames(width, height);
+    std::vector<Result> results;
+    results.push_back(bench_imwrite(dir, frames, n));
+    results.push_back(bench_fwrite(dir, frames, n, false));
+    results.push_back(bench_fwrite(dir, frames, n, true));
+    results.push_back(bench_backend(dir, frames, n, DISK_SYNC, depth, direct));
+    results.push_back(bench_backend(dir, frames, n, DISK_THREADS, depth, direct));
+    results.push_back(bench_backend(dir, frames, n, DISK_URING, depth, direct));
+
+    BenchReport report("disk_bench");
+    report.param("dir", dir);
+    report.param("frames", n);
+    report.param("width", width);
+    report.param("height", height);
+    report.param("io_depth", depth);
+    report.param("direct", direct);
+    printf("%u frames of %dx%d to %s, depth %u%s\n",
+           n, width, height, dir.c_str(), depth, direct ? ", O_DIRECT" : "");
+    printf("%-14s %10s %10s %10s %10s\n",
+           "writer", "MB/s", "p50 us", "p99 us", "max us");
+    for (const Result &r : results) {
+        printf("%-14s %10.1f %10.1f %10.1f %10.1f\n", r.name.c_str(),
+               r.mb_per_s, r.p50_us, r.p99_us, r.max_us);
+        report.result(r.name, {{"mb_per_s", r.mb_per_s},
+                               {"p50_us", r.p50_us},
+                               {"p99_us", r.p99_us},
+                               {"max_us", r.max_us}});
+    }
+    if (!json.empty() && !report.write(json))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,254 @@
+/*
+End-to-end throughput of the capture pipeline on a synthetic source: a
+reader thread moves frames from the source into a frame_ring as the capture
+application does, and a write thread pops them in batches and submits them
+to a WriterPool. Each sink is run for the same time and reports frames and
+MB/s written, frames the source lost because every buffer was still in the
+pipeline, and the source-to-write latency from PipelineStats.
+
+    pipeline_bench [-s WxH] [-f FPS] [-t SECONDS] [-w WRITERS] [-b BUFFERS]
+                   [-c CAPACITY] [-o SINKS] [-d DIR] [-J FILE]
+
+SINKS is a comma separated list of 'null' (frames are only handed over),
+'pgm' (one file per frame) and 'vcap' (recording container); all three by
+default. FPS 0, the default, generates frames as fast as the pipeline takes
+them, so 'written' is the pipeline's capacity and 'lost' only says how far
+the source outran it. Give a camera's rate instead to check it keeps up.
+*/
+#include <FrameRing.hpp>
+#include <FrameSource.hpp>
+#include <PipelineStats.hpp>
+#include <Recording.hpp>
+#include <WriterPool.hpp>
+
+#include "BenchReport.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <dirent.h>
+#include <getopt.h>
+#include <unistd.h>
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct Options {
+    unsigned int width = 1280, height = 480;
+    int fps = 0;
+    double seconds = 3;
+    unsigned int writers = 2;
+    unsigned int buffers = 64;
+    size_t capacity = 32;
+    std::string dir = ".";
+};
+
+struct Result {
+    std::string name;
+    double fps; // Frames written per second.
+    double mb_per_s;
+    unsigned long written;
+    unsigned long lost; // Frames the source had no free buffer for.
+    StageSummary total; // Source to committed.
+};
+
+class NullSink : public FrameSink
+{
+public:
+    bool encode(WriteJob &job)
+    {
+        job.bytes = job.frame.image.total();
+        return true;
+    }
+};
+
+static void remove_dir(const std::string &dir)
+{
+    if (DIR *d = opendir(dir.c_str())) {
+        while (struct dirent *e = readdir(d))
+            if (e->d_name[0] != '.')
+                unlink((dir + "/" + e->d_name).c_str());
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+static Result run_pipeline(const Options &o, const std::string &sink_name)
+{
+    // Every run writes into a directory of its own, removed afterwards.
+    std::string out = o.dir + "/pipeline_bench.XXXXXX";
+    if (!mkdtemp(&out[0])) {
+        perror(out.c_str());
+        exit(EXIT_FAILURE);
+    }
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)) || chdir(out.c_str()) != 0) {
+        perror(out.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    SourceConfig config;
+    config.kind = SOURCE_SYNTHETIC;
+    config.width = o.width;
+    config.height = o.height;
+    config.fps = o.fps;
+    config.buffers = o.buffers;
+    std::unique_ptr<FrameSource> source = make_source(config);
+
+    std::unique_ptr<FrameSink> sink;
+    std::unique_ptr<RecordWriter> recorder;
+    if (sink_name == "pgm") {
+        sink.reset(new PgmSink);
+    } else if (sink_name == "vcap") {
+        RecordingConfig rc;
+        rc.base = "bench";
+        recorder.reset(new RecordWriter(rc));
+        sink.reset(new RecordSink(*recorder, CODEC_NONE));
+    } else {
+        sink.reset(new NullSink);
+    }
+
+    PipelineStats stats;
+    stats.enable(true);
+    frame_ring ring(o.capacity);
+    ring.set_stats(&stats);
+    std::atomic_ulong written(0);
+    std::atomic_bool running(true);
+    auto start = bench_clock::now();
+    double secs;
+    {
+        WriterPool pool(*sink, written, o.writers, std::vector<int>(), 0,
+                        &stats);
+        std::thread reader([&] {
+            std::vector<Frame> frames;
+            drop_counter sequence;
+            while (running) {
+                if (source->read_batch(frames, 16) == 0)
+                    continue;
+                for (Frame &frame : frames) {
+                    stats.stamp(frame, STAGE_DEQUEUE);
+                    unsigned long missing = sequence.update(frame.sequence);
+                    if (missing > 0)
+                        stats.add_drops(missing);
+                    ring.push(std::move(frame));
+                }
+            }
+            frames.clear();
+            ring.close();
+        });
+        std::thread writer([&] {
+            std::vector<Frame> batch;
+            while (ring.pop_batch(batch, 32) > 0) {
+                for (Frame &frame : batch) {
+                    stats.stamp(frame, STAGE_POP);
+                    pool.submit(std::move(frame));
+                }
+                batch.clear();
+            }
+            pool.flush();
+        });
+        std::this_thread::sleep_for(std::chrono::duration<double>(o.seconds));
+        running = false;
+        reader.join();
+        writer.join();
+        secs = std::chrono::duration<double>(bench_clock::now() - start)
+                   .count();
+    }
+    if (recorder)
+        recorder->close();
+    source->release();
+
+    Result r;
+    r.name = sink_name;
+    r.written = written;
+    r.fps = r.written / secs;
+    r.mb_per_s = r.written * static_cast<double>(source->frame_size()) / secs
+                 / (1 << 20);
+    r.lost = stats.drops();
+    r.total = stats.summary(STAGE_COUNT);
+
+    if (chdir(cwd) != 0)
+        perror(cwd);
+    remove_dir(out);
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    Options o;
+    std::string sinks = "null,pgm,vcap", json;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:f:t:w:b:c:o:d:J:h")) != -1) {
+        switch (c) {
+        case 's': sscanf(optarg, "%ux%u", &o.width, &o.height); break;
+        case 'f': o.fps = atoi(optarg); break;
+        case 't': o.seconds = atof(optarg); break;
+        case 'w': o.writers = strtoul(optarg, NULL, 10); break;
+        case 'b': o.buffers = strtoul(optarg, NULL, 10); break;
+        case 'c': o.capacity = strtoul(optarg, NULL, 10); break;
+        case 'o': sinks = optarg; break;
+        case 'd': o.dir = optarg; break;
+        case 'J': json = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-s WxH] [-f FPS] [-t SECONDS] "
+                    "[-w WRITERS] [-b BUFFERS] [-c CAPACITY] [-o SINKS] "
+                    "[-d DIR] [-J FILE]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (o.writers == 0)
+        o.writers = 1;
+    if (o.capacity < 2)
+        o.capacity = 2;
+
+    std::vector<Result> results;
+    std::stringstream list(sinks);
+    std::string name;
+    while (std::getline(list, name, ',')) {
+        if (name != "null" && name != "pgm" && name != "vcap") {
+            fprintf(stderr, "Unknown sink '%s'\n", name.c_str());
+            return 1;
+        }
+        results.push_back(run_pipeline(o, name));
+    }
+
+    BenchReport report("pipeline_bench");
+    report.param("width", o.width);
+    report.param("height", o.height);
+    report.param("fps", o.fps);
+    report.param("seconds", o.seconds);
+    report.param("writers", o.writers);
+    report.param("buffers", o.buffers);
+    report.param("capacity", o.capacity);
+    report.param("dir", o.dir);
+    printf("%ux%u %s for %.1f s, %u writers, %u buffers, ring of %zu, in %s\n",
+           o.width, o.height,
+           o.fps ? (std::to_string(o.fps) + " fps").c_str() : "unthrottled",
+           o.seconds, o.writers, o.buffers, o.capacity, o.dir.c_str());
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n", "sink", "fps", "MB/s",
+           "lost", "p50 us", "p99 us", "max us");
+    for (const Result &r : results) {
+        printf("%-8s %10.0f %10.1f %10lu %10.0f %10.0f %10.0f\n",
+               r.name.c_str(), r.fps, r.mb_per_s, r.lost, r.total.p50_us,
+               r.total.p99_us, r.total.max_us);
+        report.result(r.name, {{"fps", r.fps},
+                               {"mb_per_s", r.mb_per_s},
+                               {"written", static_cast<double>(r.written)},
+                               {"lost", static_cast<double>(r.lost)},
+                               {"p50_us", r.total.p50_us},
+                               {"p99_us", r.total.p99_us},
+                               {"max_us", r.total.max_us}});
+    }
+    if (!json.empty() && !report.write(json))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+Times rectifying a side-by-side stereo frame through the precomputed remap
+table: the scalar fixed-point loop, the remap() kernel on one thread, and a
+Rectifier splitting the frame into bands over 1 to THREADS workers besides
+the caller (the capture path, pool and hand-off included). Reports ms per
+frame and the frame rate each would keep up with, after checking the kernel
+and the scalar loop produce the same image.
+
+Without a calibration file a made-up one is used: 500 px focal length,
+barrel distortion and a degree of rotation each way, about what a wide lens
+on the OV580 needs.
+
+    rectify_bench [-n FRAMES] [-t THREADS] [-c CALIBRATION] [-J FILE]
+*/
+#include <Rectify.hpp>
+
+#include "BenchReport.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <getopt.h>
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double run(const std::function<void(const cv::Mat&)> &rectify,
+                  const std::vector<cv::Mat> &frames, unsigned int n)
+{
+    // Best of three passes, to keep one-off page faults out of the numbers.
+    double best = 1e30;
+    for (int pass = 0; pass < 3; ++pass) {
+        auto t0 = bench_clock::now();
+        for (unsigned int i = 0; i < n; ++i)
+            rectify(frames[i % frames.size()]);
+        double ns = std::chrono::duration<double, std::nano>(
+            bench_clock::now() - t0).count() / n;
+        best = std::min(best, ns);
+    }
+    return best;
+}
+
+static void made_up(CameraModel &cam, double angle)
+{
+    const double K[9] = {500, 0, 320, 0, 500, 240, 0, 0, 1};
+    const double D[5] = {-0.28, 0.07, 0.0005, -0.0003, 0};
+    const double c = std::cos(angle), s = std::sin(angle);
+    const double R[9] = {c, 0, s, 0, 1, 0, -s, 0, c};
+    const double P[12] = {450, 0, 320, 0, 0, 450, 240, 0, 0, 0, 1, 0};
+    memcpy(cam.K, K, sizeof(K));
+    memcpy(cam.D, D, sizeof(D));
+    memcpy(cam.R, R, sizeof(R));
+    memcpy(cam.P, P, sizeof(P));
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int n = 1000, threads = 3;
+    std::string json, path;
+    int c;
+    while ((c = getopt(argc, argv, "n:t:c:J:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            path = optarg;
+            break;
+        case 'J':
+            json = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n FRAMES] [-t THREADS] "
+                    "[-c CALIBRATION] [-J FILE]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (n == 0)
+        n = 1;
+
+    StereoCalibration calib;
+    if (!path.empty()) {
+        if (!load_calibration(path, calib))
+            return EXIT_FAILURE;
+    } else {
+        calib.width = 640;
+        calib.height = 480;
+        made_up(calib.left, 0.017);
+        made_up(calib.right, -0.017);
+    }
+    const int width = 2 * calib.width, height = calib.height;
+
+    std::vector<cv::Mat> frames(16);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].create(height, width, CV_8UC1);
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+                frames[i].at<uint8_t>(y, x) = (x * 7 + y * 3 + i) & 0xff;
+    }
+    RemapTable table;
+    table.build(calib, frames[0].step);
+    cv::Mat out(height, width, CV_8UC1), check(height, width, CV_8UC1);
+
+    table.remap(frames[1].data, out.data, 0, height);
+    table.remap_scalar(frames[1].data, check.data, 0, height);
+    if (memcmp(out.data, check.data, out.total()) != 0) {
+        fprintf(stderr, "remap() disagrees with the scalar loop\n");
+        return EXIT_FAILURE;
+    }
+
+    struct Case {
+        std::string name;
+        std::function<void(const cv::Mat&)> rectify;
+    };
+    std::vector<Case> cases;
+    cases.push_back(Case{"scalar", [&](const cv::Mat &f) {
+        table.remap_scalar(f.data, out.data, 0, height);
+    }});
+    cases.push_back(Case{"kernel", [&](const cv::Mat &f) {
+        table.remap(f.data, out.data, 0, height);
+    }});
+    std::vector<unsigned int> workers;
+    for (unsigned int t = 1; t < threads; t *= 2)
+        workers.push_back(t);
+    if (threads > 0)
+        workers.push_back(threads);
+    std::vector<std::unique_ptr<Rectifier>> rectifiers;
+    for (unsigned int t : workers) {
+        rectifiers.emplace_back(new Rectifier(calib, RECTIFY_REPLACE, t, 4));
+        Rectifier *r = rectifiers.back().get();
+        cases.push_back(Case{"bands " + std::to_string(t + 1),
+                             [r](const cv::Mat &f) {
+            Frame frame, rectified;
+            frame.image = f;
+            r->rectify(frame, rectified);
+        }});
+    }
+
+    BenchReport report("rectify_bench");
+    report.param("frames", n);
+    report.param("width", width);
+    report.param("height", height);
+    report.param("kernel", rectify_kernel_name());
+    report.param("table_bytes", static_cast<double>(table.bytes()));
+    printf("%u frames of %dx%d, %s kernel, table %zu kB\n", n, width, height,
+           rectify_kernel_name(), table.bytes() >> 10);
+    printf("%-10s %10s %10s\n", "", "ms/frame", "max fps");
+    for (const Case &k : cases) {
+        double ns = run(k.rectify, frames, n);
+        printf("%-10s %10.3f %10.0f\n", k.name.c_str(), ns / 1e6, 1e9 / ns);
+        report.result(k.name, {{"ms_per_frame", ns / 1e6},
+                               {"max_fps", 1e9 / ns}});
+    }
+    if (!json.empty() && !report.write(json))
+        return EXIT_FAILURE;
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+Throughput and latency of the capture ring between two threads, against a
+mutex/condition variable deque like the bounded_buffer it replaced. The
+producer pushes frames as fast as it can, stamped on the way in; the
+consumer takes them (one at a time or in batches, optionally spending a
+fixed time on each to make the ring run full) and records how long each
+was queued.
+
+    ring_bench [-n FRAMES] [-c CAPACITY] [-w WORK_NS] [-J FILE]
+
+Frames carry no image, so this measures the hand-off alone.
+*/
+#include <FrameRing.hpp>
+#include <PipelineStats.hpp>
+
+#include "BenchReport.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <getopt.h>
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+class mutex_queue
+/*
+What bounded_buffer did: a deque under one mutex, with not_full/not_empty
+condition variables.
+*/
+{
+public:
+    explicit mutex_queue(size_t capacity) : capacity(capacity) {}
+
+    void push(Frame &&frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return queue.size() < capacity; });
+        queue.push_back(std::move(frame));
+        lock.unlock();
+        not_empty.notify_one();
+    }
+    void pop(Frame &frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !queue.empty(); });
+        frame = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+    }
+
+private:
+    size_t capacity;
+    std::deque<Frame> queue;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+struct Result {
+    std::string name;
+    double mfps; // Million frames per second through the queue.
+    StageSummary latency; // Push to pop.
+};
+
+static void work(unsigned int ns)
+{
+    if (ns == 0)
+        return;
+    auto until = bench_clock::now() + std::chrono::nanoseconds(ns);
+    while (bench_clock::now() < until) {}
+}
+
+template <typename Push, typename Consume>
+static Result run(const std::string &name, unsigned int n, Push push,
+                  Consume consume)
+{
+    latency_histogram queued;
+    auto start = bench_clock::now();
+    std::thread producer([&] {
+        Frame frame;
+        for (unsigned int i = 0; i < n; ++i) {
+            frame.sequence = i;
+            frame.stamps[STAGE_PUSH] = monotonic_ns();
+            push(std::move(frame));
+        }
+    });
+    consume(n, queued);
+    producer.join();
+    double secs = std::chrono::duration<double>(bench_clock::now() - start)
+                      .count();
+
+    Result r;
+    r.name = name;
+    r.mfps = n / secs / 1e6;
+    r.latency.count = queued.count();
+    r.latency.p50_us = queued.percentile(50) / 1e3;
+    r.latency.p99_us = queued.percentile(99) / 1e3;
+    r.latency.max_us = queued.max() / 1e3;
+    return r;
+}
+
+static Result bench_ring(const std::string &name, unsigned int n,
+                         size_t capacity, unsigned int spin, size_t batch,
+                         unsigned int work_ns)
+{
+    frame_ring ring(capacity, spin);
+    return run(name, n, [&](Frame &&f) { ring.push(std::move(f)); },
+        [&](unsigned int count, latency_histogram &queued) {
+            std::vector<Frame> frames;
+            frames.reserve(batch);
+            Frame frame;
+            for (unsigned int got = 0; got < count;) {
+                if (batch > 1) {
+                    frames.clear();
+                    got += ring.pop_batch(frames, batch);
+                } else {
+                    ring.pop(frame);
+                    frames.assign(1, std::move(frame));
+                    ++got;
+                }
+                int64_t now = monotonic_ns();
+                for (const Frame &f : frames) {
+                    queued.record(now - f.stamps[STAGE_PUSH]);
+                    work(work_ns);
+                }
+            }
+        });
+}
+
+static Result bench_mutex(unsigned int n, size_t capacity,
+                          unsigned int work_ns)
+{
+    mutex_queue queue(capacity);
+    return run("mutex deque", n, [&](Frame &&f) { queue.push(std::move(f)); },
+        [&](unsigned int count, latency_histogram &queued) {
+            Frame frame;
+            for (unsigned int got = 0; got < count; ++got) {
+                queue.pop(frame);
+                queued.record(monotonic_ns() - frame.stamps[STAGE_PUSH]);
+                work(work_ns);
+            }
+        });
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int n = 1000000, work_ns = 0;
+    size_t capacity = 256;
+    std::string json;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:c:w:J:h")) != -1) {
+        switch (c) {
+        case 'n': n = strtoul(optarg, NULL, 10); break;
+        case 'c': capacity = strtoul(optarg, NULL, 10); break;
+        case 'w': work_ns = strtoul(optarg, NULL, 10); break;
+        case 'J': json = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n FRAMES] [-c CAPACITY] [-w WORK_NS] "
+                    "[-J FILE]\n", argv[0]);
+            return c == 'h' ? 0 : 1;
+        }
+    }
+    if (capacity < 2)
+        capacity = 2;
+
+    std::vector<Result> results;
+    results.push_back(bench_mutex(n, capacity, work_ns));
+    results.push_back(bench_ring("spsc pop", n, capacity, 2000, 1, work_ns));
+    results.push_back(bench_ring("spsc batch", n, capacity, 2000, 32, work_ns));
+    results.push_back(bench_ring("spsc park", n, capacity, 0, 32, work_ns));
+
+    BenchReport report("ring_bench");
+    report.param("frames", n);
+    report.param("capacity", capacity);
+    report.param("work_ns", work_ns);
+    printf("%u frames, capacity %zu, %u ns per frame consumed\n",
+           n, capacity, work_ns);
+    printf("%-14s %10s %10s %10s %10s\n",
+           "queue", "Mfps", "p50 us", "p99 us", "max us");
+    for (const Result &r : results) {
+        printf("%-14s %10.2f %10.2f %10.2f %10.1f\n", r.name.c_str(),
+               r.mfps, r.latency.p50_us, r.latency.p99_us, r.latency.max_us);
+        report.result(r.name, {{"mfps", r.mfps},
+                               {"p50_us", r.latency.p50_us},
+                               {"p99_us", r.latency.p99_us},
+                               {"max_us", r.latency.max_us}});
+    }
+    if (!json.empty() && !report.write(json))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+Times copying a whole frame (cv::Mat copyTo() against one memcpy, the cost
+of any stage that takes a private copy) and splitting a side-by-side stereo
+frame into left and right planes: cv::Mat ROI copyTo() into two Mats (what
+post-processing did) and the split_planes() kernel, a memcpy per row. Reports
+ns per frame and GB/s of frame data for each, after checking the splits all
+produce the same planes.
+
+    split_bench [-n FRAMES] [-s WxH] [-J FILE]
+*/
+#include <StereoSplit.hpp>
+
+#include "BenchReport.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <getopt.h>
+}
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double run(const std::function<void(const cv::Mat&)> &split,
+                  const std::vector<cv::Mat> &frames, unsigned int n)
+{
+    // Best of three passes, to keep one-off page faults out of the numbers.
+    double best = 1e30;
+    for (int pass = 0; pass < 3; ++pass) {
+        auto t0 = bench_clock::now();
+        for (unsigned int i = 0; i < n; ++i)
+            split(frames[i % frames.size()]);
+        double ns = std::chrono::duration<double, std::nano>(
+            bench_clock::now() - t0).count() / n;
+        best = std::min(best, ns);
+    }
+    return best;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int n = 5000;
+    int width = 1280, height = 480;
+    std::string json;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:J:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'J':
+            json = optarg;
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) == 2)
+                break;
+            // Fall through.
+        default:
+            fprintf(stderr, "Usage: %s [-n FRAMES] [-s WxH] [-J FILE]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (n == 0)
+        n = 1;
+
+    // More frames than fit in cache, so the source is read from memory as
+    // it would be straight out of a capture buffer.
+    std::vector<cv::Mat> frames(16);
+    for (size_t i = 0; i < frames.size(); ++i) {
+        frames[i].create(height, width, CV_8UC1);
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+                frames[i].at<uint8_t>(y, x) = (x * 7 + y * 3 + i) & 0xff;
+    }
+    const int lw = width / 2, rw = width - lw;
+    cv::Mat left(height, lw, CV_8UC1), right(height, rw, CV_8UC1);
+    cv::Mat whole(height, width, CV_8UC1);
+    std::vector<uint8_t> lp(static_cast<size_t>(lw) * height);
+    std::vector<uint8_t> rp(static_cast<size_t>(rw) * height);
+
+    // Both splits must agree before either is timed.
+    frames[1](cv::Rect(0, 0, lw, height)).copyTo(left);
+    frames[1](cv::Rect(lw, 0, rw, height)).copyTo(right);
+    split_planes(frames[1], lp.data(), rp.data());
+    if (memcmp(left.data, lp.data(), lp.size()) != 0 ||
+        memcmp(right.data, rp.data(), rp.size()) != 0) {
+        fprintf(stderr, "split_planes() disagrees with ROI copy\n");
+        return EXIT_FAILURE;
+    }
+
+    struct Case {
+        const char *name;
+        std::function<void(const cv::Mat&)> split;
+    };
+    std::vector<Case> cases;
+    cases.push_back(Case{"copy copyTo", [&](const cv::Mat &f) {
+        f.copyTo(whole);
+    }});
+    cases.push_back(Case{"copy memcpy", [&](const cv::Mat &f) {
+        memcpy(whole.data, f.data, f.total());
+    }});
+    cases.push_back(Case{"roi copyTo", [&](const cv::Mat &f) {
+        f(cv::Rect(0, 0, lw, height)).copyTo(left);
+        f(cv::Rect(lw, 0, rw, height)).copyTo(right);
+    }});
+    cases.push_back(Case{"split_planes", [&](const cv::Mat &f) {
+        split_planes(f, lp.data(), rp.data());
+    }});
+
+    const double bytes = static_cast<double>(width) * height;
+    BenchReport report("split_bench");
+    report.param("frames", n);
+    report.param("width", width);
+    report.param("height", height);
+    printf("%u frames of %dx%d\n", n, width, height);
+    printf("%-14s %12s %10s\n", "", "ns/frame", "GB/s");
+    for (const Case &k : cases) {
+        double ns = run(k.split, frames, n);
+        printf("%-14s %12.0f %10.2f\n", k.name, ns, bytes / ns);
+        report.result(k.name, {{"ns_per_frame", ns}, {"gb_per_s", bytes / ns}});
+    }
+    if (!json.empty() && !report.write(json))
+        return EXIT_FAILURE;
+    return 0;
+}
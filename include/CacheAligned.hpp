@@ -0,0 +1,30 @@
+/*
+Base of the types laid out on cache lines of their own (alignas(64)), so
+separately heap allocated ones stay aligned. Before C++17 a new-expression
+only guarantees alignof(std::max_align_t), 16 bytes on x86-64, whatever the
+type asks for; these operators take the memory from posix_memalign()
+instead, for single objects and arrays alike.
+*/
+#ifndef CACHE_ALIGNED_H
+#define CACHE_ALIGNED_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+struct CacheAligned {
+    static const size_t cache_line = 64;
+
+    static void *operator new(size_t bytes)
+    {
+        void *p;
+        if (posix_memalign(&p, cache_line, bytes ? bytes : 1) != 0)
+            throw std::bad_alloc();
+        return p;
+    }
+    static void *operator new[](size_t bytes) { return operator new(bytes); }
+    static void operator delete(void *p) { free(p); }
+    static void operator delete[](void *p) { free(p); }
+};
+
+#endif // CACHE_ALIGNED_H
@@ -0,0 +1,99 @@
+/*
+Control and metrics socket of the capture application, for driving it and
+watching it from other processes without a console.
+
+The endpoint is given as for the streaming server (FrameStream.hpp):
+unix:PATH, which only local users with access to PATH can reach, or
+[ADDR:]PORT for TCP. There is no authentication, so a TCP endpoint without
+ADDR listens on 127.0.0.1 only; give ADDR (0.0.0.0 for every address) to
+take commands from other hosts. Clients send one command per line, the
+same commands the console takes (start, stop, n, fps, q, ...), and get back
+what the console would have printed, followed by an empty line. 'metrics'
+returns a snapshot of the counters in the Prometheus text format.
+
+A request starting with "GET " is answered as HTTP instead, with the
+metrics whatever the path, and the connection is closed; so a TCP endpoint
+can be scraped by Prometheus or read with curl.
+
+One server thread polls the listening socket and the clients, with
+non-blocking sockets, and answers metrics itself. Commands are handed to a
+second thread and run there one at a time, so a slow one (a reconfigure
+may take seconds) only holds up later commands of the same client, never
+metrics or other clients' replies. A client that stops reading its
+replies is dropped once too much is queued for it.
+*/
+#ifndef CONTROL_SERVER_H
+#define CONTROL_SERVER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <FrameStream.hpp>
+
+class ControlServer
+{
+public:
+    typedef std::function<std::string(const std::string&)> handler;
+    typedef std::function<std::string()> snapshot;
+
+    ControlServer(const std::string &endpoint, const handler &command,
+                  const snapshot &metrics, unsigned int max_clients = 8);
+    /*
+    Listens on 'endpoint', calls 'command' on the command thread with each
+    line a client sends (without the newline) and sends back what it
+    returns. 'metrics' is called on the server thread and must not block.
+    is_open() is false if the endpoint is bad or taken.
+    */
+    ~ControlServer(); // Waits for a running command, drops every client.
+
+    bool is_open() const { return listen_fd != -1; }
+    std::string name() const { return endpoint_name(endpoint); }
+
+private:
+    ControlServer(const ControlServer&);
+    ControlServer& operator = (const ControlServer&);
+
+    struct Client {
+        int fd;
+        unsigned long id;
+        std::string in; // Received, not handled yet.
+        std::string out; // Replies not sent yet.
+        bool waiting = false; // A command of its is queued or running.
+        bool http = false; // Reading the headers of a GET.
+        bool closing = false; // Close once 'out' is sent.
+        bool eof = false; // Sent all it will, close once answered.
+    };
+    typedef std::pair<unsigned long, std::string> message; // Client id.
+
+    StreamEndpoint endpoint;
+    handler command;
+    snapshot metrics;
+    unsigned int max_clients;
+    int listen_fd = -1;
+    int event_fd = -1; // Wakes the server thread: replies, or stopping.
+    std::thread thread; // Polls the sockets.
+    std::thread worker; // Runs commands.
+    std::vector<Client> clients; // Server thread only.
+    unsigned long next_id = 0;
+
+    std::mutex mutex; // Guards the queues and 'stopping'.
+    std::condition_variable queued;
+    std::deque<message> commands; // For the worker.
+    std::deque<message> replies; // From the worker.
+    bool stopping = false;
+
+    void run();
+    void work();
+    void accept_client();
+    bool read_client(Client &client); // False once it should be dropped.
+    bool write_client(Client &client);
+    void handle_lines(Client &client);
+};
+
+#endif // CONTROL_SERVER_H
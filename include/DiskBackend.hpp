@@ -0,0 +1,131 @@
+/*
+Write backends for the recording path. RecordWriter fills one of the
+backend's aligned staging buffers with records and hands it over with
+write(); the backend owns the buffer until the write completes, while the
+writer carries on filling the next one from acquire().
+
+    SyncBackend     - One buffer, blocking pwrite(). The behaviour before
+                      backends existed.
+    ThreadBackend   - 'depth' buffers written by a pool of threads calling
+                      pwrite(), for kernels without io_uring.
+    UringBackend    - 'depth' buffers registered with an io_uring instance
+                      (so they are pinned once, not per write) and written
+                      with IORING_OP_WRITE_FIXED. A segment handed to
+                      close_file() is fdatasync()ed once its writes, short
+                      ones finished included, have completed and closed after
+                      that, without the writer ever blocking in the kernel.
+
+make_backend() falls back to ThreadBackend when io_uring is not compiled in
+or the kernel refuses to set it up.
+*/
+#ifndef DISK_BACKEND_H
+#define DISK_BACKEND_H
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <sys/types.h>
+}
+
+enum disk_backend {
+    DISK_SYNC,
+    DISK_THREADS,
+    DISK_URING,
+};
+
+bool parse_backend(const std::string &name, disk_backend &backend);
+
+class DiskBackend
+{
+public:
+    explicit DiskBackend(size_t buffer_bytes, unsigned int depth);
+    virtual ~DiskBackend();
+
+    unsigned char *acquire();
+    /*
+    Returns a free buffer of buffer_bytes(), waiting for an earlier write to
+    complete if all of them are in flight.
+    */
+    virtual bool write(int fd, unsigned char *buf, size_t len,
+                       off_t offset) = 0;
+    /*
+    Queues 'len' bytes of 'buf' (from acquire()) for writing at 'offset'.
+    Returns false once any write or sync has failed.
+    */
+    virtual bool close_file(int fd);
+    /*
+    Takes over 'fd': once every write queued to it has completed the file is
+    fdatasync()ed, then closed. By default this waits for all of it.
+    */
+    virtual bool drain() = 0; // Waits for every queued write and sync.
+
+    size_t buffer_bytes() const { return bytes; }
+    unsigned int depth() const { return buffers.size(); }
+    virtual const char *name() const = 0;
+
+protected:
+    size_t bytes;
+    std::vector<unsigned char*> buffers; // VCAP_ALIGN aligned, prefaulted.
+    std::vector<unsigned int> free_list; // Guarded by 'mutex'.
+    std::mutex mutex;
+    std::condition_variable released;
+    bool failed = false;
+
+    unsigned int buffer_index(const unsigned char *buf) const;
+    void release(unsigned int index); // Returns a buffer to free_list.
+    virtual void wait_for_buffer(std::unique_lock<std::mutex> &lock);
+    /*
+    Called by acquire() with 'mutex' held while free_list is empty; must
+    return once it isn't. Waits on 'released' by default.
+    */
+};
+
+class SyncBackend : public DiskBackend
+{
+public:
+    explicit SyncBackend(size_t buffer_bytes);
+    bool write(int fd, unsigned char *buf, size_t len, off_t offset);
+    bool drain() { return !failed; }
+    const char *name() const { return "sync"; }
+};
+
+class ThreadBackend : public DiskBackend
+{
+public:
+    ThreadBackend(size_t buffer_bytes, unsigned int depth,
+                  unsigned int threads);
+    ~ThreadBackend();
+    bool write(int fd, unsigned char *buf, size_t len, off_t offset);
+    bool drain();
+    const char *name() const { return "threads"; }
+
+private:
+    struct Request {
+        int fd;
+        unsigned int index;
+        size_t len;
+        off_t offset;
+    };
+
+    std::vector<std::thread> threads;
+    std::deque<Request> queue; // Guarded by 'mutex'.
+    std::condition_variable queued;
+    unsigned int in_flight = 0;
+    bool stopping = false;
+
+    void run();
+};
+
+std::unique_ptr<DiskBackend> make_backend(disk_backend kind,
+                                          size_t buffer_bytes,
+                                          unsigned int depth);
+
+bool write_fully(int fd, const unsigned char *buf, size_t len, off_t offset);
+
+#endif // DISK_BACKEND_H
@@ -0,0 +1,86 @@
+/*
+Frame and the lease that ties it to the buffer its pixels live in. Shared by
+the capture device, the frame ring and the writer.
+*/
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <cstdint>
+#include <memory>
+
+extern "C" {
+#include <sys/time.h>
+}
+
+#include <opencv2/core.hpp>
+
+class LeaseOwner
+/*
+Anything that lends out frame memory and wants it back once every consumer is
+done with it (e.g. the V4L2 buffer pool of VideoCapture).
+*/
+{
+public:
+    virtual ~LeaseOwner() {}
+    virtual void requeue(unsigned int index, unsigned int generation) = 0;
+};
+
+class FrameLease
+/*
+Keeps buffer 'index' of 'owner' out of circulation for as long as it exists.
+Frames share a single lease through std::shared_ptr, so copies handed to the
+writer and the display all hold the buffer; when the last copy is dropped the
+buffer is returned to its owner. 'generation' lets the owner ignore leases
+that outlive the buffers they were issued for (e.g. across release()).
+*/
+{
+public:
+    FrameLease(LeaseOwner *owner, unsigned int index, unsigned int generation)
+    : owner(owner), index(index), generation(generation) {}
+    ~FrameLease() { owner->requeue(index, generation); }
+
+    unsigned int get_index() const { return index; }
+
+private:
+    FrameLease(const FrameLease&);
+    FrameLease& operator = (const FrameLease&);
+
+    LeaseOwner *owner;
+    unsigned int index;
+    unsigned int generation;
+};
+
+enum frame_stage {
+    STAGE_DRIVER, // Driver timestamp, when it is on CLOCK_MONOTONIC.
+    STAGE_DEQUEUE, // Handed out by the source.
+    STAGE_PUSH, // Stored in the capture ring, after any wait for room.
+    STAGE_POP, // Popped by the write thread.
+    STAGE_ENCODE, // Encoded by a writer.
+    STAGE_WRITE, // Committed to the output.
+    STAGE_COUNT,
+};
+
+enum frame_view {
+    VIEW_FULL, // The frame as captured.
+    VIEW_LEFT, // Left half of a side-by-side stereo frame.
+    VIEW_RIGHT, // Right half.
+    VIEW_RECTIFIED = 4, // Flag: remapped by the rectification stage.
+};
+
+class Frame
+{
+public:
+    cv::Mat image; // Header over the leased buffer, no copy is made.
+    struct timeval timestamp = {}; // When the source took the frame.
+    std::shared_ptr<FrameLease> lease; // Holds the buffer while frame lives.
+    uint32_t sequence = 0; // Source frame counter, gaps are dropped frames.
+    uint16_t camera = 0; // Which of the capture devices took the frame.
+    uint8_t view = VIEW_FULL; // frame_view, see StereoSplit.hpp, Rectify.hpp.
+    int64_t stamps[STAGE_COUNT] = {}; // Monotonic ns per stage, 0 if unset.
+
+    Frame() {};
+    // Drops the image header and this frame's share of the lease.
+    void clear() { image = cv::Mat(); lease.reset(); }
+};
+
+#endif // FRAME_H
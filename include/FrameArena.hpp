@@ -0,0 +1,68 @@
+/*
+Application-owned memory for frame buffers: one anonymous mapping cut into
+equal, page aligned buffers, that capture can fill directly (V4L2 USERPTR or
+read()) and every later stage can use without a copy.
+
+The mapping is backed by explicit huge pages (MAP_HUGETLB) when asked for and
+the system has them reserved (vm.nr_hugepages); otherwise transparent huge
+pages are requested with madvise(), and failing that it is plain 4 KiB pages.
+A 1280x480 frame spans 150 small pages but under a third of a 2 MiB one, so
+a pool of hundreds of frames goes from tens of thousands of TLB entries to a
+few hundred. With locking on, the whole arena is faulted in up front and
+mlock()ed, so a capture never waits on a page fault or on swap; that needs
+RLIMIT_MEMLOCK (ulimit -l) to cover the arena, and is skipped with a warning
+if it doesn't.
+*/
+#ifndef FRAME_ARENA_H
+#define FRAME_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum arena_pages {
+    PAGES_SMALL, // Regular pages.
+    PAGES_TRANSPARENT, // Regular mapping, huge pages via madvise().
+    PAGES_HUGE, // MAP_HUGETLB.
+};
+
+class FrameArena
+{
+public:
+    FrameArena() {}
+    ~FrameArena() { free(); }
+
+    bool allocate(size_t buffer_bytes, unsigned int count, bool hugepages,
+                  bool lock);
+    /*
+    Maps 'count' buffers of at least 'buffer_bytes', replacing any previous
+    mapping. Huge pages and locking are best effort; returns false (and
+    prints why) only if no memory could be mapped at all.
+    */
+    void free(); // Unmaps the arena; buffers handed out are invalid after.
+
+    uint8_t *buffer(unsigned int index) { return base + index * stride; }
+    size_t buffer_bytes() const { return bytes; } // As asked for.
+    size_t buffer_stride() const { return stride; } // Page aligned.
+    unsigned int count() const { return buffers; }
+    bool empty() const { return base == nullptr; }
+    arena_pages pages() const { return page_kind; }
+    bool locked() const { return is_locked; }
+    std::string describe() const; // E.g. "2048 KiB pages, locked".
+
+private:
+    FrameArena(const FrameArena&);
+    FrameArena& operator = (const FrameArena&);
+
+    uint8_t *base = nullptr;
+    size_t length = 0; // Of the whole mapping.
+    size_t bytes = 0;
+    size_t stride = 0;
+    unsigned int buffers = 0;
+    arena_pages page_kind = PAGES_SMALL;
+    bool is_locked = false;
+};
+
+size_t huge_page_size(); // From /proc/meminfo, 2 MiB if unknown.
+
+#endif // FRAME_ARENA_H
@@ -0,0 +1,161 @@
+/*
+Live frames for other processes through a POSIX shared-memory ring.
+
+The capture process publishes every frame the write thread sees, written or
+not, into one of a fixed number of slots of /dev/shm/<name>. Local readers
+(vcap_bus, or anything built on BusReader) map the same memory and get
+frames as cv::Mat headers over the slot: the publisher copies a frame once,
+readers copy nothing.
+
+    header   - magic, geometry, 'head' (frames published so far), the futex
+               word readers sleep on, and a table of up to 16 readers
+    slot i   - frame metadata and pixels of frame n, where n % slots == i
+
+The publisher never waits for readers. Each slot carries the number of the
+frame in it (a sequence lock: it is cleared while the slot is rewritten), so
+a reader that falls more than a ring behind finds its next frame gone,
+counts the loss as an overrun and skips ahead to half a ring behind the
+publisher. A reader holding a frame while the publisher laps it sees
+still_valid() turn false and should drop what it made of it.
+
+Readers sleep on a futex that is bumped with every frame; the publisher only
+makes the wake system call while somebody is asleep. Readers register in the
+header, with their pid, so the publisher can report how far behind each one
+is; entries of readers that died are reclaimed. On exit the publisher marks
+the bus closed and unlinks it; mapped readers see the flag and stop.
+*/
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Frame.hpp>
+
+static const uint32_t VCAP_BUS_MAGIC = 0x53554256; // "VBUS"
+static const uint32_t VCAP_BUS_VERSION = 1;
+static const unsigned int BUS_MAX_READERS = 16;
+
+struct BusReaderEntry {
+    std::atomic<int32_t> pid; // 0 if the entry is free.
+    std::atomic<uint64_t> position; // Next frame the reader wants.
+    std::atomic<uint64_t> frames; // Frames it has read.
+    std::atomic<uint64_t> overruns; // Frames it lost to the publisher.
+    uint8_t pad[32];
+};
+
+struct BusHeader {
+    uint32_t magic, version;
+    uint32_t slots;
+    uint32_t slot_stride; // Bytes from one slot to the next.
+    uint64_t slot_bytes; // Pixels a slot holds at most.
+    uint64_t data_offset; // Of slot 0.
+    int32_t publisher; // Pid.
+    std::atomic<uint32_t> closed;
+    std::atomic<uint64_t> head; // Frames published.
+    std::atomic<uint32_t> futex; // Bumped per frame, readers wait on it.
+    std::atomic<uint32_t> waiters; // Readers asleep on 'futex'.
+    uint8_t pad[8];
+    BusReaderEntry readers[BUS_MAX_READERS];
+};
+
+struct BusSlot {
+    std::atomic<uint64_t> stamp; // Frame number + 1, 0 while writing.
+    int64_t timestamp_us;
+    uint32_t sequence;
+    uint16_t camera;
+    uint8_t view;
+    uint8_t pad0;
+    int32_t rows, cols, type;
+    uint32_t step;
+    uint64_t bytes;
+    uint8_t pad[16];
+};
+
+std::string bus_path(const std::string &name); // shm_open() name.
+
+struct BusReaderStatus {
+    int pid;
+    uint64_t lag; // Frames published it hasn't read.
+    uint64_t frames, overruns;
+};
+
+struct BusStatus {
+    std::string name;
+    unsigned int slots;
+    size_t slot_bytes;
+    uint64_t published; // Frames.
+    unsigned long too_big; // Frames larger than a slot, not published.
+    std::vector<BusReaderStatus> readers;
+};
+
+class FramePublisher
+{
+public:
+    FramePublisher(const std::string &name, unsigned int slots,
+                   size_t slot_bytes);
+    /*
+    Creates the bus, replacing one whose publisher is gone. is_open() is
+    false if a live process still publishes under 'name'.
+    */
+    ~FramePublisher(); // Closes and unlinks the bus.
+
+    bool is_open() const { return header != nullptr; }
+    void publish(const Frame &frame);
+    /*
+    Copies 'frame' into the next slot and wakes sleeping readers. Never
+    waits. Only one thread may publish.
+    */
+    BusStatus status(); // Also reclaims entries of readers that died.
+
+private:
+    FramePublisher(const FramePublisher&);
+    FramePublisher& operator = (const FramePublisher&);
+
+    std::string name;
+    BusHeader *header = nullptr;
+    size_t mapped = 0;
+    std::atomic_ulong too_big;
+};
+
+class BusReader
+{
+public:
+    explicit BusReader(const std::string &name);
+    ~BusReader(); // Frees the reader's entry.
+
+    bool is_open() const { return entry != nullptr; }
+    int next(Frame &frame, int timeout_ms);
+    /*
+    The next frame, as a view of its slot: 1 on success, 0 if none came
+    within 'timeout_ms' (-1 waits for ever), -1 once the publisher has
+    closed the bus. The first is the first published after the reader
+    opened the bus.
+    */
+    bool still_valid() const;
+    /*
+    Whether the last frame returned by next() is still in its slot, i.e.
+    what was read from it is good. Call when done with it.
+    */
+    uint64_t lag() const; // Frames published but not yet read.
+    uint64_t overruns() const { return entry->overruns; }
+    const BusHeader *bus() const { return header; }
+
+private:
+    BusReader(const BusReader&);
+    BusReader& operator = (const BusReader&);
+
+    BusHeader *header = nullptr;
+    size_t mapped = 0;
+    BusReaderEntry *entry = nullptr;
+    const BusSlot *current = nullptr;
+    uint64_t current_stamp = 0;
+
+    const BusSlot *slot(uint64_t n) const;
+    static bool unchanged(const BusSlot *s, uint64_t stamp);
+};
+
+#endif // FRAME_BUS_H
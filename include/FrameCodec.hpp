@@ -0,0 +1,67 @@
+/*
+Lossless codecs for 8-bit frames written to recordings.
+
+    CODEC_NONE  - Raw pixels.
+    CODEC_FAST  - Left-neighbour delta (up-neighbour for the first pixel of a
+                  row), zigzag mapped, then packed in blocks of 16 residuals
+                  at the bit width of the largest one: 1 width byte plus
+                  2*width bytes per block. Prediction, mapping and the width
+                  search are SSE2 on x86, scalar elsewhere.
+    CODEC_HIGH  - Median edge detector (LOCO-I) prediction, SIMD on x86,
+                  followed by zlib. Falls back to CODEC_FAST when built
+                  without zlib.
+
+Encoders run on the writer pool workers, so they keep no state between
+calls. CodecStats accumulates ratio and cost across threads.
+*/
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+enum frame_codec {
+    CODEC_NONE = 0,
+    CODEC_FAST = 1,
+    CODEC_HIGH = 2,
+};
+
+bool parse_codec(const std::string &name, frame_codec &codec);
+const char *codec_name(frame_codec codec);
+frame_codec available_codec(frame_codec codec); // HIGH -> FAST w/o zlib.
+
+size_t codec_bound(frame_codec codec, size_t raw_bytes);
+/*
+Largest output encode_frame() can produce for a frame of 'raw_bytes'.
+*/
+size_t encode_frame(frame_codec codec, const cv::Mat &image,
+                    unsigned char *out, size_t capacity);
+/*
+Compresses a CV_8UC1 image into 'out', returning the number of bytes used or
+0 on failure.
+*/
+bool decode_frame(frame_codec codec, const unsigned char *in, size_t bytes,
+                  cv::Mat &image);
+/*
+Decompresses into 'image', which must already have the frame's size and
+type CV_8UC1.
+*/
+
+struct CodecStats {
+    std::atomic_ulong frames;
+    std::atomic_ullong raw_bytes;
+    std::atomic_ullong coded_bytes;
+    std::atomic_ullong encode_ns;
+
+    CodecStats() : frames(0), raw_bytes(0), coded_bytes(0), encode_ns(0) {}
+    void add(size_t raw, size_t coded, uint64_t ns);
+    void reset();
+    double ratio() const; // raw / coded, 1 if nothing was coded.
+    double ms_per_frame() const;
+};
+
+#endif // FRAME_CODEC_H
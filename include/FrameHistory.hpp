@@ -0,0 +1,70 @@
+/*
+Pre-trigger history: keeps the most recent frames that were not written, so
+that when writing starts they can be written ahead of the live stream.
+
+Frames are copied once into a preallocated arena sized by a memory budget
+(the copy also gives the capture buffer straight back to the driver). On
+flush() they are handed out oldest first as Frames leasing their arena slot,
+so the writers read them where they are; a slot is only reused once its
+lease is dropped. An optional age limit keeps only the last N seconds.
+*/
+#ifndef FRAME_HISTORY_H
+#define FRAME_HISTORY_H
+
+#include <mutex>
+#include <vector>
+
+#include <Frame.hpp>
+
+struct HistoryStatus {
+    size_t frames; // Frames currently held.
+    size_t capacity; // Frames the budget allows.
+    double span_s; // Time between oldest and newest held frame.
+    size_t budget_bytes; // Size of the arena.
+    unsigned long skipped; // Frames not kept because their slot was leased.
+};
+
+class FrameHistory : public LeaseOwner
+{
+public:
+    FrameHistory(size_t budget_bytes, double max_age_s, int fps);
+    /*
+    Keeps up to 'budget_bytes' of frames, and at flush() only those taken
+    at most 'max_age_s' before the newest (0 for no age limit). Without a
+    budget, enough memory for 'max_age_s' at 'fps' is used.
+    */
+
+    void push(const Frame &frame); // Copies frame in, evicting the oldest.
+    size_t flush(std::vector<Frame> &frames);
+    /*
+    Appends the held frames to 'frames', oldest first, and empties the
+    history. Returns the number appended.
+    */
+    void requeue(unsigned int index, unsigned int generation);
+    HistoryStatus status();
+
+private:
+    struct Slot {
+        struct timeval timestamp;
+        uint32_t sequence;
+        uint16_t camera;
+        bool leased; // Handed out by flush() and not yet released.
+    };
+
+    size_t budget;
+    double max_age;
+    int fps;
+    int rows = 0, cols = 0, type = -1; // Geometry the arena was cut for.
+    size_t frame_bytes = 0;
+    std::vector<unsigned char> arena;
+    std::vector<Slot> slots;
+    size_t head = 0; // Next slot to write.
+    size_t count = 0; // Frames held, ending at head - 1.
+    unsigned int generation = 0; // Bumped when the arena is re-cut.
+    unsigned long skipped = 0;
+    std::mutex mutex; // Guards 'leased' against requeue() from the writers.
+
+    void reshape(const cv::Mat &image); // Re-cuts the arena for new frames.
+};
+
+#endif // FRAME_HISTORY_H
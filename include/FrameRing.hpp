@@ -0,0 +1,166 @@
+/*
+Single-producer/single-consumer ring of Frame slots between the capture and
+write threads. Replaces the mutex/condition bounded_buffer: the slots are
+allocated once, frames are moved in and out rather than copied, and the
+producer and consumer only share two atomic indices, each on its own cache
+line. Frames are taken by advancing the tail (with a compare-and-swap, as
+the producer may advance it too) before they are moved out; each slot then
+records the position it may next be written at, so the producer never
+writes a slot the consumer is still reading.
+
+A side that finds the ring full (producer) or empty (consumer) spins for a
+configurable number of polls before parking on a condition variable. The
+other side only takes the park mutex when it sees someone is parked, so the
+uncontended path never locks.
+
+Shutdown is explicit: close() makes push() fail and lets pop() drain what is
+left before failing, which wakes whichever side is parked.
+
+What happens when the consumer falls behind is up to the overload policy,
+which can be changed at any time:
+
+    OVERLOAD_BLOCK       - push() waits for a free slot, as before. The
+                           source then runs out of buffers and drops frames
+                           itself; the time spent waiting is counted.
+    OVERLOAD_DROP_NEWEST - push() drops the frame when the ring is full.
+    OVERLOAD_DROP_OLDEST - Once the ring is three quarters full the consumer
+                           discards the oldest frames down to half full, so
+                           the newest frames are the ones that get through.
+                           A consumer held up elsewhere pops nothing, so on a
+                           full ring push() takes the oldest frame itself.
+    OVERLOAD_DECIMATE    - While the ring is at least half full, push() keeps
+                           only every k-th frame, thinning the stream evenly
+                           instead of losing a stretch of it.
+
+Every frame a policy discards is counted against it in status().
+*/
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Frame.hpp>
+
+class PipelineStats;
+
+enum overload_policy {
+    OVERLOAD_BLOCK,
+    OVERLOAD_DROP_NEWEST,
+    OVERLOAD_DROP_OLDEST,
+    OVERLOAD_DECIMATE,
+};
+
+bool parse_overload(const std::string &name, overload_policy &policy,
+                    unsigned int &every); // "decimate:K" sets 'every' to K.
+const char *overload_name(overload_policy policy);
+
+struct RingStatus {
+    overload_policy policy;
+    unsigned int decimate_every; // k of OVERLOAD_DECIMATE.
+    size_t capacity;
+    size_t size; // Frames waiting now.
+    unsigned long blocks; // Pushes that had to wait (OVERLOAD_BLOCK).
+    double blocked_ms; // Time spent in those waits.
+    unsigned long dropped_newest; // Pushes discarded on a full ring.
+    unsigned long dropped_oldest; // Frames shed by OVERLOAD_DROP_OLDEST.
+    unsigned long decimated; // Frames skipped by OVERLOAD_DECIMATE.
+};
+
+class frame_ring
+{
+public:
+    static const size_t cache_line = 64;
+
+    explicit frame_ring(size_t capacity, unsigned int spin_limit = 2000);
+
+    bool push(const Frame &frame);
+    bool push(Frame &&frame);
+    /*
+    Queues 'frame', or discards it as the overload policy says; false only
+    once the ring is closed. Blocks while full under OVERLOAD_BLOCK.
+    */
+    bool try_push(Frame &&frame); // Fails rather than waits when full.
+    bool pop(Frame &frame); // Blocks while empty, false when closed+drained.
+    size_t pop_batch(std::vector<Frame> &frames, size_t max_frames);
+    /*
+    Appends up to 'max_frames' frames to 'frames' after waiting for at least
+    one to be available. Returns the number of frames taken, 0 only once the
+    ring is closed and drained.
+    */
+    size_t pop_batch(std::vector<Frame> &frames, size_t max_frames,
+                     std::chrono::microseconds timeout);
+    /*
+    As above, but gives up after 'timeout' (at once for 0) and returns 0 when
+    nothing arrived; is_closed() tells that apart from a closed ring. Lets one
+    consumer service several rings.
+    */
+
+    void set_policy(overload_policy policy, unsigned int decimate_every = 2);
+    void set_stats(PipelineStats *stats) { this->stats = stats; }
+    /*
+    Frames are stamped STAGE_PUSH in 'stats' as they are stored, after any
+    wait for room, so the push latency includes the back-pressure. Set it
+    before the first push.
+    */
+    RingStatus status() const;
+    void reset_counters();
+
+    void close(); // Wakes both sides; further pushes fail.
+    void reopen(); // Call once both threads have stopped.
+    void clear(); // Drops unread frames. Consumer side or quiescent only.
+
+    size_t size() const;
+    size_t capacity() const { return slots.size(); }
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+private:
+    frame_ring(const frame_ring&);
+    frame_ring& operator = (const frame_ring&);
+
+    bool wait_not_full(size_t pos);
+    bool wait_not_empty(size_t pos,
+                        const std::chrono::steady_clock::time_point *deadline);
+    size_t take_batch(std::vector<Frame> &frames, size_t max_frames);
+    void wake(std::atomic_bool &parked, std::condition_variable &cond);
+    template <typename F> bool push_slot(F &&frame);
+    void store_slot(size_t pos, Frame &&frame); // At 'pos', once it is free.
+    size_t claim(size_t &pos, size_t max_frames); // Advances the tail.
+    void release_slot(size_t pos); // Empties a claimed slot, frees it.
+    void shed_oldest(); // OVERLOAD_DROP_OLDEST, consumer side.
+
+    std::vector<Frame> slots;
+    // Per slot, the position it may next be written at: its last one plus
+    // the capacity once released.
+    std::unique_ptr<std::atomic<size_t>[]> free_at;
+    unsigned int spin_limit; // Polls before parking, 0 parks immediately.
+    PipelineStats *stats = nullptr;
+
+    // Monotonic positions; slot = position % capacity.
+    alignas(cache_line) std::atomic<size_t> head; // Next write, producer.
+    alignas(cache_line) std::atomic<size_t> tail; // Next read, consumer.
+    alignas(cache_line) std::atomic_bool closed;
+    std::atomic_bool producer_parked;
+    std::atomic_bool consumer_parked;
+
+    std::atomic_int policy;
+    std::atomic_uint decimate_every;
+    unsigned int decimate_phase = 0; // Producer only.
+    std::atomic_ulong blocks;
+    std::atomic_ullong blocked_ns;
+    std::atomic_ulong dropped_newest;
+    std::atomic_ulong dropped_oldest;
+    std::atomic_ulong decimated;
+
+    std::mutex park_mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+#endif // FRAME_RING_H
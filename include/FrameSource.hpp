@@ -0,0 +1,222 @@
+/*
+Frame sources consumed by CaptureApplication. VideoCapture (V4L2) is one
+backend; the other two let the rest of the pipeline run without a camera:
+
+    SyntheticSource - Generates frames of a configurable size and pattern at
+                      a configurable rate (0 = as fast as possible), with
+                      optional timing jitter.
+    ReplaySource    - Streams frames previously written by the application
+                      ('<timestamp>_<count>.pgm') from a directory, either at
+                      the recorded rate or as fast as they can be read.
+
+Use make_source() to build the backend selected by a SourceConfig.
+*/
+#ifndef FRAME_SOURCE_H
+#define FRAME_SOURCE_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+#include <Frame.hpp>
+#include <FrameArena.hpp>
+
+struct PoolStatus {
+    unsigned int size; // Buffers granted by the driver.
+    unsigned int leased; // Buffers currently held by frames.
+    unsigned int peak; // High-water mark of 'leased'.
+    unsigned long starved; // Times every buffer was leased at once.
+    unsigned long leases; // Total leases handed out.
+};
+
+struct SourceEvents {
+    unsigned long timeouts; // Waits that ended without a frame.
+    unsigned long errors; // Failed waits or dequeues, all recovered from.
+    unsigned long corrupt; // Frames the driver flagged as bad and dropped.
+    unsigned long restarts; // Stream restarts after repeated timeouts.
+};
+
+enum source_kind {
+    SOURCE_V4L2,
+    SOURCE_SYNTHETIC,
+    SOURCE_REPLAY,
+};
+
+enum io_method {
+    IO_METHOD_READ, // read() into the source's own buffers.
+    IO_METHOD_MMAP, // Driver buffers mapped into the process.
+    IO_METHOD_USERPTR, // Driver fills the source's own buffers.
+};
+
+enum synthetic_pattern {
+    PATTERN_GRADIENT, // Static horizontal ramp.
+    PATTERN_CHECKER, // Static 32px checkerboard.
+    PATTERN_NOISE, // Uniform noise, different every frame.
+    PATTERN_BAR, // Ramp with a bright bar sweeping across it.
+};
+
+struct StreamFormat {
+    int fps = 0; // Zero keeps the current value, here and below.
+    unsigned int width = 0;
+    unsigned int height = 0;
+    uint32_t fourcc = 0; // V4L2 pixel format, e.g. GREY or Y16.
+};
+
+struct SourceConfig {
+    source_kind kind = SOURCE_V4L2;
+    std::string device = "/dev/video0"; // V4L2 device node.
+    unsigned int buffers = 500; // Frame buffers (driver or synthetic pool).
+    io_method io = IO_METHOD_MMAP; // How V4L2 hands over frames.
+    bool hugepages = false; // Back our own buffers with huge pages.
+    bool lock_buffers = false; // Fault in and mlock() our own buffers.
+    unsigned int width = 1280; // Synthetic frame size.
+    unsigned int height = 480;
+    int fps = 100; // Synthetic rate, 0 generates frames unthrottled.
+    unsigned int jitter_us = 0; // Max random offset added to each frame time.
+    synthetic_pattern pattern = PATTERN_BAR;
+    std::string replay_dir = "."; // Directory of recorded .pgm frames.
+    bool replay_max_speed = false; // Ignore recorded timestamps.
+    bool replay_loop = false; // Start over at the end of the recording.
+};
+
+class FrameSource
+{
+public:
+    virtual ~FrameSource() {}
+
+    virtual int read(Frame &frame) = 0;
+    /*
+    Blocks until the next frame is available and reads it into 'frame'.
+    Returns 0 if no frame was produced (e.g. end of a replay, or a timeout
+    the source recovers from); the caller just reads again.
+    */
+    virtual size_t read_batch(std::vector<Frame> &frames, size_t max);
+    /*
+    Replaces 'frames' with every frame that is ready, up to 'max', waiting
+    for at least one like read(). Returns how many were read. By default it
+    reads a single frame.
+    */
+    virtual void release() = 0; // Stops the source.
+    virtual void capture(bool fpsSwitch = false) = 0;
+    /*
+    Restarts the source after release(). If fpsSwitch is true, the fps is
+    switched between 100 and 60.
+    */
+    virtual bool reconfigure(const StreamFormat &format);
+    /*
+    Changes the frame rate and/or format, restarting only the stream: the
+    pipeline keeps running, frames in flight stay valid and buffers are kept
+    where they are big enough. Must be called from the thread that reads.
+    Returns false, with the source unchanged, if the change isn't possible;
+    by default it never is.
+    */
+    virtual int get_fps() = 0;
+    virtual size_t frame_size() { return 0; } // Bytes, 0 if not known.
+    virtual PoolStatus pool_status(); // Frame buffer usage, zeros if unpooled.
+    virtual SourceEvents events(); // Recoverable capture problems so far.
+    virtual std::string describe() = 0; // One line summary for the console.
+};
+
+bool parse_pattern(const std::string &name, synthetic_pattern &pattern);
+bool parse_io_method(const std::string &name, io_method &io);
+const char *io_method_name(io_method io);
+bool parse_fourcc(const std::string &name, uint32_t &fourcc); // "GREY" etc.
+std::string fourcc_name(uint32_t fourcc);
+
+std::unique_ptr<FrameSource> make_source(const SourceConfig &config);
+
+class SyntheticSource : public FrameSource, public LeaseOwner
+/*
+Generates frames into a fixed pool of buffers, leased to the pipeline the
+same way VideoCapture leases driver buffers. When every buffer is leased the
+frame due is dropped and counted as starved, as the driver would; unthrottled
+(fps 0), the next frame waits for a buffer to be returned instead.
+*/
+{
+public:
+    explicit SyntheticSource(const SourceConfig &config);
+
+    int read(Frame &frame);
+    void release();
+    void capture(bool fpsSwitch = false);
+    bool reconfigure(const StreamFormat &format); // GREY only.
+    int get_fps() { return fps; }
+    size_t frame_size() { return frame_bytes; }
+    PoolStatus pool_status();
+    std::string describe();
+    void requeue(unsigned int index, unsigned int generation);
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    unsigned int width, height;
+    int fps;
+    unsigned int jitter_us;
+    synthetic_pattern pattern;
+    size_t frame_bytes;
+    bool hugepages, lock_buffers;
+
+    FrameArena arena; // 'pool' buffers of 'frame_bytes' each.
+    std::vector<uchar> background; // Precomputed pattern, noise is 2 frames.
+    std::vector<unsigned int> free_list; // Buffers available for generation.
+    std::mutex pool_mutex;
+    std::condition_variable requeued; // A buffer was added to free_list.
+    unsigned int pool;
+    unsigned int generation = 0;
+    unsigned int peak = 0;
+    unsigned long starved = 0;
+    unsigned long leases = 0;
+
+    unsigned long sequence = 0;
+    clock::time_point next_frame;
+    std::minstd_rand rng;
+
+    void make_background();
+    void render(uchar *dst, unsigned long seq);
+    bool take_buffer(unsigned int &index);
+    bool wait_for_buffer(); // False if none is free within 100 ms.
+};
+
+class ReplaySource : public FrameSource
+/*
+Replays the frames in a directory in write order (the '_<count>' suffix),
+keeping their original timestamps.
+*/
+{
+public:
+    explicit ReplaySource(const SourceConfig &config);
+
+    int read(Frame &frame);
+    void release() {}
+    void capture(bool fpsSwitch = false);
+    int get_fps() { return fps; }
+    std::string describe();
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Entry {
+        long timestamp; // Microseconds, as encoded in the file name.
+        unsigned long count;
+        std::string path;
+    };
+
+    std::string dir;
+    bool max_speed;
+    bool loop;
+    int fps = 100; // Estimated from the recorded timestamps.
+    std::vector<Entry> entries;
+    size_t position = 0;
+    bool finished = false;
+    long first_timestamp = 0;
+    clock::time_point start;
+
+    void scan();
+};
+
+#endif // FRAME_SOURCE_H
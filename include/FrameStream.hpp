@@ -0,0 +1,115 @@
+/*
+Wire format of the frame streaming server (StreamServer.hpp) and a client
+for it.
+
+A stream runs over TCP or a Unix socket, given as an endpoint:
+
+    PORT, ADDR:PORT  - TCP; a server without ADDR listens on every address,
+                       a client without it connects to 127.0.0.1
+    unix:PATH        - Unix socket
+
+After connecting, the client may send a StreamHello, which can ask for a
+lower frame rate than the server's. With a 'window', the server keeps at
+most that many frames unacknowledged and the client sends a byte each time
+it is done with one, so a client that takes its time always gets the
+newest frame next instead of one that waited in the socket buffers. Without
+a hello (or a window) frames are only paced by the socket.
+
+The server sends frames, each a StreamHeader followed by 'bytes' of
+payload: raw rows, 'cols * elemSize' bytes each, or the output of
+encode_frame() (FrameCodec.hpp) if 'codec' is not CODEC_NONE. Integers are
+in the host's byte order; the stream is meant for machines of the same kind.
+
+'capture_ns' is when the frame was captured on CLOCK_MONOTONIC, so a client
+on the same host can take its latency from it directly. 'skipped' counts the
+frames the server passed over for this client so far, because the client
+was still busy with an earlier one or over its rate.
+*/
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+}
+
+#include <Frame.hpp>
+#include <FrameCodec.hpp>
+
+static const uint32_t VCAP_STREAM_MAGIC = 0x46545356; // "VSTF"
+static const uint32_t VCAP_HELLO_MAGIC = 0x48545356; // "VSTH"
+
+struct StreamHello {
+    uint32_t magic;
+    uint32_t max_mfps; // Frames per 1000 s the client wants at most.
+    uint32_t window; // Frames unacknowledged at most, 0 for no acks.
+};
+
+struct StreamHeader {
+    uint32_t magic;
+    uint32_t codec; // frame_codec of the payload.
+    int32_t rows, cols, type;
+    uint32_t bytes; // Of the payload that follows.
+    uint32_t sequence;
+    uint16_t camera;
+    uint8_t view;
+    uint8_t pad;
+    int64_t timestamp_us;
+    int64_t capture_ns; // CLOCK_MONOTONIC.
+    uint64_t skipped; // Frames passed over for this client so far.
+};
+
+struct StreamEndpoint {
+    bool unix_socket = false;
+    std::string address; // Host or path.
+    int port = 0;
+};
+
+bool parse_endpoint(const std::string &spec, StreamEndpoint &endpoint);
+bool endpoint_address(const StreamEndpoint &endpoint, bool listening,
+                      struct sockaddr_storage &addr, socklen_t &length);
+std::string endpoint_name(const StreamEndpoint &endpoint);
+bool clear_stale_socket(const StreamEndpoint &endpoint);
+/*
+Before listening on a Unix socket: removes a socket left at the path by a
+run that is gone, i.e. one nothing accepts connections on. False, and
+the path left alone, if it is not a socket or another process listens on
+it. Always true for TCP.
+*/
+
+class StreamClient
+{
+public:
+    StreamClient() {}
+    ~StreamClient();
+
+    bool connect(const std::string &endpoint, double max_fps = 0);
+    /*
+    Connects to a server, asking for at most 'max_fps' frames a second
+    unless it is 0. Each read() acknowledges the frame before it.
+    */
+    bool read(Frame &frame, StreamHeader &header);
+    /*
+    Blocks for the next frame. The image is decoded into a buffer of the
+    client's, reused by the next read(). False when the server is gone.
+    */
+    bool is_open() const { return fd != -1; }
+
+private:
+    StreamClient(const StreamClient&);
+    StreamClient& operator = (const StreamClient&);
+
+    static const uint32_t window = 2; // One arriving while one is used.
+    int fd = -1;
+    unsigned long received = 0;
+    std::vector<uint8_t> payload; // Compressed frames as received.
+    cv::Mat image;
+
+    bool receive(void *data, size_t bytes);
+};
+
+#endif // FRAME_STREAM_H
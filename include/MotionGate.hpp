@@ -0,0 +1,136 @@
+/*
+Change-gated writing: in continuous ('start') mode, only frames in which
+the scene changed are written, with some padding either side.
+
+Each frame is reduced to a thumbnail of every 4th row, summed over blocks of
+8 pixels (SSE2 psadbw against zero, 16 pixels per instruction), so the
+reduction reads a quarter of the frame and averages out most sensor noise.
+The thumbnail is compared with that of the last frame written from the same
+camera: the change is the percentage of blocks whose mean moved by more than
+'level' grey levels. Comparing against the last frame written rather than
+the previous one means a slow drift is still caught once it adds up.
+
+A group of frames (one per camera) is written when
+
+    change    - its change is at least 'threshold' percent (or there is no
+                reference yet, i.e. the first frame of a take),
+    pre       - it is one of the last 'pre' groups skipped before a change,
+                which are held back (with their capture buffers) for that,
+    post      - it is one of 'post' groups following a change,
+    keep      - nothing was written for 1/'keep_fps' seconds,
+
+and skipped otherwise. Every decision can be logged to a CSV file, one line
+per frame: timestamp_us,sequence,camera,change_pct,decision. A frame held
+for pre-padding is logged 'skip' and, if a change then comes, again as
+'pre'. status() sums up what was written for which reason and how many
+frames and bytes were skipped.
+
+Only 8-bit frames are measured; others always count as changed.
+*/
+#ifndef MOTION_GATE_H
+#define MOTION_GATE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <Frame.hpp>
+#include <PipelineStats.hpp>
+
+struct GateConfig {
+    double threshold = 0; // Percent of blocks changed, 0 for no gate.
+    unsigned int level = 8; // Grey levels a block has to move by.
+    unsigned int pre = 10; // Groups written ahead of a change.
+    unsigned int post = 50; // Groups written after a change.
+    double keep_fps = 1; // Least rate frames are written at, 0 for none.
+    std::string log; // CSV of every decision, empty for none.
+};
+
+enum gate_decision {
+    GATE_SKIP,
+    GATE_CHANGE,
+    GATE_PRE,
+    GATE_POST,
+    GATE_KEEP,
+    GATE_DECISIONS,
+};
+
+struct GateStatus {
+    double threshold;
+    unsigned long frames; // Frames the gate has seen.
+    unsigned long written[GATE_DECISIONS]; // By reason; [GATE_SKIP] unused.
+    unsigned long skipped; // Frames not written.
+    unsigned long held; // Held for pre-padding right now.
+    uint64_t bytes_seen, bytes_skipped;
+    double last_change; // Percent, of the last group.
+    double metric_us; // Mean cost of measuring a frame.
+};
+
+void gate_thumbnail(const cv::Mat &image, std::vector<uint16_t> &thumb);
+/*
+Sums of 8 pixel blocks along every 4th row of 8-bit 'image'.
+*/
+size_t gate_changed(const std::vector<uint16_t> &a,
+                    const std::vector<uint16_t> &b, unsigned int max_diff);
+/*
+Number of blocks whose sums differ by more than 'max_diff'.
+*/
+
+class MotionGate
+{
+public:
+    explicit MotionGate(const GateConfig &config);
+    ~MotionGate();
+
+    void process(Frame *group, size_t n, std::vector<Frame> &out);
+    /*
+    Decides on a group of frames taken together and appends what is to be
+    written now (held frames first) to 'out'. Frames of 'group' that are
+    written or held are moved from.
+    */
+    void reset(); // Writing stopped: drops held frames and references.
+    void set_threshold(double percent) { threshold = percent; }
+    bool active() const { return threshold > 0; }
+    bool is_idle() const { return idle; } // On the writing thread.
+    GateStatus status();
+    static const char *decision_name(gate_decision d);
+
+private:
+    MotionGate(const MotionGate&);
+    MotionGate& operator = (const MotionGate&);
+
+    GateConfig config;
+    std::atomic<double> threshold;
+    FILE *log = nullptr;
+    std::map<uint16_t, std::vector<uint16_t>> reference; // By camera.
+    std::vector<uint16_t> thumb;
+    struct Group {
+        std::vector<Frame> frames;
+        std::vector<double> change; // Of each frame, percent.
+    };
+    std::deque<Group> held; // Skipped groups, oldest first.
+    unsigned int post_left = 0;
+    int64_t last_written_us = 0;
+    bool idle = true; // Nothing seen since reset().
+
+    // Read by status() on the console thread.
+    std::atomic_ulong frames;
+    std::atomic_ulong written[GATE_DECISIONS];
+    std::atomic_ulong skipped;
+    std::atomic_ulong held_frames;
+    std::atomic<uint64_t> bytes_seen, bytes_skipped;
+    std::atomic<double> last_change;
+    std::atomic<uint64_t> metric_ns;
+    std::atomic_ulong measured;
+
+    double measure(const Frame &frame); // Change in percent.
+    void keep(Group &group, gate_decision d, std::vector<Frame> &out);
+    void drop(Group &group); // Counts its frames as skipped.
+    void log_frame(const Frame &frame, double change, gate_decision d);
+};
+
+#endif // MOTION_GATE_H
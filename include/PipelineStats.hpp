@@ -0,0 +1,115 @@
+/*
+Per-stage latency and drop instrumentation of the capture pipeline.
+
+Each frame carries a CLOCK_MONOTONIC stamp per stage (see frame_stage in
+Frame.hpp). When a stage is stamped, the time since the previous stage goes
+into that stage's histogram:
+
+    dqbuf   - Driver timestamp to the frame being handed out by the source.
+    push    - Into the capture ring.
+    pop     - Out of the ring on the write thread (time spent queued).
+    encode  - Encoded by a writer.
+    write   - Committed to the output in order.
+
+plus 'total', from the driver (or dequeue, where the source has no monotonic
+timestamp) to the write. Frames that are not written stop after 'pop'.
+
+Histograms are HDR-style: values are bucketed log-linearly, 16 buckets per
+power of two, so every reading is within ~3% of the true value at any scale.
+Recording a value is a couple of relaxed atomic increments, and nothing but
+a flag check is done while stats are disabled. Drops are counted from gaps
+in each source's frame sequence numbers, which is always on.
+*/
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+#include <atomic>
+#include <cstdint>
+
+#include <Frame.hpp>
+
+class latency_histogram
+{
+public:
+    latency_histogram() { reset(); }
+
+    void record(int64_t ns);
+    void reset(); // Not atomic with respect to concurrent record()s.
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    int64_t max() const { return peak.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return total_ns.load(std::memory_order_relaxed); }
+    int64_t percentile(double p) const; // p in [0, 100], ns.
+
+private:
+    static const int SUB_BITS = 5; // 2^(SUB_BITS-1) buckets per octave.
+    static const int BUCKETS = (64 - SUB_BITS + 1) << (SUB_BITS - 1);
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> total_ns; // Of every value recorded.
+    std::atomic<int64_t> peak;
+
+    static int bucket_of(uint64_t v);
+    static int64_t value_of(int bucket); // Middle of the bucket.
+};
+
+class drop_counter
+/*
+Frames missing from one source's sequence numbers, updated by its reader
+only. A sequence that goes backwards (restart or replay loop) starts
+counting afresh.
+*/
+{
+public:
+    unsigned long update(uint32_t seq); // Frames missing before 'seq'.
+    void restart() { have_last = false; }
+
+private:
+    uint32_t last = 0;
+    bool have_last = false;
+};
+
+struct StageSummary {
+    uint64_t count;
+    double sum_us; // Of every latency recorded, for the mean.
+    double p50_us;
+    double p99_us;
+    double max_us;
+};
+
+class PipelineStats
+{
+public:
+    PipelineStats() : on(false) { reset(); }
+
+    void enable(bool enabled) { on.store(enabled, std::memory_order_relaxed); }
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+    void reset(); // Clears histograms, drops and the high-water mark.
+
+    void stamp(Frame &frame, frame_stage stage);
+    /*
+    Stamps 'stage' of 'frame' with the current time and records the latency
+    since the previous stage. Does nothing while disabled.
+    */
+    void add_drops(unsigned long frames); // Counts one gap of 'frames'.
+    void ring_depth(size_t frames); // Tracks the ring high-water mark.
+
+    StageSummary summary(int histogram) const; // Stage, or STAGE_COUNT.
+    static const char *stage_name(int histogram);
+    unsigned long drops() const { return dropped; }
+    unsigned long drop_events() const { return gaps; }
+    size_t ring_peak() const { return ring_high; }
+
+private:
+    std::atomic_bool on;
+    latency_histogram stages[STAGE_COUNT + 1]; // Last one is the total.
+    std::atomic_ulong dropped;
+    std::atomic_ulong gaps;
+    std::atomic<size_t> ring_high;
+};
+
+int64_t monotonic_ns();
+int64_t timeval_ns(const struct timeval &tv);
+
+#endif // PIPELINE_STATS_H
@@ -0,0 +1,67 @@
+/*
+Live preview of the capture, on a thread of its own.
+
+Readers hand every frame to offer(), which never waits: each camera has a
+newest-wins slot, and a reader that finds the slot busy just skips it. The
+preview thread wakes at its own (reduced) rate, copies out the newest frame
+of each camera, scaled down if asked to, and shows it. All HighGUI calls are
+made on that thread, so a stalled window or X server can only slow the
+preview, never capture, and several cameras can be shown safely.
+
+Frames in the slots share the lease of the capture buffer, so each camera
+has at most one buffer held by the preview, and only until the next frame
+replaces it.
+*/
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CacheAligned.hpp>
+#include <Frame.hpp>
+
+struct PreviewConfig {
+    bool enabled = true; // False for headless runs.
+    double fps = 30; // Display rate.
+    double scale = 1; // Size of the displayed frame relative to capture.
+    std::vector<int> cpus; // CPUs for the preview thread, empty for any.
+};
+
+class Preview
+{
+public:
+    Preview(const PreviewConfig &config, unsigned int cameras);
+    ~Preview(); // Stops the thread and closes the windows.
+
+    void offer(unsigned int camera, const Frame &frame); // Never blocks.
+    void clear(); // Drops frames not shown yet, e.g. before a restart.
+    std::thread &get_thread() { return thread; }
+
+private:
+    Preview(const Preview&);
+    Preview& operator = (const Preview&);
+
+    struct alignas(CacheAligned::cache_line) Slot : CacheAligned {
+        std::mutex mutex;
+        Frame frame; // Newest frame, empty once taken.
+    };
+
+    PreviewConfig config;
+    unsigned int cameras;
+    std::unique_ptr<Slot[]> slots;
+    std::thread thread;
+    std::mutex stop_mutex;
+    std::condition_variable stop_cond;
+    bool stopping = false;
+
+    void run();
+    static std::string window_name(unsigned int camera);
+};
+
+#endif // PREVIEW_H
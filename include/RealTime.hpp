@@ -0,0 +1,101 @@
+/*
+Scheduling and memory controls for the capture threads.
+
+By default every thread of the pipeline runs under SCHED_OTHER wherever the
+kernel puts it, so on a busy host a camera reader can be preempted long
+enough for the driver to run out of buffers. The capture application can
+instead:
+
+    - pin each stage (camera readers, write thread, writers, preview) to a
+      set of CPUs, ideally ones kept free of other work (isolcpus),
+    - run the camera readers under SCHED_FIFO at a given priority, so they
+      preempt everything but the kernel's own real-time threads as soon as a
+      frame is ready,
+    - lock all of its memory, current and future, with mlockall() and fault
+      in the reader stacks, so no frame waits on a page fault.
+
+Each of these can be refused (no CAP_SYS_NICE, RLIMIT_MEMLOCK, a CPU that is
+offline); a refusal is reported and capture carries on without it. What was
+actually granted is read back from the kernel by describe_thread() and
+describe_memory(), rather than assumed.
+
+cpu_load and interval_stats back the jitter test (--jitter-test): frames are
+timed as they are dequeued, first on an idle host and then with a busy
+thread on every CPU, to show how much the settings above buy.
+*/
+#ifndef REAL_TIME_H
+#define REAL_TIME_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <PipelineStats.hpp>
+
+bool parse_cpu_list(const std::string &list, std::vector<int> &cpus);
+std::string format_cpu_list(const std::vector<int> &cpus); // "2-3,6".
+bool pin_thread(std::thread &thread, int cpu);
+bool pin_thread(std::thread &thread, const std::vector<int> &cpus);
+bool set_fifo(std::thread &thread, int priority);
+/*
+Runs 'thread' under SCHED_FIFO at 'priority' (1-99). Needs CAP_SYS_NICE or
+an RLIMIT_RTPRIO of at least 'priority'.
+*/
+std::string describe_thread(std::thread &thread);
+/*
+CPUs the thread may run on and its scheduling policy, e.g. "CPUs 2,
+SCHED_FIFO 50".
+*/
+bool lock_memory(); // mlockall() of current and future mappings.
+std::string describe_memory(); // Locked bytes and the RLIMIT_MEMLOCK.
+void prefault_stack(size_t bytes = 256 << 10); // On the calling thread.
+
+class cpu_load
+/*
+A busy-looping thread per CPU (or 'threads' of them, unpinned) until
+destroyed, at normal priority.
+*/
+{
+public:
+    explicit cpu_load(int threads = -1); // -1 for one per online CPU.
+    ~cpu_load();
+
+    unsigned int size() const { return workers.size(); }
+
+private:
+    cpu_load(const cpu_load&);
+    cpu_load& operator = (const cpu_load&);
+
+    std::atomic_bool running;
+    std::vector<std::thread> workers;
+};
+
+struct IntervalSummary {
+    uint64_t count;
+    double mean_us;
+    double stddev_us;
+    double p50_us, p99_us, max_us;
+};
+
+class interval_stats
+/*
+Time between successive events: distribution and running mean/variance
+(Welford). One thread records, any thread may read a summary.
+*/
+{
+public:
+    void record(int64_t ns);
+    IntervalSummary summary() const;
+
+private:
+    mutable std::mutex mutex;
+    latency_histogram histogram;
+    uint64_t count = 0;
+    double mean = 0; // ns.
+    double m2 = 0; // Sum of squared deviations from the mean, ns^2.
+};
+
+#endif // REAL_TIME_H
@@ -0,0 +1,100 @@
+/*
+Random access to a .vcap recording through memory maps, for playback and
+scrubbing.
+
+The index and the segments are mapped read-only, so opening a recording
+reads nothing but the index pages, and raw frames are handed out as cv::Mat
+headers over the mapped records: reading a frame copies nothing, and the
+kernel pages the pixels in on first touch. Compressed records are decoded
+into a Mat of their own.
+
+Frames are addressed by position in capture time order, which is the order
+of the index unless cameras were interleaved out of order; only then is a
+sorted permutation built. Both seek_time() and seek_sequence() are binary
+searches.
+
+The segments are mapped MADV_RANDOM so the kernel doesn't read around every
+fault on its own; prefetch() asks for the records about to be shown
+(MADV_WILLNEED) instead, in whichever direction playback is going, which is
+what keeps scrubbing through a long recording smooth.
+
+    RecordMap rec("<base>");
+    size_t p = rec.seek_time(timestamp_us);
+    rec.prefetch(p, 32);
+    rec.read(p, frame); // frame.image points into the mapping.
+*/
+#ifndef RECORD_MAP_H
+#define RECORD_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <Frame.hpp>
+#include <Recording.hpp>
+
+class RecordMap
+{
+public:
+    explicit RecordMap(const std::string &base);
+    ~RecordMap(); // Unmaps; frames read from raw records become invalid.
+
+    bool is_open() const { return opened; }
+    size_t size() const { return count; }
+    const IndexEntry &entry(size_t pos) const { return entries[record(pos)]; }
+
+    bool read(size_t pos, Frame &frame);
+    /*
+    Frame at position 'pos'. Raw records are not copied: the image is a
+    read-only view of the mapping, valid for as long as the RecordMap.
+    */
+    size_t seek_time(int64_t timestamp_us) const;
+    /*
+    Position of the first frame captured at or after 'timestamp_us', size()
+    if there is none.
+    */
+    size_t seek_sequence(uint64_t sequence) const;
+    /*
+    Position of frame 'sequence' (the number in exported file names), or of
+    the next one recorded after it; size() if there is none.
+    */
+    void prefetch(size_t pos, long frames);
+    /*
+    Starts reading in the records of 'frames' frames from 'pos' onwards, or
+    backwards for a negative count. Returns at once.
+    */
+
+    int64_t first_us() const { return count ? entry(0).timestamp_us : 0; }
+    int64_t last_us() const
+    {
+        return count ? entry(count - 1).timestamp_us : 0;
+    }
+
+private:
+    RecordMap(const RecordMap&);
+    RecordMap& operator = (const RecordMap&);
+
+    struct Mapping {
+        unsigned char *data = nullptr;
+        size_t bytes = 0;
+        bool tried = false; // Failed maps aren't retried.
+    };
+
+    std::string base;
+    bool opened = false;
+    Mapping index;
+    const IndexEntry *entries = nullptr; // In the index mapping.
+    size_t count = 0;
+    std::vector<uint32_t> by_time; // Record of each position, if reordered.
+    std::vector<uint32_t> position; // Inverse of 'by_time'.
+    std::vector<Mapping> segments;
+
+    size_t record(size_t pos) const
+    {
+        return by_time.empty() ? pos : by_time[pos];
+    }
+    const unsigned char *record_data(const IndexEntry &entry);
+};
+
+#endif // RECORD_MAP_H
@@ -0,0 +1,200 @@
+/*
+Append-only recording container, replacing one .pgm file per frame.
+
+A recording '<base>' is a set of segment files '<base>.NNNN.vcap' plus a
+sidecar index '<base>.vidx'. Each segment is preallocated to the segment size
+and starts with a SegmentHeader block. Frames follow as records of a
+RecordHeader and the raw pixel payload, padded to the record alignment (4096
+bytes) so that every write is a whole number of aligned blocks and the
+segment can be opened with O_DIRECT. For fixed size, uncompressed frames every
+record has the same size. When the next record would not fit, the segment is trimmed to
+its used length and the next one is started. Staged buffers are written by
+a DiskBackend (blocking, threaded or io_uring), and a completed segment is
+synced before it is closed.
+
+The index holds one IndexEntry per record (sequence, timestamp, segment and
+offset) and is appended as records are written, so a recording can be read
+without scanning the segments.
+
+    RecordWriter rec(config);
+    rec.append(frame, sequence);
+    rec.close();
+
+    RecordReader reader("<base>");
+    reader.read(i, frame);
+*/
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <memory>
+
+#include <DiskBackend.hpp>
+#include <Frame.hpp>
+#include <FrameCodec.hpp>
+
+static const uint32_t VCAP_SEGMENT_MAGIC = 0x47455356; // "VSEG"
+static const uint32_t VCAP_RECORD_MAGIC = 0x4d524656; // "VFRM"
+static const uint32_t VCAP_INDEX_MAGIC = 0x58444956; // "VIDX"
+static const uint32_t VCAP_VERSION = 1;
+static const size_t VCAP_ALIGN = 4096; // Record and I/O alignment.
+
+struct SegmentHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t segment; // Position of this file in the recording.
+    uint32_t align; // Records start at multiples of this.
+    uint64_t created_us; // Wall clock time the segment was opened.
+    uint8_t reserved[40];
+};
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t header_bytes; // sizeof(RecordHeader), payload follows.
+    uint64_t sequence; // Frame number within the recording.
+    int64_t timestamp_us; // Capture timestamp of the frame.
+    uint32_t fourcc; // V4L2 pixel format of the payload.
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride; // Bytes per row in the payload.
+    uint32_t payload_bytes; // Stored (possibly compressed) size.
+    uint32_t record_bytes; // Header, payload and padding.
+    uint32_t flags;
+    uint32_t codec; // frame_codec of the payload, 0 for raw pixels.
+    uint32_t raw_bytes; // Payload size once decoded.
+    uint16_t camera; // Capture device index, 0 with a single camera.
+    uint8_t view; // frame_view: whole frame or stereo half, rectified or not.
+    uint8_t reserved;
+};
+
+struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_bytes; // sizeof(IndexEntry).
+    uint32_t reserved;
+};
+
+struct IndexEntry {
+    uint64_t sequence;
+    int64_t timestamp_us;
+    uint32_t segment;
+    uint32_t record_bytes;
+    uint64_t offset; // Of the RecordHeader within the segment.
+};
+
+static_assert(sizeof(SegmentHeader) == 64, "SegmentHeader layout");
+static_assert(sizeof(RecordHeader) == 64, "RecordHeader layout");
+static_assert(sizeof(IndexEntry) == 32, "IndexEntry layout");
+
+struct RecordingConfig {
+    std::string base; // Path prefix of the segment and index files.
+    size_t segment_bytes = 1UL << 30; // Size segments are preallocated to.
+    size_t staging_bytes = 8UL << 20; // Bytes gathered per write() call.
+    bool direct_io = false; // Open segments with O_DIRECT.
+    disk_backend backend = DISK_SYNC; // How staged records reach the disk.
+    unsigned int io_depth = 4; // Staging buffers, i.e. writes in flight.
+    frame_codec codec = CODEC_NONE; // Compression applied by the writers.
+};
+
+std::string segment_path(const std::string &base, unsigned int segment);
+std::string index_path(const std::string &base);
+std::string pgm_name(int64_t timestamp_us, uint64_t sequence,
+                     unsigned int camera, unsigned int view);
+/*
+'<timestamp>_<sequence>.pgm', with '_cam<N>' before the extension for
+cameras other than the first and '_L'/'_R' for stereo halves, so single
+camera output (and replay of it) is unchanged.
+*/
+int record_type(const RecordHeader &header);
+/*
+cv::Mat type of the pixels of a record, -1 if this build can't read it back.
+*/
+
+class RecordWriter
+{
+public:
+    explicit RecordWriter(const RecordingConfig &config);
+    ~RecordWriter();
+
+    bool append(const Frame &frame, uint64_t sequence);
+    /*
+    Queues a record for 'frame'. Records are gathered in an aligned staging
+    buffer and written once it is full, so most calls only copy the frame.
+    Returns false if the record could not be written.
+    */
+    bool append_record(const unsigned char *record);
+    /*
+    Queues a record previously built with encode_record(), e.g. by another
+    thread.
+    */
+    static size_t record_bound(const cv::Mat &image,
+                               frame_codec codec = CODEC_NONE);
+    static size_t encode_record(const Frame &frame, uint64_t sequence,
+                                unsigned char *record,
+                                frame_codec codec = CODEC_NONE);
+    /*
+    Builds the record for 'frame' in 'record', which must have room for
+    record_bound(frame.image, codec) bytes, and returns its size. The pixels
+    are compressed with 'codec'; 0 is returned if that fails.
+    */
+    void flush(); // Writes staged records and the index to disk.
+    void close(); // Flushes, trims and syncs the last segment.
+
+    bool pending() const { return staged > 0; }
+    uint64_t bytes_written() const { return total_bytes; }
+    const std::string &get_base() const { return config.base; }
+
+private:
+    RecordWriter(const RecordWriter&);
+    RecordWriter& operator = (const RecordWriter&);
+
+    RecordingConfig config;
+    int fd = -1; // Current segment.
+    unsigned int segment = 0;
+    uint64_t offset = 0; // Of the next record within the segment.
+    uint64_t total_bytes = 0;
+    std::unique_ptr<DiskBackend> backend; // Owns the staging buffers.
+    unsigned char *staging = nullptr; // Buffer being filled, from backend.
+    size_t staged = 0;
+    FILE *index = nullptr;
+    bool failed = false;
+
+    void open_segment();
+    void close_segment();
+    bool write_staged();
+    unsigned char *reserve(size_t record_bytes); // Staging space for a record.
+    void commit(const RecordHeader &header); // Indexes the reserved record.
+};
+
+class RecordReader
+/*
+Reads back the frames of a recording through its index.
+*/
+{
+public:
+    explicit RecordReader(const std::string &base);
+    ~RecordReader();
+
+    bool is_open() const { return opened; }
+    size_t size() const { return entries.size(); }
+    const IndexEntry &entry(size_t i) const { return entries[i]; }
+    bool read(size_t i, Frame &frame); // Copies/decodes record 'i' to frame.
+
+private:
+    RecordReader(const RecordReader&);
+    RecordReader& operator = (const RecordReader&);
+
+    std::string base;
+    bool opened = false;
+    std::vector<IndexEntry> entries;
+    std::vector<int> segments; // Open fds, by segment number.
+    std::vector<unsigned char> scratch; // Compressed payloads.
+
+    int segment_fd(uint32_t segment);
+};
+
+#endif // RECORDING_H
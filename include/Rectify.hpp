@@ -0,0 +1,173 @@
+/*
+Stereo rectification of the side-by-side frame on its way to the writers.
+
+The calibration is read once at start-up from a plain text file holding, for
+each sensor, the camera matrix K, the distortion (k1 k2 p1 p2 [k3]), and the
+rectifying rotation R and projection P that cv::stereoRectify() returns (R1,
+P1 and R2, P2):
+
+    # Size of one half of the frame.
+    size 640 480
+    left.K  fx 0 cx  0 fy cy  0 0 1
+    left.D  k1 k2 p1 p2 k3
+    left.R  r11 r12 r13  r21 r22 r23  r31 r32 r33
+    left.P  p11 p12 p13 p14  p21 p22 p23 p24  p31 p32 p33 p34
+    right.K ...
+
+From it one remap table for the whole frame is computed, with the same model
+as cv::initUndistortRectifyMap(). Every output pixel holds the offset of the
+top-left of its 2x2 source neighbourhood (-1 if that falls outside its half,
+which comes out black) and two 7-bit fractions, 6 bytes a pixel, so the table
+for a 1280x480 frame is under 4 MB. The float maps OpenCV would use take 8.
+
+Frames are remapped with fixed-point bilinear interpolation: 8 pixels per
+AVX2 gather where the CPU has it (checked at run time), one at a time
+otherwise, both with the same integer arithmetic so their output is
+identical. Rows are cut into bands that 'threads' workers and the calling
+thread remap together, which is what keeps a 1280x480 frame well inside the
+10 ms of 100 fps; bench/rectify_bench measures it.
+
+    RECTIFY_REPLACE - Only the rectified frame is written.
+    RECTIFY_BOTH    - The raw frame and then the rectified one, which is told
+                      apart by VIEW_RECTIFIED in Frame::view ('_rect' in file
+                      names).
+
+Rectified frames live in buffers pooled by the Rectifier; the capture buffer
+goes back to the driver as soon as the raw frame is dropped. Only 8-bit
+frames twice the calibrated width are rectified, others are passed on as
+they are and counted.
+*/
+#ifndef RECTIFY_H
+#define RECTIFY_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Frame.hpp>
+#include <PipelineStats.hpp>
+
+enum rectify_mode {
+    RECTIFY_OFF,
+    RECTIFY_REPLACE, // Write the rectified frame instead of the raw one.
+    RECTIFY_BOTH, // Write both.
+};
+
+bool parse_rectify(const std::string &name, rectify_mode &mode);
+
+struct CameraModel {
+    double K[9]; // Camera matrix, row major.
+    double D[5]; // k1, k2, p1, p2, k3.
+    double R[9]; // Rectifying rotation.
+    double P[12]; // Projection in the rectified frame, 3x4.
+};
+
+struct StereoCalibration {
+    int width = 0, height = 0; // Of one half.
+    CameraModel left, right;
+};
+
+bool load_calibration(const std::string &path, StereoCalibration &calib);
+
+class RemapTable
+/*
+Where each output pixel of a 'cols' x 'rows' frame is sampled from, in a
+source frame of the same size and 'step' bytes per row.
+*/
+{
+public:
+    void build(const StereoCalibration &calib, int step);
+    void remap(const uint8_t *src, uint8_t *dst, int first_row,
+               int last_row) const; // Rows [first_row, last_row).
+    void remap_scalar(const uint8_t *src, uint8_t *dst, int first_row,
+                      int last_row) const; // Without SIMD, for comparison.
+
+    int rows = 0, cols = 0, step = 0;
+    size_t bytes() const; // Memory the table takes.
+
+private:
+    std::vector<int32_t> offsets; // Top-left source pixel, -1 for none.
+    std::vector<uint8_t> wx, wy; // Fractions of a pixel, 0-128.
+    // Rows a 4 byte gather can't overrun the source in; the few others
+    // (sampling the last source row, right edge) go pixel by pixel.
+    std::vector<uint8_t> gather_ok;
+
+    void build_half(const CameraModel &cam, int x0, int half_cols);
+};
+
+const char *rectify_kernel_name(); // Which kernel remap() uses.
+
+struct RectifyStatus {
+    unsigned long rectified; // Frames remapped.
+    unsigned long skipped; // Frames passed on for their type or size.
+    unsigned long fallbacks; // Frames remapped into a fresh allocation.
+    unsigned int buffers; // Output buffers in the pool.
+    unsigned int in_use; // Held by frames in flight.
+    unsigned int threads; // Band workers, besides the caller.
+    size_t table_bytes;
+    double p50_us, p99_us, max_us; // Cost per frame.
+};
+
+class Rectifier : public LeaseOwner
+{
+public:
+    Rectifier(const StereoCalibration &calib, rectify_mode mode,
+              unsigned int threads, unsigned int buffers);
+    ~Rectifier();
+
+    bool rectify(const Frame &frame, Frame &rectified);
+    /*
+    Remaps 'frame' into a pooled buffer (or a new one if the pool is empty)
+    and returns true, or false if the frame can't be rectified. The table is
+    built at the first frame, and again if the row step changes. May be
+    called from several threads at once; with band workers the frames take
+    turns at them.
+    */
+    void requeue(unsigned int index, unsigned int generation);
+    RectifyStatus status();
+    void reset_cost() { cost.reset(); }
+    rectify_mode get_mode() const { return mode; }
+
+private:
+    Rectifier(const Rectifier&);
+    Rectifier& operator = (const Rectifier&);
+
+    StereoCalibration calib;
+    rectify_mode mode;
+    unsigned int buffers;
+    std::shared_ptr<const RemapTable> current; // atomic_load/store only.
+    latency_histogram cost;
+    std::atomic_ulong rectified_count;
+    std::atomic_ulong skipped_count;
+    std::atomic_ulong fallback_count;
+
+    std::mutex pool_mutex;
+    std::vector<uint8_t> arena;
+    std::vector<unsigned int> free_list;
+    size_t frame_bytes = 0; // Per buffer, 64 byte aligned.
+
+    // One job at a time: a frame cut into bands, band 0 for the caller.
+    std::vector<std::thread> workers;
+    std::mutex job_mutex;
+    std::condition_variable job_cond, done_cond;
+    std::mutex band_mutex; // Held by the frame using the workers.
+    const RemapTable *job_table = nullptr;
+    const uint8_t *job_src = nullptr;
+    uint8_t *job_dst = nullptr;
+    unsigned long job = 0; // Incremented per frame.
+    unsigned int pending = 0; // Bands not yet done.
+    bool stopping = false;
+
+    void work(unsigned int band);
+    void run_band(unsigned int band, const RemapTable &table,
+                  const uint8_t *src, uint8_t *dst);
+    void run_bands(const RemapTable &table, const uint8_t *src, uint8_t *dst);
+    uint8_t *take(unsigned int &index); // Null if every buffer is out.
+};
+
+#endif // RECTIFY_H
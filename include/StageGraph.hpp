@@ -0,0 +1,176 @@
+/*
+Graph of processing stages between the write thread and the writers.
+
+A stage (FrameStage) takes one frame at a time and emits any number of
+frames, and/or notes: named values such as a measurement of the frame. Each
+stage is fed by one other stage, or by the graph's input, so stages form
+chains that can fan out: every stage fed by the same parent gets each of its
+frames (copies share the lease, no pixels are copied). The frames coming out
+of the last stage of every branch go to the sink, i.e. the writers:
+
+                  +-> rectify -> split -+
+    submit() -----+                     +--> sink
+                  +-> brightness -------+
+
+Stages run as tasks on a shared WorkPool, one task per frame a stage has to
+process, so a stage gets as many workers as it has frames waiting. A stage
+that declares itself ordered() instead processes frames one at a time in
+the order they were submitted, e.g. because it compares a frame with the one
+before. The frames of every branch are handed to the sink in submit order
+too, the branches of one frame in the order they were added, so a recording
+comes out as it would without the graph.
+
+Every frame submitted gets a ticket, and every stage passes each ticket on
+to its children, even when it emits nothing for it; that is what lets an
+ordered stage (and the sink) wait for the next ticket instead of guessing
+whether a frame was dropped upstream.
+
+Queues are bounded at the input: while any stage has 'capacity' tickets
+queued, submit() waits, so a stage that can't keep up holds frames back in
+the capture ring, where the overload policy applies, rather than letting
+them pile up in the graph. (Tickets already inside can take a queue a few
+past 'capacity'.) Stages report frames in and out, the
+CPU time they took (thread CPU time, so time waiting for a core or a lock
+isn't counted), their queue depth and the latest value of each note.
+*/
+#ifndef STAGE_GRAPH_H
+#define STAGE_GRAPH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Frame.hpp>
+#include <WorkPool.hpp>
+
+struct StageNote {
+    std::string key;
+    double value;
+};
+
+struct StageOutput
+/*
+What a stage emits for the frames of one ticket, in order.
+*/
+{
+    std::vector<Frame> frames;
+    std::vector<StageNote> notes;
+
+    void emit(Frame &&frame) { frames.push_back(std::move(frame)); }
+    void note(const std::string &key, double value)
+    {
+        notes.push_back(StageNote{key, value});
+    }
+};
+
+class FrameStage
+{
+public:
+    virtual ~FrameStage() {}
+    virtual const char *name() const = 0;
+    virtual bool ordered() const { return false; }
+    virtual bool emits_frames() const { return true; } // Not just notes.
+    virtual void process(Frame &&frame, StageOutput &out) = 0;
+    /*
+    Called on any worker of the pool, concurrently with other frames unless
+    the stage is ordered().
+    */
+};
+
+struct StageStatus {
+    std::string name; // "sink" for the writers.
+    int parent; // Stage feeding this one, -1 for the graph's input.
+    bool ordered;
+    unsigned long frames_in, frames_out;
+    double cpu_ms; // Thread CPU time in process().
+    unsigned int depth, peak_depth; // Tickets queued or waiting for order.
+    std::vector<StageNote> notes; // Latest value of each key.
+};
+
+class StageGraph
+{
+public:
+    typedef std::function<void(Frame&&)> Sink;
+
+    StageGraph(WorkPool &pool, Sink sink, unsigned int capacity = 8);
+    ~StageGraph(); // Waits for the frames in the graph to reach the sink.
+
+    int add(std::unique_ptr<FrameStage> stage, int parent = -1);
+    /*
+    Adds a stage fed by stage 'parent' (as returned by an earlier add()), or
+    by the graph's input if -1, and returns its id.
+    */
+    void start(); // After the last add(), before the first submit().
+    void submit(Frame &&frame); // Blocks while a stage's queue is full.
+    void drain(); // Waits until every frame submitted has left the graph.
+    std::vector<StageStatus> status(); // Stages in the order added, sink last.
+    /*
+    submit() and drain() are called from one thread, the write thread;
+    status() from any once the graph has started.
+    */
+
+private:
+    StageGraph(const StageGraph&);
+    StageGraph& operator = (const StageGraph&);
+
+    struct Batch {
+        uint64_t ticket;
+        std::vector<Frame> frames;
+    };
+
+    struct Slot { // One ticket of an ordered stage, from all its inputs.
+        unsigned int arrived = 0;
+        std::vector<std::vector<Frame>> parts;
+    };
+
+    struct Node {
+        std::unique_ptr<FrameStage> stage; // Null for the sink.
+        std::string name;
+        bool ordered = false;
+        int parent = -1;
+        std::vector<int> children;
+        unsigned int inputs = 1; // Parents; only the sink has more.
+        unsigned int part = 0; // Which input of the sink a leaf is.
+
+        std::mutex mutex;
+        std::deque<Batch> ready; // Unordered stages.
+        std::map<uint64_t, Slot> waiting; // Ordered stages, by ticket.
+        uint64_t next = 0; // Ticket an ordered stage processes next.
+        bool running = false; // An ordered stage is processing.
+        unsigned int depth = 0, peak = 0;
+        std::map<std::string, double> notes;
+
+        std::atomic_ulong frames_in;
+        std::atomic_ulong frames_out;
+        std::atomic_ullong cpu_ns;
+
+        Node() : frames_in(0), frames_out(0), cpu_ns(0) {}
+    };
+
+    WorkPool &pool;
+    Sink sink;
+    unsigned int capacity;
+    std::vector<std::unique_ptr<Node>> nodes; // Stages, then the sink.
+    int sink_id = -1; // Set by start().
+    std::vector<int> roots; // Stages fed by submit().
+    uint64_t next_ticket = 0;
+
+    std::mutex mutex;
+    std::condition_variable changed; // Queue space or in-flight count.
+    unsigned int full = 0; // Stages whose queue is full.
+    unsigned long in_flight = 0; // Deliveries not yet processed.
+
+    void deliver(int id, unsigned int part, uint64_t ticket,
+                 std::vector<Frame> &&frames);
+    void run(int id);
+    bool take(Node &node, Batch &batch, unsigned int &parts);
+};
+
+#endif // STAGE_GRAPH_H
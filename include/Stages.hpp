@@ -0,0 +1,85 @@
+/*
+The processing stages the capture application can put in its stage graph
+(StageGraph.hpp), by name:
+
+    rectify    - Rectifies frames with the Rectifier (Rectify.hpp); in
+                 'both' mode emits the raw frame, then the rectified one.
+    split      - Splits frames into left and right halves with the
+                 StereoSplitter (StereoSplit.hpp).
+    brightness - Emits no frames, only notes: the mean level of each
+                 camera's frames and its change from the previous frame
+                 ('cam0.mean', 'cam0.change'). Ordered, as it compares each
+                 frame with the one before.
+
+A graph in which no branch emits frames (brightness alone, say) only
+watches: the writers get every frame as captured, besides the graph.
+
+A graph is given as branches fed by the capture, separated by ';', each a
+chain of stages separated by '>':
+
+    --stages 'rectify>split;brightness'
+
+writes rectified halves and keeps an eye on the exposure on the side.
+Without --stages the graph is built from --rectify and --stereo, in that
+order, and without either there is no graph at all.
+*/
+#ifndef STAGES_H
+#define STAGES_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Rectify.hpp>
+#include <StageGraph.hpp>
+#include <StereoSplit.hpp>
+
+typedef std::vector<std::vector<std::string>> stage_branches;
+
+bool parse_stages(const std::string &spec, stage_branches &branches);
+bool uses_stage(const stage_branches &branches, const std::string &name);
+
+std::unique_ptr<FrameStage> make_stage(const std::string &name,
+                                       Rectifier *rectifier,
+                                       StereoSplitter *splitter);
+/*
+Stage 'name', null if it is unknown or needs a rectifier or splitter that
+isn't given.
+*/
+
+class RectifyStage : public FrameStage
+{
+public:
+    explicit RectifyStage(Rectifier &rectifier) : rectifier(rectifier) {}
+    const char *name() const { return "rectify"; }
+    void process(Frame &&frame, StageOutput &out);
+
+private:
+    Rectifier &rectifier;
+};
+
+class SplitStage : public FrameStage
+{
+public:
+    explicit SplitStage(StereoSplitter &splitter) : splitter(splitter) {}
+    const char *name() const { return "split"; }
+    void process(Frame &&frame, StageOutput &out);
+
+private:
+    StereoSplitter &splitter;
+};
+
+class BrightnessStage : public FrameStage
+{
+public:
+    const char *name() const { return "brightness"; }
+    bool ordered() const { return true; }
+    bool emits_frames() const { return false; }
+    void process(Frame &&frame, StageOutput &out);
+
+private:
+    std::map<unsigned int, double> previous; // Mean per camera.
+};
+
+#endif // STAGES_H
@@ -0,0 +1,83 @@
+/*
+Splitting of the side-by-side OV580 frame into left and right images.
+
+The camera delivers one 1280x480 GREY frame per exposure, the left sensor in
+the first 640 columns of every row and the right one in the last 640. With
+splitting on, every frame submitted to the writers becomes two frames, left
+then right (Frame::view), which are recorded as separate streams:
+
+    STEREO_VIEW - The two images are ROI headers into the capture buffer,
+                  sharing its lease. No copy is made, but each row is
+                  strided, which encoders have to follow row by row.
+    STEREO_COPY - The halves are copied into contiguous planes taken from a
+                  pool owned by StereoSplitter, and the capture buffer goes
+                  back to the driver right away. If every plane buffer is in
+                  flight the frame falls back to views.
+
+split_planes() is the copy kernel: a memcpy per half row. It is bound by
+memory bandwidth, and glibc's memcpy already uses the widest vectors the
+CPU has; bench/split_bench compares it with cv::Mat ROI copies.
+*/
+#ifndef STEREO_SPLIT_H
+#define STEREO_SPLIT_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Frame.hpp>
+
+enum stereo_mode {
+    STEREO_OFF, // Frames are written whole.
+    STEREO_VIEW, // Zero copy ROI views.
+    STEREO_COPY, // Contiguous planes.
+};
+
+bool parse_stereo(const std::string &name, stereo_mode &mode);
+
+void split_planes(const cv::Mat &image, uint8_t *left, uint8_t *right);
+/*
+Copies the left half of each row of 8-bit 'image' to 'left' and the right
+half to 'right', both packed at (cols / 2) and (cols - cols / 2) bytes per
+row.
+*/
+
+struct StereoStatus {
+    unsigned int buffers; // Plane buffers in the pool.
+    unsigned int in_use; // Held by frames in flight.
+    unsigned long split; // Frames split.
+    unsigned long fallbacks; // Frames split into views for want of buffers.
+};
+
+class StereoSplitter : public LeaseOwner
+{
+public:
+    StereoSplitter(stereo_mode mode, unsigned int buffers);
+    /*
+    'buffers' plane buffers (each holding both halves of one frame) are
+    allocated at the first frame, or again when the frame size changes.
+    */
+
+    void split(const Frame &frame, Frame &left, Frame &right);
+    void requeue(unsigned int index, unsigned int generation);
+    StereoStatus status();
+    stereo_mode get_mode() const { return mode; }
+
+private:
+    stereo_mode mode;
+    unsigned int buffers;
+    std::mutex mutex;
+    std::vector<uint8_t> arena;
+    std::vector<unsigned int> free_list;
+    size_t left_bytes = 0, plane_bytes = 0; // Per buffer, 64 byte aligned.
+    int rows = 0, cols = 0;
+    unsigned int generation = 0;
+    std::atomic_ulong split_count;
+    std::atomic_ulong fallback_count;
+
+    bool take(const cv::Mat &image, unsigned int &index, unsigned int &gen);
+    static void views(const Frame &frame, Frame &left, Frame &right);
+};
+
+#endif // STEREO_SPLIT_H
@@ -0,0 +1,132 @@
+/*
+Streams live frames to clients over TCP or a Unix socket (FrameStream.hpp
+has the wire format and a client; vcap_recv is a client tool).
+
+The write thread offer()s every frame it takes from the rings, written or
+not, and returns at once: the server only keeps the newest frame of each
+camera, by reference, so offering costs a lock and an eventfd write, and
+frames are never queued. One server thread runs an epoll loop over the
+listening socket, the clients and the eventfd.
+
+Each client has at most one frame being sent, and, if it acknowledges
+frames (see StreamHello), at most its window of frames unacknowledged. When
+it can take another, it gets the newest frame of the next camera it hasn't
+seen yet; frames that came and went in between are counted as skipped for
+it. So a slow client or link gets fewer, but current, frames (latest frame
+wins), never a backlog, and never holds up capture or the other clients.
+A per-client rate limit (the server's --stream-fps, or lower if the client
+asks for it) spaces frames out the same way.
+
+Raw frames are sent straight from the capture buffer: sendmsg() gathers
+the header and the pixels, which the in-flight frame keeps alive. With a
+codec, frames are encoded into a buffer of the client's, reused from one
+frame to the next. Either way nothing is allocated per frame.
+*/
+#ifndef STREAM_SERVER_H
+#define STREAM_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Frame.hpp>
+#include <FrameCodec.hpp>
+#include <FrameStream.hpp>
+#include <PipelineStats.hpp>
+
+struct StreamConfig {
+    std::string endpoint; // See FrameStream.hpp, empty for no server.
+    frame_codec codec = CODEC_NONE;
+    double max_fps = 0; // Per client, 0 for no limit.
+    unsigned int max_clients = 8;
+};
+
+struct StreamClientStatus {
+    std::string peer;
+    double max_fps; // 0 for no limit.
+    unsigned long frames; // Sent whole.
+    unsigned long skipped; // Passed over for this client.
+    uint64_t bytes;
+    bool sending; // A frame is in flight.
+};
+
+struct StreamStatus {
+    std::string endpoint;
+    frame_codec codec;
+    unsigned long offered; // Frames handed to the server.
+    unsigned long accepted, refused; // Connections.
+    std::vector<StreamClientStatus> clients;
+};
+
+class StreamServer
+{
+public:
+    explicit StreamServer(const StreamConfig &config);
+    ~StreamServer(); // Disconnects every client.
+
+    bool is_open() const { return listen_fd != -1; }
+    void offer(const Frame &frame);
+    /*
+    Makes 'frame' the newest of its camera. Never blocks on clients.
+    */
+    StreamStatus status();
+
+private:
+    StreamServer(const StreamServer&);
+    StreamServer& operator = (const StreamServer&);
+
+    struct Latest {
+        Frame frame;
+        int64_t capture_ns = 0;
+        unsigned long count = 0; // Frames offered for this camera.
+    };
+    struct Client {
+        int fd = -1;
+        std::string peer;
+        std::atomic<int64_t> interval_ns{0}; // Rate limit, 0 for none.
+        int64_t next_ns = 0; // When the next frame may start.
+        std::vector<unsigned long> seen; // Latest::count sent, by camera.
+        unsigned int camera = 0; // Sent last.
+        StreamHello hello;
+        size_t hello_bytes = 0;
+        int credits = -1; // Frames it may be sent, -1 without acks.
+        // Frame in flight.
+        Frame frame;
+        StreamHeader header;
+        const uint8_t *payload = nullptr;
+        std::vector<uint8_t> coded; // Encoded or gathered rows, reused.
+        size_t sent = 0, total = 0; // Bytes of header plus payload.
+        bool writable_wait = false; // Waiting for EPOLLOUT.
+        // Read by status().
+        std::atomic_ulong frames{0}, skipped{0};
+        std::atomic<uint64_t> bytes{0};
+        std::atomic_bool busy{false}; // total != 0.
+    };
+
+    StreamConfig config;
+    StreamEndpoint endpoint;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int event_fd = -1; // Written by offer().
+    std::thread thread;
+    std::atomic_bool stopping;
+
+    std::mutex mutex; // Guards 'latest', the counts and adding clients.
+    std::vector<Latest> latest; // By camera.
+    std::vector<std::unique_ptr<Client>> clients;
+    unsigned long offered = 0;
+    unsigned long accepted = 0, refused = 0;
+
+    void run();
+    void accept_clients();
+    bool read_client(Client &client); // False if it went away.
+    bool start_frame(Client &client, int64_t now); // False if none is due.
+    bool send_frame(Client &client); // False if the client is gone.
+    bool pump(Client &client, int64_t now, int &timeout_ms);
+};
+
+#endif // STREAM_SERVER_H
@@ -6,12 +6,83 @@ line after the application starts. Commands are:
     n     - Where 'n' is an integer; writes 'n' frames to disk.
     stop  - Stops writing. Can be used after one of the previous two commands
             are called.
+    pool  - Prints how many driver buffers are held by frames in flight, and
+            stereo plane buffers when splitting (see StereoSplit.hpp) and
+            rectified frame buffers when rectifying (see Rectify.hpp).
+    workers - Prints frames, MB/s and load of each writer thread.
+    codec - Prints the compression ratio and cost per frame of a recording.
+    codec=X - Switches recording compression to X (none, fast or high).
+    history - Prints what the pre-trigger history holds.
+    bus   - Prints frames published to the shared-memory frame bus and the
+            lag and overruns of each reader (see FrameBus.hpp).
+    stream - Prints the clients of the streaming server, with frames sent
+            and skipped (see StreamServer.hpp).
+    gate  - Prints what change-gated writing wrote, why, and what it saved
+            (see MotionGate.hpp).
+    gate=PCT - Sets the change that opens the gate, in percent of the
+            frame; 0 writes every frame.
+    stats - Prints p50/p99/max latency per pipeline stage, the ring high-water
+            mark, frames dropped by the source, recoverable source events
+            (timeouts, errors, restarts) and the cost of rectifying a frame.
+    stats=X - Stage timing on, off, or reset (see PipelineStats.hpp).
+    cameras - Prints fps, drops and unmatched frames of each camera.
+    overload - Prints the ring overload policy and what it has discarded.
+    stages - Prints frames in and out, CPU time per frame and queue depth of
+            each processing stage, and the notes they emitted (see
+            Stages.hpp).
+    threads - Prints the CPUs and scheduling policy each thread actually
+            got, and how much memory is locked (see RealTime.hpp).
+    overload=P - Switches the policy: block, drop-newest, drop-oldest or
+            decimate[:K] (see FrameRing.hpp).
+    fps   - Switches between 100 and 60 fps.
+    fps=N, size=WxH, format=F - Changes the frame rate, size or pixel format
+            (GREY or Y16) of every camera. Only the driver stream restarts;
+            rings, writers and history keep running, and the gap between the
+            last frame before and the first after is printed.
+    metrics - Prints frames captured, written and dropped, ring occupancy,
+            writer throughput and stage latencies in the Prometheus text
+            format (see below).
     q     - Quits application.
 
-Capture Application initializes video capture device with address /dev/video0.
+With --control ENDPOINT the same commands are taken, one per line, on a
+socket as well (see ControlServer.hpp), and the reply to each is what the
+console would have printed, followed by an empty line. A bare PORT only
+listens on 127.0.0.1. Commands from the console and the socket run one
+at a time, the socket's on a thread of their own. 'metrics' is answered
+by the socket's polling thread without taking that turn: it only reads
+atomic counters, so scraping it (a TCP endpoint answers HTTP GET too)
+never waits for, or holds up, a command or the capture path. The console
+is polled rather than read blocking, so a 'q' from the socket quits too;
+with a control socket, the end of the console's input no longer quits.
+
+With a pre-trigger history enabled (--history-mb / --history-s) frames that
+arrive while not writing are kept in memory, and written ahead of the live
+stream by the next 'start' or 'n' command.
+
+Several cameras can be captured at once (-d given more than once, or
+--cameras N for synthetic sources). Each camera gets a reader thread and a
+ring of its own; the write thread matches their frames by driver timestamp
+into groups, one frame per camera within a tolerance (half a frame period by
+default), and writes whole groups. 'n' then counts groups. Frames that find
+no partner, e.g. because the other camera dropped its frame, are counted as
+unmatched and not written.
+
+Readers can run under SCHED_FIFO (--rt-priority) and every stage can be
+pinned to CPUs (--reader-cpus, --write-cpus, --writer-cpus, --preview-cpus);
+--mlockall locks all memory. What was granted is printed at startup.
+--jitter-test SEC times frame dequeues idle and under CPU load, prints the
+interval spread and exits, to check the settings on a given host.
+
+Frames are displayed by a preview thread (see Preview.hpp) at a reduced rate
+and size (--preview-fps, --preview-scale), or not at all (--no-preview), so
+the display never holds up capture.
+
+Capture Application initializes video capture device with address /dev/video0,
+unless another device or a synthetic/replay source is selected on the command
+line (see main.cpp).
 
 To initialize a VideoCapture object:
-    vc = VideoCapture()
+    vc = VideoCapture("/dev/video0")
 To grab a frame, call vc.read(). To release capture, vc.release().
 
     - David Henry 2018
@@ -37,89 +108,158 @@ extern "C" {
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <poll.h>
 // V4L2 - video4linux
 #include <linux/videodev2.h>
 }
 
 #include <iostream>
+#include <sstream>
+#include <vector>
 #include <thread>
 #include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
 
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 
-#include <boost/circular_buffer.hpp>
-#include <boost/thread/mutex.hpp>
-#include <boost/thread/condition.hpp>
-#include <boost/thread/thread.hpp>
-#include <boost/call_traits.hpp>
-#include <boost/bind.hpp>
+#include <CacheAligned.hpp>
+#include <ControlServer.hpp>
+#include <Frame.hpp>
+#include <FrameRing.hpp>
+#include <FrameSource.hpp>
+#include <Recording.hpp>
+#include <WriterPool.hpp>
+#include <FrameBus.hpp>
+#include <FrameHistory.hpp>
+#include <MotionGate.hpp>
+#include <PipelineStats.hpp>
+#include <Preview.hpp>
+#include <RealTime.hpp>
+#include <Rectify.hpp>
+#include <StageGraph.hpp>
+#include <Stages.hpp>
+#include <StereoSplit.hpp>
+#include <StreamServer.hpp>
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
-class Frame
-{
-public:
-    cv::Mat image;
-    struct timeval timestamp;
-
-    Frame() : image(cv::Mat(480, 1280, CV_8U)) {};
-    void clear();
-};
-
 class buffer {
 public:
     void *start;
     size_t length;
 };
 
-enum io_method {
-    IO_METHOD_READ,
-    IO_METHOD_MMAP,
-    IO_METHOD_USERPTR,
-};
-
-class VideoCapture{
+class VideoCapture : public FrameSource, public LeaseOwner {
 private:
-    const char *dev_name; // /dev/videoX
-    const enum io_method io = IO_METHOD_MMAP; // Memory mapping.
+    std::string dev_name; // /dev/videoX
+    io_method io; // As asked for, until the driver turns it down.
+    bool hugepages; // Arena options, for USERPTR and READ.
+    bool lock_buffers;
+    FrameArena arena; // Our own buffers for USERPTR and READ.
     int fd = -1;
+    int epoll_fd = -1; // Waits for the device to have buffers ready.
     buffer *buffers;
     unsigned int n_buffers;
+    unsigned int pool_size; // Number of buffers requested from the driver.
+    unsigned int width = 1280; // Frame size as accepted by the driver.
+    unsigned int height = 480;
+    uint32_t pixelformat = V4L2_PIX_FMT_GREY;
+    int mat_type = CV_8UC1; // Of 'pixelformat'.
+    size_t image_bytes = 0; // Driver's sizeimage.
     int out_buf;
     int force_format = 1; // If set != 0, img format specified in init_device()
     int fps = 100; // Defaults at 100 fps.
 
+    std::mutex pool_mutex; // Serializes requeue() against uninit_device().
+    std::condition_variable returned; // A lease was dropped.
+    unsigned int generation = 0; // Bumped whenever the buffers are unmapped.
+    std::atomic_uint leased; // Buffers dequeued and held by frame leases.
+    std::atomic_uint leased_peak;
+    std::atomic_ulong starved_count;
+    std::atomic_ulong lease_count;
+    std::vector<unsigned char> held; // Per buffer, leased; guarded by mutex.
+    std::vector<unsigned int> free_list; // READ: buffers to read into.
+    uint32_t read_sequence = 0; // READ: no driver sequence numbers.
+
+    int timeout_ms = 2000; // Wait for a frame before reporting a timeout.
+    unsigned int restart_after = 3; // Consecutive timeouts before restarting.
+    unsigned int timeouts_in_row = 0;
+    std::atomic_ulong timeout_count;
+    std::atomic_ulong error_count;
+    std::atomic_ulong corrupt_count;
+    std::atomic_ulong restart_count;
+
     void errno_exit(const char *s);
     int xioctl(int fh, int request, void *arg);
 
     void open_device(); // 'open()' call on file descriptor.
-    void init_device(); // Sets video capture format, fps, calls init_mmap().
-    void init_mmap(); // Initiates memory mapping.
-    void start_capturing(); // Starts capture, queues buffers.
+    void init_device(); // Checks the device, then set_format() or exits.
+    // The methods below report a failure and return false, so a live
+    // reconfigure can back out of it.
+    bool set_format(); // Sets video capture format, fps, sets up buffers.
+    bool set_rate(); // VIDIOC_S_PARM, keeps the rate the driver accepted.
+    bool init_mmap(); // Initiates memory mapping.
+    bool init_userp(size_t buffer_size); // Arena buffers, falls back to mmap.
+    bool init_read(size_t buffer_size); // Arena buffers plus a discard one.
+    bool renew_buffers(); // Frees the buffers, then set_format().
+    bool start_capturing(); // Starts capture, queues buffers.
+    int queue_buffer(unsigned int index); // VIDIOC_QBUF for 'io'.
+    int wait_ready(); // Waits for a buffer, 0 on a timeout or error.
     int process_frame(cv::Mat *frame); // Reads buffer into frame.
-    int process_frame(Frame &frame);
+    int process_frame(Frame &frame); // 1 frame, 0 none ready, -1 try again.
+    int read_frame(Frame &frame); // process_frame() for IO_METHOD_READ.
+    void restart_stream(); // STREAMOFF/ON, leaving leased buffers alone.
+    void report_error(const char *s); // Counts and prints, doesn't exit.
     void uninit_device(); // Unitiates memory map.
+    void free_buffers(bool keep_arena); // Stream off and pool_mutex held.
     void close_device(); // Closes device.
     void switch_fps(); // Fps value switch, called by capture() if needed.
+    // Wraps a dequeued buffer in a lease that re-queues it when dropped.
+    std::shared_ptr<FrameLease> lease_buffer(unsigned int index);
 
 public:
-    VideoCapture();
+    VideoCapture(const std::string &dev_name = "/dev/video0",
+                 unsigned int pool_size = 500, io_method io = IO_METHOD_MMAP,
+                 bool hugepages = false, bool lock_buffers = false);
     /*
-    On initialization, dev_name is set to "/dev/video0",
+    On initialization, 'pool_size' buffers are requested from 'dev_name',
         open_device();
         init_device();
         start_capturing();
+    With IO_METHOD_MMAP the buffers are the driver's, mapped in. With
+    IO_METHOD_USERPTR and IO_METHOD_READ they are ours, in a FrameArena
+    ('hugepages', 'lock_buffers', see FrameArena.hpp): USERPTR has the
+    driver DMA straight into them, READ copies each frame in with read().
+    A method the device doesn't support falls back to mmap (or, for a
+    device without streaming, to read); describe() names the one in use.
     */
     int read(cv::Mat *frame);
     int read(Frame &frame);
+    size_t read_batch(std::vector<Frame> &frames, size_t max);
     /*
-    Reads buffer into input frame.
+    Reads buffer into input frame. The cv::Mat of a Frame points straight at
+    the driver buffer, which stays dequeued until the frame and every copy of
+    it have been cleared or destroyed.
+
+    read_batch() waits on epoll and then dequeues every ready buffer (until
+    EAGAIN), so a burst of frames costs one wakeup. Timeouts, I/O errors and
+    frames flagged bad by the driver are counted in events() and the call
+    returns 0 instead of exiting; after 'restart_after' timeouts in a row the
+    stream is restarted, which often brings a stalled USB camera back.
+    */
+    void requeue(unsigned int index, unsigned int generation);
+    /*
+    Returns a leased buffer to the driver with VIDIOC_QBUF. Called by
+    FrameLease, leases from a previous generation are ignored.
     */
     void release();
     /*
-    Releases the video capture.
-        cv::destroyAllWindows;
+    Releases the video capture. Windows belong to the preview thread now.
         uninit_device();
         close_device();
     */
@@ -131,60 +271,132 @@ public:
         init_device();
         start_capturing();
     */
+    bool reconfigure(const StreamFormat &format);
+    /*
+    Changes fps, size and/or pixel format (GREY or Y16) between two reads,
+    without closing the device. A rate change is STREAMOFF, S_PARM and
+    STREAMON with every buffer kept, leased ones included. A format change
+    also has to give the buffers back to the driver, so it first waits (up
+    to 2 s) for frames in flight to be let go, and returns false without
+    touching anything if they aren't; USERPTR and READ buffers are kept if
+    the new frames fit in them, MMAP buffers are always new. If the driver
+    refuses the new rate or format, the old one is set up again and false
+    returned; errors are reported, never fatal.
+    */
     int get_fps(); // Returns fps value.
+    size_t frame_size() { return image_bytes; }
+    PoolStatus pool_status(); // Snapshot of buffer pool usage.
+    SourceEvents events();
+    std::string describe();
 };
 
-class bounded_buffer
-/*
-Thread-safe implementation of circular buffer, ensuring mutual exclusion
-between capture and write threads during buffer access. This is achieved by
-wrapping the operations of the underlying boost::circular_buffer object with
-lock acquisition and release.
+enum output_format {
+    OUTPUT_PGM, // One .pgm file per frame.
+    OUTPUT_VCAP, // Segmented recording container, see Recording.hpp.
+};
 
-Implementation is based on this example:
-http://www.boost.org/doc/libs/master/libs/circular_buffer/example/circular_buffer_bound_example.cpp
+struct CaptureConfig {
+    SourceConfig source; // Which frame source to capture from.
+    std::vector<std::string> devices; // V4L2 devices, if more than one.
+    unsigned int cameras = 1; // Synthetic sources to run side by side.
+    std::vector<int> reader_cpus; // CPUs to pin camera readers to.
+    size_t ring_bytes = 256 << 20; // Frames a camera's ring may hold.
+    overload_policy overload = OVERLOAD_BLOCK; // When the ring fills up.
+    unsigned int decimate_every = 2; // k of OVERLOAD_DECIMATE.
+    double group_ms = 0; // Timestamp tolerance of a group, 0 for automatic.
+    PreviewConfig preview; // Live display of the cameras.
+    stereo_mode stereo = STEREO_OFF; // Write left and right halves apart.
+    rectify_mode rectify = RECTIFY_OFF; // Write rectified frames.
+    StereoCalibration calibration; // Loaded when rectifying.
+    unsigned int rectify_threads = 3; // Band workers besides the caller.
+    std::string stages; // Stage graph (Stages.hpp), empty for the default.
+    unsigned int stage_threads = 2; // Workers running the stages.
+    std::vector<int> stage_cpus; // CPUs to pin them to, empty for any.
+    unsigned int stage_queue = 8; // Frames queued per stage at most.
+    output_format output = OUTPUT_PGM;
+    RecordingConfig recording; // Used with OUTPUT_VCAP.
+    unsigned int writer_threads = 2; // Workers encoding and writing frames.
+    std::vector<int> writer_cpus; // CPUs to pin writers to, empty for none.
+    std::vector<int> write_cpus; // CPUs for the write thread, empty for any.
+    int reader_priority = 0; // SCHED_FIFO priority of readers, 0 for none.
+    bool lock_memory = false; // mlockall() once everything is set up.
+    double jitter_seconds = 0; // Run the jitter test instead of commands.
+    int jitter_load = -1; // Load threads of the test, -1 for one per CPU.
+    size_t history_bytes = 0; // Pre-trigger history budget, 0 for none.
+    double history_seconds = 0; // Age limit of the history, 0 for none.
+    GateConfig gate; // Change-gated writing of 'start' takes.
+    std::string bus; // Shared-memory frame bus to publish to, if any.
+    unsigned int bus_slots = 32; // Frames the bus holds.
+    StreamConfig stream; // Network streaming of live frames.
+    std::string control; // Control and metrics socket, if any.
+    bool stats = false; // Collect stage latencies from the start.
+};
+
+struct Camera : CacheAligned
+/*
+One capture device with the reader thread that drains it and the SPSC ring
+that reader feeds. Counters are written by the reader and the write thread,
+and read by the console. The ring's indices sit on cache lines of their own,
+which CacheAligned keeps so on the heap.
 */
 {
-public:
-    typedef boost::circular_buffer<Frame> container_type;
-    typedef typename container_type::size_type size_type;
-    typedef typename container_type::value_type value_type;
-    typedef typename boost::call_traits<value_type>::param_type param_type;
-
-    explicit bounded_buffer(size_type capacity)
-    : m_unread(0), m_container(capacity) {}
+    Camera(unsigned int id, std::unique_ptr<FrameSource> source,
+           size_t ring_frames);
 
-    void push_front(typename boost::call_traits<value_type>::param_type item);
-    void pop_back(value_type* frameCopy);
-    void pop_back(value_type &frameCopy);
+    unsigned int id;
+    std::unique_ptr<FrameSource> source; // V4L2, synthetic or replay.
+    frame_ring ring; // Frames for the write thread.
+    std::thread thread; // Reader.
+    int cpu = -1; // CPU the reader is pinned to, -1 if not pinned.
+    std::vector<Frame> frames; // Batch read from the source.
+    drop_counter sequence; // Gaps in the source's frame numbers.
+    std::atomic_ulong received; // Frames read from the source.
+    std::atomic_ulong dropped; // Frames missing from the sequence.
+    std::atomic_ulong unmatched; // Frames that found no group.
+    std::chrono::steady_clock::time_point rate_start; // Of the fps report.
+    unsigned long rate_frames = 0; // 'received' at rate_start.
 
-    void clear_buffer() { m_container.clear(); m_unread = 0;}
-    void clear_consumer();
-    void clear_producer();
+    // A reconfigure is handed to the reader, which applies it between reads.
+    std::mutex control_mutex;
+    std::condition_variable control_cond;
+    std::atomic_bool reconfig_pending;
+    StreamFormat reconfig_format; // Guarded by control_mutex.
+    bool reconfig_ok = false;
+    int64_t last_frame_ns = 0; // Driver time of the newest frame, reader only.
+    int64_t gap_from_ns = 0; // last_frame_ns at a reconfigure, until reported.
 
-private:
-    // Disabled copy constructor.
-    bounded_buffer(const bounded_buffer&);
-    // Disabled assign operator.
-    bounded_buffer& operator = (const bounded_buffer&);
-
-    bool is_not_empty() const { return m_unread > 0; }
-    bool is_not_full() const { return m_unread < m_container.capacity(); }
-
-    size_type m_unread;
-    container_type m_container;
-    boost::mutex m_mutex;
-    boost::condition m_not_empty;
-    boost::condition m_not_full;
+    // Dequeue intervals of the jitter test, recorded by the reader while
+    // jitter_phase is 0 (idle) or 1 (loaded).
+    std::atomic_int jitter_phase;
+    interval_stats intervals[2];
+    int64_t last_dequeue_ns = 0; // Reader only.
 };
 
 class CaptureApplication
 {
 private:
-    VideoCapture vc;
-    std::thread readThread; // Thread for reading frames from VideoCapture.
+    std::vector<std::unique_ptr<Camera>> cameras; // At least one.
+    std::unique_ptr<Preview> preview; // Null when running headless.
     std::thread writeThread; // Thread for writing frames from VideoCapture.
-    bounded_buffer *CapAppBuffer; // Circular buffer for frame R/W.
+    std::unique_ptr<RecordWriter> recorder; // Set when writing a recording.
+    std::unique_ptr<FrameSink> sink; // Output format of the writers.
+    RecordSink *recordSink = nullptr; // 'sink' when writing a recording.
+    std::unique_ptr<FrameHistory> history; // Frames from before 'start'.
+    PipelineStats stats; // Stage latencies, drops and ring occupancy.
+    std::unique_ptr<StereoSplitter> splitter; // Set when splitting frames.
+    std::unique_ptr<Rectifier> rectifier; // Set when rectifying frames.
+    std::unique_ptr<WriterPool> writers; // Encode and write frames.
+    std::unique_ptr<WorkPool> stagePool; // Runs the stages.
+    std::unique_ptr<StageGraph> graph; // Null without processing stages.
+    bool graph_watches = false; // No stage emits frames, write them as is.
+    std::unique_ptr<MotionGate> gate; // Skips frames without change.
+    std::vector<Frame> gated; // Let through by the gate, write thread only.
+    std::unique_ptr<FramePublisher> bus; // Live frames for other processes.
+    std::unique_ptr<StreamServer> streamer; // Live frames over the network.
+    std::unique_ptr<ControlServer> control; // Commands from other processes.
+    std::mutex command_mutex; // Runs one command at a time.
+    std::string console; // Read from stdin, up to the next command.
+    bool console_closed = false; // stdin is at its end.
     std::atomic_bool writeContinuous; // Switch for writing frames to disk.
     std::atomic_bool writeSingles; // Switch for writing given amount of frames.
     std::atomic_bool writing; // Write status.
@@ -192,23 +404,65 @@ private:
     std::atomic_ulong writeCount; // Number of frames written to disk.
     std::atomic_uint additionalFrames; // User specified number of frames.
     //cv::Mat frame; // OpenCV Mat object which camera buffer is read to.
-    Frame frame;
-    const unsigned int cap_app_size = 500; // Frame capacity of circular buffer.
+    double group_ms; // Configured group tolerance, 0 for automatic.
+    std::atomic_int group_fps; // Rate the automatic tolerance is based on.
+    std::vector<Frame> earlier; // History being written, write thread only.
+    bool flushed = true; // Nothing submitted since the last flush.
+    bool wasWriting = false; // Write state of the previous group.
+    static const unsigned int source_batch = 16; // Max frames per read.
+    static const unsigned int write_batch = 32; // Max frames per writer pop.
+    std::vector<int> write_cpus; // Affinity of the write thread.
+    int reader_priority; // SCHED_FIFO priority of the readers, 0 for none.
+    bool memory_locked = false; // mlockall() succeeded.
 
     void run_capture(); // Loops through Videocapture.read() calls.
-    void parse_command();
+    void parse_command(); // Waits a little for a console command.
+    bool read_console(std::string &command);
+    void run_command(const std::string &command, std::ostream &out);
+    std::string control_command(const std::string &command);
+    void print_metrics(std::ostream &out); // Atomics only, no lock.
     void print_timestamp();
-    void write_image(Frame &frame);
     void write_image(cv::Mat *image); // Write current frame to disk.
     void write_image_raw(cv::Mat *image);
-    void update_write_status(); // Updates the write status.
-    void get_write_status();
+    // Updates the write status.
+    void update_write_status(std::ostream &out = std::cout);
+    void get_write_status(std::ostream &out = std::cout);
+    // Prints driver buffer usage by frame leases.
+    void print_pool_status(std::ostream &out);
+    void print_writer_stats(std::ostream &out); // Per-worker throughput.
+    void print_codec_stats(std::ostream &out); // Compression ratio and cost.
+    void print_history_status(std::ostream &out);
+    void print_pipeline_stats(std::ostream &out); // Stage latencies, drops.
+    void set_stats(const std::string &mode, std::ostream &out);
+    void set_codec(const std::string &name, std::ostream &out);
+    // fps=, size=, format=
+    void reconfigure(const std::string &command, std::ostream &out);
+    void apply_reconfigure(Camera &camera); // On the reader thread.
     bool numeric_command(const std::string *command); // Checks if input is num.
     unsigned int str2int(const std::string *command); // Converts str to int.
-    void read_frames(); // Reads frames to CapAppBuffer, and displays them.
-    void write_frames(); // Writes frames from CapAppBuffer.
+    void print_cameras(std::ostream &out); // Rate, drops and matching.
+    void print_overload(std::ostream &out); // Ring policies and discards.
+    // Prints the affinity and policy granted.
+    void print_threads(std::ostream &out = std::cout);
+    void run_jitter_test(double seconds, int load);
+    void set_overload(const std::string &name, std::ostream &out);
+    void read_frames(Camera &camera); // Fills the camera's ring.
+    void write_frames(); // Passes frames from the rings to the writers.
+    void group_frames(); // write_frames() with several cameras.
+    void dispatch(Frame *group, size_t n); // Writes or keeps a group.
+    void submit(Frame &&frame); // To the stages, or straight to the writers.
+    void build_graph(const CaptureConfig &config);
+    // Prints frames, CPU and queues of each stage.
+    void print_stages(std::ostream &out);
+    void print_gate(std::ostream &out); // Gate decisions and savings.
+    void print_bus(std::ostream &out); // Bus readers' lag and overruns.
+    void print_stream(std::ostream &out); // Stream clients' frames, skips.
+    void set_gate(const std::string &percent, std::ostream &out);
+    void finish_take(); // Flushes the writers once writing has stopped.
+    void start_threads();
+    void stop_threads(); // Closes the rings, joins, drops unread frames.
 public:
-    CaptureApplication();
+    explicit CaptureApplication(const CaptureConfig &config);
     ~CaptureApplication();
 };
 
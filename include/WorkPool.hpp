@@ -0,0 +1,61 @@
+/*
+Work-stealing thread pool that runs the processing stages (StageGraph.hpp).
+
+Each worker has a deque of tasks of its own. A task posted by a worker goes
+to the back of that worker's deque and the worker takes from the back too,
+so the frame a stage just emitted is processed next, on the same CPU, while
+it is still in cache. Tasks posted from outside the pool are dealt to the
+workers in turn. A worker whose deque is empty steals from the front of the
+others', the oldest task first, and only sleeps once every deque is empty.
+Deques have a mutex each, so workers only contend with thieves.
+*/
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkPool
+{
+public:
+    WorkPool(unsigned int threads, const std::vector<int> &cpus);
+    /*
+    Starts 'threads' workers (at least one), worker i pinned to
+    cpus[i % cpus.size()] if 'cpus' isn't empty.
+    */
+    ~WorkPool(); // Runs every task posted so far, then stops.
+
+    void post(std::function<void()> task);
+    unsigned int size() const { return workers.size(); }
+    std::thread &get_thread(unsigned int i) { return workers[i]->thread; }
+    unsigned long steals() const { return stolen; } // Tasks stolen so far.
+
+private:
+    WorkPool(const WorkPool&);
+    WorkPool& operator = (const WorkPool&);
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> queued; // Tasks in all deques.
+    std::atomic_ulong stolen;
+    std::atomic_uint next; // Worker the next outside post() goes to.
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false; // Guarded by 'sleep_mutex'.
+
+    bool take(unsigned int self, std::function<void()> &task);
+    void run(unsigned int self);
+};
+
+#endif // WORK_POOL_H
@@ -0,0 +1,155 @@
+/*
+Pool of writer threads between the capture ring and the disk.
+
+The write thread of CaptureApplication decides which frames are written and
+submit()s them in order; each gets the next sequence number. N worker threads
+take frames in that order and run FrameSink::encode() in parallel, which is
+where the expensive work (encoding, and for .pgm output the whole file write)
+happens. FrameSink::commit() is then called strictly in sequence order, so
+output that has to be appended in order (a recording) stays ordered, and the
+written-frame counter only ever counts a contiguous prefix of the frames.
+
+In-flight frames live in a fixed set of slots, each with its own encode
+buffer, so submit() blocks once 'depth' frames are queued or being written.
+*/
+#ifndef WRITER_POOL_H
+#define WRITER_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <CacheAligned.hpp>
+#include <Frame.hpp>
+#include <PipelineStats.hpp>
+#include <RealTime.hpp>
+#include <Recording.hpp>
+
+struct WriteJob {
+    Frame frame;
+    uint64_t sequence; // Position in the output, equals writeCount at commit.
+    std::vector<unsigned char> buffer; // Encoded output, reused between jobs.
+    size_t bytes; // Bytes produced by encode().
+};
+
+class FrameSink
+/*
+Output format of the writer pool. encode() runs concurrently on the workers,
+commit() and flush() are serialized and called in sequence order. A frame
+counts as written once both have returned true.
+*/
+{
+public:
+    virtual ~FrameSink() {}
+    virtual bool encode(WriteJob &job) = 0;
+    virtual bool commit(WriteJob&) { return true; }
+    virtual void flush() {}
+};
+
+class PgmSink : public FrameSink
+/*
+One '<timestamp>_<sequence>.pgm' file per frame, written by the worker that
+encoded it.
+*/
+{
+public:
+    bool encode(WriteJob &job);
+};
+
+class RecordSink : public FrameSink
+/*
+Records are built, and compressed if a codec is set, on the workers and
+appended to a RecordWriter in order. The codec can be changed at any time;
+each record says which one it was written with.
+*/
+{
+public:
+    RecordSink(RecordWriter &recorder, frame_codec codec)
+    : recorder(recorder), codec(codec) {}
+    bool encode(WriteJob &job);
+    bool commit(WriteJob &job);
+    void flush() { recorder.flush(); }
+
+    void set_codec(frame_codec c) { codec = c; }
+    frame_codec get_codec() const { return codec; }
+    CodecStats &codec_stats() { return stats; }
+
+private:
+    RecordWriter &recorder;
+    std::atomic<frame_codec> codec;
+    CodecStats stats;
+};
+
+struct WorkerStats {
+    unsigned long frames; // Frames encoded by the worker.
+    unsigned long bytes; // Bytes they encoded to.
+    double busy_s; // Time spent in encode() and commit().
+    double elapsed_s; // Since the worker started.
+    int cpu; // CPU the worker is pinned to, -1 if not pinned.
+};
+
+class WriterPool
+{
+public:
+    WriterPool(FrameSink &sink, std::atomic_ulong &written,
+               unsigned int workers, const std::vector<int> &cpus,
+               unsigned int depth = 0, PipelineStats *pipeline = nullptr);
+    /*
+    Starts 'workers' threads writing to 'sink' and incrementing 'written' as
+    frames are committed. Worker i is pinned to cpus[i % cpus.size()] when
+    'cpus' is not empty. 'depth' is the number of in-flight frames, 4 per
+    worker by default. Frames are stamped as encoded and written in
+    'pipeline', if given.
+    */
+    ~WriterPool(); // Writes everything submitted, then stops the workers.
+
+    bool submit(Frame &&frame); // Blocks while every slot is in flight.
+    void flush(); // Waits for submitted frames to commit, flushes the sink.
+    std::vector<WorkerStats> stats();
+    unsigned long backlog() const { return pending; } // Not yet committed.
+    unsigned long failures() const { return failed; } // Encode or commit.
+    unsigned int size() const { return threads.size(); }
+    std::thread &get_thread(unsigned int i) { return threads[i]; }
+
+private:
+    WriterPool(const WriterPool&);
+    WriterPool& operator = (const WriterPool&);
+
+    enum slot_state { SLOT_FREE, SLOT_QUEUED, SLOT_DONE };
+
+    struct alignas(CacheAligned::cache_line) Worker : CacheAligned {
+        std::atomic_ulong frames;
+        std::atomic_ulong bytes;
+        std::atomic_ullong busy_ns;
+        int cpu;
+    };
+
+    FrameSink &sink;
+    std::atomic_ulong &written;
+    PipelineStats *pipeline;
+    std::vector<WriteJob> slots;
+    std::vector<slot_state> states; // Guarded by 'mutex'.
+    std::unique_ptr<Worker[]> workers;
+    std::vector<std::thread> threads;
+    std::chrono::steady_clock::time_point started;
+
+    std::mutex mutex;
+    std::condition_variable work_ready; // Something to take, or stopping.
+    std::condition_variable slot_freed; // submit() and flush() wait on this.
+    uint64_t next_submit = 0; // Sequence of the next submit().
+    uint64_t next_take = 0; // Next sequence a worker picks up.
+    uint64_t next_commit = 0; // Next sequence to be committed.
+    bool stopping = false;
+    std::atomic_ulong pending; // next_submit - next_commit, for backlog().
+    std::atomic_ulong failed; // Frames not written, for failures().
+    std::mutex commit_mutex; // Serializes sink.commit() in sequence order.
+
+    void run(unsigned int id);
+    void commit_ready(Worker &worker);
+};
+
+#endif // WRITER_POOL_H
@@ -0,0 +1,110 @@
+/*
+Reads frames live from the shared-memory frame bus of a running
+VideoCapture (--bus NAME) and shows them.
+
+    vcap_bus [-c FRAMES] [-d MS] [-n] NAME
+
+Frames are shown as they come, straight from the bus without copies, in a
+window per camera and view. Once a second the rate, how far behind the
+publisher the reader is and how many frames it lost are printed. -c stops
+after FRAMES frames; -d spends MS milliseconds on each frame, to see what a
+slow reader does to itself (capture is never held up); -n shows no windows,
+e.g. on a headless machine. Exits when the capture does.
+*/
+#include <FrameBus.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <getopt.h>
+}
+
+#include <opencv2/highgui.hpp>
+
+typedef std::chrono::steady_clock bus_clock;
+
+static std::string window_name(const Frame &frame)
+{
+    static const char *views[] = {"", " L", " R", ""};
+    return "Bus camera " + std::to_string(frame.camera) +
+           views[frame.view & ~VIEW_RECTIFIED & 3] +
+           (frame.view & VIEW_RECTIFIED ? " rectified" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long count = 0;
+    long delay_ms = 0;
+    bool display = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "c:d:nh")) != -1) {
+        switch (c) {
+        case 'c': count = strtoul(optarg, NULL, 10); break;
+        case 'd': delay_ms = atol(optarg); break;
+        case 'n': display = false; break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-c FRAMES] [-d MS] [-n] "
+                      << "NAME" << std::endl;
+            return c == 'h' ? 0 : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "No bus given" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    BusReader reader(argv[optind]);
+    if (!reader.is_open())
+        return EXIT_FAILURE;
+    std::cout << "Reading " << bus_path(argv[optind]) << " of pid "
+              << reader.bus()->publisher << ": " << reader.bus()->slots
+              << " slots" << std::endl;
+
+    unsigned long frames = 0, torn = 0, second_frames = 0;
+    auto started = bus_clock::now(), second = started;
+    Frame frame;
+    int ret;
+    while ((ret = reader.next(frame, 500)) >= 0) {
+        auto now = bus_clock::now();
+        if (now - second >= std::chrono::seconds(1)) {
+            double s = std::chrono::duration<double>(now - second).count();
+            printf("%6.1f fps, %4llu behind, %llu overruns, %lu torn\n",
+                   second_frames / s,
+                   static_cast<unsigned long long>(reader.lag()),
+                   static_cast<unsigned long long>(reader.overruns()), torn);
+            fflush(stdout);
+            second = now;
+            second_frames = 0;
+        }
+        if (ret == 0)
+            continue;
+        if (display) {
+            cv::imshow(window_name(frame), frame.image);
+            if (cv::waitKey(1) == 'q')
+                break;
+        }
+        if (delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+        // Overwritten while in use: whatever was made of it is suspect.
+        if (!reader.still_valid())
+            ++torn;
+        ++frames;
+        ++second_frames;
+        if (count && frames >= count)
+            break;
+    }
+    frame.clear();
+    double wall = std::chrono::duration<double>(bus_clock::now() - started)
+                      .count();
+    std::cout << (ret < 0 ? "Bus closed. " : "") << "Read " << frames
+              << " frames in " << wall << " s, "
+              << reader.overruns() << " overruns, " << torn << " torn"
+              << std::endl;
+    return 0;
+}
@@ -1,37 +1,194 @@
 #include <VideoCap.hpp>
 
-CaptureApplication::CaptureApplication()
-: writeContinuous(false), writeSingles(false), captureOn(true), writeCount(0)
+#include <algorithm>
+#include <deque>
+
+Camera::Camera(unsigned int id, std::unique_ptr<FrameSource> source,
+               size_t ring_frames)
+: id(id), source(std::move(source)), ring(ring_frames), received(0),
+  dropped(0), unmatched(0), rate_start(std::chrono::steady_clock::now()),
+  reconfig_pending(false), jitter_phase(-1)
+{
+}
+
+static size_t ring_capacity(size_t budget, FrameSource &source)
+{
+    size_t frame = source.frame_size();
+    if (frame == 0)
+        frame = 1280 * 480; // A replay, say; assume the OV580.
+    size_t frames = budget / frame;
+    // Frames in the ring hold source buffers. A ring as big as the pool
+    // would let the source run out first and drop frames where no overload
+    // policy sees them.
+    unsigned int pool = source.pool_status().size;
+    if (pool > 0)
+        frames = std::min<size_t>(frames, pool - pool / 4);
+    return std::max<size_t>(frames, 4);
+}
+
+static std::vector<SourceConfig> camera_configs(const CaptureConfig &config)
 {
+    std::vector<SourceConfig> configs;
+    if (config.source.kind == SOURCE_V4L2 && !config.devices.empty()) {
+        for (const std::string &device : config.devices) {
+            SourceConfig c = config.source;
+            c.device = device;
+            configs.push_back(c);
+        }
+    } else if (config.source.kind == SOURCE_SYNTHETIC) {
+        configs.assign(std::max(config.cameras, 1u), config.source);
+    } else {
+        configs.push_back(config.source);
+    }
+    return configs;
+}
+
+CaptureApplication::CaptureApplication(const CaptureConfig &config)
+: writeContinuous(false), writeSingles(false), captureOn(true), writeCount(0),
+  group_ms(config.group_ms), group_fps(0), write_cpus(config.write_cpus),
+  reader_priority(config.reader_priority)
+{
+    std::vector<SourceConfig> configs = camera_configs(config);
+    for (size_t i = 0; i < configs.size(); ++i) {
+        std::unique_ptr<FrameSource> source = make_source(configs[i]);
+        size_t frames = ring_capacity(config.ring_bytes, *source);
+        cameras.emplace_back(new Camera(i, std::move(source), frames));
+        cameras[i]->ring.set_policy(config.overload, config.decimate_every);
+        cameras[i]->ring.set_stats(&stats);
+        std::cout << (configs.size() > 1 ? "Camera " + std::to_string(i) + ": "
+                                         : "Source: ")
+                  << cameras[i]->source->describe() << std::endl;
+    }
+    std::cout << "Ring: " << cameras[0]->ring.capacity() << " frames, "
+              << overload_name(config.overload) << " when full" << std::endl;
+    FrameSource *source = cameras[0]->source.get();
+    group_fps = source->get_fps();
+    if (config.preview.enabled)
+        preview.reset(new Preview(config.preview, cameras.size()));
+    if (config.output == OUTPUT_VCAP) {
+        RecordingConfig recording = config.recording;
+        if (recording.base.empty())
+            recording.base = "recording_" + std::to_string(time(NULL));
+        recorder.reset(new RecordWriter(recording));
+        recordSink = new RecordSink(*recorder, config.recording.codec);
+        sink.reset(recordSink);
+        std::cout << "Recording to " << recording.base << ".*" << std::endl;
+    } else {
+        if (config.recording.codec != CODEC_NONE)
+            std::cout << "Compression only applies to vcap output"
+                      << std::endl;
+        sink.reset(new PgmSink());
+    }
+    if (config.history_bytes > 0 || config.history_seconds > 0) {
+        history.reset(new FrameHistory(config.history_bytes,
+                                       config.history_seconds,
+                                       source->get_fps()));
+        std::cout << "Pre-trigger history enabled" << std::endl;
+    }
+    stats.enable(config.stats);
+    if (!config.bus.empty()) {
+        // Slots fit the largest frame, or a 1280x480 Y16 one if unknown.
+        size_t slot_bytes = 0;
+        for (const std::unique_ptr<Camera> &camera : cameras)
+            slot_bytes = std::max(slot_bytes, camera->source->frame_size());
+        if (slot_bytes == 0)
+            slot_bytes = 1280 * 480 * 2;
+        bus.reset(new FramePublisher(config.bus, config.bus_slots,
+                                     slot_bytes));
+        if (bus->is_open())
+            std::cout << "Publishing frames to " << bus_path(config.bus)
+                      << " (" << config.bus_slots << " slots of "
+                      << (slot_bytes >> 10) << " kB)" << std::endl;
+        else
+            bus.reset();
+    }
+    if (!config.stream.endpoint.empty()) {
+        streamer.reset(new StreamServer(config.stream));
+        if (streamer->is_open())
+            std::cout << "Streaming frames on " << config.stream.endpoint
+                      << " (" << codec_name(config.stream.codec) << ")"
+                      << std::endl;
+        else
+            streamer.reset();
+    }
+    gate.reset(new MotionGate(config.gate));
+    if (gate->active())
+        std::cout << "Writing frames that change by " << config.gate.threshold
+                  << "% or more" << std::endl;
+    if (config.stereo != STEREO_OFF)
+        splitter.reset(new StereoSplitter(config.stereo,
+                                          4 * config.writer_threads + 8));
+    if (config.rectify != RECTIFY_OFF) {
+        rectifier.reset(new Rectifier(config.calibration, config.rectify,
+                                      config.rectify_threads,
+                                      4 * config.writer_threads + 8));
+        std::cout << "Rectifying " << 2 * config.calibration.width << "x"
+                  << config.calibration.height << " frames ("
+                  << rectify_kernel_name() << ", "
+                  << config.rectify_threads + 1 << " bands)" << std::endl;
+    }
+    writers.reset(new WriterPool(*sink, writeCount, config.writer_threads,
+                                 config.writer_cpus, 0, &stats));
+    std::cout << "Writer threads: " << writers->size() << std::endl;
+    build_graph(config);
     // Print out current fps.
-    std::cout << "FPS: " << vc.get_fps() << std::endl;
+    std::cout << "FPS: " << source->get_fps() << std::endl;
     writing = (writeContinuous || writeCount); // Initial write status = 0.
     get_write_status();
-    /* Because the bounded buffer could not be initialized directly as a class
-    variable, we initialize the CapAppBuffer pointer instead, and set it to
-    the address of the bounded buffer buf. */
-    bounded_buffer buf(cap_app_size);
-    CapAppBuffer = &buf;
 
     // Start separate threads for reading and writing frames to/from the
     // application buffer.
-    readThread = std::thread(&CaptureApplication::read_frames, this);
-    writeThread = std::thread(&CaptureApplication::write_frames, this);
+    if (!config.reader_cpus.empty())
+        for (const std::unique_ptr<Camera> &camera : cameras)
+            camera->cpu = config.reader_cpus[camera->id %
+                                             config.reader_cpus.size()];
+    // Everything allocated so far is locked now, and later allocations as
+    // they are made.
+    if (config.lock_memory)
+        memory_locked = lock_memory();
+    start_threads();
+    print_threads();
 
+    if (config.jitter_seconds > 0) {
+        run_jitter_test(config.jitter_seconds, config.jitter_load);
+        captureOn = false;
+    }
+    if (captureOn && !config.control.empty()) {
+        control.reset(new ControlServer(config.control,
+            [this](const std::string &command) {
+                return control_command(command);
+            },
+            [this]() {
+                std::ostringstream out;
+                print_metrics(out);
+                return out.str();
+            }));
+        if (control->is_open())
+            std::cout << "Taking commands on " << control->name()
+                      << std::endl;
+        else
+            control.reset();
+    }
     while (captureOn) {
         parse_command();
     }
     // When captureOn is set to false via the 'q' command, end application.
-    readThread.join();
+    control.reset(); // No commands while shutting down.
+    stop_threads();
     std::cout << "..." << std::endl;
-    writeThread.join();
-    std::cout << "..." << std::endl;
-    CapAppBuffer->clear_buffer();
+    preview.reset(); // Shown frames hold source buffers too.
+    streamer.reset(); // As do streamed ones, and its thread reads them.
+    bus.reset();
+    gate->reset(); // As do frames held for pre-padding.
+    if (graph)
+        graph->drain();
+    writers->flush(); // Frames already handed to the writers get written.
 }
 
 CaptureApplication::~CaptureApplication()
 {
-    vc.release();
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->source->release();
     std::cout << "Application exited." << std::endl;
 }
 
@@ -44,15 +201,15 @@ bool CaptureApplication::numeric_command(const std::string *command)
     return true;
 }
 
-void CaptureApplication::get_write_status()
+void CaptureApplication::get_write_status(std::ostream &out)
 {
-    std::cout << "Write status: " << writing << std::endl;
+    out << "Write status: " << writing << std::endl;
 }
 
-void CaptureApplication::update_write_status()
+void CaptureApplication::update_write_status(std::ostream &out)
 {
     writing = (writeContinuous || writeSingles);
-    get_write_status();
+    get_write_status(out);
 }
 
 unsigned int CaptureApplication::str2int(const std::string *command)
@@ -66,87 +223,598 @@ unsigned int CaptureApplication::str2int(const std::string *command)
 void CaptureApplication::parse_command()
 {
     std::string command;
-    std::cin >> command;
+    if (!read_console(command))
+        return;
+    std::lock_guard<std::mutex> lock(command_mutex);
+    run_command(command, std::cout);
+}
+
+bool CaptureApplication::read_console(std::string &command)
+{
+    // Commands are words separated by white space, as with std::cin >>.
+    for (;;) {
+        size_t start = console.find_first_not_of(" \t\r\n");
+        size_t end = console.find_first_of(" \t\r\n", start);
+        if (start != std::string::npos && end != std::string::npos) {
+            command = console.substr(start, end - start);
+            console.erase(0, end);
+            return true;
+        }
+        if (console_closed) {
+            command = console.substr(std::min(start, console.size()));
+            console.clear();
+            if (!command.empty())
+                return true;
+            // Without a control socket nothing else can quit.
+            if (control)
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            else
+                command = "q";
+            return !command.empty();
+        }
+        // Waits briefly, so the caller sees a 'q' from the control socket.
+        pollfd in = {STDIN_FILENO, POLLIN, 0};
+        int ready = poll(&in, 1, 200);
+        if (ready == 0 || (ready == -1 && errno == EINTR))
+            return false;
+        char data[256];
+        ssize_t n = ready > 0 ? read(STDIN_FILENO, data, sizeof(data)) : 0;
+        if (n > 0)
+            console.append(data, n);
+        else if (n == 0 || errno != EINTR)
+            console_closed = true;
+    }
+}
+
+std::string CaptureApplication::control_command(const std::string &command)
+{
+    std::ostringstream out;
+    std::lock_guard<std::mutex> lock(command_mutex);
+    run_command(command, out);
+    return out.str();
+}
+
+void CaptureApplication::run_command(const std::string &command,
+                                     std::ostream &out)
+{
     if (command == "q") {
         // Quit command.
-        std::cout << "Quitting..." << std::endl;
+        out << "Quitting..." << std::endl;
         captureOn = false;
-        std::cout << "..." << std::endl;
+        for (const std::unique_ptr<Camera> &camera : cameras)
+            camera->ring.close();
+        out << "..." << std::endl;
     } else if (command == "start" && !writing) {
         // Starts writing frames to disk continuously.
-        writeContinuous = true; update_write_status();
-        std::cout << "Writing frames..." << std::endl;
+        writeContinuous = true; update_write_status(out);
+        out << "Writing frames..." << std::endl;
     } else if (command == "start" && writing) {
-        std::cout << "Already writing!" << std::endl;
+        out << "Already writing!" << std::endl;
     } else if (command == "stop" && !writing) {
-        std::cout << "Enter 'start' to commence writing" << std::endl;
+        out << "Enter 'start' to commence writing" << std::endl;
     } else if (command == "stop" && writing) {
         // Stops writing frames to disk.
         writeContinuous = false; writeSingles = false;
-        std::cout << "Write stopped!" << std::endl;
-        update_write_status();
+        out << "Write stopped!" << std::endl;
+        update_write_status(out);
     } else if (numeric_command(&command) && !writing) {
         additionalFrames = str2int(&command);
-        std::cout << "Writing " << additionalFrames
-                  << " frames" << std::endl;
-        writeSingles = true; update_write_status();
+        out << "Writing " << additionalFrames
+            << " frames" << std::endl;
+        writeSingles = true; update_write_status(out);
     } else if (numeric_command(&command) && writing) {
-        std::cout << "Already writing!" << std::endl;
-    } else if (command == "fps") {
-        captureOn = false;
-        readThread.join();
-        writeThread.join();
-        CapAppBuffer->clear_buffer();
-        vc.release();
-        vc.capture(true);
-        captureOn = true;
-        readThread = std::thread(&CaptureApplication::read_frames, this);
-        writeThread = std::thread(&CaptureApplication::write_frames, this);
-        get_write_status();
+        out << "Already writing!" << std::endl;
+    } else if (command == "pool") {
+        print_pool_status(out);
+    } else if (command == "workers") {
+        print_writer_stats(out);
+    } else if (command == "history") {
+        print_history_status(out);
+    } else if (command == "bus") {
+        print_bus(out);
+    } else if (command == "stream") {
+        print_stream(out);
+    } else if (command == "gate") {
+        print_gate(out);
+    } else if (command.compare(0, 5, "gate=") == 0) {
+        set_gate(command.substr(5), out);
+    } else if (command == "cameras") {
+        print_cameras(out);
+    } else if (command == "stages") {
+        print_stages(out);
+    } else if (command == "threads") {
+        print_threads(out);
+    } else if (command == "overload") {
+        print_overload(out);
+    } else if (command.compare(0, 9, "overload=") == 0) {
+        set_overload(command.substr(9), out);
+    } else if (command == "metrics") {
+        print_metrics(out);
+    } else if (command == "stats") {
+        print_pipeline_stats(out);
+    } else if (command.compare(0, 6, "stats=") == 0) {
+        set_stats(command.substr(6), out);
+    } else if (command == "codec") {
+        print_codec_stats(out);
+    } else if (command.compare(0, 6, "codec=") == 0) {
+        set_codec(command.substr(6), out);
+    } else if (command == "fps" || command.compare(0, 4, "fps=") == 0 ||
+               command.compare(0, 5, "size=") == 0 ||
+               command.compare(0, 7, "format=") == 0) {
+        reconfigure(command, out);
     } else {
-        std::cout << "Command not valid!" << std::endl;
+        out << "Command not valid!" << std::endl;
     }
 }
 
-void CaptureApplication::read_frames()
+void CaptureApplication::start_threads()
 {
-    int ret;
+    captureOn = true;
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        camera->thread = std::thread(&CaptureApplication::read_frames, this,
+                                     std::ref(*camera));
+        if (camera->cpu >= 0 && !pin_thread(camera->thread, camera->cpu))
+            camera->cpu = -1;
+        if (reader_priority > 0)
+            set_fifo(camera->thread, reader_priority);
+    }
+    writeThread = std::thread(&CaptureApplication::write_frames, this);
+    if (!write_cpus.empty())
+        pin_thread(writeThread, write_cpus);
+}
+
+void CaptureApplication::build_graph(const CaptureConfig &config)
+{
+    stage_branches branches;
+    if (!config.stages.empty()) {
+        parse_stages(config.stages, branches);
+    } else {
+        std::vector<std::string> chain;
+        if (rectifier)
+            chain.push_back("rectify");
+        if (splitter)
+            chain.push_back("split");
+        if (chain.empty())
+            return; // Straight to the writers.
+        branches.push_back(chain);
+    }
+    stagePool.reset(new WorkPool(config.stage_threads, config.stage_cpus));
+    WriterPool *pool = writers.get();
+    graph.reset(new StageGraph(*stagePool, [pool](Frame &&frame) {
+        pool->submit(std::move(frame));
+    }, config.stage_queue));
+    graph_watches = true;
+    for (const std::vector<std::string> &chain : branches) {
+        int parent = -1;
+        bool emits = true;
+        for (const std::string &name : chain) {
+            std::unique_ptr<FrameStage> stage =
+                make_stage(name, rectifier.get(), splitter.get());
+            if (!stage) {
+                std::cout << "Stage '" << name << "' is not set up, left out"
+                          << std::endl;
+                continue;
+            }
+            emits = emits && stage->emits_frames();
+            parent = graph->add(std::move(stage), parent);
+        }
+        if (parent != -1 && emits)
+            graph_watches = false;
+    }
+    graph->start();
+    std::cout << "Stages: ";
+    for (size_t i = 0; i < branches.size(); ++i) {
+        std::cout << (i ? "; " : "");
+        for (size_t j = 0; j < branches[i].size(); ++j)
+            std::cout << (j ? " > " : "") << branches[i][j];
+    }
+    std::cout << " on " << stagePool->size() << " workers" << std::endl;
+    if (graph_watches)
+        std::cout << "No stage emits frames, frames are written as captured"
+                  << std::endl;
+}
+
+void CaptureApplication::print_threads(std::ostream &out)
+{
+    // Read back from the kernel: a refused request shows up as the default.
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        out << "Reader " << camera->id << ": "
+            << describe_thread(camera->thread) << std::endl;
+    out << "Write thread: " << describe_thread(writeThread) << std::endl;
+    for (unsigned int i = 0; i < writers->size(); ++i)
+        out << "Writer " << i << ": "
+            << describe_thread(writers->get_thread(i)) << std::endl;
+    if (stagePool)
+        for (unsigned int i = 0; i < stagePool->size(); ++i)
+            out << "Stage worker " << i << ": "
+                << describe_thread(stagePool->get_thread(i))
+                << std::endl;
+    if (preview)
+        out << "Preview: " << describe_thread(preview->get_thread())
+            << std::endl;
+    out << "Memory: " << describe_memory()
+        << (memory_locked ? ", mlockall" : "") << std::endl;
+}
+
+void CaptureApplication::run_jitter_test(double seconds, int load)
+{
+    // Frames are read and discarded as usual, nothing is written.
+    static const char *phases[] = {"idle", "loaded"};
+    std::vector<unsigned long> dropped(2 * cameras.size());
+    std::unique_ptr<cpu_load> hog;
+    for (int phase = 0; phase < 2; ++phase) {
+        if (phase == 1) {
+            hog.reset(new cpu_load(load));
+            std::cout << "Jitter test: " << hog->size() << " busy threads"
+                      << std::endl;
+        }
+        std::cout << "Jitter test: " << seconds << " s " << phases[phase]
+                  << "..." << std::endl;
+        for (const std::unique_ptr<Camera> &camera : cameras) {
+            dropped[2 * camera->id + phase] = camera->dropped;
+            camera->jitter_phase = phase;
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        for (const std::unique_ptr<Camera> &camera : cameras)
+            dropped[2 * camera->id + phase] =
+                camera->dropped - dropped[2 * camera->id + phase];
+    }
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->jitter_phase = -1;
+    hog.reset();
+
+    int fps = group_fps;
+    std::cout << "Dequeue intervals, " << (fps > 0 ? 1e6 / fps : 0)
+              << " us expected:" << std::endl;
+    std::cout << "camera   phase     frames    mean us  stddev us     p50 us"
+                 "     p99 us     max us    dropped" << std::endl;
+    char line[160];
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        for (int phase = 0; phase < 2; ++phase) {
+            IntervalSummary s = camera->intervals[phase].summary();
+            snprintf(line, sizeof(line),
+                     "%-8u %-6s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10lu",
+                     camera->id, phases[phase],
+                     static_cast<unsigned long>(s.count), s.mean_us,
+                     s.stddev_us, s.p50_us, s.p99_us, s.max_us,
+                     dropped[2 * camera->id + phase]);
+            std::cout << line << std::endl;
+        }
+    }
+}
+
+void CaptureApplication::stop_threads()
+{
+    // Closing the rings wakes any thread parked on one.
+    captureOn = false;
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->ring.close();
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->thread.join();
+    writeThread.join();
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->ring.clear();
+}
+
+void CaptureApplication::reconfigure(const std::string &command,
+                                     std::ostream &out)
+{
+    StreamFormat format;
+    unsigned int width, height;
+    if (command == "fps") {
+        format.fps = cameras[0]->source->get_fps() == 100 ? 60 : 100;
+    } else if (command.compare(0, 4, "fps=") == 0) {
+        format.fps = atoi(command.c_str() + 4);
+    } else if (command.compare(0, 5, "size=") == 0 &&
+               sscanf(command.c_str() + 5, "%ux%u", &width, &height) == 2) {
+        format.width = width;
+        format.height = height;
+    } else if (command.compare(0, 7, "format=") == 0) {
+        parse_fourcc(command.substr(7), format.fourcc);
+    }
+    if (format.fps <= 0 && !format.width && !format.fourcc) {
+        out << "Command not valid!" << std::endl;
+        return;
+    }
+
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        std::lock_guard<std::mutex> lock(camera->control_mutex);
+        camera->reconfig_format = format;
+        camera->reconfig_pending = true;
+    }
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        std::unique_lock<std::mutex> lock(camera->control_mutex);
+        // The reader gets to it within a read, or a source timeout.
+        if (!camera->control_cond.wait_for(lock, std::chrono::seconds(10),
+                [&camera] { return !camera->reconfig_pending; }))
+            out << "Camera " << camera->id
+                << " did not reconfigure in time" << std::endl;
+        else if (!camera->reconfig_ok)
+            out << "Camera " << camera->id << " unchanged" << std::endl;
+    }
+    group_fps = cameras[0]->source->get_fps();
+    out << "FPS: " << group_fps << std::endl;
+}
+
+void CaptureApplication::apply_reconfigure(Camera &camera)
+{
+    std::unique_lock<std::mutex> lock(camera.control_mutex);
+    // The last batch still shares its buffers' leases.
+    camera.frames.clear();
+    camera.reconfig_ok = camera.source->reconfigure(camera.reconfig_format);
+    if (camera.reconfig_ok) {
+        camera.sequence.restart(); // The driver counts from 0 again.
+        camera.gap_from_ns = camera.last_frame_ns;
+    }
+    camera.reconfig_pending = false;
+    lock.unlock();
+    camera.control_cond.notify_all();
+}
+
+void CaptureApplication::read_frames(Camera &camera)
+{
+    // A read that returns nothing (timeout, recovered error) just loops, so
+    // 'q' still works while the camera is stalled.
+    std::vector<Frame> &frames = camera.frames;
+    if (memory_locked)
+        prefault_stack();
     while (captureOn)
     {
-        ret = vc.read(frame);
-        if (ret) {
-            CapAppBuffer->push_front(frame); // writes to front of buffer
-            cv::imshow("Frame", frame.image);
-            cv::waitKey(1);
+        if (camera.reconfig_pending)
+            apply_reconfigure(camera);
+        if (camera.source->read_batch(frames, source_batch) == 0)
+            continue;
+        int phase = camera.jitter_phase.load(std::memory_order_relaxed);
+        if (phase >= 0) {
+            // A batch was dequeued at once; its later frames came late.
+            int64_t now = monotonic_ns();
+            for (size_t i = 0; i < frames.size(); ++i) {
+                if (camera.last_dequeue_ns > 0)
+                    camera.intervals[phase].record(now -
+                                                   camera.last_dequeue_ns);
+                camera.last_dequeue_ns = now;
+            }
+        }
+        bool closed = false;
+        camera.received += frames.size();
+        if (camera.gap_from_ns > 0) {
+            std::cout << "Camera " << camera.id << ": first frame "
+                      << (timeval_ns(frames[0].timestamp) -
+                          camera.gap_from_ns) / 1e6
+                      << " ms after the last one before reconfiguring"
+                      << std::endl;
+            camera.gap_from_ns = 0;
+        }
+        camera.last_frame_ns = timeval_ns(frames.back().timestamp);
+        for (Frame &frame : frames) {
+            frame.camera = camera.id;
+            stats.stamp(frame, STAGE_DEQUEUE);
+            unsigned long missing = camera.sequence.update(frame.sequence);
+            if (missing > 0) {
+                camera.dropped += missing;
+                stats.add_drops(missing);
+            }
+            // Shares the lease with the ring, the buffer is not copied.
+            if (!camera.ring.push(frame)) {
+                closed = true;
+                break;
+            }
         }
+        if (closed)
+            break;
+        if (stats.enabled())
+            stats.ring_depth(camera.ring.size());
+        // Only the newest frame of a batch is worth showing.
+        if (preview)
+            preview->offer(camera.id, frames.back());
     }
-    cv::destroyAllWindows();
-    CapAppBuffer->clear_consumer();
+    frames.clear(); // Give the buffers back before the device is released.
+    camera.ring.close();
 }
 
 void CaptureApplication::write_frames()
 {
-    // Mat objects held in buffer are written to frameCopy.
-    //cv::Mat frameCopy(480, 1280, CV_8U);
-    Frame frameCopy;
+    // Frames are moved out of the ring, several per wakeup, and those to be
+    // written are moved on to the writer pool; writeCount is updated by the
+    // pool as they are committed.
+    if (cameras.size() > 1) {
+        group_frames();
+        return;
+    }
+    frame_ring &ring = cameras[0]->ring;
+    std::vector<Frame> batch;
+    batch.reserve(write_batch);
     while (captureOn)
     {
-        CapAppBuffer->pop_back(frameCopy);
-        if (writeContinuous) {
-            write_image(frameCopy);
-            writeCount += 1;
-        } else if (writeSingles) {
-            if (additionalFrames > 0) {
-                write_image(frameCopy);
-                writeCount += 1;
-                --additionalFrames;
-            } else {
-                writeSingles = false;
-                update_write_status();
+        if (!ring.pop_batch(batch, write_batch))
+            break;
+        for (Frame &frameCopy : batch) {
+            if (!captureOn)
+                break;
+            stats.stamp(frameCopy, STAGE_POP);
+            dispatch(&frameCopy, 1);
+        }
+        batch.clear();
+        finish_take();
+    }
+    ring.close();
+}
+
+void CaptureApplication::group_frames()
+{
+    // Each camera's frames queue up in 'pending' until every camera has one
+    // within the tolerance of the first camera's oldest frame. With the
+    // tolerance at most half a frame period only one frame per camera can
+    // qualify, and free-running cameras always have one unless they dropped
+    // it. Frames passed over can't be part of a later group and are dropped
+    // as unmatched.
+    const size_t n = cameras.size();
+    int fps = -1;
+    int64_t tolerance = 0;
+    int64_t stale = 0;
+    std::vector<std::deque<Frame>> pending(n);
+    std::vector<Frame> batch;
+    std::vector<Frame> group(n);
+    bool closed = false;
+
+    while (captureOn && !closed)
+    {
+        if (fps != group_fps) {
+            // Again after every rate change.
+            fps = group_fps;
+            tolerance = group_ms > 0 ? int64_t(group_ms * 1e6)
+                        : 500000000 / (fps > 0 ? fps : 100);
+            // A camera that stops delivering must not hold the others'
+            // buffers.
+            stale = std::max<int64_t>(8 * tolerance, 200000000);
+        }
+        bool waited = false;
+        for (size_t k = 0; k < n; ++k) {
+            Camera &camera = *cameras[k];
+            // Only wait on a camera the next group still needs a frame from.
+            std::chrono::microseconds timeout(0);
+            if (pending[k].empty() && !waited) {
+                timeout = std::chrono::microseconds(20000);
+                waited = true;
+            }
+            if (camera.ring.pop_batch(batch, write_batch, timeout) == 0) {
+                closed = closed || camera.ring.is_closed();
+                continue;
+            }
+            for (Frame &frame : batch) {
+                stats.stamp(frame, STAGE_POP);
+                pending[k].push_back(std::move(frame));
+            }
+            batch.clear();
+        }
+
+        while (!pending[0].empty() && captureOn) {
+            const int64_t ref = timeval_ns(pending[0].front().timestamp);
+            bool complete = true;
+            bool missing = false;
+            for (size_t k = 1; k < n && complete; ++k) {
+                while (!pending[k].empty() &&
+                       timeval_ns(pending[k].front().timestamp) <=
+                       ref - tolerance) {
+                    pending[k].pop_front();
+                    ++cameras[k]->unmatched;
+                }
+                if (pending[k].empty())
+                    complete = false; // Not here yet, wait for it.
+                else if (timeval_ns(pending[k].front().timestamp) >=
+                         ref + tolerance)
+                    missing = true; // Camera k has no frame for this one.
+            }
+            if (!complete)
+                break;
+            if (missing) {
+                pending[0].pop_front();
+                ++cameras[0]->unmatched;
+                continue;
+            }
+            for (size_t k = 0; k < n; ++k) {
+                group[k] = std::move(pending[k].front());
+                pending[k].pop_front();
             }
+            dispatch(group.data(), n);
         }
+
+        int64_t cutoff = monotonic_ns() - stale;
+        for (size_t k = 0; k < n; ++k) {
+            while (!pending[k].empty() &&
+                   timeval_ns(pending[k].front().timestamp) < cutoff) {
+                pending[k].pop_front();
+                ++cameras[k]->unmatched;
+            }
+        }
+        finish_take();
+    }
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->ring.close();
+}
+
+void CaptureApplication::dispatch(Frame *group, size_t n)
+{
+    if (bus)
+        for (size_t i = 0; i < n; ++i)
+            bus->publish(group[i]);
+    if (streamer)
+        for (size_t i = 0; i < n; ++i)
+            streamer->offer(group[i]);
+    if (history) {
+        bool nowWriting = writeContinuous || writeSingles;
+        if (nowWriting && !wasWriting) {
+            // Writing just started: what led up to it goes first.
+            history->flush(earlier);
+            for (Frame &f : earlier)
+                submit(std::move(f));
+            if (!earlier.empty())
+                std::cout << "Wrote " << earlier.size()
+                          << " frames of history" << std::endl;
+            earlier.clear();
+            flushed = false;
+        } else if (!nowWriting) {
+            for (size_t i = 0; i < n; ++i)
+                history->push(group[i]);
+        }
+        wasWriting = nowWriting;
+    }
+    bool take = false;
+    if (writeContinuous) {
+        take = true;
+    } else if (writeSingles) {
+        if (additionalFrames > 0) {
+            take = true;
+            --additionalFrames;
+        } else {
+            writeSingles = false;
+            update_write_status();
+        }
+    }
+    if (take && writeContinuous && gate->active()) {
+        gate->process(group, n, gated);
+        for (Frame &f : gated)
+            submit(std::move(f));
+        if (!gated.empty())
+            flushed = false;
+        gated.clear();
+        for (size_t i = 0; i < n; ++i)
+            group[i].clear(); // Skipped ones go back, held ones are moved.
+        return;
+    }
+    if (!gate->is_idle())
+        gate->reset(); // The take is over, or the gate was switched off.
+    for (size_t i = 0; i < n; ++i) {
+        if (take) {
+            submit(std::move(group[i]));
+            flushed = false;
+        }
+        group[i].clear(); // Re-queue the buffer if it wasn't submitted.
+    }
+}
+
+void CaptureApplication::submit(Frame &&frame)
+{
+    if (!graph) {
+        writers->submit(std::move(frame));
+    } else if (graph_watches) {
+        // The stages only look, the frame is written as captured.
+        graph->submit(Frame(frame)); // Shares the buffer.
+        writers->submit(std::move(frame));
+    } else {
+        graph->submit(std::move(frame));
+    }
+}
+
+void CaptureApplication::finish_take()
+{
+    // Don't leave the tail of a take sitting in the staging buffer.
+    if (!writing && !flushed) {
+        if (graph)
+            graph->drain();
+        writers->flush();
+        flushed = true;
     }
-    CapAppBuffer->clear_producer();
 }
 /*
 void CaptureApplication::run_capture()
@@ -181,18 +849,6 @@ void CaptureApplication::run_capture()
     }
 }
 */
-void CaptureApplication::write_image(Frame &frame)
-{
-    struct timeval tv;
-    std::string fName;
-    long ts;
-
-    tv = frame.timestamp;
-    ts = tv.tv_sec*1e6 + tv.tv_usec;
-    fName = std::to_string(ts) + "_" + std::to_string(this->writeCount) + ".pgm";
-    cv::imwrite(fName, frame.image);
-}
-
 void CaptureApplication::write_image(cv::Mat *image)
 {
     char timestamp[30];
@@ -233,65 +889,438 @@ void CaptureApplication::write_image_raw(cv::Mat *image)
     fclose(fp);
 }
 
-void CaptureApplication::print_timestamp()
+void CaptureApplication::print_pool_status(std::ostream &out)
 {
-    char ts[30];
-    struct timeval tv;
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        PoolStatus status = camera->source->pool_status();
+        if (cameras.size() > 1)
+            out << "Camera " << camera->id << ": ";
+        out << "Buffers: " << status.size
+            << ", leased: " << status.leased
+            << ", peak: " << status.peak
+            << ", starved: " << status.starved
+            << ", leases: " << status.leases << std::endl;
+    }
+    if (splitter) {
+        StereoStatus status = splitter->status();
+        out << "Stereo split: " << status.split << " frames";
+        if (splitter->get_mode() == STEREO_COPY)
+            out << ", planes in use: " << status.in_use << "/"
+                << status.buffers << ", fell back to views: "
+                << status.fallbacks;
+        out << std::endl;
+    }
+    if (rectifier) {
+        RectifyStatus status = rectifier->status();
+        out << "Rectified: " << status.rectified << " frames, buffers "
+            << "in use: " << status.in_use << "/" << status.buffers
+            << ", allocated instead: " << status.fallbacks << std::endl;
+    }
+}
 
-    time_t curtime;
+void CaptureApplication::print_cameras(std::ostream &out)
+{
+    // Rates are over the time since the previous 'cameras' command.
+    auto now = std::chrono::steady_clock::now();
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        unsigned long received = camera->received;
+        double secs = std::chrono::duration<double>(
+            now - camera->rate_start).count();
+        double fps = secs > 0 ? (received - camera->rate_frames) / secs : 0;
+        camera->rate_start = now;
+        camera->rate_frames = received;
+        out << "Camera " << camera->id
+            << (camera->cpu >= 0 ? " (cpu " + std::to_string(camera->cpu)
+                                   + ")" : "")
+            << ": " << fps << " fps, " << received << " frames, "
+            << camera->dropped << " dropped, " << camera->unmatched
+            << " unmatched" << std::endl;
+    }
+}
 
-    gettimeofday(&tv, NULL);
-    curtime = tv.tv_sec;
-    strftime(ts, 30, "%m-%d-%Y  %T.",localtime(&curtime));
-    printf("%s%ld\n",ts,tv.tv_usec);
+void CaptureApplication::print_overload(std::ostream &out)
+{
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        RingStatus s = camera->ring.status();
+        out << "Camera " << camera->id << " ring: "
+            << overload_name(s.policy);
+        if (s.policy == OVERLOAD_DECIMATE)
+            out << " every " << s.decimate_every;
+        out << ", " << s.size << "/" << s.capacity << " frames"
+            << std::endl
+            << "  blocked " << s.blocks << " times (" << s.blocked_ms
+            << " ms), dropped " << s.dropped_newest << " newest, "
+            << s.dropped_oldest << " oldest, decimated " << s.decimated
+            << std::endl;
+    }
+    // Under 'block' the losses happen in the source instead.
+    out << "Frames missing from the source: " << stats.drops()
+        << std::endl;
 }
 
-void bounded_buffer::push_front(
-    typename boost::call_traits<value_type>::param_type item)
+void CaptureApplication::set_overload(const std::string &name,
+                                      std::ostream &out)
 {
-    // `param_type` represents the "best" way to pass a parameter of type
-    // `value_type` to a method.
-    boost::mutex::scoped_lock lock(m_mutex);
-    m_not_full.wait(lock, boost::bind(&bounded_buffer::is_not_full, this));
-    m_container.push_front(item);
-    ++m_unread;
-    lock.unlock();
-    m_not_empty.notify_one();
+    overload_policy policy;
+    unsigned int every = 2;
+    if (!parse_overload(name, policy, every)) {
+        out << "Unknown overload policy '" << name << "'" << std::endl;
+        return;
+    }
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        camera->ring.set_policy(policy, every);
+    out << "Overload policy: " << overload_name(policy) << std::endl;
 }
 
-void bounded_buffer::pop_back(value_type &frameCopy)
+void CaptureApplication::print_writer_stats(std::ostream &out)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    m_not_empty.wait(lock, boost::bind(&bounded_buffer::is_not_empty, this));
-    frameCopy = m_container[--m_unread];
-    lock.unlock();
-    m_not_full.notify_one();
+    std::vector<WorkerStats> stats = writers->stats();
+    for (size_t i = 0; i < stats.size(); ++i) {
+        const WorkerStats &w = stats[i];
+        double secs = w.elapsed_s > 0 ? w.elapsed_s : 1;
+        out << "Writer " << i
+            << (w.cpu >= 0 ? " (cpu " + std::to_string(w.cpu) + ")" : "")
+            << ": " << w.frames << " frames, "
+            << w.frames / secs << " fps, "
+            << w.bytes / secs / (1 << 20) << " MB/s, "
+            << 100 * w.busy_s / secs << "% busy" << std::endl;
+    }
+    if (writers->failures() > 0)
+        out << "Not written: " << writers->failures() << " frames"
+            << std::endl;
 }
 
-void bounded_buffer::pop_back(value_type* frameCopy)
+void CaptureApplication::print_codec_stats(std::ostream &out)
 {
-    boost::mutex::scoped_lock lock(m_mutex);
-    m_not_empty.wait(lock, boost::bind(&bounded_buffer::is_not_empty, this));
-    *frameCopy = m_container[--m_unread];
-    lock.unlock();
-    m_not_full.notify_one();
+    if (!recordSink) {
+        out << "Not writing a recording" << std::endl;
+        return;
+    }
+    CodecStats &stats = recordSink->codec_stats();
+    out << "Codec: " << codec_name(recordSink->get_codec())
+        << ", ratio " << stats.ratio()
+        << ", " << stats.ms_per_frame() << " ms/frame over "
+        << stats.frames << " frames" << std::endl;
 }
 
-void bounded_buffer::clear_consumer()
+void CaptureApplication::set_codec(const std::string &name, std::ostream &out)
 {
-    ++m_unread;
-    m_not_empty.notify_one();
+    frame_codec codec;
+    if (!recordSink) {
+        out << "Not writing a recording" << std::endl;
+    } else if (!parse_codec(name, codec)) {
+        out << "Unknown codec '" << name << "'" << std::endl;
+    } else {
+        if (available_codec(codec) != codec)
+            out << "Built without zlib, using "
+                << codec_name(available_codec(codec)) << std::endl;
+        recordSink->set_codec(codec);
+        recordSink->codec_stats().reset();
+        out << "Codec set to " << codec_name(codec) << std::endl;
+    }
 }
 
-void bounded_buffer::clear_producer()
+void CaptureApplication::print_history_status(std::ostream &out)
 {
-    m_unread = m_container.capacity() - 1;
-    m_not_full.notify_one();
+    if (!history) {
+        out << "No pre-trigger history" << std::endl;
+        return;
+    }
+    HistoryStatus status = history->status();
+    out << "History: " << status.frames << "/" << status.capacity
+        << " frames, " << status.span_s << " s, "
+        << status.budget_bytes / (1 << 20) << " MB, "
+        << status.skipped << " skipped" << std::endl;
 }
 
-void Frame::clear()
+void CaptureApplication::print_bus(std::ostream &out)
 {
-    image.data = nullptr;
-    timestamp.tv_sec = 0L;
-    timestamp.tv_usec = 0L;
+    if (!bus) {
+        out << "No frame bus, see --bus" << std::endl;
+        return;
+    }
+    BusStatus s = bus->status();
+    out << "Bus " << s.name << ": " << s.published << " frames in "
+        << s.slots << " slots of " << (s.slot_bytes >> 10) << " kB, "
+        << s.too_big << " too big, " << s.readers.size() << " readers"
+        << std::endl;
+    for (const BusReaderStatus &r : s.readers)
+        out << "  pid " << r.pid << ": " << r.frames << " frames, "
+            << r.lag << " behind, " << r.overruns << " overrun"
+            << std::endl;
+}
+
+void CaptureApplication::print_stream(std::ostream &out)
+{
+    if (!streamer) {
+        out << "Not streaming, see --stream" << std::endl;
+        return;
+    }
+    StreamStatus s = streamer->status();
+    out << "Stream " << s.endpoint << " (" << codec_name(s.codec)
+        << "): " << s.offered << " frames offered, " << s.accepted
+        << " connections, " << s.refused << " refused" << std::endl;
+    for (const StreamClientStatus &c : s.clients) {
+        out << "  " << c.peer << ": " << c.frames << " frames, "
+            << c.skipped << " skipped, " << (c.bytes >> 20) << " MB";
+        if (c.max_fps > 0)
+            out << ", at most " << c.max_fps << " fps";
+        out << (c.sending ? ", sending" : "") << std::endl;
+    }
+}
+
+void CaptureApplication::print_gate(std::ostream &out)
+{
+    GateStatus s = gate->status();
+    if (s.threshold <= 0)
+        out << "Gate off, every frame is written" << std::endl;
+    else
+        out << "Gate at " << s.threshold << "% change, last "
+            << s.last_change << "%" << std::endl;
+    if (s.frames == 0)
+        return;
+    out << "Gated " << s.frames << " frames, " << s.metric_us
+        << " us each to measure:";
+    for (int d = GATE_CHANGE; d < GATE_DECISIONS; ++d)
+        out << " " << s.written[d] << " "
+            << MotionGate::decision_name(static_cast<gate_decision>(d));
+    out << ", " << s.skipped << " skipped, " << s.held << " held"
+        << std::endl;
+    if (s.bytes_seen > 0)
+        out << "Saved " << (s.bytes_skipped >> 20) << " of "
+            << (s.bytes_seen >> 20) << " MB ("
+            << 100.0 * s.bytes_skipped / s.bytes_seen << "%)"
+            << std::endl;
+}
+
+void CaptureApplication::set_gate(const std::string &percent, std::ostream &out)
+{
+    char *end = nullptr;
+    double value = strtod(percent.c_str(), &end);
+    if (percent.empty() || *end || value < 0 || value > 100) {
+        out << "Use gate=PCT, 0 to 100, 0 for off" << std::endl;
+        return;
+    }
+    gate->set_threshold(value);
+    out << "Gate " << (value > 0 ? "at " + percent + "%" : "off")
+        << std::endl;
+}
+
+void CaptureApplication::print_pipeline_stats(std::ostream &out)
+{
+    out << "Dropped: " << stats.drops() << " frames in "
+        << stats.drop_events() << " gaps" << std::endl;
+    out << "Ring high-water: " << stats.ring_peak() << "/"
+        << cameras[0]->ring.capacity() << std::endl;
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        SourceEvents events = camera->source->events();
+        if (cameras.size() > 1)
+            out << "Camera " << camera->id << " events: ";
+        else
+            out << "Source events: ";
+        out << events.timeouts << " timeouts, "
+            << events.errors << " errors, " << events.corrupt
+            << " corrupt frames, " << events.restarts << " restarts"
+            << std::endl;
+    }
+    if (rectifier) {
+        // Timed whether or not stage timing is on.
+        RectifyStatus s = rectifier->status();
+        out << "Rectify (" << rectify_kernel_name() << ", "
+            << s.threads + 1 << " bands, table "
+            << (s.table_bytes >> 10) << " kB): " << s.rectified
+            << " frames, p50 " << s.p50_us << " us, p99 " << s.p99_us
+            << " us, max " << s.max_us << " us, " << s.skipped
+            << " not rectified" << std::endl;
+    }
+    if (!stats.enabled()) {
+        out << "Stage timing off, enter 'stats=on'" << std::endl;
+        return;
+    }
+    char line[128];
+    out << "stage      frames      p50 us      p99 us      max us"
+        << std::endl;
+    for (int i = STAGE_DEQUEUE; i <= STAGE_COUNT; ++i) {
+        StageSummary s = stats.summary(i);
+        snprintf(line, sizeof(line), "%-8s %8lu %11.1f %11.1f %11.1f",
+                 PipelineStats::stage_name(i),
+                 static_cast<unsigned long>(s.count),
+                 s.p50_us, s.p99_us, s.max_us);
+        out << line << std::endl;
+    }
+}
+
+static void metric_header(std::ostream &out, const char *name,
+                          const char *type, const char *help)
+{
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " "
+        << type << "\n";
+}
+
+void CaptureApplication::print_metrics(std::ostream &out)
+{
+    // Everything read here is an atomic counter or fixed after start-up, so
+    // this runs on the control thread without command_mutex.
+    metric_header(out, "vcap_frames_captured_total", "counter",
+                  "Frames read from the camera.");
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        out << "vcap_frames_captured_total{camera=\"" << camera->id
+            << "\"} " << camera->received << "\n";
+    metric_header(out, "vcap_frames_dropped_total", "counter",
+                  "Frames missing from the camera's sequence numbers.");
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        out << "vcap_frames_dropped_total{camera=\"" << camera->id
+            << "\"} " << camera->dropped << "\n";
+    metric_header(out, "vcap_frames_unmatched_total", "counter",
+                  "Frames that found no group of the other cameras.");
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        out << "vcap_frames_unmatched_total{camera=\"" << camera->id
+            << "\"} " << camera->unmatched << "\n";
+    metric_header(out, "vcap_frames_written_total", "counter",
+                  "Frames committed to disk.");
+    out << "vcap_frames_written_total " << writeCount << "\n";
+    metric_header(out, "vcap_frames_failed_total", "counter",
+                  "Frames the writers could not encode or write.");
+    out << "vcap_frames_failed_total " << writers->failures() << "\n";
+    metric_header(out, "vcap_writing", "gauge",
+                  "1 while frames are being written.");
+    out << "vcap_writing " << (writing ? 1 : 0) << "\n";
+
+    metric_header(out, "vcap_ring_frames", "gauge",
+                  "Frames waiting in the camera's ring.");
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        out << "vcap_ring_frames{camera=\"" << camera->id << "\"} "
+            << camera->ring.status().size << "\n";
+    metric_header(out, "vcap_ring_capacity_frames", "gauge",
+                  "Frames a ring holds.");
+    out << "vcap_ring_capacity_frames " << cameras[0]->ring.capacity()
+        << "\n";
+    metric_header(out, "vcap_ring_high_water_frames", "gauge",
+                  "Most frames seen waiting in a ring while timing stages.");
+    out << "vcap_ring_high_water_frames " << stats.ring_peak() << "\n";
+    metric_header(out, "vcap_ring_discarded_total", "counter",
+                  "Frames the ring's overload policy discarded.");
+    for (const std::unique_ptr<Camera> &camera : cameras) {
+        RingStatus s = camera->ring.status();
+        const char *reasons[] = {"newest", "oldest", "decimated"};
+        unsigned long counts[] = {s.dropped_newest, s.dropped_oldest,
+                                  s.decimated};
+        for (int i = 0; i < 3; ++i)
+            out << "vcap_ring_discarded_total{camera=\"" << camera->id
+                << "\",reason=\"" << reasons[i] << "\"} " << counts[i]
+                << "\n";
+    }
+    metric_header(out, "vcap_ring_blocked_seconds_total", "counter",
+                  "Time readers waited on a full ring.");
+    for (const std::unique_ptr<Camera> &camera : cameras)
+        out << "vcap_ring_blocked_seconds_total{camera=\"" << camera->id
+            << "\"} " << camera->ring.status().blocked_ms / 1e3 << "\n";
+
+    std::vector<WorkerStats> workers = writers->stats();
+    metric_header(out, "vcap_writer_frames_total", "counter",
+                  "Frames encoded by the writer thread.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        out << "vcap_writer_frames_total{writer=\"" << i << "\"} "
+            << workers[i].frames << "\n";
+    metric_header(out, "vcap_writer_bytes_total", "counter",
+                  "Bytes the writer thread encoded frames to.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        out << "vcap_writer_bytes_total{writer=\"" << i << "\"} "
+            << workers[i].bytes << "\n";
+    metric_header(out, "vcap_writer_bytes_per_second", "gauge",
+                  "Bytes written per second since the writers started.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        out << "vcap_writer_bytes_per_second{writer=\"" << i << "\"} "
+            << (workers[i].elapsed_s > 0 ?
+                workers[i].bytes / workers[i].elapsed_s : 0) << "\n";
+    metric_header(out, "vcap_writer_busy_seconds_total", "counter",
+                  "Time the writer thread spent encoding and writing.");
+    for (size_t i = 0; i < workers.size(); ++i)
+        out << "vcap_writer_busy_seconds_total{writer=\"" << i << "\"} "
+            << workers[i].busy_s << "\n";
+    metric_header(out, "vcap_write_backlog_frames", "gauge",
+                  "Frames handed to the writers and not yet committed.");
+    out << "vcap_write_backlog_frames " << writers->backlog() << "\n";
+
+    // Stage latencies only once 'stats=on' (or --stats) is timing them.
+    if (!stats.enabled())
+        return;
+    metric_header(out, "vcap_stage_latency_seconds", "summary",
+                  "Time a frame took to reach the stage from the one "
+                  "before; 'total' is from the driver to the write.");
+    for (int i = STAGE_DEQUEUE; i <= STAGE_COUNT; ++i) {
+        StageSummary s = stats.summary(i);
+        const char *stage = PipelineStats::stage_name(i);
+        out << "vcap_stage_latency_seconds{stage=\"" << stage
+            << "\",quantile=\"0.5\"} " << s.p50_us * 1e-6 << "\n"
+            << "vcap_stage_latency_seconds{stage=\"" << stage
+            << "\",quantile=\"0.99\"} " << s.p99_us * 1e-6 << "\n"
+            << "vcap_stage_latency_seconds{stage=\"" << stage
+            << "\",quantile=\"1\"} " << s.max_us * 1e-6 << "\n"
+            << "vcap_stage_latency_seconds_sum{stage=\"" << stage
+            << "\"} " << s.sum_us * 1e-6 << "\n"
+            << "vcap_stage_latency_seconds_count{stage=\"" << stage
+            << "\"} " << s.count << "\n";
+    }
+}
+
+void CaptureApplication::print_stages(std::ostream &out)
+{
+    if (!graph) {
+        out << "No stages, frames go straight to the writers"
+            << std::endl;
+        return;
+    }
+    // CPU per frame is of the frames a stage took in.
+    char line[160];
+    out << " # stage      from  frames in    out  cpu us/frame"
+        << "  queue  peak" << std::endl;
+    std::vector<StageStatus> list = graph->status();
+    for (size_t i = 0; i < list.size(); ++i) {
+        const StageStatus &s = list[i];
+        std::string from = s.parent < 0 ? "in" : std::to_string(s.parent);
+        if (i + 1 == list.size())
+            from = "leaves";
+        snprintf(line, sizeof(line), "%2zu %-10s %6s %10lu %6lu %13.1f %6u %5u",
+                 i, (s.name + (s.ordered ? "*" : "")).c_str(), from.c_str(),
+                 s.frames_in, s.frames_out,
+                 s.frames_in ? s.cpu_ms * 1e3 / s.frames_in : 0.0,
+                 s.depth, s.peak_depth);
+        out << line << std::endl;
+        for (const StageNote &note : s.notes)
+            out << "     " << note.key << " = " << note.value
+                << std::endl;
+    }
+    out << "(* ordered) " << stagePool->size() << " workers, "
+        << stagePool->steals() << " tasks stolen" << std::endl;
+}
+
+void CaptureApplication::set_stats(const std::string &mode, std::ostream &out)
+{
+    if (mode == "on") {
+        stats.enable(true);
+    } else if (mode == "off") {
+        stats.enable(false);
+    } else if (mode == "reset") {
+        stats.reset();
+        if (rectifier)
+            rectifier->reset_cost();
+    } else {
+        out << "Use stats=on, stats=off or stats=reset" << std::endl;
+        return;
+    }
+    out << "Stats " << mode << std::endl;
+}
+
+void CaptureApplication::print_timestamp()
+{
+    char ts[30];
+    struct timeval tv;
+
+    time_t curtime;
+
+    gettimeofday(&tv, NULL);
+    curtime = tv.tv_sec;
+    strftime(ts, 30, "%m-%d-%Y  %T.",localtime(&curtime));
+    printf("%s%ld\n",ts,tv.tv_usec);
 }
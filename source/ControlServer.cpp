@@ -0,0 +1,265 @@
+#include <ControlServer.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+}
+
+static const size_t max_line = 4096;
+static const size_t max_output = 4 << 20; // Queued for a client at most.
+
+ControlServer::ControlServer(const std::string &spec, const handler &command,
+                             const snapshot &metrics,
+                             unsigned int max_clients)
+: command(command), metrics(metrics), max_clients(max_clients)
+{
+    sockaddr_storage addr;
+    socklen_t length;
+    if (!parse_endpoint(spec, endpoint)) {
+        fprintf(stderr, "Bad control endpoint '%s'\n", spec.c_str());
+        return;
+    }
+    // Commands are unauthenticated: other hosts only if asked for.
+    if (!endpoint.unix_socket && endpoint.address.empty())
+        endpoint.address = "127.0.0.1";
+    if (!endpoint_address(endpoint, true, addr, length) ||
+        !clear_stale_socket(endpoint))
+        return;
+    int fd = socket(addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if (fd != -1 && !endpoint.unix_socket)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd == -1 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), length) == -1 ||
+        listen(fd, 8) == -1) {
+        fprintf(stderr, "Cannot listen on '%s': %d, %s\n", spec.c_str(),
+                errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        fprintf(stderr, "Cannot set up control server: %d, %s\n",
+                errno, strerror(errno));
+        close(fd);
+        return;
+    }
+    listen_fd = fd;
+    thread = std::thread(&ControlServer::run, this);
+    worker = std::thread(&ControlServer::work, this);
+}
+
+ControlServer::~ControlServer()
+{
+    if (thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        queued.notify_all();
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) {}
+        thread.join();
+        worker.join();
+    }
+    for (Client &client : clients)
+        close(client.fd);
+    if (listen_fd != -1) {
+        close(listen_fd);
+        if (endpoint.unix_socket)
+            unlink(endpoint.address.c_str());
+    }
+    if (event_fd != -1)
+        close(event_fd);
+}
+
+void ControlServer::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        queued.wait(lock, [this] { return stopping || !commands.empty(); });
+        if (stopping)
+            return;
+        message m = std::move(commands.front());
+        commands.pop_front();
+        lock.unlock();
+        std::string text = command(m.second);
+        if (!text.empty() && text.back() != '\n')
+            text += '\n';
+        text += '\n'; // Ends the reply.
+        lock.lock();
+        replies.push_back(message(m.first, std::move(text)));
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+void ControlServer::run()
+{
+    std::vector<pollfd> fds;
+    for (;;) {
+        fds.clear();
+        fds.push_back({event_fd, POLLIN, 0});
+        fds.push_back({listen_fd, POLLIN, 0});
+        for (const Client &client : clients) {
+            short events = client.closing || client.eof ? 0 : POLLIN;
+            if (!client.out.empty())
+                events |= POLLOUT;
+            fds.push_back({client.fd, events, 0});
+        }
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Control server stopped: %d, %s\n", errno,
+                    strerror(errno));
+            return;
+        }
+        if (fds[0].revents) {
+            uint64_t count;
+            if (read(event_fd, &count, sizeof(count)) < 0) {}
+            std::deque<message> done;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping)
+                    return;
+                done.swap(replies);
+            }
+            // Replies of clients that have gone since are dropped.
+            for (message &m : done)
+                for (Client &client : clients)
+                    if (client.id == m.first) {
+                        client.out += m.second;
+                        client.waiting = false;
+                        handle_lines(client);
+                        break;
+                    }
+        }
+        // Clients first: accepting appends to 'clients', and replies
+        // above may have added to 'out' without POLLOUT being asked for.
+        size_t kept = 0;
+        const size_t polled = fds.size() - 2;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            Client &client = clients[i];
+            const short revents = i < polled ? fds[i + 2].revents : 0;
+            bool keep = true;
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+                keep = read_client(client);
+            if (keep && !client.out.empty())
+                keep = write_client(client);
+            // Done once everything asked for before the end is answered.
+            if (keep && (client.closing || client.eof) &&
+                client.out.empty() && !client.waiting)
+                keep = false;
+            if (!keep) {
+                close(client.fd);
+                continue;
+            }
+            if (kept != i)
+                clients[kept] = std::move(client);
+            ++kept;
+        }
+        clients.resize(kept);
+        if (fds[1].revents)
+            accept_client();
+    }
+}
+
+void ControlServer::accept_client()
+{
+    int fd = accept4(listen_fd, nullptr, nullptr,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+    if (clients.size() >= max_clients) {
+        static const char busy[] = "Too many control clients\n\n";
+        if (send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL) < 0) {}
+        close(fd);
+        return;
+    }
+    clients.push_back(Client());
+    clients.back().fd = fd;
+    clients.back().id = next_id++;
+}
+
+bool ControlServer::read_client(Client &client)
+{
+    char data[512];
+    for (;;) {
+        ssize_t n = recv(client.fd, data, sizeof(data), 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if (n == -1)
+            break;
+        if (n == 0) {
+            client.eof = true; // It may still read the replies.
+            client.in += '\n'; // A last line without a newline counts.
+            break;
+        }
+        client.in.append(data, n);
+    }
+    handle_lines(client);
+    return client.in.size() <= (client.waiting ? max_output : max_line);
+}
+
+void ControlServer::handle_lines(Client &client)
+{
+    // A client's lines are answered in order: later ones wait for its
+    // command to come back from the worker.
+    size_t start = 0, end;
+    while (!client.waiting && !client.closing &&
+           (end = client.in.find('\n', start)) != std::string::npos) {
+        std::string line = client.in.substr(start, end - start);
+        start = end + 1;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (client.http) {
+            if (!line.empty())
+                continue; // A header.
+            // A scrape: whatever the path, answer with the metrics.
+            std::string body = metrics();
+            client.out += "HTTP/1.0 200 OK\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: " + std::to_string(body.size()) +
+                          "\r\nConnection: close\r\n\r\n" + body;
+            client.closing = true;
+        } else if (line.compare(0, 4, "GET ") == 0) {
+            client.http = true;
+        } else if (line == "metrics") {
+            client.out += metrics() + "\n";
+        } else if (!line.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            commands.push_back(message(client.id, line));
+            client.waiting = true;
+            queued.notify_one();
+        }
+    }
+    client.in.erase(0, start);
+}
+
+bool ControlServer::write_client(Client &client)
+{
+    while (!client.out.empty()) {
+        ssize_t n = send(client.fd, client.out.data(), client.out.size(),
+                         MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return client.out.size() <= max_output;
+        if (n <= 0)
+            return false;
+        client.out.erase(0, n);
+    }
+    if (client.closing)
+        shutdown(client.fd, SHUT_WR);
+    return true;
+}
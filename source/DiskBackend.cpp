@@ -0,0 +1,546 @@
+#include <DiskBackend.hpp>
+#include <Recording.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef VIDEOCAP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+}
+
+bool parse_backend(const std::string &name, disk_backend &backend)
+{
+    if (name == "sync")
+        backend = DISK_SYNC;
+    else if (name == "threads")
+        backend = DISK_THREADS;
+    else if (name == "uring")
+        backend = DISK_URING;
+    else
+        return false;
+    return true;
+}
+
+bool write_fully(int fd, const unsigned char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Recording write error %d, %s\n",
+                    errno, strerror(errno));
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+DiskBackend::DiskBackend(size_t buffer_bytes, unsigned int depth)
+: bytes(buffer_bytes)
+{
+    for (unsigned int i = 0; i < std::max(depth, 1u); ++i) {
+        void *buf;
+        if (posix_memalign(&buf, VCAP_ALIGN, bytes) != 0) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        // Fault the pages in now rather than on the first frames written.
+        memset(buf, 0, bytes);
+        buffers.push_back(static_cast<unsigned char*>(buf));
+        free_list.push_back(i);
+    }
+}
+
+DiskBackend::~DiskBackend()
+{
+    for (unsigned char *buf : buffers)
+        free(buf);
+}
+
+unsigned int DiskBackend::buffer_index(const unsigned char *buf) const
+{
+    return std::find(buffers.begin(), buffers.end(), buf) - buffers.begin();
+}
+
+void DiskBackend::release(unsigned int index)
+{
+    free_list.push_back(index);
+    released.notify_all();
+}
+
+void DiskBackend::wait_for_buffer(std::unique_lock<std::mutex> &lock)
+{
+    released.wait(lock, [&] { return !free_list.empty(); });
+}
+
+bool DiskBackend::close_file(int fd)
+{
+    bool ok = drain();
+    if (fdatasync(fd) == -1) {
+        fprintf(stderr, "Recording sync error %d, %s\n",
+                errno, strerror(errno));
+        std::lock_guard<std::mutex> lock(mutex);
+        failed = true;
+        ok = false;
+    }
+    ::close(fd);
+    return ok;
+}
+
+unsigned char *DiskBackend::acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (free_list.empty())
+        wait_for_buffer(lock);
+    unsigned int index = free_list.back();
+    free_list.pop_back();
+    return buffers[index];
+}
+
+SyncBackend::SyncBackend(size_t buffer_bytes)
+: DiskBackend(buffer_bytes, 1)
+{
+}
+
+bool SyncBackend::write(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    if (!write_fully(fd, buf, len, offset))
+        failed = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    release(buffer_index(buf));
+    return !failed;
+}
+
+ThreadBackend::ThreadBackend(size_t buffer_bytes, unsigned int depth,
+                             unsigned int n_threads)
+: DiskBackend(buffer_bytes, depth)
+{
+    for (unsigned int i = 0; i < std::max(n_threads, 1u); ++i)
+        threads.push_back(std::thread(&ThreadBackend::run, this));
+}
+
+ThreadBackend::~ThreadBackend()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    queued.notify_all();
+    for (std::thread &t : threads)
+        t.join();
+}
+
+void ThreadBackend::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        queued.wait(lock, [&] { return !queue.empty() || stopping; });
+        if (queue.empty())
+            return;
+        Request req = queue.front();
+        queue.pop_front();
+        lock.unlock();
+
+        bool ok = write_fully(req.fd, buffers[req.index], req.len, req.offset);
+
+        lock.lock();
+        if (!ok)
+            failed = true;
+        --in_flight;
+        release(req.index);
+    }
+}
+
+bool ThreadBackend::write(int fd, unsigned char *buf, size_t len,
+                          off_t offset)
+{
+    Request req;
+    req.fd = fd;
+    req.index = buffer_index(buf);
+    req.len = len;
+    req.offset = offset;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(req);
+        ++in_flight;
+    }
+    queued.notify_one();
+    std::lock_guard<std::mutex> lock(mutex);
+    return !failed;
+}
+
+bool ThreadBackend::drain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [&] { return in_flight == 0; });
+    return !failed;
+}
+
+#ifdef VIDEOCAP_HAVE_IO_URING
+class UringBackend : public DiskBackend
+/*
+io_uring driven directly through the system calls, so liburing isn't needed.
+Only the writing thread touches the rings: completions are reaped when it
+needs a buffer or drains. The rest of a short write is queued again from
+there, and a file being closed gets its fdatasync once nothing is left in
+flight for it; the sync's completion closes it.
+*/
+{
+public:
+    UringBackend(size_t buffer_bytes, unsigned int depth);
+    ~UringBackend();
+    bool setup(); // False if the kernel refuses io_uring.
+    bool write(int fd, unsigned char *buf, size_t len, off_t offset);
+    bool close_file(int fd);
+    bool drain();
+    const char *name() const { return "uring"; }
+
+private:
+    static const uint64_t SYNC_TAG = 1ULL << 63; // Or'ed with the fd.
+
+    struct File {
+        int fd;
+        unsigned int writes; // In flight.
+        bool closing; // Sync and close once 'writes' is 0.
+    };
+
+    int ring_fd = -1;
+    struct io_uring_params params;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    size_t sq_ring_bytes = 0;
+    size_t cq_ring_bytes = 0;
+    struct io_uring_sqe *sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    unsigned int *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    bool registered = false; // Buffers registered, use WRITE_FIXED.
+    std::vector<struct iovec> iovecs;
+    std::vector<int> pending_fd; // Per buffer, for resubmitting short writes.
+    std::vector<off_t> pending_offset;
+    std::vector<size_t> pending_len;
+    std::vector<size_t> pending_done; // Written by earlier short writes.
+    std::vector<File> files; // Those with writes in flight.
+    unsigned int in_flight = 0; // Writes and syncs submitted, not reaped.
+
+    void wait_for_buffer(std::unique_lock<std::mutex>&);
+    struct io_uring_sqe *next_sqe();
+    void queue_write(unsigned int index); // The rest of buffer 'index'.
+    void queue_sync(int fd);
+    unsigned int write_done(int fd); // Returns the syncs queued.
+    bool submit(unsigned int count);
+    void reap(unsigned int min_complete);
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, NULL, 0));
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+                                 unsigned int nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg,
+                                    nr_args));
+}
+
+UringBackend::UringBackend(size_t buffer_bytes, unsigned int depth)
+: DiskBackend(buffer_bytes, depth),
+  pending_fd(buffers.size(), -1), pending_offset(buffers.size(), 0),
+  pending_len(buffers.size(), 0), pending_done(buffers.size(), 0)
+{
+    memset(&params, 0, sizeof(params));
+    for (unsigned char *buf : buffers) {
+        struct iovec iov;
+        iov.iov_base = buf;
+        iov.iov_len = bytes;
+        iovecs.push_back(iov);
+    }
+}
+
+UringBackend::~UringBackend()
+{
+    if (ring_fd != -1) {
+        drain();
+        if (sqes != MAP_FAILED)
+            munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_bytes);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_bytes);
+        close(ring_fd);
+    }
+}
+
+bool UringBackend::setup()
+{
+    // Every buffer in flight, and the syncs of segments being closed.
+    ring_fd = sys_io_uring_setup(2 * buffers.size() + 2, &params);
+    if (ring_fd < 0) {
+        fprintf(stderr, "io_uring unavailable: %d, %s\n",
+                errno, strerror(errno));
+        ring_fd = -1;
+        return false;
+    }
+
+    sq_ring_bytes = params.sq_off.array +
+                    params.sq_entries * sizeof(unsigned int);
+    cq_ring_bytes = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+
+    sq_ring = mmap(NULL, sq_ring_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED)
+        return false;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+        cq_ring = mmap(NULL, cq_ring_bytes, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED)
+        return false;
+    sqes = static_cast<struct io_uring_sqe*>(
+        mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED)
+        return false;
+
+    char *sq = static_cast<char*>(sq_ring);
+    char *cq = static_cast<char*>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned int*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned int*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned int*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned int*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned int*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned int*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // Registering pins the buffers once instead of on every write. It counts
+    // against RLIMIT_MEMLOCK, so fall back to plain vectored writes.
+    registered = sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS,
+                                       iovecs.data(), iovecs.size()) == 0;
+    if (!registered)
+        fprintf(stderr, "io_uring buffer registration failed (%s), "
+                "using unregistered buffers\n", strerror(errno));
+    return true;
+}
+
+struct io_uring_sqe *UringBackend::next_sqe()
+{
+    unsigned int tail = *sq_tail;
+    unsigned int index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+void UringBackend::queue_write(unsigned int i)
+{
+    const size_t done = pending_done[i];
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->fd = pending_fd[i];
+    sqe->off = pending_offset[i] + done;
+    sqe->user_data = i;
+    if (registered) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = reinterpret_cast<uint64_t>(buffers[i] + done);
+        sqe->len = pending_len[i] - done;
+        sqe->buf_index = i;
+    } else {
+        iovecs[i].iov_base = buffers[i] + done;
+        iovecs[i].iov_len = pending_len[i] - done;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = reinterpret_cast<uint64_t>(&iovecs[i]);
+        sqe->len = 1;
+    }
+}
+
+void UringBackend::queue_sync(int fd)
+{
+    struct io_uring_sqe *sqe = next_sqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = SYNC_TAG | static_cast<uint64_t>(fd);
+}
+
+unsigned int UringBackend::write_done(int fd)
+{
+    for (size_t f = 0; f < files.size(); ++f) {
+        if (files[f].fd != fd || --files[f].writes > 0)
+            continue;
+        const bool closing = files[f].closing;
+        files.erase(files.begin() + f);
+        if (!closing)
+            return 0;
+        queue_sync(fd);
+        return 1;
+    }
+    return 0;
+}
+
+bool UringBackend::submit(unsigned int count)
+{
+    in_flight += count;
+    while (count > 0) {
+        int n = sys_io_uring_enter(ring_fd, count, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                reap(1);
+                continue;
+            }
+            fprintf(stderr, "io_uring_enter error %d, %s\n",
+                    errno, strerror(errno));
+            in_flight -= count; // Never to complete.
+            failed = true;
+            return false;
+        }
+        count -= n;
+    }
+    return true;
+}
+
+void UringBackend::reap(unsigned int min_complete)
+{
+    if (min_complete > 0) {
+        while (sys_io_uring_enter(ring_fd, 0, min_complete,
+                                  IORING_ENTER_GETEVENTS) < 0 &&
+               errno == EINTR) {}
+    }
+    unsigned int queued = 0; // Follow-up writes and syncs.
+    unsigned int head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+        ++head;
+        --in_flight;
+        if (cqe.user_data & SYNC_TAG) {
+            if (cqe.res < 0) {
+                fprintf(stderr, "Recording sync error %d, %s\n",
+                        -cqe.res, strerror(-cqe.res));
+                failed = true;
+            }
+            ::close(static_cast<int>(cqe.user_data & ~SYNC_TAG));
+            continue;
+        }
+        unsigned int i = static_cast<unsigned int>(cqe.user_data);
+        if (cqe.res <= 0) {
+            const int error = cqe.res < 0 ? -cqe.res : EIO;
+            fprintf(stderr, "Recording write error %d, %s\n",
+                    error, strerror(error));
+            failed = true;
+        } else if (pending_done[i] + cqe.res < pending_len[i]) {
+            // A short write, the buffer stays in flight for the rest.
+            pending_done[i] += cqe.res;
+            queue_write(i);
+            ++queued;
+            continue;
+        }
+        free_list.push_back(i);
+        queued += write_done(pending_fd[i]);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    if (queued > 0)
+        submit(queued);
+}
+
+void UringBackend::wait_for_buffer(std::unique_lock<std::mutex>&)
+{
+    while (free_list.empty())
+        reap(1);
+}
+
+bool UringBackend::write(int fd, unsigned char *buf, size_t len,
+                         off_t offset)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    unsigned int i = buffer_index(buf);
+    pending_fd[i] = fd;
+    pending_offset[i] = offset;
+    pending_len[i] = len;
+    pending_done[i] = 0;
+    std::vector<File>::iterator f = files.begin();
+    while (f != files.end() && f->fd != fd)
+        ++f;
+    if (f == files.end())
+        files.push_back({fd, 1, false});
+    else
+        ++f->writes;
+    queue_write(i);
+    return submit(1) && !failed;
+}
+
+bool UringBackend::close_file(int fd)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (File &f : files)
+        if (f.fd == fd) {
+            // Its last write to complete queues the sync.
+            f.closing = true;
+            return !failed;
+        }
+    queue_sync(fd);
+    if (!submit(1)) {
+        ::close(fd);
+        return false;
+    }
+    return !failed;
+}
+
+bool UringBackend::drain()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    while (in_flight > 0)
+        reap(1);
+    return !failed;
+}
+#endif // VIDEOCAP_HAVE_IO_URING
+
+std::unique_ptr<DiskBackend> make_backend(disk_backend kind,
+                                          size_t buffer_bytes,
+                                          unsigned int depth)
+{
+    switch (kind) {
+    case DISK_URING: {
+#ifdef VIDEOCAP_HAVE_IO_URING
+        std::unique_ptr<UringBackend> uring(
+            new UringBackend(buffer_bytes, depth));
+        if (uring->setup())
+            return std::unique_ptr<DiskBackend>(uring.release());
+#endif
+        fprintf(stderr, "Falling back to threaded pwrite backend\n");
+        return std::unique_ptr<DiskBackend>(
+            new ThreadBackend(buffer_bytes, depth, depth));
+    }
+    case DISK_THREADS:
+        return std::unique_ptr<DiskBackend>(
+            new ThreadBackend(buffer_bytes, depth, depth));
+    case DISK_SYNC:
+    default:
+        return std::unique_ptr<DiskBackend>(new SyncBackend(buffer_bytes));
+    }
+}
@@ -0,0 +1,79 @@
+/*
+Exports frames of a .vcap recording back to individual .pgm files, named
+'<timestamp>_<sequence>.pgm' like the frames written by CaptureApplication.
+
+    vcap_export [-o DIR] [-e N] BASE [FIRST[-LAST]]
+
+BASE is the recording prefix (without '.vidx'). FIRST and LAST select frames
+by sequence number, -e keeps every N-th selected frame.
+*/
+#include <Recording.hpp>
+
+#include <iostream>
+#include <string>
+
+extern "C" {
+#include <getopt.h>
+}
+
+#include <opencv2/imgcodecs.hpp>
+
+int main(int argc, char *argv[])
+{
+    std::string out_dir = ".";
+    unsigned long every = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "o:e:h")) != -1) {
+        switch (c) {
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'e':
+            every = std::max(strtoul(optarg, NULL, 10), 1UL);
+            break;
+        default:
+            std::cerr << "Usage: " << argv[0]
+                      << " [-o DIR] [-e N] BASE [FIRST[-LAST]]" << std::endl;
+            return c == 'h' ? 0 : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "No recording given" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    RecordReader reader(argv[optind]);
+    if (!reader.is_open())
+        return EXIT_FAILURE;
+
+    unsigned long first = 0, last = ~0UL;
+    if (optind + 1 < argc) {
+        const char *range = argv[optind + 1];
+        if (sscanf(range, "%lu-%lu", &first, &last) == 1)
+            last = strchr(range, '-') ? ~0UL : first;
+    }
+
+    unsigned long selected = 0, exported = 0;
+    Frame frame;
+    for (size_t i = 0; i < reader.size(); ++i) {
+        const IndexEntry &entry = reader.entry(i);
+        if (entry.sequence < first || entry.sequence > last)
+            continue;
+        if (selected++ % every != 0)
+            continue;
+        if (!reader.read(i, frame))
+            continue;
+        std::string name = out_dir + "/" +
+                           pgm_name(entry.timestamp_us, entry.sequence,
+                                    frame.camera, frame.view);
+        if (!cv::imwrite(name, frame.image)) {
+            std::cerr << "Cannot write '" << name << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        ++exported;
+    }
+    std::cout << "Exported " << exported << " of " << reader.size()
+              << " frames" << std::endl;
+    return 0;
+}
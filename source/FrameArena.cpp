@@ -0,0 +1,119 @@
+#include <FrameArena.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+}
+
+size_t huge_page_size()
+{
+    static size_t size = 0;
+    if (size)
+        return size;
+    size = 2 << 20;
+    FILE *f = fopen("/proc/meminfo", "r");
+    if (!f)
+        return size;
+    char line[128];
+    unsigned long kb;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1 && kb > 0) {
+            size = kb << 10;
+            break;
+        }
+    fclose(f);
+    return size;
+}
+
+bool FrameArena::allocate(size_t buffer_bytes, unsigned int count,
+                          bool hugepages, bool lock)
+{
+    free();
+    const size_t page = sysconf(_SC_PAGESIZE);
+    bytes = buffer_bytes;
+    stride = round_up(buffer_bytes, page);
+    buffers = count;
+    length = stride * count;
+    if (length == 0) {
+        fprintf(stderr, "Cannot map a frame arena of %u buffers of %zu "
+                "bytes\n", count, buffer_bytes);
+        buffers = 0;
+        return false;
+    }
+
+    void *p = MAP_FAILED;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS | (lock ? MAP_POPULATE : 0);
+    page_kind = PAGES_SMALL;
+    if (hugepages) {
+        const size_t huge_length = round_up(length, huge_page_size());
+        p = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+                 flags | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            length = huge_length;
+            page_kind = PAGES_HUGE;
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Cannot map %zu byte frame arena: %d, %s\n",
+                    length, errno, strerror(errno));
+            length = 0;
+            buffers = 0;
+            return false;
+        }
+        if (hugepages && madvise(p, length, MADV_HUGEPAGE) == 0)
+            page_kind = PAGES_TRANSPARENT;
+    }
+    base = static_cast<uint8_t*>(p);
+
+    is_locked = false;
+    if (lock) {
+        if (mlock(base, length) == 0)
+            is_locked = true;
+        else
+            fprintf(stderr, "Cannot lock %zu MB frame arena (ulimit -l?): "
+                    "%d, %s\n", length >> 20, errno, strerror(errno));
+    }
+    return true;
+}
+
+void FrameArena::free()
+{
+    if (!base)
+        return;
+    // munmap() drops the lock with the pages.
+    if (munmap(base, length) == -1)
+        fprintf(stderr, "munmap frame arena error %d, %s\n", errno,
+                strerror(errno));
+    base = nullptr;
+    length = 0;
+    buffers = 0;
+    is_locked = false;
+}
+
+std::string FrameArena::describe() const
+{
+    std::string s;
+    switch (page_kind) {
+    case PAGES_HUGE:
+        s = std::to_string(huge_page_size() >> 10) + " KiB pages";
+        break;
+    case PAGES_TRANSPARENT:
+        s = "transparent huge pages";
+        break;
+    default:
+        s = std::to_string(sysconf(_SC_PAGESIZE) >> 10) + " KiB pages";
+        break;
+    }
+    return s + (is_locked ? ", locked" : "");
+}
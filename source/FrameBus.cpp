@@ -0,0 +1,371 @@
+#include <FrameBus.hpp>
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+}
+
+static_assert(sizeof(BusReaderEntry) == 64, "reader entries are 64 bytes");
+static_assert(sizeof(BusSlot) == 64, "slot headers are 64 bytes");
+
+static const size_t page_bytes = 4096;
+
+static size_t round_page(size_t bytes)
+{
+    return (bytes + page_bytes - 1) & ~(page_bytes - 1);
+}
+
+static uint32_t *futex_word(BusHeader *header)
+{
+    // std::atomic<uint32_t> is a plain 32-bit word, which the kernel uses.
+    return reinterpret_cast<uint32_t*>(&header->futex);
+}
+
+static void futex_wake(BusHeader *header)
+{
+    // Not FUTEX_PRIVATE_FLAG: the waiters are other processes.
+    syscall(SYS_futex, futex_word(header), FUTEX_WAKE, INT_MAX, NULL, NULL,
+            0);
+}
+
+static void futex_wait(BusHeader *header, uint32_t value, int timeout_ms)
+{
+    struct timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    syscall(SYS_futex, futex_word(header), FUTEX_WAIT, value,
+            timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static bool process_alive(int pid)
+{
+    if (kill(pid, 0) == -1 && errno != EPERM)
+        return false;
+    // A process that was killed is a zombie until its parent reaps it.
+    char path[32], stat[256];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return true;
+    size_t n = fread(stat, 1, sizeof(stat) - 1, f);
+    fclose(f);
+    stat[n] = 0;
+    const char *state = strrchr(stat, ')');
+    return !state || state[1] != ' ' || (state[2] != 'Z' && state[2] != 'X');
+}
+
+static int live_publisher(const std::string &path)
+{
+    // Pid of the process publishing on an existing bus, 0 if there is no
+    // bus or whoever made it is gone.
+    int fd = shm_open(path.c_str(), O_RDONLY, 0);
+    if (fd == -1)
+        return 0;
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= sizeof(BusHeader))
+        p = mmap(NULL, sizeof(BusHeader), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return 0;
+    const BusHeader *h = static_cast<const BusHeader*>(p);
+    int pid = 0;
+    if (h->magic == VCAP_BUS_MAGIC && !h->closed.load() && h->publisher > 0 &&
+        process_alive(h->publisher))
+        pid = h->publisher;
+    munmap(p, sizeof(BusHeader));
+    return pid;
+}
+
+std::string bus_path(const std::string &name)
+{
+    return name.empty() || name[0] == '/' ? name : "/" + name;
+}
+
+FramePublisher::FramePublisher(const std::string &name, unsigned int slots,
+                               size_t slot_bytes)
+: name(bus_path(name)), too_big(0)
+{
+    const size_t stride = round_page(sizeof(BusSlot) + slot_bytes);
+    const size_t offset = round_page(sizeof(BusHeader));
+    if (slots == 0 || stride > UINT32_MAX) {
+        fprintf(stderr, "Bad frame bus geometry: %u slots of %zu bytes\n",
+                slots, slot_bytes);
+        return;
+    }
+    // A bus left behind by a publisher that crashed is replaced; readers
+    // still mapping it keep the old memory. A live one is left alone.
+    if (int pid = live_publisher(this->name)) {
+        fprintf(stderr, "Frame bus '%s' is in use by process %d\n",
+                this->name.c_str(), pid);
+        return;
+    }
+    shm_unlink(this->name.c_str());
+    int fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot create frame bus '%s': %d, %s\n",
+                this->name.c_str(), errno, strerror(errno));
+        return;
+    }
+    const size_t bytes = offset + stride * slots;
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, bytes) == 0)
+        p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Cannot map frame bus '%s' (%zu MB): %d, %s\n",
+                this->name.c_str(), bytes >> 20, errno, strerror(errno));
+        shm_unlink(this->name.c_str());
+        return;
+    }
+    // Fresh pages are zero, which is every counter's starting value.
+    BusHeader *h = static_cast<BusHeader*>(p);
+    h->version = VCAP_BUS_VERSION;
+    h->slots = slots;
+    h->slot_stride = stride;
+    h->slot_bytes = slot_bytes;
+    h->data_offset = offset;
+    h->publisher = getpid();
+    // Readers check the magic last.
+    std::atomic_thread_fence(std::memory_order_release);
+    h->magic = VCAP_BUS_MAGIC;
+    header = h;
+    mapped = bytes;
+}
+
+FramePublisher::~FramePublisher()
+{
+    if (!header)
+        return;
+    header->closed = 1;
+    header->futex.fetch_add(1);
+    futex_wake(header);
+    shm_unlink(name.c_str());
+    munmap(header, mapped);
+}
+
+void FramePublisher::publish(const Frame &frame)
+{
+    const cv::Mat &image = frame.image;
+    if (!header || image.empty())
+        return;
+    const size_t row_bytes = image.cols * image.elemSize();
+    const size_t bytes = row_bytes * image.rows;
+    if (bytes > header->slot_bytes) {
+        ++too_big;
+        return;
+    }
+    const uint64_t n = header->head.load(std::memory_order_relaxed);
+    BusSlot *slot = reinterpret_cast<BusSlot*>(
+        reinterpret_cast<uint8_t*>(header) + header->data_offset +
+        (n % header->slots) * header->slot_stride);
+
+    // Sequence lock: a reader that sees the same stamp before and after
+    // reading knows nothing was overwritten in between.
+    slot->stamp.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->timestamp_us = static_cast<int64_t>(frame.timestamp.tv_sec) *
+                         1000000 + frame.timestamp.tv_usec;
+    slot->sequence = frame.sequence;
+    slot->camera = frame.camera;
+    slot->view = frame.view;
+    slot->rows = image.rows;
+    slot->cols = image.cols;
+    slot->type = image.type();
+    slot->step = row_bytes;
+    slot->bytes = bytes;
+    uint8_t *dst = reinterpret_cast<uint8_t*>(slot + 1);
+    if (image.isContinuous()) {
+        memcpy(dst, image.data, bytes);
+    } else {
+        for (int r = 0; r < image.rows; ++r)
+            memcpy(dst + r * row_bytes, image.ptr(r), row_bytes);
+    }
+    slot->stamp.store(n + 1, std::memory_order_release);
+    header->head.store(n + 1, std::memory_order_release);
+
+    header->futex.fetch_add(1, std::memory_order_release);
+    if (header->waiters.load() > 0)
+        futex_wake(header);
+}
+
+BusStatus FramePublisher::status()
+{
+    BusStatus s;
+    s.name = name;
+    s.too_big = too_big;
+    if (!header)
+        return s;
+    s.slots = header->slots;
+    s.slot_bytes = header->slot_bytes;
+    s.published = header->head;
+    for (BusReaderEntry &entry : header->readers) {
+        int pid = entry.pid;
+        if (pid == 0)
+            continue;
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+            int expected = pid;
+            entry.pid.compare_exchange_strong(expected, 0);
+            continue;
+        }
+        BusReaderStatus r;
+        r.pid = pid;
+        uint64_t position = entry.position;
+        r.lag = s.published > position ? s.published - position : 0;
+        r.frames = entry.frames;
+        r.overruns = entry.overruns;
+        s.readers.push_back(r);
+    }
+    return s;
+}
+
+BusReader::BusReader(const std::string &name)
+{
+    const std::string path = bus_path(name);
+    int fd = shm_open(path.c_str(), O_RDWR, 0);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Cannot open frame bus '%s': %d, %s\n",
+                path.c_str(), errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    const size_t bytes = st.st_size;
+    void *p = bytes >= sizeof(BusHeader)
+              ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+              : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Cannot map frame bus '%s'\n", path.c_str());
+        return;
+    }
+    header = static_cast<BusHeader*>(p);
+    mapped = bytes;
+    if (header->magic != VCAP_BUS_MAGIC ||
+        header->version != VCAP_BUS_VERSION ||
+        header->data_offset + static_cast<uint64_t>(header->slot_stride) *
+            header->slots > bytes) {
+        fprintf(stderr, "'%s' is not a frame bus\n", path.c_str());
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    for (BusReaderEntry &e : header->readers) {
+        int expected = 0;
+        if (e.pid.compare_exchange_strong(expected, getpid())) {
+            e.frames = 0;
+            e.overruns = 0;
+            e.position = header->head.load();
+            entry = &e;
+            break;
+        }
+    }
+    if (!entry)
+        fprintf(stderr, "Frame bus '%s' has %u readers already\n",
+                path.c_str(), BUS_MAX_READERS);
+}
+
+BusReader::~BusReader()
+{
+    if (entry)
+        entry->pid = 0;
+    if (header)
+        munmap(header, mapped);
+}
+
+const BusSlot *BusReader::slot(uint64_t n) const
+{
+    return reinterpret_cast<const BusSlot*>(
+        reinterpret_cast<const uint8_t*>(header) + header->data_offset +
+        (n % header->slots) * header->slot_stride);
+}
+
+int BusReader::next(Frame &frame, int timeout_ms)
+{
+    frame.clear();
+    current = nullptr;
+    uint64_t position = entry->position.load(std::memory_order_relaxed);
+    for (;;) {
+        uint64_t head = header->head.load(std::memory_order_acquire);
+        if (position < head) {
+            // The publisher is writing frame 'head' over 'head - slots'.
+            if (head - position >= header->slots) {
+                uint64_t resume = head - header->slots / 2;
+                entry->overruns += resume - position;
+                position = resume;
+            }
+            const BusSlot *s = slot(position);
+            uint64_t stamp = s->stamp.load(std::memory_order_acquire);
+            if (stamp != position + 1) {
+                // Lapped between reading 'head' and the stamp.
+                ++position;
+                ++entry->overruns;
+                continue;
+            }
+            BusSlot meta;
+            memcpy(static_cast<void*>(&meta), s, sizeof(meta));
+            if (!unchanged(s, stamp) || meta.rows < 0 || meta.cols < 0 ||
+                meta.bytes > header->slot_bytes) {
+                ++position;
+                ++entry->overruns;
+                continue;
+            }
+            frame.image = cv::Mat(meta.rows, meta.cols, meta.type,
+                                  const_cast<BusSlot*>(s + 1), meta.step);
+            frame.timestamp.tv_sec = meta.timestamp_us / 1000000;
+            frame.timestamp.tv_usec = meta.timestamp_us % 1000000;
+            frame.sequence = meta.sequence;
+            frame.camera = meta.camera;
+            frame.view = meta.view;
+            current = s;
+            current_stamp = stamp;
+            entry->position.store(position + 1, std::memory_order_relaxed);
+            ++entry->frames;
+            return 1;
+        }
+        entry->position.store(position, std::memory_order_relaxed);
+        if (header->closed)
+            return -1;
+        if (timeout_ms == 0)
+            return 0;
+        // Announce the wait, then check again so a frame published in
+        // between isn't slept through.
+        uint32_t value = header->futex.load(std::memory_order_acquire);
+        header->waiters.fetch_add(1);
+        if (header->head.load(std::memory_order_acquire) == head &&
+            !header->closed)
+            futex_wait(header, value, timeout_ms);
+        header->waiters.fetch_sub(1);
+        if (header->head.load(std::memory_order_acquire) == head &&
+            timeout_ms > 0)
+            return header->closed ? -1 : 0;
+    }
+}
+
+bool BusReader::still_valid() const
+{
+    return current && unchanged(current, current_stamp);
+}
+
+bool BusReader::unchanged(const BusSlot *s, uint64_t stamp)
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return s->stamp.load(std::memory_order_relaxed) == stamp;
+}
+
+uint64_t BusReader::lag() const
+{
+    uint64_t head = header->head, position = entry->position;
+    return head > position ? head - position : 0;
+}
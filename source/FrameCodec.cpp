@@ -0,0 +1,310 @@
+#include <FrameCodec.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef VIDEOCAP_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+static const size_t BLOCK = 16; // Residuals per packed block.
+static const int ZLIB_LEVEL = 3; // Most of level 9's ratio at a fraction of the cost.
+
+bool parse_codec(const std::string &name, frame_codec &codec)
+{
+    if (name == "none")
+        codec = CODEC_NONE;
+    else if (name == "fast")
+        codec = CODEC_FAST;
+    else if (name == "high")
+        codec = CODEC_HIGH;
+    else
+        return false;
+    return true;
+}
+
+const char *codec_name(frame_codec codec)
+{
+    switch (codec) {
+    case CODEC_FAST: return "fast";
+    case CODEC_HIGH: return "high";
+    case CODEC_NONE:
+    default: return "none";
+    }
+}
+
+frame_codec available_codec(frame_codec codec)
+{
+#ifndef VIDEOCAP_HAVE_ZLIB
+    if (codec == CODEC_HIGH)
+        return CODEC_FAST;
+#endif
+    return codec;
+}
+
+static inline uint8_t zigzag(uint8_t r)
+{
+    return static_cast<uint8_t>((r << 1) ^ -(r >> 7));
+}
+
+static inline uint8_t unzigzag(uint8_t z)
+{
+    return static_cast<uint8_t>((z >> 1) ^ -(z & 1));
+}
+
+static inline uint8_t med(int a, int b, int c)
+{
+    int lo = std::min(a, b), hi = std::max(a, b);
+    return static_cast<uint8_t>(c >= hi ? lo : c <= lo ? hi : a + b - c);
+}
+
+static void left_residuals(const uint8_t *row, const uint8_t *up, size_t width,
+                           uint8_t *res)
+{
+    res[0] = zigzag(row[0] - (up ? up[0] : 0));
+    size_t x = 1;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x));
+        __m128i left = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(row + x - 1));
+        __m128i r = _mm_sub_epi8(cur, left);
+        __m128i sign = _mm_cmpgt_epi8(zero, r);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(res + x),
+                         _mm_xor_si128(_mm_add_epi8(r, r), sign));
+    }
+#endif
+    for (; x < width; ++x)
+        res[x] = zigzag(row[x] - row[x - 1]);
+}
+
+static void med_residuals(const uint8_t *row, const uint8_t *up, size_t width,
+                          uint8_t *res)
+{
+    if (!up) {
+        left_residuals(row, NULL, width, res);
+        return;
+    }
+    res[0] = zigzag(row[0] - up[0]);
+    size_t x = 1;
+#ifdef __SSE2__
+    // median(a, b, a + b - c) in 16-bit lanes, 8 pixels at a time.
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 8 <= width; x += 8) {
+        __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(row + x - 1)), zero);
+        __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(up + x)), zero);
+        __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(up + x - 1)), zero);
+        __m128i cur = _mm_unpacklo_epi8(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(row + x)), zero);
+        __m128i g = _mm_sub_epi16(_mm_add_epi16(a, b), c);
+        __m128i lo = _mm_min_epi16(a, b), hi = _mm_max_epi16(a, b);
+        __m128i pred = _mm_max_epi16(lo, _mm_min_epi16(hi, g));
+        __m128i r = _mm_sub_epi16(cur, pred);
+        // Residual mod 256, then zigzag on the low byte.
+        r = _mm_and_si128(r, _mm_set1_epi16(0xff));
+        __m128i r8 = _mm_packus_epi16(r, zero);
+        __m128i sign = _mm_cmpgt_epi8(zero, r8);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(res + x),
+                         _mm_xor_si128(_mm_add_epi8(r8, r8), sign));
+    }
+#endif
+    for (; x < width; ++x)
+        res[x] = zigzag(row[x] - med(row[x - 1], up[x], up[x - 1]));
+}
+
+static size_t pack_blocks(const uint8_t *res, size_t n, uint8_t *out)
+{
+    uint8_t *dst = out;
+    for (size_t i = 0; i < n; i += BLOCK) {
+        uint8_t v[BLOCK] = {0};
+        size_t count = std::min(BLOCK, n - i);
+        memcpy(v, res + i, count);
+
+        uint8_t bits = 0;
+#ifdef __SSE2__
+        __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v));
+        m = _mm_or_si128(m, _mm_srli_si128(m, 8));
+        m = _mm_or_si128(m, _mm_srli_si128(m, 4));
+        m = _mm_or_si128(m, _mm_srli_si128(m, 2));
+        m = _mm_or_si128(m, _mm_srli_si128(m, 1));
+        bits = static_cast<uint8_t>(_mm_cvtsi128_si32(m));
+#else
+        for (size_t k = 0; k < BLOCK; ++k)
+            bits |= v[k];
+#endif
+        unsigned int width = bits ? 32 - __builtin_clz(bits) : 0;
+        *dst++ = static_cast<uint8_t>(width);
+        if (width == 0)
+            continue;
+        unsigned __int128 acc = 0;
+        for (size_t k = 0; k < BLOCK; ++k)
+            acc |= static_cast<unsigned __int128>(v[k]) << (k * width);
+        // 16 values of 'width' bits are exactly 2*width bytes.
+        memcpy(dst, &acc, 2 * width);
+        dst += 2 * width;
+    }
+    return dst - out;
+}
+
+static bool unpack_blocks(const uint8_t *in, size_t bytes, uint8_t *res,
+                          size_t n)
+{
+    const uint8_t *src = in, *end = in + bytes;
+    for (size_t i = 0; i < n; i += BLOCK) {
+        if (src >= end)
+            return false;
+        unsigned int width = *src++;
+        size_t count = std::min(BLOCK, n - i);
+        if (width > 8 || src + 2 * width > end)
+            return false;
+        if (width == 0) {
+            memset(res + i, 0, count);
+            continue;
+        }
+        unsigned __int128 acc = 0;
+        memcpy(&acc, src, 2 * width);
+        src += 2 * width;
+        const unsigned int mask = (1u << width) - 1;
+        for (size_t k = 0; k < count; ++k)
+            res[i + k] = static_cast<uint8_t>((acc >> (k * width)) & mask);
+    }
+    return true;
+}
+
+size_t codec_bound(frame_codec codec, size_t raw_bytes)
+{
+    switch (available_codec(codec)) {
+    case CODEC_FAST:
+        return (raw_bytes + BLOCK - 1) / BLOCK * (BLOCK + 1);
+#ifdef VIDEOCAP_HAVE_ZLIB
+    case CODEC_HIGH:
+        return compressBound(raw_bytes);
+#endif
+    case CODEC_NONE:
+    default:
+        return raw_bytes;
+    }
+}
+
+size_t encode_frame(frame_codec codec, const cv::Mat &image,
+                    unsigned char *out, size_t capacity)
+{
+    const size_t width = image.cols, height = image.rows;
+    const size_t raw = width * height;
+    codec = available_codec(codec);
+    if (image.type() != CV_8UC1 || capacity < codec_bound(codec, raw))
+        return 0;
+
+    if (codec == CODEC_NONE) {
+        for (size_t y = 0; y < height; ++y)
+            memcpy(out + y * width, image.ptr(y), width);
+        return raw;
+    }
+
+    // Residuals for the whole frame, one scratch buffer per worker thread.
+    static thread_local std::vector<uint8_t> residuals;
+    residuals.resize(raw);
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *up = y > 0 ? image.ptr(y - 1) : NULL;
+        if (codec == CODEC_FAST)
+            left_residuals(image.ptr(y), up, width, &residuals[y * width]);
+        else
+            med_residuals(image.ptr(y), up, width, &residuals[y * width]);
+    }
+
+    if (codec == CODEC_FAST)
+        return pack_blocks(residuals.data(), raw, out);
+#ifdef VIDEOCAP_HAVE_ZLIB
+    uLongf coded = capacity;
+    if (compress2(out, &coded, residuals.data(), raw, ZLIB_LEVEL) != Z_OK)
+        return 0;
+    return coded;
+#else
+    return 0;
+#endif
+}
+
+bool decode_frame(frame_codec codec, const unsigned char *in, size_t bytes,
+                  cv::Mat &image)
+{
+    const size_t width = image.cols, height = image.rows;
+    const size_t raw = width * height;
+    if (image.type() != CV_8UC1 || !image.isContinuous())
+        return false;
+
+    uint8_t *px = image.data;
+    switch (codec) {
+    case CODEC_NONE:
+        if (bytes < raw)
+            return false;
+        memcpy(px, in, raw);
+        return true;
+    case CODEC_FAST:
+        if (!unpack_blocks(in, bytes, px, raw))
+            return false;
+        break;
+    case CODEC_HIGH: {
+#ifdef VIDEOCAP_HAVE_ZLIB
+        uLongf out = raw;
+        if (uncompress(px, &out, in, bytes) != Z_OK || out != raw)
+            return false;
+        break;
+#else
+        return false;
+#endif
+    }
+    default:
+        return false;
+    }
+
+    // Residuals are decoded in place, undo the prediction row by row.
+    for (size_t y = 0; y < height; ++y) {
+        uint8_t *row = px + y * width;
+        const uint8_t *up = y > 0 ? row - width : NULL;
+        row[0] = unzigzag(row[0]) + (up ? up[0] : 0);
+        if (codec == CODEC_FAST || !up) {
+            for (size_t x = 1; x < width; ++x)
+                row[x] = unzigzag(row[x]) + row[x - 1];
+        } else {
+            for (size_t x = 1; x < width; ++x)
+                row[x] = unzigzag(row[x]) + med(row[x - 1], up[x], up[x - 1]);
+        }
+    }
+    return true;
+}
+
+void CodecStats::add(size_t raw, size_t coded, uint64_t ns)
+{
+    frames += 1;
+    raw_bytes += raw;
+    coded_bytes += coded;
+    encode_ns += ns;
+}
+
+void CodecStats::reset()
+{
+    frames = 0;
+    raw_bytes = 0;
+    coded_bytes = 0;
+    encode_ns = 0;
+}
+
+double CodecStats::ratio() const
+{
+    unsigned long long coded = coded_bytes;
+    return coded ? static_cast<double>(raw_bytes) / coded : 1.0;
+}
+
+double CodecStats::ms_per_frame() const
+{
+    unsigned long n = frames;
+    return n ? encode_ns / 1e6 / n : 0.0;
+}
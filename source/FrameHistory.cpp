@@ -0,0 +1,126 @@
+#include <FrameHistory.hpp>
+
+#include <cstring>
+
+static double seconds(const struct timeval &tv)
+{
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+FrameHistory::FrameHistory(size_t budget_bytes, double max_age_s, int fps)
+: budget(budget_bytes), max_age(max_age_s), fps(fps)
+{
+}
+
+void FrameHistory::reshape(const cv::Mat &image)
+{
+    // Frames still leased from the old arena keep pointing at memory that is
+    // about to go, so only re-cut it once they are all back.
+    for (const Slot &slot : slots)
+        if (slot.leased)
+            return;
+    rows = image.rows;
+    cols = image.cols;
+    type = image.type();
+    frame_bytes = image.total() * image.elemSize();
+    size_t n = frame_bytes ? budget / frame_bytes : 0;
+    if (budget == 0 && max_age > 0)
+        n = static_cast<size_t>(max_age * (fps > 0 ? fps : 100)) + 1;
+    arena.assign(n * frame_bytes, 0);
+    slots.assign(n, Slot());
+    head = 0;
+    count = 0;
+    ++generation;
+}
+
+void FrameHistory::push(const Frame &frame)
+{
+    const cv::Mat &image = frame.image;
+    if (image.empty())
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (image.rows != rows || image.cols != cols || image.type() != type) {
+        reshape(image);
+        if (image.rows != rows || image.cols != cols || image.type() != type) {
+            ++skipped;
+            return;
+        }
+    }
+    if (slots.empty() || slots[head].leased) {
+        // Either the budget is below one frame, or the writers still hold
+        // the oldest slot from the last flush.
+        ++skipped;
+        return;
+    }
+
+    unsigned char *dst = &arena[head * frame_bytes];
+    if (image.isContinuous()) {
+        memcpy(dst, image.data, frame_bytes);
+    } else {
+        const size_t row_bytes = image.cols * image.elemSize();
+        for (int r = 0; r < image.rows; ++r)
+            memcpy(dst + r * row_bytes, image.ptr(r), row_bytes);
+    }
+    slots[head].timestamp = frame.timestamp;
+    slots[head].sequence = frame.sequence;
+    slots[head].camera = frame.camera;
+    head = (head + 1) % slots.size();
+    if (count < slots.size())
+        ++count;
+}
+
+size_t FrameHistory::flush(std::vector<Frame> &frames)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0)
+        return 0;
+
+    const size_t n = slots.size();
+    const size_t first = (head + n - count) % n;
+    const double newest = seconds(slots[(head + n - 1) % n].timestamp);
+    size_t added = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t index = (first + i) % n;
+        Slot &slot = slots[index];
+        if (max_age > 0 && newest - seconds(slot.timestamp) > max_age)
+            continue;
+        Frame frame;
+        frame.image = cv::Mat(rows, cols, type, &arena[index * frame_bytes]);
+        frame.timestamp = slot.timestamp;
+        frame.sequence = slot.sequence;
+        frame.camera = slot.camera;
+        frame.lease = std::make_shared<FrameLease>(this, index, generation);
+        slot.leased = true;
+        frames.push_back(frame);
+        ++added;
+    }
+    count = 0;
+    return added;
+}
+
+void FrameHistory::requeue(unsigned int index, unsigned int gen)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (gen == generation && index < slots.size())
+        slots[index].leased = false;
+}
+
+HistoryStatus FrameHistory::status()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    HistoryStatus s;
+    const size_t n = slots.size();
+    s.frames = count;
+    s.capacity = n;
+    s.budget_bytes = arena.size();
+    s.skipped = skipped;
+    s.span_s = 0;
+    if (count > 1) {
+        double newest = seconds(slots[(head + n - 1) % n].timestamp);
+        double oldest = seconds(slots[(head + n - count) % n].timestamp);
+        s.span_s = newest - oldest;
+    }
+    return s;
+}
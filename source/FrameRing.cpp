@@ -0,0 +1,338 @@
+#include <FrameRing.hpp>
+#include <PipelineStats.hpp>
+
+#include <cstdlib>
+#include <thread>
+#include <utility>
+
+bool parse_overload(const std::string &name, overload_policy &policy,
+                    unsigned int &every)
+{
+    if (name == "block") {
+        policy = OVERLOAD_BLOCK;
+    } else if (name == "drop-newest") {
+        policy = OVERLOAD_DROP_NEWEST;
+    } else if (name == "drop-oldest") {
+        policy = OVERLOAD_DROP_OLDEST;
+    } else if (name.compare(0, 8, "decimate") == 0) {
+        if (name.size() > 8) {
+            if (name[8] != ':' || atoi(name.c_str() + 9) < 2)
+                return false;
+            every = atoi(name.c_str() + 9);
+        }
+        policy = OVERLOAD_DECIMATE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char *overload_name(overload_policy policy)
+{
+    static const char *names[] = {"block", "drop-newest", "drop-oldest",
+                                  "decimate"};
+    return names[policy];
+}
+
+frame_ring::frame_ring(size_t capacity, unsigned int spin_limit)
+: slots(capacity), spin_limit(spin_limit), head(0), tail(0), closed(false),
+  producer_parked(false), consumer_parked(false), policy(OVERLOAD_BLOCK),
+  decimate_every(2), blocks(0), blocked_ns(0), dropped_newest(0),
+  dropped_oldest(0), decimated(0)
+{
+    free_at.reset(new std::atomic<size_t>[capacity]);
+    for (size_t i = 0; i < capacity; ++i)
+        free_at[i].store(i, std::memory_order_relaxed);
+}
+
+void frame_ring::set_policy(overload_policy p, unsigned int every)
+{
+    decimate_every.store(every < 2 ? 2 : every, std::memory_order_relaxed);
+    policy.store(p, std::memory_order_release);
+    // A producer parked under OVERLOAD_BLOCK stays parked until a slot
+    // frees up, which the consumer will see to.
+}
+
+RingStatus frame_ring::status() const
+{
+    RingStatus s;
+    s.policy = static_cast<overload_policy>(policy.load());
+    s.decimate_every = decimate_every;
+    s.capacity = slots.size();
+    s.size = size();
+    s.blocks = blocks;
+    s.blocked_ms = blocked_ns / 1e6;
+    s.dropped_newest = dropped_newest;
+    s.dropped_oldest = dropped_oldest;
+    s.decimated = decimated;
+    return s;
+}
+
+void frame_ring::reset_counters()
+{
+    blocks = 0;
+    blocked_ns = 0;
+    dropped_newest = 0;
+    dropped_oldest = 0;
+    decimated = 0;
+}
+
+size_t frame_ring::size() const
+{
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t h = head.load(std::memory_order_acquire);
+    return h - t;
+}
+
+void frame_ring::wake(std::atomic_bool &parked, std::condition_variable &cond)
+{
+    // Pairs with the fence in wait_*(): either the parked side sees our index
+    // update before sleeping, or we see its flag and notify under the mutex.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(park_mutex);
+        cond.notify_one();
+    }
+}
+
+bool frame_ring::wait_not_full(size_t pos)
+{
+    const size_t cap = slots.size();
+    for (unsigned int i = 0; i < spin_limit; ++i) {
+        if (pos - tail.load(std::memory_order_acquire) < cap)
+            return true;
+        if (closed.load(std::memory_order_acquire))
+            return false;
+        if ((i & 63) == 63)
+            std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock(park_mutex);
+    producer_parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    not_full.wait(lock, [&] {
+        return pos - tail.load(std::memory_order_acquire) < cap ||
+               closed.load(std::memory_order_acquire);
+    });
+    producer_parked.store(false, std::memory_order_relaxed);
+    return pos - tail.load(std::memory_order_acquire) < cap;
+}
+
+bool frame_ring::wait_not_empty(
+    size_t pos, const std::chrono::steady_clock::time_point *deadline)
+{
+    for (unsigned int i = 0; i < spin_limit; ++i) {
+        if (head.load(std::memory_order_acquire) != pos)
+            return true;
+        if (closed.load(std::memory_order_acquire))
+            break;
+        if ((i & 63) == 63)
+            std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lock(park_mutex);
+    consumer_parked.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto ready = [&] {
+        return head.load(std::memory_order_acquire) != pos ||
+               closed.load(std::memory_order_acquire);
+    };
+    if (deadline)
+        not_empty.wait_until(lock, *deadline, ready);
+    else
+        not_empty.wait(lock, ready);
+    consumer_parked.store(false, std::memory_order_relaxed);
+    // A closed ring is still drained before pop() reports failure.
+    return head.load(std::memory_order_acquire) != pos;
+}
+
+template <typename F>
+bool frame_ring::push_slot(F &&frame)
+{
+    if (closed.load(std::memory_order_acquire))
+        return false;
+    const size_t cap = slots.size();
+    size_t pos = head.load(std::memory_order_relaxed);
+    size_t fill = pos - tail.load(std::memory_order_acquire);
+    const int p = policy.load(std::memory_order_acquire);
+    if (p == OVERLOAD_DECIMATE && fill >= cap / 2) {
+        if (++decimate_phase % decimate_every.load(std::memory_order_relaxed)) {
+            decimated.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    } else {
+        decimate_phase = 0;
+    }
+    if (fill >= cap && p == OVERLOAD_DROP_OLDEST) {
+        // The consumer isn't keeping up: take the oldest frame from it,
+        // unless it has just taken that one itself.
+        size_t oldest = pos - cap;
+        if (tail.compare_exchange_strong(oldest, oldest + 1,
+                                         std::memory_order_acq_rel)) {
+            release_slot(oldest);
+            dropped_oldest.fetch_add(1, std::memory_order_relaxed);
+        }
+    } else if (fill >= cap && p != OVERLOAD_BLOCK) {
+        dropped_newest.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    } else if (fill >= cap) {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = wait_not_full(pos);
+        auto waited = std::chrono::steady_clock::now() - start;
+        blocks.fetch_add(1, std::memory_order_relaxed);
+        blocked_ns.fetch_add(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(waited).count(),
+            std::memory_order_relaxed);
+        if (!ok)
+            return false;
+    }
+    store_slot(pos, Frame(std::forward<F>(frame)));
+    return true;
+}
+
+void frame_ring::store_slot(size_t pos, Frame &&frame)
+{
+    // The tail moves before a frame is read out, so the slot's reader may
+    // still be at it; that takes no longer than a move.
+    std::atomic<size_t> &slot_free = free_at[pos % slots.size()];
+    while (slot_free.load(std::memory_order_acquire) != pos)
+        std::this_thread::yield();
+    Frame &slot = slots[pos % slots.size()];
+    slot = std::move(frame);
+    if (stats)
+        stats->stamp(slot, STAGE_PUSH);
+    head.store(pos + 1, std::memory_order_release);
+    wake(consumer_parked, not_empty);
+}
+
+bool frame_ring::push(const Frame &frame)
+{
+    return push_slot(frame);
+}
+
+bool frame_ring::push(Frame &&frame)
+{
+    return push_slot(std::move(frame));
+}
+
+bool frame_ring::try_push(Frame &&frame)
+{
+    size_t pos = head.load(std::memory_order_relaxed);
+    if (closed.load(std::memory_order_acquire) ||
+        pos - tail.load(std::memory_order_acquire) >= slots.size())
+        return false;
+    store_slot(pos, std::move(frame));
+    return true;
+}
+
+size_t frame_ring::claim(size_t &pos, size_t max_frames)
+{
+    pos = tail.load(std::memory_order_acquire);
+    for (;;) {
+        size_t available = head.load(std::memory_order_acquire) - pos;
+        size_t n = available < max_frames ? available : max_frames;
+        // Fails only if the producer took the oldest frame meanwhile.
+        if (n == 0 ||
+            tail.compare_exchange_weak(pos, pos + n,
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire))
+            return n;
+    }
+}
+
+void frame_ring::release_slot(size_t pos)
+{
+    const size_t cap = slots.size();
+    slots[pos % cap].clear(); // Gives the buffer back.
+    free_at[pos % cap].store(pos + cap, std::memory_order_release);
+}
+
+void frame_ring::shed_oldest()
+{
+    const size_t cap = slots.size();
+    const size_t fill = size(); // Only the consumer lowers it.
+    if (policy.load(std::memory_order_acquire) != OVERLOAD_DROP_OLDEST ||
+        fill <= cap - cap / 4)
+        return;
+    size_t pos;
+    size_t n = claim(pos, fill - cap / 2);
+    for (size_t i = 0; i < n; ++i)
+        release_slot(pos + i);
+    dropped_oldest.fetch_add(n, std::memory_order_relaxed);
+    wake(producer_parked, not_full);
+}
+
+bool frame_ring::pop(Frame &frame)
+{
+    size_t pos;
+    do {
+        if (!wait_not_empty(tail.load(std::memory_order_acquire), nullptr))
+            return false;
+        shed_oldest();
+    } while (claim(pos, 1) == 0);
+    // Moving out leaves the slot empty, so it holds no lease once read.
+    frame = std::move(slots[pos % slots.size()]);
+    release_slot(pos);
+    wake(producer_parked, not_full);
+    return true;
+}
+
+size_t frame_ring::pop_batch(std::vector<Frame> &frames, size_t max_frames)
+{
+    size_t n = 0;
+    while (max_frames > 0 && n == 0) {
+        if (!wait_not_empty(tail.load(std::memory_order_acquire), nullptr))
+            return 0;
+        n = take_batch(frames, max_frames);
+    }
+    return n;
+}
+
+size_t frame_ring::pop_batch(std::vector<Frame> &frames, size_t max_frames,
+                             std::chrono::microseconds timeout)
+{
+    size_t pos = tail.load(std::memory_order_acquire);
+    if (max_frames == 0)
+        return 0;
+    if (head.load(std::memory_order_acquire) == pos) {
+        if (timeout.count() <= 0)
+            return 0;
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        if (!wait_not_empty(pos, &deadline))
+            return 0;
+    }
+    return take_batch(frames, max_frames);
+}
+
+size_t frame_ring::take_batch(std::vector<Frame> &frames, size_t max_frames)
+{
+    shed_oldest();
+    size_t pos;
+    size_t n = claim(pos, max_frames);
+    for (size_t i = 0; i < n; ++i) {
+        frames.push_back(std::move(slots[(pos + i) % slots.size()]));
+        release_slot(pos + i);
+    }
+    wake(producer_parked, not_full);
+    return n;
+}
+
+void frame_ring::close()
+{
+    closed.store(true, std::memory_order_release);
+    std::lock_guard<std::mutex> lock(park_mutex);
+    not_full.notify_all();
+    not_empty.notify_all();
+}
+
+void frame_ring::reopen()
+{
+    closed.store(false, std::memory_order_release);
+}
+
+void frame_ring::clear()
+{
+    size_t pos;
+    size_t n = claim(pos, slots.size());
+    for (size_t i = 0; i < n; ++i)
+        release_slot(pos + i);
+    wake(producer_parked, not_full);
+}
@@ -0,0 +1,427 @@
+#include <VideoCap.hpp>
+
+#include <algorithm>
+#include <thread>
+
+extern "C" {
+#include <dirent.h>
+}
+
+PoolStatus FrameSource::pool_status()
+{
+    PoolStatus status = PoolStatus();
+    return status;
+}
+
+SourceEvents FrameSource::events()
+{
+    SourceEvents events = SourceEvents();
+    return events;
+}
+
+bool FrameSource::reconfigure(const StreamFormat &)
+{
+    fprintf(stderr, "%s can't be reconfigured\n", describe().c_str());
+    return false;
+}
+
+size_t FrameSource::read_batch(std::vector<Frame> &frames, size_t max)
+{
+    frames.resize(1);
+    if (max == 0 || !read(frames[0])) {
+        frames.clear();
+        return 0;
+    }
+    return 1;
+}
+
+bool parse_pattern(const std::string &name, synthetic_pattern &pattern)
+{
+    if (name == "gradient")
+        pattern = PATTERN_GRADIENT;
+    else if (name == "checker")
+        pattern = PATTERN_CHECKER;
+    else if (name == "noise")
+        pattern = PATTERN_NOISE;
+    else if (name == "bar")
+        pattern = PATTERN_BAR;
+    else
+        return false;
+    return true;
+}
+
+bool parse_io_method(const std::string &name, io_method &io)
+{
+    if (name == "read")
+        io = IO_METHOD_READ;
+    else if (name == "mmap")
+        io = IO_METHOD_MMAP;
+    else if (name == "userptr")
+        io = IO_METHOD_USERPTR;
+    else
+        return false;
+    return true;
+}
+
+const char *io_method_name(io_method io)
+{
+    static const char *names[] = {"read", "mmap", "userptr"};
+    return names[io];
+}
+
+bool parse_fourcc(const std::string &name, uint32_t &fourcc)
+{
+    if (name.empty() || name.size() > 4)
+        return false;
+    std::string code = name + std::string(4 - name.size(), ' ');
+    fourcc = v4l2_fourcc(code[0], code[1], code[2], code[3]);
+    return true;
+}
+
+std::string fourcc_name(uint32_t fourcc)
+{
+    std::string name;
+    for (int i = 0; i < 4; ++i)
+        name += static_cast<char>((fourcc >> (8 * i)) & 0xff);
+    return name.substr(0, name.find_last_not_of(' ') + 1);
+}
+
+std::unique_ptr<FrameSource> make_source(const SourceConfig &config)
+{
+    switch (config.kind) {
+    case SOURCE_SYNTHETIC:
+        return std::unique_ptr<FrameSource>(new SyntheticSource(config));
+    case SOURCE_REPLAY:
+        return std::unique_ptr<FrameSource>(new ReplaySource(config));
+    case SOURCE_V4L2:
+    default:
+        return std::unique_ptr<FrameSource>(
+            new VideoCapture(config.device, config.buffers, config.io,
+                             config.hugepages, config.lock_buffers));
+    }
+}
+
+static struct timeval monotonic_timeval()
+{
+    // V4L2 drivers stamp buffers with CLOCK_MONOTONIC, so do the same.
+    struct timespec ts;
+    struct timeval tv;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    tv.tv_sec = ts.tv_sec;
+    tv.tv_usec = ts.tv_nsec / 1000;
+    return tv;
+}
+
+SyntheticSource::SyntheticSource(const SourceConfig &config)
+: width(config.width), height(config.height), fps(config.fps),
+  jitter_us(config.jitter_us), pattern(config.pattern),
+  frame_bytes(static_cast<size_t>(config.width) * config.height),
+  hugepages(config.hugepages), lock_buffers(config.lock_buffers),
+  pool(std::max(config.buffers, 2u))
+{
+    if (!arena.allocate(frame_bytes, pool, hugepages, lock_buffers))
+        exit(EXIT_FAILURE);
+    make_background();
+    capture();
+}
+
+void SyntheticSource::make_background()
+{
+    // Noise keeps two frames worth so each frame can start at a new offset.
+    background.resize(pattern == PATTERN_NOISE ? 2 * frame_bytes : frame_bytes);
+    for (size_t i = 0; i < background.size(); ++i) {
+        unsigned int x = (i % frame_bytes) % width;
+        unsigned int y = (i % frame_bytes) / width;
+        switch (pattern) {
+        case PATTERN_CHECKER:
+            background[i] = ((x / 32 + y / 32) & 1) ? 255 : 0;
+            break;
+        case PATTERN_NOISE:
+            background[i] = static_cast<uchar>(rng() >> 7);
+            break;
+        case PATTERN_GRADIENT:
+        case PATTERN_BAR:
+        default:
+            background[i] = static_cast<uchar>(x * 255 / std::max(width - 1, 1u));
+            break;
+        }
+    }
+}
+
+void SyntheticSource::capture(bool fpsSwitch)
+{
+    if (fpsSwitch) {
+        if (fps == 60)
+            fps = 100;
+        else if (fps == 100)
+            fps = 60;
+        std::cout << "FPS set to " << fps << std::endl;
+    }
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    free_list.clear();
+    for (unsigned int i = 0; i < pool; ++i)
+        free_list.push_back(i);
+    next_frame = clock::now();
+    requeued.notify_all();
+}
+
+bool SyntheticSource::reconfigure(const StreamFormat &format)
+{
+    if (format.fourcc && format.fourcc != V4L2_PIX_FMT_GREY) {
+        fprintf(stderr, "Synthetic frames are GREY only\n");
+        return false;
+    }
+    const unsigned int w = format.width ? format.width : width;
+    const unsigned int h = format.height ? format.height : height;
+    const size_t bytes = static_cast<size_t>(w) * h;
+    bool reused = true;
+    if (w != width || h != height) {
+        std::unique_lock<std::mutex> lock(pool_mutex);
+        if (bytes > arena.buffer_stride()) {
+            // Frames in flight still point into the arena; wait (a while)
+            // for the pipeline to let go of them before replacing it.
+            for (int i = 0; i < 2000 && free_list.size() < pool; ++i) {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                lock.lock();
+            }
+            if (free_list.size() < pool) {
+                fprintf(stderr, "%u frame leases still held, not "
+                        "reconfiguring\n",
+                        pool - static_cast<unsigned int>(free_list.size()));
+                return false;
+            }
+            ++generation;
+            if (!arena.allocate(bytes, pool, hugepages, lock_buffers)) {
+                // Nothing is leased, so the old size can be mapped again.
+                if (!arena.allocate(frame_bytes, pool, hugepages,
+                                    lock_buffers)) {
+                    fprintf(stderr, "Synthetic source has no buffers\n");
+                    free_list.clear();
+                }
+                return false;
+            }
+            free_list.clear();
+            for (unsigned int i = 0; i < pool; ++i)
+                free_list.push_back(i);
+            reused = false;
+        }
+        width = w;
+        height = h;
+        frame_bytes = bytes;
+        make_background();
+    }
+    if (format.fps > 0)
+        fps = format.fps;
+    next_frame = clock::now();
+    std::cout << "Synthetic " << width << "x" << height << " at " << fps
+              << " fps, buffers " << (reused ? "reused" : "reallocated")
+              << std::endl;
+    return true;
+}
+
+void SyntheticSource::release()
+{
+    // Outstanding leases belong to the old generation and are ignored.
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    ++generation;
+    free_list.clear();
+}
+
+bool SyntheticSource::take_buffer(unsigned int &index)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (free_list.empty()) {
+        ++starved;
+        return false;
+    }
+    index = free_list.back();
+    free_list.pop_back();
+    ++leases;
+    peak = std::max(peak, pool - static_cast<unsigned int>(free_list.size()));
+    return true;
+}
+
+void SyntheticSource::requeue(unsigned int index, unsigned int gen)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (gen == generation) {
+        free_list.push_back(index);
+        requeued.notify_all();
+    }
+}
+
+bool SyntheticSource::wait_for_buffer()
+{
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    return requeued.wait_for(lock, std::chrono::milliseconds(100),
+                             [this] { return !free_list.empty(); });
+}
+
+void SyntheticSource::render(uchar *dst, unsigned long seq)
+{
+    if (pattern == PATTERN_NOISE) {
+        size_t offset = (seq * 7919) % frame_bytes;
+        memcpy(dst, &background[offset], frame_bytes);
+        return;
+    }
+    memcpy(dst, &background[0], frame_bytes);
+    if (pattern == PATTERN_BAR) {
+        const unsigned int bar = std::max(width / 64, 1u);
+        unsigned int x0 = static_cast<unsigned int>((seq * 4) % width);
+        unsigned int x1 = std::min(x0 + bar, width);
+        for (unsigned int y = 0; y < height; ++y)
+            memset(dst + static_cast<size_t>(y) * width + x0, 255, x1 - x0);
+    }
+}
+
+int SyntheticSource::read(Frame &frame)
+{
+    frame.clear();
+    for (;;) {
+        if (fps > 0) {
+            auto due = next_frame;
+            if (jitter_us > 0) {
+                std::uniform_int_distribution<int> jitter(
+                    -static_cast<int>(jitter_us), static_cast<int>(jitter_us));
+                due += std::chrono::microseconds(jitter(rng));
+            }
+            std::this_thread::sleep_until(due);
+            next_frame += std::chrono::microseconds(1000000 / fps);
+        } else if (!wait_for_buffer()) {
+            // Unthrottled, a frame is only due once a buffer is free.
+            return 0;
+        }
+        unsigned long seq = sequence++;
+        unsigned int index;
+        // No free buffer: the frame is lost, as it would be in the driver.
+        if (!take_buffer(index))
+            continue;
+
+        uchar *data = arena.buffer(index);
+        render(data, seq);
+        frame.image = cv::Mat(height, width, CV_8U, data);
+        frame.timestamp = monotonic_timeval();
+        frame.sequence = static_cast<uint32_t>(seq);
+        frame.stamps[STAGE_DRIVER] = timeval_ns(frame.timestamp);
+        frame.lease = std::make_shared<FrameLease>(this, index, generation);
+        return 1;
+    }
+}
+
+PoolStatus SyntheticSource::pool_status()
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    PoolStatus status;
+    status.size = pool;
+    status.leased = pool - static_cast<unsigned int>(free_list.size());
+    status.peak = peak;
+    status.starved = starved;
+    status.leases = leases;
+    return status;
+}
+
+std::string SyntheticSource::describe()
+{
+    static const char *names[] = {"gradient", "checker", "noise", "bar"};
+    return "Synthetic " + std::to_string(width) + "x" +
+           std::to_string(height) + " " + names[pattern] + ", " +
+           (fps > 0 ? std::to_string(fps) + " fps" : "unthrottled") +
+           (jitter_us ? ", +/-" + std::to_string(jitter_us) + " us jitter"
+                      : "") +
+           ", " + std::to_string(pool) + " buffers (" + arena.describe() +
+           ")";
+}
+
+ReplaySource::ReplaySource(const SourceConfig &config)
+: dir(config.replay_dir), max_speed(config.replay_max_speed),
+  loop(config.replay_loop)
+{
+    scan();
+    if (entries.empty()) {
+        fprintf(stderr, "No recorded frames found in '%s'\n", dir.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (entries.size() > 1) {
+        long span = entries.back().timestamp - entries.front().timestamp;
+        if (span > 0)
+            fps = static_cast<int>((entries.size() - 1) * 1000000L / span);
+    }
+    capture();
+}
+
+void ReplaySource::scan()
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                dir.c_str(), errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        // Names are '<timestamp>_<count>.pgm', see write_image(Frame&).
+        long ts;
+        unsigned long count;
+        char ext[8];
+        if (sscanf(ent->d_name, "%ld_%lu.%7s", &ts, &count, ext) != 3 ||
+            strcmp(ext, "pgm") != 0)
+            continue;
+        Entry entry;
+        entry.timestamp = ts;
+        entry.count = count;
+        entry.path = dir + "/" + ent->d_name;
+        entries.push_back(entry);
+    }
+    closedir(d);
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry &a, const Entry &b) { return a.count < b.count; });
+}
+
+void ReplaySource::capture(bool fpsSwitch)
+{
+    if (fpsSwitch)
+        std::cout << "Replay rate is fixed by the recording" << std::endl;
+    position = 0;
+    finished = false;
+    first_timestamp = entries.front().timestamp;
+    start = clock::now();
+}
+
+int ReplaySource::read(Frame &frame)
+{
+    frame.clear();
+    if (position == entries.size()) {
+        if (!loop) {
+            if (!finished)
+                std::cout << "Replay finished" << std::endl;
+            finished = true;
+            // Nothing more to deliver, don't let the reader spin.
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            return 0;
+        }
+        capture();
+    }
+    const Entry &entry = entries[position++];
+    if (!max_speed)
+        std::this_thread::sleep_until(
+            start + std::chrono::microseconds(entry.timestamp - first_timestamp));
+
+    // The decoded Mat owns its pixels, so no lease is needed.
+    frame.image = cv::imread(entry.path, cv::IMREAD_UNCHANGED);
+    if (frame.image.empty()) {
+        fprintf(stderr, "Cannot read '%s'\n", entry.path.c_str());
+        return 0;
+    }
+    frame.timestamp.tv_sec = entry.timestamp / 1000000;
+    frame.timestamp.tv_usec = entry.timestamp % 1000000;
+    frame.sequence = static_cast<uint32_t>(entry.count);
+    return 1;
+}
+
+std::string ReplaySource::describe()
+{
+    return "Replay of " + std::to_string(entries.size()) + " frames from '" +
+           dir + "', " + (max_speed ? "max speed" : "recorded speed") +
+           (loop ? ", looping" : "");
+}
@@ -0,0 +1,207 @@
+#include <FrameStream.hpp>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+}
+
+bool parse_endpoint(const std::string &spec, StreamEndpoint &endpoint)
+{
+    endpoint = StreamEndpoint();
+    if (spec.compare(0, 5, "unix:") == 0) {
+        endpoint.unix_socket = true;
+        endpoint.address = spec.substr(5);
+        return !endpoint.address.empty() &&
+               endpoint.address.size() < sizeof(sockaddr_un::sun_path);
+    }
+    std::string port = spec;
+    size_t colon = spec.rfind(':');
+    if (colon != std::string::npos) {
+        endpoint.address = spec.substr(0, colon);
+        port = spec.substr(colon + 1);
+    }
+    char *end = nullptr;
+    long p = strtol(port.c_str(), &end, 10);
+    if (port.empty() || *end || p <= 0 || p > 65535)
+        return false;
+    endpoint.port = p;
+    return true;
+}
+
+bool endpoint_address(const StreamEndpoint &endpoint, bool listening,
+                      struct sockaddr_storage &addr, socklen_t &length)
+{
+    memset(&addr, 0, sizeof(addr));
+    if (endpoint.unix_socket) {
+        sockaddr_un *un = reinterpret_cast<sockaddr_un*>(&addr);
+        un->sun_family = AF_UNIX;
+        strncpy(un->sun_path, endpoint.address.c_str(),
+                sizeof(un->sun_path) - 1);
+        length = sizeof(*un);
+        return true;
+    }
+    std::string host = endpoint.address;
+    if (host.empty())
+        host = listening ? "0.0.0.0" : "127.0.0.1";
+    addrinfo hints, *found = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    std::string port = std::to_string(endpoint.port);
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &found);
+    if (ret != 0 || !found) {
+        fprintf(stderr, "Cannot resolve '%s': %s\n", host.c_str(),
+                gai_strerror(ret));
+        return false;
+    }
+    memcpy(&addr, found->ai_addr, found->ai_addrlen);
+    length = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+std::string endpoint_name(const StreamEndpoint &endpoint)
+{
+    if (endpoint.unix_socket)
+        return "unix:" + endpoint.address;
+    return (endpoint.address.empty() ? "*" : endpoint.address) + ":" +
+           std::to_string(endpoint.port);
+}
+
+bool clear_stale_socket(const StreamEndpoint &endpoint)
+{
+    if (!endpoint.unix_socket)
+        return true;
+    const char *path = endpoint.address.c_str();
+    struct stat st;
+    if (lstat(path, &st) == -1)
+        return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "'%s' exists and is not a socket\n", path);
+        return false;
+    }
+    sockaddr_storage addr;
+    socklen_t length;
+    endpoint_address(endpoint, false, addr, length);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    bool live = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), length) == 0;
+    close(fd);
+    if (live) {
+        fprintf(stderr, "'%s' is in use by another process\n", path);
+        return false;
+    }
+    unlink(path); // Left by a run that is gone.
+    return true;
+}
+
+StreamClient::~StreamClient()
+{
+    if (fd != -1)
+        close(fd);
+}
+
+bool StreamClient::connect(const std::string &spec, double max_fps)
+{
+    StreamEndpoint endpoint;
+    sockaddr_storage addr;
+    socklen_t length;
+    if (!parse_endpoint(spec, endpoint)) {
+        fprintf(stderr, "Bad endpoint '%s'\n", spec.c_str());
+        return false;
+    }
+    if (!endpoint_address(endpoint, false, addr, length))
+        return false;
+    fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 ||
+        ::connect(fd, reinterpret_cast<sockaddr*>(&addr), length) == -1) {
+        fprintf(stderr, "Cannot connect to '%s': %d, %s\n", spec.c_str(),
+                errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        fd = -1;
+        return false;
+    }
+    StreamHello hello;
+    hello.magic = VCAP_HELLO_MAGIC;
+    hello.max_mfps = static_cast<uint32_t>(max_fps * 1000);
+    hello.window = window;
+    if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(sizeof(hello))) {
+        fprintf(stderr, "Cannot send to '%s': %d, %s\n", spec.c_str(),
+                errno, strerror(errno));
+        return false;
+    }
+    received = 0;
+    return true;
+}
+
+bool StreamClient::receive(void *data, size_t bytes)
+{
+    uint8_t *p = static_cast<uint8_t*>(data);
+    while (bytes > 0) {
+        ssize_t n = recv(fd, p, bytes, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+bool StreamClient::read(Frame &frame, StreamHeader &header)
+{
+    frame.clear();
+    if (fd == -1)
+        return false;
+    // Ready for another: the server sends the newest frame there is then.
+    const uint8_t ack = 1;
+    if (received++ > 0 && send(fd, &ack, 1, MSG_NOSIGNAL) != 1)
+        return false;
+    if (!receive(&header, sizeof(header)))
+        return false;
+    if (header.magic != VCAP_STREAM_MAGIC || header.rows < 0 ||
+        header.cols < 0) {
+        fprintf(stderr, "Stream is out of step\n");
+        return false;
+    }
+    // Both buffers are kept, so a steady stream reallocates nothing.
+    image.create(header.rows, header.cols, header.type);
+    if (header.codec == CODEC_NONE) {
+        if (header.bytes != image.total() * image.elemSize()) {
+            fprintf(stderr, "Frame of %u bytes doesn't fit %dx%d\n",
+                    header.bytes, header.cols, header.rows);
+            return false;
+        }
+        if (!receive(image.data, header.bytes))
+            return false;
+    } else {
+        if (payload.size() < header.bytes)
+            payload.resize(header.bytes);
+        if (!receive(payload.data(), header.bytes))
+            return false;
+        if (!decode_frame(static_cast<frame_codec>(header.codec),
+                          payload.data(), header.bytes, image)) {
+            fprintf(stderr, "Cannot decode frame %u\n", header.sequence);
+            return false;
+        }
+    }
+    frame.image = image;
+    frame.timestamp.tv_sec = header.timestamp_us / 1000000;
+    frame.timestamp.tv_usec = header.timestamp_us % 1000000;
+    frame.sequence = header.sequence;
+    frame.camera = header.camera;
+    frame.view = header.view;
+    return true;
+}
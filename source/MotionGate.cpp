@@ -0,0 +1,237 @@
+#include <MotionGate.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static const int ROW_STEP = 4; // Rows measured: every 4th.
+static const int BLOCK = 8; // Pixels summed per block.
+
+void gate_thumbnail(const cv::Mat &image, std::vector<uint16_t> &thumb)
+{
+    const int blocks = image.cols / BLOCK;
+    thumb.resize(static_cast<size_t>((image.rows + ROW_STEP - 1) / ROW_STEP) *
+                 blocks);
+    uint16_t *out = thumb.data();
+    for (int y = 0; y < image.rows; y += ROW_STEP, out += blocks) {
+        const uint8_t *row = image.ptr<uint8_t>(y);
+        int b = 0;
+#ifdef __SSE2__
+        // psadbw against zero sums each 8 bytes into a 64-bit lane.
+        const __m128i zero = _mm_setzero_si128();
+        for (; b + 2 <= blocks; b += 2) {
+            __m128i sums = _mm_sad_epu8(_mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(row + b * BLOCK)), zero);
+            out[b] = static_cast<uint16_t>(_mm_extract_epi16(sums, 0));
+            out[b + 1] = static_cast<uint16_t>(_mm_extract_epi16(sums, 4));
+        }
+#endif
+        for (; b < blocks; ++b) {
+            unsigned int sum = 0;
+            for (int x = 0; x < BLOCK; ++x)
+                sum += row[b * BLOCK + x];
+            out[b] = static_cast<uint16_t>(sum);
+        }
+    }
+}
+
+size_t gate_changed(const std::vector<uint16_t> &a,
+                    const std::vector<uint16_t> &b, unsigned int max_diff)
+{
+    const size_t n = std::min(a.size(), b.size());
+    size_t changed = 0, i = 0;
+#ifdef __SSE2__
+    // Sums are at most 2040, so signed 16-bit compares are safe.
+    const __m128i limit = _mm_set1_epi16(static_cast<short>(max_diff));
+    for (; i + 8 <= n; i += 8) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&a[i]));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&b[i]));
+        __m128i diff = _mm_or_si128(_mm_subs_epu16(x, y),
+                                    _mm_subs_epu16(y, x));
+        int mask = _mm_movemask_epi8(_mm_cmpgt_epi16(diff, limit));
+        changed += __builtin_popcount(mask) / 2;
+    }
+#endif
+    for (; i < n; ++i) {
+        unsigned int diff = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        changed += diff > max_diff;
+    }
+    return changed;
+}
+
+static int64_t timestamp_us(const Frame &frame)
+{
+    return static_cast<int64_t>(frame.timestamp.tv_sec) * 1000000 +
+           frame.timestamp.tv_usec;
+}
+
+MotionGate::MotionGate(const GateConfig &config)
+: config(config), threshold(config.threshold), frames(0), skipped(0),
+  held_frames(0), bytes_seen(0), bytes_skipped(0), last_change(0),
+  metric_ns(0), measured(0)
+{
+    for (std::atomic_ulong &w : written)
+        w = 0;
+    if (!config.log.empty()) {
+        log = fopen(config.log.c_str(), "w");
+        if (!log)
+            fprintf(stderr, "Cannot open gate log '%s': %d, %s\n",
+                    config.log.c_str(), errno, strerror(errno));
+        else
+            fprintf(log, "timestamp_us,sequence,camera,change_pct,"
+                         "decision\n");
+    }
+}
+
+MotionGate::~MotionGate()
+{
+    reset();
+    if (log)
+        fclose(log);
+}
+
+const char *MotionGate::decision_name(gate_decision d)
+{
+    static const char *names[] = {"skip", "change", "pre", "post", "keep"};
+    return d < GATE_DECISIONS ? names[d] : "?";
+}
+
+double MotionGate::measure(const Frame &frame)
+{
+    const cv::Mat &image = frame.image;
+    if (image.type() != CV_8UC1 || image.cols < BLOCK)
+        return 100;
+    int64_t start = monotonic_ns();
+    gate_thumbnail(image, thumb);
+    std::vector<uint16_t> &ref = reference[frame.camera];
+    double change = 100;
+    if (ref.size() == thumb.size())
+        change = 100.0 * gate_changed(thumb, ref, config.level * BLOCK) /
+                 thumb.size();
+    metric_ns += monotonic_ns() - start;
+    ++measured;
+    return change;
+}
+
+void MotionGate::log_frame(const Frame &frame, double change,
+                           gate_decision d)
+{
+    if (log)
+        fprintf(log, "%lld,%u,%u,%.3f,%s\n",
+                static_cast<long long>(timestamp_us(frame)), frame.sequence,
+                frame.camera, change, decision_name(d));
+}
+
+void MotionGate::keep(Group &group, gate_decision d, std::vector<Frame> &out)
+{
+    for (size_t i = 0; i < group.frames.size(); ++i) {
+        Frame &frame = group.frames[i];
+        if (d == GATE_PRE)
+            log_frame(frame, group.change[i], d);
+        // What is written becomes the reference to measure change from.
+        if (frame.image.type() == CV_8UC1 && frame.image.cols >= BLOCK)
+            gate_thumbnail(frame.image, reference[frame.camera]);
+        out.push_back(std::move(frame));
+    }
+    written[d] += group.frames.size();
+    if (!group.frames.empty())
+        last_written_us = timestamp_us(out.back());
+}
+
+void MotionGate::drop(Group &group)
+{
+    for (Frame &frame : group.frames)
+        bytes_skipped += frame.image.total() * frame.image.elemSize();
+    skipped += group.frames.size();
+}
+
+void MotionGate::process(Frame *frames_in, size_t n, std::vector<Frame> &out)
+{
+    if (n == 0)
+        return;
+    Group group;
+    double change = 0;
+    for (size_t i = 0; i < n; ++i) {
+        double c = measure(frames_in[i]);
+        group.change.push_back(c);
+        change = std::max(change, c);
+        bytes_seen += frames_in[i].image.total() *
+                      frames_in[i].image.elemSize();
+    }
+    frames += n;
+    last_change = change;
+    const int64_t now_us = timestamp_us(frames_in[0]);
+
+    gate_decision d = GATE_SKIP;
+    if (idle || change >= threshold) {
+        d = GATE_CHANGE;
+        post_left = config.post;
+    } else if (post_left > 0) {
+        d = GATE_POST;
+        --post_left;
+    } else if (config.keep_fps > 0 &&
+               now_us - last_written_us >= 1e6 / config.keep_fps) {
+        d = GATE_KEEP;
+    }
+    idle = false;
+    for (size_t i = 0; i < n; ++i)
+        log_frame(frames_in[i], group.change[i], d);
+    for (size_t i = 0; i < n; ++i)
+        group.frames.push_back(std::move(frames_in[i]));
+
+    if (d == GATE_SKIP) {
+        held.push_back(std::move(group));
+        held_frames += n;
+        while (held.size() > config.pre) {
+            held_frames -= held.front().frames.size();
+            drop(held.front());
+            held.pop_front();
+        }
+        if (log)
+            fflush(log);
+        return;
+    }
+    if (d == GATE_CHANGE) {
+        for (Group &g : held)
+            keep(g, GATE_PRE, out);
+    } else {
+        for (Group &g : held)
+            drop(g);
+    }
+    held.clear();
+    held_frames = 0;
+    keep(group, d, out);
+}
+
+void MotionGate::reset()
+{
+    for (Group &g : held)
+        drop(g);
+    held.clear();
+    held_frames = 0;
+    reference.clear();
+    post_left = 0;
+    idle = true;
+    if (log)
+        fflush(log);
+}
+
+GateStatus MotionGate::status()
+{
+    GateStatus s;
+    s.threshold = threshold;
+    s.frames = frames;
+    for (int d = 0; d < GATE_DECISIONS; ++d)
+        s.written[d] = written[d];
+    s.skipped = skipped;
+    s.held = held_frames;
+    s.bytes_seen = bytes_seen;
+    s.bytes_skipped = bytes_skipped;
+    s.last_change = last_change;
+    s.metric_us = measured ? metric_ns / 1e3 / measured : 0;
+    return s;
+}
@@ -0,0 +1,147 @@
+#include <PipelineStats.hpp>
+
+#include <algorithm>
+
+extern "C" {
+#include <time.h>
+}
+
+int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int64_t timeval_ns(const struct timeval &tv)
+{
+    return static_cast<int64_t>(tv.tv_sec) * 1000000000 +
+           static_cast<int64_t>(tv.tv_usec) * 1000;
+}
+
+int latency_histogram::bucket_of(uint64_t v)
+{
+    // Values below 2^SUB_BITS get a bucket each; above, a value with its top
+    // bit at position e is shifted down to keep SUB_BITS significant bits,
+    // and the shift picks the octave.
+    if (v < (1u << SUB_BITS))
+        return static_cast<int>(v);
+    int e = 63 - __builtin_clzll(v);
+    int shift = e - SUB_BITS + 1;
+    return (shift << (SUB_BITS - 1)) + static_cast<int>(v >> shift);
+}
+
+int64_t latency_histogram::value_of(int bucket)
+{
+    if (bucket < (1 << SUB_BITS))
+        return bucket;
+    int shift = (bucket >> (SUB_BITS - 1)) - 1;
+    int64_t mantissa = bucket - (shift << (SUB_BITS - 1));
+    return (mantissa << shift) + ((int64_t(1) << shift) >> 1);
+}
+
+void latency_histogram::record(int64_t ns)
+{
+    if (ns < 0) // Clock skew between the driver and us.
+        ns = 0;
+    buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    total_ns.fetch_add(ns, std::memory_order_relaxed);
+    int64_t old = peak.load(std::memory_order_relaxed);
+    while (ns > old &&
+           !peak.compare_exchange_weak(old, ns, std::memory_order_relaxed)) {}
+}
+
+void latency_histogram::reset()
+{
+    for (int i = 0; i < BUCKETS; ++i)
+        buckets[i].store(0, std::memory_order_relaxed);
+    total.store(0, std::memory_order_relaxed);
+    total_ns.store(0, std::memory_order_relaxed);
+    peak.store(0, std::memory_order_relaxed);
+}
+
+int64_t latency_histogram::percentile(double p) const
+{
+    uint64_t n = count();
+    if (n == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * n + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return std::min(value_of(i), max());
+    }
+    return max();
+}
+
+void PipelineStats::reset()
+{
+    for (latency_histogram &h : stages)
+        h.reset();
+    dropped = 0;
+    gaps = 0;
+    ring_high = 0;
+}
+
+void PipelineStats::stamp(Frame &frame, frame_stage stage)
+{
+    if (!enabled())
+        return;
+    int64_t now = monotonic_ns();
+    frame.stamps[stage] = now;
+    if (stage > 0 && frame.stamps[stage - 1] != 0)
+        stages[stage].record(now - frame.stamps[stage - 1]);
+    if (stage == STAGE_WRITE) {
+        int64_t first = frame.stamps[STAGE_DRIVER] ? frame.stamps[STAGE_DRIVER]
+                                                   : frame.stamps[STAGE_DEQUEUE];
+        if (first != 0)
+            stages[STAGE_COUNT].record(now - first);
+    }
+}
+
+unsigned long drop_counter::update(uint32_t seq)
+{
+    unsigned long missing = 0;
+    if (have_last && seq > last + 1)
+        missing = seq - last - 1;
+    last = seq;
+    have_last = true;
+    return missing;
+}
+
+void PipelineStats::add_drops(unsigned long frames)
+{
+    dropped += frames;
+    ++gaps;
+}
+
+void PipelineStats::ring_depth(size_t frames)
+{
+    size_t old = ring_high.load(std::memory_order_relaxed);
+    while (frames > old &&
+           !ring_high.compare_exchange_weak(old, frames,
+                                            std::memory_order_relaxed)) {}
+}
+
+StageSummary PipelineStats::summary(int histogram) const
+{
+    const latency_histogram &h = stages[histogram];
+    StageSummary s;
+    s.count = h.count();
+    s.sum_us = h.sum() * 1e-3;
+    s.p50_us = h.percentile(50) * 1e-3;
+    s.p99_us = h.percentile(99) * 1e-3;
+    s.max_us = h.max() * 1e-3;
+    return s;
+}
+
+const char *PipelineStats::stage_name(int histogram)
+{
+    static const char *names[] = {
+        "driver", "dqbuf", "push", "pop", "encode", "write", "total"};
+    return names[histogram];
+}
@@ -0,0 +1,189 @@
+/*
+Plays back a .vcap recording straight from its memory-mapped segments.
+
+    vcap_play [-x SPEED] [-t SECONDS | -f SEQUENCE] [-w FRAMES] [-n] BASE
+
+BASE is the recording prefix (without '.vidx'). Frames are shown at their
+recorded pace scaled by SPEED (default 1; 0 starts paused, stepping a frame
+at a time), from SECONDS into the recording or from frame SEQUENCE. Frames
+that fall behind the clock are skipped rather than played late. The next
+FRAMES frames in the direction of play are prefetched (default 64).
+
+While playing:
+
+    space   pause / resume          + -     double / halve the speed
+    . ,     step a frame fwd/back   ] [     seek 1 s forward / back
+    } {     seek 10 s fwd/back      q, Esc  quit
+
+Each camera, and each half of a stereo recording, has a window of its own.
+-n plays without windows, e.g. on a headless machine, and only reports how
+well playback kept time; there SPEED 0 plays as fast as frames can be read.
+*/
+#include <RecordMap.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <getopt.h>
+}
+
+#include <opencv2/highgui.hpp>
+
+typedef std::chrono::steady_clock play_clock;
+
+static std::string window_name(const Frame &frame)
+{
+    static const char *views[] = {"", " L", " R", ""};
+    return "Camera " + std::to_string(frame.camera) +
+           views[frame.view & ~VIEW_RECTIFIED & 3] +
+           (frame.view & VIEW_RECTIFIED ? " rectified" : "");
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1, start_s = -1;
+    long start_seq = -1, window = 64;
+    bool display = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "x:t:f:w:nh")) != -1) {
+        switch (c) {
+        case 'x': speed = std::max(atof(optarg), 0.0); break;
+        case 't': start_s = atof(optarg); break;
+        case 'f': start_seq = atol(optarg); break;
+        case 'w': window = std::max(atol(optarg), 1L); break;
+        case 'n': display = false; break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-x SPEED] "
+                      << "[-t SECONDS | -f SEQUENCE] [-w FRAMES] [-n] BASE"
+                      << std::endl;
+            return c == 'h' ? 0 : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "No recording given" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    RecordMap rec(argv[optind]);
+    if (!rec.is_open())
+        return EXIT_FAILURE;
+    if (rec.size() == 0) {
+        std::cout << "Recording is empty" << std::endl;
+        return 0;
+    }
+    size_t pos = 0;
+    if (start_seq >= 0)
+        pos = rec.seek_sequence(start_seq);
+    else if (start_s > 0)
+        pos = rec.seek_time(rec.first_us() +
+                            static_cast<int64_t>(start_s * 1e6));
+    if (pos >= rec.size()) {
+        std::cerr << "Start is past the end of the recording" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << rec.size() << " frames, "
+              << (rec.last_us() - rec.first_us()) / 1e6 << " s, starting at "
+              << (rec.entry(pos).timestamp_us - rec.first_us()) / 1e6 << " s"
+              << std::endl;
+
+    bool paused = display && speed == 0;
+    if (paused)
+        speed = 1;
+    int direction = 1;
+    // Playback time runs from this frame, re-anchored whenever it jumps.
+    play_clock::time_point anchor_wall = play_clock::now();
+    int64_t anchor_us = rec.entry(pos).timestamp_us;
+    size_t prefetched = pos; // Prefetch again once playback gets here.
+    unsigned long shown = 0, skipped = 0, late = 0;
+    auto started = play_clock::now();
+    int64_t played_from = anchor_us;
+    Frame frame;
+
+    while (pos < rec.size()) {
+        if (pos == prefetched) {
+            rec.prefetch(pos, direction * window);
+            long ahead = direction * window / 2;
+            prefetched = static_cast<long>(pos) + ahead < 0 ? 0 : pos + ahead;
+        }
+        const int64_t ts = rec.entry(pos).timestamp_us;
+        const bool realtime = !paused && speed > 0;
+        auto due_at = [&](int64_t us) {
+            return anchor_wall + std::chrono::microseconds(
+                static_cast<int64_t>((us - anchor_us) / speed));
+        };
+        auto due = realtime ? due_at(ts) : anchor_wall;
+        auto now = play_clock::now();
+
+        // Behind by more than a frame: drop this one if the next is due too.
+        bool skip = realtime && now > due && pos + 1 < rec.size() &&
+                    now > due_at(rec.entry(pos + 1).timestamp_us);
+        if (skip) {
+            ++skipped;
+        } else if (rec.read(pos, frame)) {
+            if (realtime && now < due)
+                std::this_thread::sleep_until(due);
+            else if (realtime && now - due > std::chrono::milliseconds(1))
+                ++late;
+            if (display)
+                cv::imshow(window_name(frame), frame.image);
+            ++shown;
+        }
+
+        int key = -1;
+        if (display)
+            key = cv::waitKey(paused ? 0 : 1);
+        size_t next = paused ? pos : pos + 1;
+        switch (key) {
+        case ' ': paused = !paused; break;
+        case '.':
+            paused = true;
+            next = std::min(pos + 1, rec.size() - 1);
+            break;
+        case ',': paused = true; next = pos ? pos - 1 : 0; break;
+        case '+': speed *= 2; break;
+        case '-': speed /= 2; break;
+        case ']': case '[': case '}': case '{': {
+            int64_t step = (key == ']' || key == '[') ? 1000000 : 10000000;
+            if (key == '[' || key == '{')
+                step = -step;
+            next = rec.seek_time(ts + step);
+            if (next >= rec.size())
+                next = rec.size() - 1;
+            break;
+        }
+        case 'q': case 27:
+            next = rec.size();
+            break;
+        }
+        if (key != -1 && next < rec.size()) {
+            int d = next < pos ? -1 : 1;
+            if (d != direction || (next != pos && next != pos + 1)) {
+                direction = d;
+                prefetched = next;
+            }
+            anchor_wall = play_clock::now();
+            anchor_us = rec.entry(next).timestamp_us;
+            if (key == ',' || key == '.' || key == ' ')
+                std::cout << "Frame " << rec.entry(next).sequence << " at "
+                          << (anchor_us - rec.first_us()) / 1e6 << " s"
+                          << std::endl;
+        }
+        pos = next;
+    }
+
+    double wall = std::chrono::duration<double>(play_clock::now() - started)
+                      .count();
+    double recorded = (rec.entry(std::min(pos, rec.size() - 1)).timestamp_us -
+                       played_from) / 1e6;
+    std::cout << "Played " << recorded << " s of recording in " << wall
+              << " s: " << shown << " frames shown, " << skipped
+              << " skipped, " << late << " late" << std::endl;
+    return 0;
+}
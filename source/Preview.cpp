@@ -0,0 +1,99 @@
+#include <Preview.hpp>
+#include <RealTime.hpp>
+
+#include <chrono>
+#include <vector>
+
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
+
+Preview::Preview(const PreviewConfig &config, unsigned int cameras)
+: config(config), cameras(cameras), slots(new Slot[cameras])
+{
+    if (this->config.fps <= 0)
+        this->config.fps = 30;
+    if (this->config.scale <= 0 || this->config.scale > 1)
+        this->config.scale = 1;
+    thread = std::thread(&Preview::run, this);
+    if (!this->config.cpus.empty())
+        pin_thread(thread, this->config.cpus);
+}
+
+Preview::~Preview()
+{
+    {
+        std::lock_guard<std::mutex> lock(stop_mutex);
+        stopping = true;
+    }
+    stop_cond.notify_all();
+    thread.join();
+    clear();
+}
+
+std::string Preview::window_name(unsigned int camera)
+{
+    return camera == 0 ? "Frame" : "Frame " + std::to_string(camera);
+}
+
+void Preview::offer(unsigned int camera, const Frame &frame)
+{
+    if (camera >= cameras)
+        return;
+    Slot &slot = slots[camera];
+    // The preview thread only holds the slot for a copy; if it is in there
+    // now, this frame is simply not shown.
+    std::unique_lock<std::mutex> lock(slot.mutex, std::try_to_lock);
+    if (lock.owns_lock())
+        slot.frame = frame;
+}
+
+void Preview::clear()
+{
+    for (unsigned int i = 0; i < cameras; ++i) {
+        std::lock_guard<std::mutex> lock(slots[i].mutex);
+        slots[i].frame.clear();
+    }
+}
+
+void Preview::run()
+{
+    typedef std::chrono::steady_clock clock;
+    const auto period = std::chrono::microseconds(
+        static_cast<long>(1e6 / config.fps));
+    std::vector<cv::Mat> shown(cameras);
+    auto next = clock::now();
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            if (stop_cond.wait_until(lock, next, [this] { return stopping; }))
+                break;
+        }
+        next += period;
+        if (next < clock::now())
+            next = clock::now() + period; // Fell behind, don't try to catch up.
+
+        for (unsigned int i = 0; i < cameras; ++i) {
+            Slot &slot = slots[i];
+            bool fresh = false;
+            {
+                // Copy out under the lock, so the lease goes back with it.
+                std::lock_guard<std::mutex> lock(slot.mutex);
+                if (!slot.frame.image.empty()) {
+                    if (config.scale < 1)
+                        cv::resize(slot.frame.image, shown[i], cv::Size(),
+                                   config.scale, config.scale,
+                                   cv::INTER_AREA);
+                    else
+                        slot.frame.image.copyTo(shown[i]);
+                    slot.frame.clear();
+                    fresh = true;
+                }
+            }
+            if (fresh)
+                cv::imshow(window_name(i), shown[i]);
+        }
+        cv::waitKey(1);
+    }
+    cv::destroyAllWindows();
+}
@@ -0,0 +1,198 @@
+#include <RealTime.hpp>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+extern "C" {
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+}
+
+bool parse_cpu_list(const std::string &list, std::vector<int> &cpus)
+{
+    // Accepts e.g. "2,3,6-7".
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int first, last;
+        if (sscanf(item.c_str(), "%d-%d", &first, &last) == 2) {
+            if (first < 0 || last < first)
+                return false;
+            for (int c = first; c <= last; ++c)
+                cpus.push_back(c);
+        } else if (sscanf(item.c_str(), "%d", &first) == 1 && first >= 0) {
+            cpus.push_back(first);
+        } else {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+std::string format_cpu_list(const std::vector<int> &cpus)
+{
+    std::string list;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            ++j;
+        if (!list.empty())
+            list += ",";
+        list += std::to_string(cpus[i]);
+        if (j > i)
+            list += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return list;
+}
+
+bool pin_thread(std::thread &thread, int cpu)
+{
+    return pin_thread(thread, std::vector<int>(1, cpu));
+}
+
+bool pin_thread(std::thread &thread, const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "Cannot pin thread to CPU %s: %s\n",
+                format_cpu_list(cpus).c_str(), strerror(err));
+        return false;
+    }
+    return true;
+}
+
+bool set_fifo(std::thread &thread, int priority)
+{
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    int err = pthread_setschedparam(thread.native_handle(), SCHED_FIFO, &param);
+    if (err != 0) {
+        fprintf(stderr, "Cannot run thread as SCHED_FIFO %d: %s\n",
+                priority, strerror(err));
+        return false;
+    }
+    return true;
+}
+
+std::string describe_thread(std::thread &thread)
+{
+    std::string s;
+    cpu_set_t set;
+    if (pthread_getaffinity_np(thread.native_handle(), sizeof(set), &set) == 0) {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &set))
+                cpus.push_back(cpu);
+        s = "CPUs " + format_cpu_list(cpus);
+    }
+    int policy;
+    struct sched_param param;
+    if (pthread_getschedparam(thread.native_handle(), &policy, &param) == 0) {
+        s += s.empty() ? "" : ", ";
+        if (policy == SCHED_FIFO)
+            s += "SCHED_FIFO " + std::to_string(param.sched_priority);
+        else if (policy == SCHED_RR)
+            s += "SCHED_RR " + std::to_string(param.sched_priority);
+        else
+            s += "SCHED_OTHER";
+    }
+    return s;
+}
+
+bool lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Cannot lock memory: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+std::string describe_memory()
+{
+    // What the kernel says is locked, whichever way it got locked.
+    std::ifstream status("/proc/self/status");
+    std::string line, locked = "?";
+    while (std::getline(status, line))
+        if (line.compare(0, 6, "VmLck:") == 0)
+            locked = line.substr(line.find_first_not_of(" \t", 6));
+    struct rlimit limit;
+    std::string max = "?";
+    if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0)
+        max = limit.rlim_cur == RLIM_INFINITY
+            ? "unlimited" : std::to_string(limit.rlim_cur >> 10) + " kB";
+    return locked + " locked (limit " + max + ")";
+}
+
+void prefault_stack(size_t bytes)
+{
+    // Touching the pages now faults them in, and with mlockall() keeps them.
+    volatile unsigned char *stack =
+        static_cast<unsigned char*>(alloca(bytes));
+    for (size_t i = 0; i < bytes; i += 4096)
+        stack[i] = 0;
+}
+
+cpu_load::cpu_load(int threads)
+: running(true)
+{
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    bool pinned = threads < 0;
+    unsigned int n = pinned ? (online > 0 ? online : 1) : threads;
+    for (unsigned int i = 0; i < n; ++i) {
+        workers.push_back(std::thread([this] {
+            volatile unsigned long spin = 0;
+            while (running.load(std::memory_order_relaxed))
+                ++spin;
+        }));
+        if (pinned)
+            pin_thread(workers.back(), static_cast<int>(i));
+    }
+}
+
+cpu_load::~cpu_load()
+{
+    running = false;
+    for (std::thread &t : workers)
+        t.join();
+}
+
+void interval_stats::record(int64_t ns)
+{
+    histogram.record(ns);
+    std::lock_guard<std::mutex> lock(mutex);
+    ++count;
+    double delta = ns - mean;
+    mean += delta / count;
+    m2 += delta * (ns - mean);
+}
+
+IntervalSummary interval_stats::summary() const
+{
+    IntervalSummary s;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        s.count = count;
+        s.mean_us = mean / 1e3;
+        s.stddev_us = count > 1 ? std::sqrt(m2 / (count - 1)) / 1e3 : 0;
+    }
+    s.p50_us = histogram.percentile(50) / 1e3;
+    s.p99_us = histogram.percentile(99) / 1e3;
+    s.max_us = histogram.max() / 1e3;
+    return s;
+}
@@ -0,0 +1,212 @@
+#include <RecordMap.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+
+static bool map_file(const std::string &path, int advice, unsigned char *&data,
+                     size_t &bytes)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                path.c_str(), errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+    bytes = st.st_size;
+    void *p = bytes ? mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0)
+                    : MAP_FAILED;
+    close(fd); // The mapping keeps the file open.
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Cannot map '%s': %d, %s\n",
+                path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    data = static_cast<unsigned char*>(p);
+    madvise(data, bytes, advice);
+    return true;
+}
+
+static void will_need(const unsigned char *data, size_t bytes)
+{
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = reinterpret_cast<uintptr_t>(data) & ~(page - 1);
+    madvise(reinterpret_cast<void*>(start),
+            bytes + (reinterpret_cast<uintptr_t>(data) - start),
+            MADV_WILLNEED);
+}
+
+RecordMap::RecordMap(const std::string &base)
+: base(base)
+{
+    std::string path = index_path(base);
+    if (!map_file(path, MADV_SEQUENTIAL, index.data, index.bytes))
+        return;
+    const IndexHeader *header =
+        reinterpret_cast<const IndexHeader*>(index.data);
+    if (index.bytes < sizeof(IndexHeader) ||
+        header->magic != VCAP_INDEX_MAGIC ||
+        header->entry_bytes != sizeof(IndexEntry)) {
+        fprintf(stderr, "'%s' is not a recording index\n", path.c_str());
+        return;
+    }
+    entries = reinterpret_cast<const IndexEntry*>(index.data + sizeof(*header));
+    // A recording still being written may end in a partial entry.
+    count = (index.bytes - sizeof(*header)) / sizeof(IndexEntry);
+
+    // Records are indexed in write order, which is capture order unless
+    // several cameras were interleaved.
+    bool sorted = true;
+    for (size_t i = 1; i < count && sorted; ++i)
+        sorted = entries[i].timestamp_us >= entries[i - 1].timestamp_us;
+    if (!sorted) {
+        by_time.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            by_time[i] = i;
+        std::stable_sort(by_time.begin(), by_time.end(),
+                         [this](uint32_t a, uint32_t b) {
+            return entries[a].timestamp_us < entries[b].timestamp_us;
+        });
+        position.resize(count);
+        for (size_t p = 0; p < count; ++p)
+            position[by_time[p]] = p;
+    }
+    opened = true;
+}
+
+RecordMap::~RecordMap()
+{
+    for (Mapping &m : segments)
+        if (m.data)
+            munmap(m.data, m.bytes);
+    if (index.data)
+        munmap(index.data, index.bytes);
+}
+
+const unsigned char *RecordMap::record_data(const IndexEntry &entry)
+{
+    if (entry.segment >= segments.size())
+        segments.resize(entry.segment + 1);
+    Mapping &m = segments[entry.segment];
+    if (!m.tried) {
+        m.tried = true;
+        // Playback decides what to read ahead, see prefetch().
+        if (!map_file(segment_path(base, entry.segment), MADV_RANDOM,
+                      m.data, m.bytes))
+            m.data = nullptr;
+    }
+    if (!m.data || entry.offset + entry.record_bytes > m.bytes)
+        return nullptr;
+    return m.data + entry.offset;
+}
+
+bool RecordMap::read(size_t pos, Frame &frame)
+{
+    frame.clear();
+    if (pos >= count)
+        return false;
+
+    const IndexEntry &entry = this->entry(pos);
+    const unsigned char *data = record_data(entry);
+    const RecordHeader *header = reinterpret_cast<const RecordHeader*>(data);
+    if (!data || header->magic != VCAP_RECORD_MAGIC ||
+        header->header_bytes + header->payload_bytes > entry.record_bytes) {
+        fprintf(stderr, "Bad record at %zu in '%s'\n", pos, base.c_str());
+        return false;
+    }
+    const int type = record_type(*header);
+    if (type < 0) {
+        fprintf(stderr, "Unsupported record format in '%s'\n", base.c_str());
+        return false;
+    }
+    const unsigned char *payload = data + header->header_bytes;
+    if (header->codec == CODEC_NONE) {
+        // PROT_READ: anything that tries to write to it faults.
+        frame.image = cv::Mat(header->height, header->width, type,
+                              const_cast<unsigned char*>(payload),
+                              header->stride);
+    } else {
+        frame.image.create(header->height, header->width, type);
+        if (!decode_frame(static_cast<frame_codec>(header->codec), payload,
+                          header->payload_bytes, frame.image)) {
+            fprintf(stderr, "Cannot decode record at %zu in '%s'\n",
+                    pos, base.c_str());
+            frame.clear();
+            return false;
+        }
+    }
+    frame.timestamp.tv_sec = header->timestamp_us / 1000000;
+    frame.timestamp.tv_usec = header->timestamp_us % 1000000;
+    frame.sequence = static_cast<uint32_t>(header->sequence);
+    frame.camera = header->camera;
+    frame.view = header->view;
+    return true;
+}
+
+size_t RecordMap::seek_time(int64_t timestamp_us) const
+{
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (entry(mid).timestamp_us < timestamp_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+size_t RecordMap::seek_sequence(uint64_t sequence) const
+{
+    // Sequence numbers increase in index (write) order.
+    const IndexEntry *it = std::lower_bound(
+        entries, entries + count, sequence,
+        [](const IndexEntry &e, uint64_t s) { return e.sequence < s; });
+    size_t r = it - entries;
+    if (r == count || by_time.empty())
+        return r;
+    return position[r];
+}
+
+void RecordMap::prefetch(size_t pos, long frames)
+{
+    if (pos >= count || frames == 0)
+        return;
+    size_t first = pos, last = pos;
+    if (frames > 0)
+        last = std::min(count - 1, pos + frames - 1);
+    else
+        first = static_cast<size_t>(-frames) > pos ? 0 : pos + frames + 1;
+
+    // Records of neighbouring frames are usually adjacent in a segment, so
+    // runs of them go in one call.
+    const unsigned char *run = nullptr;
+    size_t run_bytes = 0;
+    for (size_t p = first; p <= last; ++p) {
+        const IndexEntry &e = entry(p);
+        const unsigned char *data = record_data(e);
+        if (!data)
+            continue;
+        if (run && data == run + run_bytes) {
+            run_bytes += e.record_bytes;
+            continue;
+        }
+        if (run)
+            will_need(run, run_bytes);
+        run = data;
+        run_bytes = e.record_bytes;
+    }
+    if (run)
+        will_need(run, run_bytes);
+}
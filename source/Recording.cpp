@@ -0,0 +1,402 @@
+#include <Recording.hpp>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <linux/videodev2.h>
+}
+
+static size_t align_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+std::string segment_path(const std::string &base, unsigned int segment)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".%04u.vcap", segment);
+    return base + suffix;
+}
+
+std::string index_path(const std::string &base)
+{
+    return base + ".vidx";
+}
+
+std::string pgm_name(int64_t timestamp_us, uint64_t sequence,
+                     unsigned int camera, unsigned int view)
+{
+    std::string name = std::to_string(timestamp_us) + "_" +
+                       std::to_string(sequence);
+    if (camera > 0)
+        name += "_cam" + std::to_string(camera);
+    if ((view & ~VIEW_RECTIFIED) == VIEW_LEFT)
+        name += "_L";
+    else if ((view & ~VIEW_RECTIFIED) == VIEW_RIGHT)
+        name += "_R";
+    if (view & VIEW_RECTIFIED)
+        name += "_rect";
+    return name + ".pgm";
+}
+
+RecordWriter::RecordWriter(const RecordingConfig &config)
+: config(config)
+{
+    this->config.staging_bytes = align_up(config.staging_bytes, VCAP_ALIGN);
+    backend = make_backend(config.backend, this->config.staging_bytes,
+                           config.io_depth);
+    staging = backend->acquire();
+
+    std::string path = index_path(config.base);
+    index = fopen(path.c_str(), "wb");
+    if (!index) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                path.c_str(), errno, strerror(errno));
+        failed = true;
+        return;
+    }
+    IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = VCAP_INDEX_MAGIC;
+    header.version = VCAP_VERSION;
+    header.entry_bytes = sizeof(IndexEntry);
+    fwrite(&header, sizeof(header), 1, index);
+}
+
+RecordWriter::~RecordWriter()
+{
+    close();
+}
+
+void RecordWriter::open_segment()
+{
+    std::string path = segment_path(config.base, segment);
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    fd = -1;
+    if (config.direct_io) {
+        fd = open(path.c_str(), flags | O_DIRECT, 0644);
+        // tmpfs and some other filesystems refuse O_DIRECT.
+        if (fd == -1 && errno == EINVAL) {
+            fprintf(stderr, "O_DIRECT not supported for '%s', using "
+                    "buffered I/O\n", path.c_str());
+            config.direct_io = false;
+        }
+    }
+    if (fd == -1)
+        fd = open(path.c_str(), flags, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                path.c_str(), errno, strerror(errno));
+        failed = true;
+        return;
+    }
+    // Reserve the whole segment up front so appends don't allocate blocks.
+    // Not every filesystem supports it, which is harmless.
+    posix_fallocate(fd, 0, config.segment_bytes);
+
+    SegmentHeader header;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    memset(staging, 0, VCAP_ALIGN);
+    memset(&header, 0, sizeof(header));
+    header.magic = VCAP_SEGMENT_MAGIC;
+    header.version = VCAP_VERSION;
+    header.segment = segment;
+    header.align = VCAP_ALIGN;
+    header.created_us = static_cast<uint64_t>(tv.tv_sec) * 1000000 +
+                        tv.tv_usec;
+    memcpy(staging, &header, sizeof(header));
+    staged = VCAP_ALIGN;
+    offset = VCAP_ALIGN;
+}
+
+bool RecordWriter::write_staged()
+{
+    off_t pos = static_cast<off_t>(offset - staged);
+
+    // The backend owns the buffer until the write completes, carry on in
+    // another one.
+    if (!backend->write(fd, staging, staged, pos)) {
+        failed = true;
+        return false;
+    }
+    total_bytes += staged;
+    staged = 0;
+    staging = backend->acquire();
+    return true;
+}
+
+void RecordWriter::close_segment()
+{
+    if (fd == -1)
+        return;
+    if (!failed && staged > 0)
+        write_staged();
+    // Give back the preallocated space the segment didn't use. Writes still
+    // in flight all lie below 'offset'.
+    if (ftruncate(fd, static_cast<off_t>(offset)) == -1)
+        fprintf(stderr, "Cannot trim segment %u: %d, %s\n",
+                segment, errno, strerror(errno));
+    // Synced and closed by the backend once its writes are done.
+    if (!backend->close_file(fd))
+        failed = true;
+    fd = -1;
+}
+
+size_t RecordWriter::record_bound(const cv::Mat &image, frame_codec codec)
+{
+    size_t raw = image.total() * image.elemSize();
+    return align_up(sizeof(RecordHeader) + codec_bound(codec, raw),
+                    VCAP_ALIGN);
+}
+
+size_t RecordWriter::encode_record(const Frame &frame, uint64_t sequence,
+                                   unsigned char *record, frame_codec codec)
+{
+    const cv::Mat &image = frame.image;
+    const size_t row_bytes = image.cols * image.elemSize();
+    const size_t raw = row_bytes * image.rows;
+    unsigned char *dst = record + sizeof(RecordHeader);
+    size_t payload;
+
+    codec = available_codec(codec);
+    if (codec != CODEC_NONE && image.type() == CV_8UC1) {
+        payload = encode_frame(codec, image, dst, codec_bound(codec, raw));
+        if (payload == 0)
+            return 0;
+    } else {
+        codec = CODEC_NONE;
+        payload = raw;
+        if (image.isContinuous()) {
+            memcpy(dst, image.data, payload);
+        } else {
+            for (int r = 0; r < image.rows; ++r)
+                memcpy(dst + r * row_bytes, image.ptr(r), row_bytes);
+        }
+    }
+    const size_t record_bytes = align_up(sizeof(RecordHeader) + payload,
+                                         VCAP_ALIGN);
+
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = VCAP_RECORD_MAGIC;
+    header.header_bytes = sizeof(RecordHeader);
+    header.sequence = sequence;
+    header.camera = frame.camera;
+    header.view = frame.view;
+    header.timestamp_us = static_cast<int64_t>(frame.timestamp.tv_sec) *
+                          1000000 + frame.timestamp.tv_usec;
+    header.fourcc = image.type() == CV_8UC1 ? V4L2_PIX_FMT_GREY :
+                    image.type() == CV_16UC1 ? V4L2_PIX_FMT_Y16 : 0;
+    header.width = image.cols;
+    header.height = image.rows;
+    header.stride = row_bytes;
+    header.payload_bytes = payload;
+    header.record_bytes = record_bytes;
+    header.codec = codec;
+    header.raw_bytes = raw;
+
+    memcpy(record, &header, sizeof(header));
+    memset(dst + payload, 0, record_bytes - sizeof(header) - payload);
+    return record_bytes;
+}
+
+unsigned char *RecordWriter::reserve(size_t record_bytes)
+{
+    if (failed)
+        return nullptr;
+    if (record_bytes > config.staging_bytes) {
+        // Only happens for frames larger than the staging size: swap in a
+        // backend with buffers that fit.
+        if (fd != -1 && staged > 0 && !write_staged())
+            return nullptr;
+        backend->drain();
+        backend.reset();
+        config.staging_bytes = record_bytes;
+        backend = make_backend(config.backend, record_bytes, config.io_depth);
+        staging = backend->acquire();
+    }
+    if (fd != -1 && offset > VCAP_ALIGN &&
+        offset + record_bytes > config.segment_bytes) {
+        close_segment();
+        ++segment;
+    }
+    if (fd == -1) {
+        open_segment();
+        if (failed)
+            return nullptr;
+    }
+    if (staged + record_bytes > config.staging_bytes && !write_staged())
+        return nullptr;
+    return staging + staged;
+}
+
+void RecordWriter::commit(const RecordHeader &header)
+{
+    IndexEntry entry;
+    entry.sequence = header.sequence;
+    entry.timestamp_us = header.timestamp_us;
+    entry.segment = segment;
+    entry.record_bytes = header.record_bytes;
+    entry.offset = offset;
+    fwrite(&entry, sizeof(entry), 1, index);
+
+    staged += header.record_bytes;
+    offset += header.record_bytes;
+}
+
+bool RecordWriter::append(const Frame &frame, uint64_t sequence)
+{
+    if (frame.image.empty())
+        return false;
+    unsigned char *dst = reserve(record_bound(frame.image));
+    if (!dst)
+        return false;
+    encode_record(frame, sequence, dst);
+    commit(*reinterpret_cast<const RecordHeader*>(dst));
+    return true;
+}
+
+bool RecordWriter::append_record(const unsigned char *record)
+{
+    RecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    unsigned char *dst = reserve(header.record_bytes);
+    if (!dst)
+        return false;
+    memcpy(dst, record, header.record_bytes);
+    commit(header);
+    return true;
+}
+
+void RecordWriter::flush()
+{
+    if (fd != -1 && staged > 0)
+        write_staged();
+    // Index entries must not get ahead of the records they point at.
+    backend->drain();
+    if (index)
+        fflush(index);
+}
+
+void RecordWriter::close()
+{
+    close_segment();
+    backend->drain();
+    if (index) {
+        fclose(index);
+        index = nullptr;
+    }
+}
+
+int record_type(const RecordHeader &header)
+{
+    const int type = header.fourcc == V4L2_PIX_FMT_GREY ? CV_8UC1 :
+                     header.fourcc == V4L2_PIX_FMT_Y16 ? CV_16UC1 : -1;
+    const unsigned int pixel_bytes = type == CV_16UC1 ? 2 : 1;
+    if (type < 0 || header.stride != header.width * pixel_bytes ||
+        (header.codec != CODEC_NONE && type != CV_8UC1) ||
+        (header.codec == CODEC_NONE &&
+         header.stride * header.height != header.payload_bytes))
+        return -1;
+    return type;
+}
+
+RecordReader::RecordReader(const std::string &base)
+: base(base)
+{
+    std::string path = index_path(base);
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                path.c_str(), errno, strerror(errno));
+        return;
+    }
+    IndexHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != VCAP_INDEX_MAGIC ||
+        header.entry_bytes != sizeof(IndexEntry)) {
+        fprintf(stderr, "'%s' is not a recording index\n", path.c_str());
+        fclose(fp);
+        return;
+    }
+    IndexEntry entry;
+    while (fread(&entry, sizeof(entry), 1, fp) == 1)
+        entries.push_back(entry);
+    fclose(fp);
+    opened = true;
+}
+
+RecordReader::~RecordReader()
+{
+    for (int fd : segments)
+        if (fd != -1)
+            ::close(fd);
+}
+
+int RecordReader::segment_fd(uint32_t segment)
+{
+    if (segment >= segments.size())
+        segments.resize(segment + 1, -1);
+    if (segments[segment] == -1) {
+        std::string path = segment_path(base, segment);
+        segments[segment] = open(path.c_str(), O_RDONLY);
+        if (segments[segment] == -1)
+            fprintf(stderr, "Cannot open '%s': %d, %s\n",
+                    path.c_str(), errno, strerror(errno));
+    }
+    return segments[segment];
+}
+
+bool RecordReader::read(size_t i, Frame &frame)
+{
+    frame.clear();
+    if (i >= entries.size())
+        return false;
+
+    const IndexEntry &entry = entries[i];
+    int fd = segment_fd(entry.segment);
+    RecordHeader header;
+    if (fd == -1 ||
+        pread(fd, &header, sizeof(header), entry.offset) != sizeof(header) ||
+        header.magic != VCAP_RECORD_MAGIC) {
+        fprintf(stderr, "Bad record %zu in '%s'\n", i, base.c_str());
+        return false;
+    }
+    const int type = record_type(header);
+    if (type < 0) {
+        fprintf(stderr, "Unsupported record format in '%s'\n", base.c_str());
+        return false;
+    }
+    cv::Mat image(header.height, header.width, type);
+    unsigned char *payload = image.data;
+    if (header.codec != CODEC_NONE) {
+        scratch.resize(header.payload_bytes);
+        payload = scratch.data();
+    }
+    if (pread(fd, payload, header.payload_bytes,
+              entry.offset + header.header_bytes) !=
+        static_cast<ssize_t>(header.payload_bytes)) {
+        fprintf(stderr, "Short record %zu in '%s'\n", i, base.c_str());
+        return false;
+    }
+    if (header.codec != CODEC_NONE &&
+        !decode_frame(static_cast<frame_codec>(header.codec), payload,
+                      header.payload_bytes, image)) {
+        fprintf(stderr, "Cannot decode record %zu in '%s'\n",
+                i, base.c_str());
+        return false;
+    }
+    frame.image = image;
+    frame.timestamp.tv_sec = header.timestamp_us / 1000000;
+    frame.timestamp.tv_usec = header.timestamp_us % 1000000;
+    frame.camera = header.camera;
+    frame.view = header.view;
+    return true;
+}
@@ -0,0 +1,466 @@
+#include <Rectify.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define VIDEOCAP_RECTIFY_AVX2
+#endif
+
+static const size_t PLANE_ALIGN = 64;
+static const int FRAC_BITS = 7; // Per weight, more overflows the 16-bit madd.
+static const int ONE = 1 << FRAC_BITS;
+static const int ROUND = 1 << (2 * FRAC_BITS - 1);
+
+bool parse_rectify(const std::string &name, rectify_mode &mode)
+{
+    if (name == "off")
+        mode = RECTIFY_OFF;
+    else if (name == "replace")
+        mode = RECTIFY_REPLACE;
+    else if (name == "both")
+        mode = RECTIFY_BOTH;
+    else
+        return false;
+    return true;
+}
+
+bool load_calibration(const std::string &path, StereoCalibration &calib)
+{
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "Cannot open calibration '%s'\n", path.c_str());
+        return false;
+    }
+    struct Field {
+        const char *key;
+        double *values;
+        int count, optional; // Trailing values that may be left out.
+    };
+    const Field fields[] = {
+        {"left.K", calib.left.K, 9, 0}, {"left.D", calib.left.D, 5, 1},
+        {"left.R", calib.left.R, 9, 0}, {"left.P", calib.left.P, 12, 0},
+        {"right.K", calib.right.K, 9, 0}, {"right.D", calib.right.D, 5, 1},
+        {"right.R", calib.right.R, 9, 0}, {"right.P", calib.right.P, 12, 0},
+    };
+    const unsigned int all = (1u << 9) - 1; // Every field and the size.
+    unsigned int seen = 0;
+    std::string line;
+    for (int n = 1; std::getline(in, line); ++n) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream ss(line);
+        std::string key;
+        if (!(ss >> key))
+            continue;
+        if (key == "size") {
+            if (!(ss >> calib.width >> calib.height) || calib.width < 2 ||
+                calib.height < 2) {
+                fprintf(stderr, "%s:%d: bad size\n", path.c_str(), n);
+                return false;
+            }
+            seen |= 1u << 8;
+            continue;
+        }
+        int f = 0;
+        while (f < 8 && key != fields[f].key)
+            ++f;
+        if (f == 8) {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", path.c_str(), n,
+                    key.c_str());
+            return false;
+        }
+        int got = 0;
+        double v;
+        while (got < fields[f].count && ss >> v)
+            fields[f].values[got++] = v;
+        if (got < fields[f].count - fields[f].optional || !ss.eof()) {
+            fprintf(stderr, "%s:%d: %s takes %d numbers\n", path.c_str(), n,
+                    key.c_str(), fields[f].count);
+            return false;
+        }
+        for (; got < fields[f].count; ++got)
+            fields[f].values[got] = 0;
+        seen |= 1u << f;
+    }
+    if (seen != all) {
+        fprintf(stderr, "Calibration '%s' is incomplete\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// inv = a^-1 for a 3x3 row major matrix; false if it is singular.
+static bool invert3(const double *a, double *inv)
+{
+    double c0 = a[4] * a[8] - a[5] * a[7];
+    double c1 = a[5] * a[6] - a[3] * a[8];
+    double c2 = a[3] * a[7] - a[4] * a[6];
+    double det = a[0] * c0 + a[1] * c1 + a[2] * c2;
+    if (std::fabs(det) < 1e-12)
+        return false;
+    double d = 1 / det;
+    inv[0] = c0 * d;
+    inv[1] = (a[2] * a[7] - a[1] * a[8]) * d;
+    inv[2] = (a[1] * a[5] - a[2] * a[4]) * d;
+    inv[3] = c1 * d;
+    inv[4] = (a[0] * a[8] - a[2] * a[6]) * d;
+    inv[5] = (a[2] * a[3] - a[0] * a[5]) * d;
+    inv[6] = c2 * d;
+    inv[7] = (a[1] * a[6] - a[0] * a[7]) * d;
+    inv[8] = (a[0] * a[4] - a[1] * a[3]) * d;
+    return true;
+}
+
+void RemapTable::build(const StereoCalibration &calib, int step)
+{
+    rows = calib.height;
+    cols = 2 * calib.width;
+    this->step = step;
+    const size_t n = static_cast<size_t>(rows) * cols;
+    offsets.assign(n, -1);
+    wx.assign(n, 0);
+    wy.assign(n, 0);
+    gather_ok.assign(rows, 1);
+    build_half(calib.left, 0, calib.width);
+    build_half(calib.right, calib.width, calib.width);
+}
+
+void RemapTable::build_half(const CameraModel &cam, int x0, int half_cols)
+{
+    // As cv::initUndistortRectifyMap(): back through P and R to a ray, then
+    // forward through the distortion and K. Skew is ignored, as there.
+    double ar[9], iR[9];
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 3; ++j)
+            ar[i * 3 + j] = cam.P[i * 4] * cam.R[j] +
+                            cam.P[i * 4 + 1] * cam.R[3 + j] +
+                            cam.P[i * 4 + 2] * cam.R[6 + j];
+    if (!invert3(ar, iR)) {
+        fprintf(stderr, "Calibration: P * R is singular, half left black\n");
+        return;
+    }
+    const double fx = cam.K[0], cx = cam.K[2], fy = cam.K[4], cy = cam.K[5];
+    const double k1 = cam.D[0], k2 = cam.D[1], p1 = cam.D[2], p2 = cam.D[3],
+                 k3 = cam.D[4];
+    // Past this a gather of 4 bytes at the lower row runs off the source.
+    const long limit = static_cast<long>(rows - 1) * step + cols - 4;
+
+    for (int v = 0; v < rows; ++v) {
+        double X = v * iR[1] + iR[2], Y = v * iR[4] + iR[5],
+               W = v * iR[7] + iR[8];
+        const size_t row = static_cast<size_t>(v) * cols + x0;
+        for (int u = 0; u < half_cols; ++u,
+             X += iR[0], Y += iR[3], W += iR[6]) {
+            double w = 1 / W, x = X * w, y = Y * w;
+            double x2 = x * x, y2 = y * y, xy2 = 2 * x * y, r2 = x2 + y2;
+            double kr = 1 + ((k3 * r2 + k2) * r2 + k1) * r2;
+            double su = fx * (x * kr + p1 * xy2 + p2 * (r2 + 2 * x2)) + cx;
+            double sv = fy * (y * kr + p1 * (r2 + 2 * y2) + p2 * xy2) + cy;
+            if (!(su >= 0 && sv >= 0 && su < half_cols && sv < rows))
+                continue;
+            int ix = static_cast<int>(su), iy = static_cast<int>(sv);
+            int fu = static_cast<int>((su - ix) * ONE + 0.5);
+            int fv = static_cast<int>((sv - iy) * ONE + 0.5);
+            if (fu == ONE) {
+                ++ix;
+                fu = 0;
+            }
+            if (fv == ONE) {
+                ++iy;
+                fv = 0;
+            }
+            if (ix + 1 >= half_cols || iy + 1 >= rows)
+                continue;
+            long off = static_cast<long>(iy) * step + x0 + ix;
+            offsets[row + u] = static_cast<int32_t>(off);
+            wx[row + u] = static_cast<uint8_t>(fu);
+            wy[row + u] = static_cast<uint8_t>(fv);
+            if (off + step > limit)
+                gather_ok[v] = 0;
+        }
+    }
+}
+
+size_t RemapTable::bytes() const
+{
+    return offsets.size() * sizeof(int32_t) + wx.size() + wy.size() +
+           gather_ok.size();
+}
+
+static inline uint8_t sample(const uint8_t *src, int step, int32_t off,
+                             int fu, int fv)
+{
+    if (off < 0)
+        return 0;
+    const uint8_t *p = src + off;
+    int top = p[0] * (ONE - fu) + p[1] * fu;
+    int bottom = p[step] * (ONE - fu) + p[step + 1] * fu;
+    return static_cast<uint8_t>((top * (ONE - fv) + bottom * fv + ROUND) >>
+                                (2 * FRAC_BITS));
+}
+
+// Remaps 'n' pixels of one row from their table entries.
+typedef void (*remap_fn)(const uint8_t *src, int step, const int32_t *off,
+                         const uint8_t *wx, const uint8_t *wy, uint8_t *dst,
+                         int n);
+
+static void remap_row_scalar(const uint8_t *src, int step, const int32_t *off,
+                             const uint8_t *wx, const uint8_t *wy,
+                             uint8_t *dst, int n)
+{
+    for (int x = 0; x < n; ++x)
+        dst[x] = sample(src, step, off[x], wx[x], wy[x]);
+}
+
+#ifdef VIDEOCAP_RECTIFY_AVX2
+__attribute__((target("avx2")))
+static void remap_row_avx2(const uint8_t *src, int step, const int32_t *off,
+                           const uint8_t *wx, const uint8_t *wy, uint8_t *dst,
+                           int n)
+{
+    const __m256i none = _mm256_set1_epi32(-1);
+    const __m256i one = _mm256_set1_epi32(ONE);
+    const __m256i round = _mm256_set1_epi32(ROUND);
+    // Bytes 0 and 1 of each lane to the low bytes of its two 16-bit halves.
+    const __m256i spread = _mm256_setr_epi8(
+        0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+        0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1);
+    const __m256i low_bytes = _mm256_setr_epi8(
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const int *top_row = reinterpret_cast<const int*>(src);
+    const int *bottom_row = reinterpret_cast<const int*>(src + step);
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i o = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(off + x));
+        __m256i inside = _mm256_cmpgt_epi32(o, none);
+        // Outside pixels aren't read; their lanes stay 0 and come out black.
+        __m256i top = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+                                                  top_row, o, inside, 1);
+        __m256i bottom = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+                                                     bottom_row, o, inside, 1);
+        __m256i u = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(wx + x)));
+        __m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i*>(wy + x)));
+        // (1 - u, u) pairs of 16 bits, against (p00, p01) and (p10, p11).
+        __m256i wu = _mm256_or_si256(_mm256_sub_epi32(one, u),
+                                     _mm256_slli_epi32(u, 16));
+        __m256i wv = _mm256_or_si256(_mm256_sub_epi32(one, v),
+                                     _mm256_slli_epi32(v, 16));
+        __m256i t = _mm256_madd_epi16(_mm256_shuffle_epi8(top, spread), wu);
+        __m256i b = _mm256_madd_epi16(_mm256_shuffle_epi8(bottom, spread), wu);
+        // Both fit in 15 bits, so the vertical pass is one more madd.
+        __m256i r = _mm256_madd_epi16(
+            _mm256_or_si256(t, _mm256_slli_epi32(b, 16)), wv);
+        r = _mm256_srli_epi32(_mm256_add_epi32(r, round), 2 * FRAC_BITS);
+        r = _mm256_shuffle_epi8(r, low_bytes);
+        __m128i packed = _mm_unpacklo_epi32(_mm256_castsi256_si128(r),
+                                            _mm256_extracti128_si256(r, 1));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x), packed);
+    }
+    remap_row_scalar(src, step, off + x, wx + x, wy + x, dst + x, n - x);
+}
+#endif
+
+struct RemapKernel {
+    remap_fn row;
+    const char *name;
+};
+
+static RemapKernel pick_kernel()
+{
+#ifdef VIDEOCAP_RECTIFY_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        return RemapKernel{remap_row_avx2, "avx2"};
+#endif
+    return RemapKernel{remap_row_scalar, "scalar"};
+}
+
+static const RemapKernel kernel = pick_kernel();
+
+const char *rectify_kernel_name()
+{
+    return kernel.name;
+}
+
+void RemapTable::remap(const uint8_t *src, uint8_t *dst, int first_row,
+                       int last_row) const
+{
+    for (int y = first_row; y < last_row; ++y) {
+        const size_t i = static_cast<size_t>(y) * cols;
+        remap_fn row = gather_ok[y] ? kernel.row : remap_row_scalar;
+        row(src, step, &offsets[i], &wx[i], &wy[i], dst + i, cols);
+    }
+}
+
+void RemapTable::remap_scalar(const uint8_t *src, uint8_t *dst, int first_row,
+                              int last_row) const
+{
+    for (int y = first_row; y < last_row; ++y) {
+        const size_t i = static_cast<size_t>(y) * cols;
+        remap_row_scalar(src, step, &offsets[i], &wx[i], &wy[i], dst + i,
+                         cols);
+    }
+}
+
+Rectifier::Rectifier(const StereoCalibration &calib, rectify_mode mode,
+                     unsigned int threads, unsigned int buffers)
+: calib(calib), mode(mode), buffers(buffers > 0 ? buffers : 1),
+  rectified_count(0), skipped_count(0), fallback_count(0)
+{
+    const size_t n = static_cast<size_t>(2 * calib.width) * calib.height;
+    frame_bytes = (n + PLANE_ALIGN - 1) & ~(PLANE_ALIGN - 1);
+    arena.assign(frame_bytes * this->buffers + PLANE_ALIGN, 0);
+    for (unsigned int i = this->buffers; i > 0; --i)
+        free_list.push_back(i - 1);
+    for (unsigned int i = 0; i < threads; ++i)
+        workers.push_back(std::thread(&Rectifier::work, this, i + 1));
+}
+
+Rectifier::~Rectifier()
+{
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        stopping = true;
+    }
+    job_cond.notify_all();
+    for (std::thread &t : workers)
+        t.join();
+}
+
+void Rectifier::run_band(unsigned int band, const RemapTable &table,
+                         const uint8_t *src, uint8_t *dst)
+{
+    const unsigned int bands = workers.size() + 1;
+    const int per_band = (table.rows + bands - 1) / bands;
+    const int first = band * per_band;
+    const int last = std::min(table.rows, first + per_band);
+    if (first < last)
+        table.remap(src, dst, first, last);
+}
+
+void Rectifier::work(unsigned int band)
+{
+    unsigned long done = 0;
+    std::unique_lock<std::mutex> lock(job_mutex);
+    while (true) {
+        job_cond.wait(lock, [&] { return stopping || job != done; });
+        if (stopping)
+            return;
+        done = job;
+        const RemapTable *table = job_table;
+        const uint8_t *src = job_src;
+        uint8_t *dst = job_dst;
+        lock.unlock();
+        run_band(band, *table, src, dst);
+        lock.lock();
+        if (--pending == 0)
+            done_cond.notify_one();
+    }
+}
+
+void Rectifier::run_bands(const RemapTable &table, const uint8_t *src,
+                          uint8_t *dst)
+{
+    if (workers.empty()) {
+        run_band(0, table, src, dst);
+        return;
+    }
+    // Frames rectified on several threads at once take turns at the bands.
+    std::lock_guard<std::mutex> turn(band_mutex);
+    {
+        std::lock_guard<std::mutex> lock(job_mutex);
+        job_table = &table;
+        job_src = src;
+        job_dst = dst;
+        pending = workers.size();
+        ++job;
+    }
+    job_cond.notify_all();
+    run_band(0, table, src, dst);
+    std::unique_lock<std::mutex> lock(job_mutex);
+    done_cond.wait(lock, [this] { return pending == 0; });
+}
+
+uint8_t *Rectifier::take(unsigned int &index)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (free_list.empty())
+        return nullptr;
+    index = free_list.back();
+    free_list.pop_back();
+    uint8_t *base = arena.data();
+    base += (PLANE_ALIGN - reinterpret_cast<uintptr_t>(base) % PLANE_ALIGN) %
+            PLANE_ALIGN;
+    return base + index * frame_bytes;
+}
+
+bool Rectifier::rectify(const Frame &frame, Frame &rectified)
+{
+    const cv::Mat &image = frame.image;
+    if (image.type() != CV_8UC1 || image.cols != 2 * calib.width ||
+        image.rows != calib.height) {
+        ++skipped_count;
+        return false;
+    }
+    const int64_t start = monotonic_ns();
+    std::shared_ptr<const RemapTable> table = std::atomic_load(&current);
+    if (!table || table->step != static_cast<int>(image.step)) {
+        // Frames already being remapped keep the table they started with.
+        std::shared_ptr<RemapTable> built = std::make_shared<RemapTable>();
+        built->build(calib, image.step);
+        table = built;
+        std::atomic_store(&current, table);
+    }
+
+    unsigned int index;
+    uint8_t *dst = take(index);
+    rectified = frame;
+    if (dst) {
+        rectified.image = cv::Mat(image.rows, image.cols, CV_8UC1, dst);
+        rectified.lease = std::make_shared<FrameLease>(this, index, 0);
+    } else {
+        ++fallback_count;
+        rectified.image = cv::Mat(image.rows, image.cols, CV_8UC1);
+        rectified.lease.reset();
+    }
+    rectified.view = frame.view | VIEW_RECTIFIED;
+    run_bands(*table, image.data, rectified.image.data);
+    cost.record(monotonic_ns() - start);
+    ++rectified_count;
+    return true;
+}
+
+void Rectifier::requeue(unsigned int index, unsigned int)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    free_list.push_back(index);
+}
+
+RectifyStatus Rectifier::status()
+{
+    RectifyStatus s;
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        s.buffers = buffers;
+        s.in_use = buffers - free_list.size();
+    }
+    s.rectified = rectified_count;
+    s.skipped = skipped_count;
+    s.fallbacks = fallback_count;
+    s.threads = workers.size();
+    std::shared_ptr<const RemapTable> table = std::atomic_load(&current);
+    s.table_bytes = table ? table->bytes() : 0;
+    s.p50_us = cost.percentile(50) / 1e3;
+    s.p99_us = cost.percentile(99) / 1e3;
+    s.max_us = cost.max() / 1e3;
+    return s;
+}
@@ -0,0 +1,112 @@
+/*
+Receives frames from a VideoCapture streaming server (--stream) and measures
+how they arrive.
+
+    vcap_recv [-r FPS] [-c FRAMES] [-d MS] [-n] ENDPOINT
+
+ENDPOINT is [HOST:]PORT (HOST defaults to 127.0.0.1) or unix:PATH. Once a
+second the delivered rate, MB/s, the frames the server skipped for this
+client and the latency from capture to arrival (p50/p99/max) are printed;
+latency is only meaningful on the capturing host, where both ends share
+CLOCK_MONOTONIC. -r asks the server for at most FPS frames a second; -c
+stops after FRAMES frames; -d spends MS milliseconds on each frame, to see a
+slow client get fewer frames rather than late ones; -n shows no windows.
+*/
+#include <FrameStream.hpp>
+#include <PipelineStats.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <getopt.h>
+}
+
+#include <opencv2/highgui.hpp>
+
+typedef std::chrono::steady_clock recv_clock;
+
+int main(int argc, char *argv[])
+{
+    double max_fps = 0;
+    unsigned long count = 0;
+    long delay_ms = 0;
+    bool display = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "r:c:d:nh")) != -1) {
+        switch (c) {
+        case 'r': max_fps = atof(optarg); break;
+        case 'c': count = strtoul(optarg, NULL, 10); break;
+        case 'd': delay_ms = atol(optarg); break;
+        case 'n': display = false; break;
+        default:
+            std::cerr << "Usage: " << argv[0] << " [-r FPS] [-c FRAMES] "
+                      << "[-d MS] [-n] ENDPOINT" << std::endl;
+            return c == 'h' ? 0 : EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        std::cerr << "No endpoint given" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    StreamClient client;
+    if (!client.connect(argv[optind], max_fps))
+        return EXIT_FAILURE;
+    std::cout << "Connected to " << argv[optind] << std::endl;
+
+    latency_histogram latency, total_latency;
+    unsigned long frames = 0, second_frames = 0;
+    uint64_t second_bytes = 0, skipped = 0;
+    auto started = recv_clock::now(), second = started;
+    Frame frame;
+    StreamHeader header;
+    while (client.read(frame, header)) {
+        const int64_t now_ns = monotonic_ns();
+        latency.record(now_ns - header.capture_ns);
+        total_latency.record(now_ns - header.capture_ns);
+        skipped = header.skipped;
+        ++frames;
+        ++second_frames;
+        second_bytes += sizeof(header) + header.bytes;
+
+        auto now = recv_clock::now();
+        if (now - second >= std::chrono::seconds(1)) {
+            double s = std::chrono::duration<double>(now - second).count();
+            printf("%6.1f fps, %6.1f MB/s, %llu skipped, latency p50 %.2f "
+                   "p99 %.2f max %.2f ms\n", second_frames / s,
+                   second_bytes / s / (1 << 20),
+                   static_cast<unsigned long long>(skipped),
+                   latency.percentile(50) / 1e6,
+                   latency.percentile(99) / 1e6, latency.max() / 1e6);
+            fflush(stdout);
+            latency.reset();
+            second = now;
+            second_frames = 0;
+            second_bytes = 0;
+        }
+        if (display) {
+            cv::imshow("Stream camera " + std::to_string(frame.camera),
+                       frame.image);
+            if (cv::waitKey(1) == 'q')
+                break;
+        }
+        if (delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+        if (count && frames >= count)
+            break;
+    }
+    double wall = std::chrono::duration<double>(recv_clock::now() - started)
+                      .count();
+    printf("Received %lu frames in %.2f s (%.1f fps), %llu skipped by the "
+           "server, latency p50 %.2f p99 %.2f ms\n", frames, wall,
+           frames / wall, static_cast<unsigned long long>(skipped),
+           total_latency.percentile(50) / 1e6,
+           total_latency.percentile(99) / 1e6);
+    return 0;
+}
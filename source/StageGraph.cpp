@@ -0,0 +1,239 @@
+#include <StageGraph.hpp>
+
+#include <algorithm>
+
+extern "C" {
+#include <time.h>
+}
+
+static int64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+StageGraph::StageGraph(WorkPool &pool, Sink sink, unsigned int capacity)
+: pool(pool), sink(sink), capacity(capacity > 0 ? capacity : 1)
+{
+}
+
+StageGraph::~StageGraph()
+{
+    if (sink_id >= 0)
+        drain();
+}
+
+int StageGraph::add(std::unique_ptr<FrameStage> stage, int parent)
+{
+    if (sink_id >= 0)
+        return -1; // Started already.
+    std::unique_ptr<Node> node(new Node());
+    node->name = stage->name();
+    node->ordered = stage->ordered();
+    node->stage = std::move(stage);
+    node->parent = parent >= 0 && parent < static_cast<int>(nodes.size())
+                   ? parent : -1;
+    const int id = nodes.size();
+    if (node->parent >= 0)
+        nodes[node->parent]->children.push_back(id);
+    nodes.push_back(std::move(node));
+    return id;
+}
+
+void StageGraph::start()
+{
+    if (sink_id >= 0)
+        return;
+    // The sink is an ordered stage of its own, fed by every leaf (or by the
+    // input, with no stages at all), which puts the branches back in order.
+    std::unique_ptr<Node> node(new Node());
+    node->name = "sink";
+    node->ordered = true;
+    node->inputs = 0;
+    for (std::unique_ptr<Node> &leaf : nodes)
+        if (leaf->children.empty())
+            leaf->part = node->inputs++;
+    if (node->inputs == 0)
+        node->inputs = 1;
+    sink_id = nodes.size();
+    nodes.push_back(std::move(node));
+    for (int id = 0; id < sink_id; ++id)
+        if (nodes[id]->parent < 0)
+            roots.push_back(id);
+    if (roots.empty())
+        roots.push_back(sink_id);
+}
+
+void StageGraph::submit(Frame &&frame)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return full == 0; });
+    }
+    const uint64_t ticket = next_ticket++;
+    for (size_t i = 0; i < roots.size(); ++i) {
+        std::vector<Frame> frames(1);
+        if (i + 1 < roots.size())
+            frames[0] = frame;
+        else
+            frames[0] = std::move(frame);
+        deliver(roots[i], 0, ticket, std::move(frames));
+    }
+}
+
+void StageGraph::drain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return in_flight == 0; });
+}
+
+void StageGraph::deliver(int id, unsigned int part, uint64_t ticket,
+                         std::vector<Frame> &&frames)
+{
+    Node &node = *nodes[id];
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++in_flight;
+    }
+    bool filled;
+    {
+        std::lock_guard<std::mutex> lock(node.mutex);
+        unsigned int depth = node.depth;
+        if (node.ordered) {
+            Slot &slot = node.waiting[ticket];
+            if (slot.parts.empty()) {
+                slot.parts.resize(node.inputs);
+                ++node.depth;
+            }
+            slot.parts[part] = std::move(frames);
+            ++slot.arrived;
+        } else {
+            node.ready.push_back(Batch{ticket, std::move(frames)});
+            ++node.depth;
+        }
+        node.peak = std::max(node.peak, node.depth);
+        filled = depth < capacity && node.depth >= capacity;
+    }
+    if (filled) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++full;
+    }
+    pool.post([this, id] { run(id); });
+}
+
+bool StageGraph::take(Node &node, Batch &batch, unsigned int &parts)
+{
+    // Called with node.mutex held.
+    if (!node.ordered) {
+        if (node.ready.empty())
+            return false;
+        batch = std::move(node.ready.front());
+        node.ready.pop_front();
+        parts = 1;
+        return true;
+    }
+    if (node.running || node.waiting.empty())
+        return false;
+    std::map<uint64_t, Slot>::iterator it = node.waiting.begin();
+    if (it->first != node.next || it->second.arrived < node.inputs)
+        return false;
+    batch.ticket = it->first;
+    batch.frames.clear();
+    for (std::vector<Frame> &frames : it->second.parts)
+        for (Frame &frame : frames)
+            batch.frames.push_back(std::move(frame));
+    parts = it->second.arrived;
+    node.waiting.erase(it);
+    ++node.next;
+    node.running = true;
+    return true;
+}
+
+void StageGraph::run(int id)
+{
+    Node &node = *nodes[id];
+    Batch batch;
+    unsigned int parts;
+    bool released;
+    {
+        std::lock_guard<std::mutex> lock(node.mutex);
+        // An ordered stage that is busy, or still missing the next ticket,
+        // is run again once that changes.
+        if (!take(node, batch, parts))
+            return;
+        released = node.depth-- == capacity;
+    }
+    if (released) {
+        std::lock_guard<std::mutex> lock(mutex);
+        --full;
+        changed.notify_all();
+    }
+
+    node.frames_in += batch.frames.size();
+    if (!node.stage) {
+        for (Frame &frame : batch.frames)
+            sink(std::move(frame));
+        node.frames_out += batch.frames.size();
+    } else {
+        StageOutput out;
+        int64_t start = thread_cpu_ns();
+        for (Frame &frame : batch.frames)
+            node.stage->process(std::move(frame), out);
+        node.cpu_ns += thread_cpu_ns() - start;
+        node.frames_out += out.frames.size();
+        if (!out.notes.empty()) {
+            std::lock_guard<std::mutex> lock(node.mutex);
+            for (const StageNote &note : out.notes)
+                node.notes[note.key] = note.value;
+        }
+        if (node.children.empty()) {
+            deliver(sink_id, node.part, batch.ticket, std::move(out.frames));
+        } else {
+            // Copies for all children but the last, which gets the frames.
+            for (size_t i = 0; i + 1 < node.children.size(); ++i)
+                deliver(node.children[i], 0, batch.ticket,
+                        std::vector<Frame>(out.frames));
+            deliver(node.children.back(), 0, batch.ticket,
+                    std::move(out.frames));
+        }
+    }
+
+    if (node.ordered) {
+        bool more;
+        {
+            std::lock_guard<std::mutex> lock(node.mutex);
+            node.running = false;
+            more = !node.waiting.empty() &&
+                   node.waiting.begin()->first == node.next &&
+                   node.waiting.begin()->second.arrived == node.inputs;
+        }
+        if (more)
+            pool.post([this, id] { run(id); });
+    }
+    // Only after the children have theirs, so drain() can't see a gap.
+    std::lock_guard<std::mutex> lock(mutex);
+    in_flight -= parts;
+    changed.notify_all();
+}
+
+std::vector<StageStatus> StageGraph::status()
+{
+    std::vector<StageStatus> list;
+    for (std::unique_ptr<Node> &node : nodes) {
+        StageStatus s;
+        s.name = node->name;
+        s.parent = node->parent;
+        s.ordered = node->ordered;
+        s.frames_in = node->frames_in;
+        s.frames_out = node->frames_out;
+        s.cpu_ms = node->cpu_ns / 1e6;
+        std::lock_guard<std::mutex> lock(node->mutex);
+        s.depth = node->depth;
+        s.peak_depth = node->peak;
+        for (const std::pair<const std::string, double> &note : node->notes)
+            s.notes.push_back(StageNote{note.first, note.second});
+        list.push_back(s);
+    }
+    return list;
+}
@@ -0,0 +1,95 @@
+#include <Stages.hpp>
+
+#include <sstream>
+
+static const char *stage_names[] = {"rectify", "split", "brightness"};
+
+bool parse_stages(const std::string &spec, stage_branches &branches)
+{
+    std::stringstream ss(spec);
+    std::string chain;
+    while (std::getline(ss, chain, ';')) {
+        std::vector<std::string> names;
+        std::stringstream cs(chain);
+        std::string name;
+        while (std::getline(cs, name, '>')) {
+            bool known = false;
+            for (const char *n : stage_names)
+                known = known || name == n;
+            if (!known)
+                return false;
+            names.push_back(name);
+        }
+        if (names.empty())
+            return false;
+        branches.push_back(names);
+    }
+    return !branches.empty();
+}
+
+bool uses_stage(const stage_branches &branches, const std::string &name)
+{
+    for (const std::vector<std::string> &chain : branches)
+        for (const std::string &n : chain)
+            if (n == name)
+                return true;
+    return false;
+}
+
+std::unique_ptr<FrameStage> make_stage(const std::string &name,
+                                       Rectifier *rectifier,
+                                       StereoSplitter *splitter)
+{
+    std::unique_ptr<FrameStage> stage;
+    if (name == "rectify" && rectifier)
+        stage.reset(new RectifyStage(*rectifier));
+    else if (name == "split" && splitter)
+        stage.reset(new SplitStage(*splitter));
+    else if (name == "brightness")
+        stage.reset(new BrightnessStage());
+    return stage;
+}
+
+void RectifyStage::process(Frame &&frame, StageOutput &out)
+{
+    Frame rectified;
+    if (!rectifier.rectify(frame, rectified)) {
+        out.emit(std::move(frame));
+        return;
+    }
+    if (rectifier.get_mode() == RECTIFY_BOTH)
+        out.emit(std::move(frame));
+    frame.clear(); // The capture buffer goes back before the writes.
+    out.emit(std::move(rectified));
+}
+
+void SplitStage::process(Frame &&frame, StageOutput &out)
+{
+    Frame left, right;
+    splitter.split(frame, left, right);
+    frame.clear(); // With the halves copied out the buffer goes back now.
+    out.emit(std::move(left));
+    out.emit(std::move(right));
+}
+
+void BrightnessStage::process(Frame &&frame, StageOutput &out)
+{
+    // Every 4th pixel of every 4th row is plenty for a mean.
+    const cv::Mat &image = frame.image;
+    if (image.empty() || image.channels() != 1)
+        return;
+    const bool wide = image.elemSize() == 2;
+    double sum = 0;
+    unsigned long n = 0;
+    for (int y = 0; y < image.rows; y += 4) {
+        const uint8_t *row = image.ptr<uint8_t>(y);
+        for (int x = 0; x < image.cols; x += 4, ++n)
+            sum += wide ? reinterpret_cast<const uint16_t*>(row)[x] : row[x];
+    }
+    const double mean = sum / n;
+    const std::string key = "cam" + std::to_string(frame.camera);
+    std::map<unsigned int, double>::iterator it = previous.find(frame.camera);
+    out.note(key + ".mean", mean);
+    out.note(key + ".change", it == previous.end() ? 0 : mean - it->second);
+    previous[frame.camera] = mean;
+}
@@ -0,0 +1,135 @@
+#include <StereoSplit.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+static const size_t PLANE_ALIGN = 64;
+
+static size_t align_plane(size_t n)
+{
+    return (n + PLANE_ALIGN - 1) & ~(PLANE_ALIGN - 1);
+}
+
+bool parse_stereo(const std::string &name, stereo_mode &mode)
+{
+    if (name == "off")
+        mode = STEREO_OFF;
+    else if (name == "view")
+        mode = STEREO_VIEW;
+    else if (name == "copy")
+        mode = STEREO_COPY;
+    else
+        return false;
+    return true;
+}
+
+void split_planes(const cv::Mat &image, uint8_t *left, uint8_t *right)
+{
+    // Two memcpy()s per row: glibc picks the widest copy the CPU has at run
+    // time, which hand-written SSE2/AVX2 loops only ever matched at best,
+    // and the hardware prefetcher follows the rows on its own.
+    const size_t lw = image.cols / 2;
+    const size_t rw = image.cols - lw;
+    for (int y = 0; y < image.rows; ++y) {
+        const uint8_t *src = image.ptr<uint8_t>(y);
+        memcpy(left + y * lw, src, lw);
+        memcpy(right + y * rw, src + lw, rw);
+    }
+}
+
+StereoSplitter::StereoSplitter(stereo_mode mode, unsigned int buffers)
+: mode(mode), buffers(buffers > 0 ? buffers : 1), split_count(0),
+  fallback_count(0)
+{
+}
+
+void StereoSplitter::views(const Frame &frame, Frame &left, Frame &right)
+{
+    const int lw = frame.image.cols / 2;
+    left = frame;
+    right = frame;
+    left.image = frame.image(cv::Rect(0, 0, lw, frame.image.rows));
+    right.image = frame.image(cv::Rect(lw, 0, frame.image.cols - lw,
+                                       frame.image.rows));
+}
+
+bool StereoSplitter::take(const cv::Mat &image, unsigned int &index,
+                          unsigned int &gen)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (image.rows != rows || image.cols != cols) {
+        // New geometry: start a new arena once the old one is all back.
+        if (!arena.empty() && free_list.size() != buffers)
+            return false;
+        rows = image.rows;
+        cols = image.cols;
+        left_bytes = align_plane(static_cast<size_t>(cols / 2) * rows);
+        plane_bytes = left_bytes +
+                      align_plane(static_cast<size_t>(cols - cols / 2) * rows);
+        arena.assign(plane_bytes * buffers + PLANE_ALIGN, 0);
+        free_list.clear();
+        for (unsigned int i = buffers; i > 0; --i)
+            free_list.push_back(i - 1);
+        ++generation;
+    }
+    if (free_list.empty())
+        return false;
+    index = free_list.back();
+    free_list.pop_back();
+    gen = generation;
+    return true;
+}
+
+void StereoSplitter::split(const Frame &frame, Frame &left, Frame &right)
+{
+    ++split_count;
+    unsigned int index, gen;
+    if (mode == STEREO_VIEW || frame.image.type() != CV_8UC1 ||
+        !take(frame.image, index, gen)) {
+        if (mode == STEREO_COPY)
+            ++fallback_count;
+        views(frame, left, right);
+        left.view = frame.view | VIEW_LEFT;
+        right.view = frame.view | VIEW_RIGHT;
+        return;
+    }
+    uint8_t *base = arena.data();
+    base += (PLANE_ALIGN - reinterpret_cast<uintptr_t>(base) % PLANE_ALIGN) %
+            PLANE_ALIGN;
+    uint8_t *lp = base + index * plane_bytes;
+    uint8_t *rp = lp + left_bytes;
+    split_planes(frame.image, lp, rp);
+
+    // Both halves share one lease on the plane buffer; the capture buffer is
+    // let go as soon as the caller drops 'frame'.
+    std::shared_ptr<FrameLease> lease =
+        std::make_shared<FrameLease>(this, index, gen);
+    const int lw = frame.image.cols / 2;
+    left = frame;
+    right = frame;
+    left.image = cv::Mat(frame.image.rows, lw, CV_8UC1, lp);
+    right.image = cv::Mat(frame.image.rows, frame.image.cols - lw, CV_8UC1, rp);
+    left.lease = lease;
+    right.lease = lease;
+    left.view = frame.view | VIEW_LEFT;
+    right.view = frame.view | VIEW_RIGHT;
+}
+
+void StereoSplitter::requeue(unsigned int index, unsigned int gen)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (gen == generation)
+        free_list.push_back(index);
+}
+
+StereoStatus StereoSplitter::status()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    StereoStatus s;
+    s.buffers = mode == STEREO_COPY ? buffers : 0;
+    s.in_use = arena.empty() ? 0 : buffers - free_list.size();
+    s.split = split_count;
+    s.fallbacks = fallback_count;
+    return s;
+}
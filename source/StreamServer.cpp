@@ -0,0 +1,422 @@
+#include <StreamServer.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+}
+
+static const int max_events = 16;
+static const int socket_buffer = 256 << 10;
+
+StreamServer::StreamServer(const StreamConfig &config)
+: config(config), stopping(false)
+{
+    sockaddr_storage addr;
+    socklen_t length;
+    if (!parse_endpoint(config.endpoint, endpoint)) {
+        fprintf(stderr, "Bad stream endpoint '%s'\n",
+                config.endpoint.c_str());
+        return;
+    }
+    if (!endpoint_address(endpoint, true, addr, length))
+        return;
+    if (!clear_stale_socket(endpoint))
+        return;
+    int fd = socket(addr.ss_family,
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if (fd != -1 && !endpoint.unix_socket)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd == -1 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), length) == -1 ||
+        listen(fd, 16) == -1) {
+        fprintf(stderr, "Cannot listen on '%s': %d, %s\n",
+                config.endpoint.c_str(), errno, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd == -1 || event_fd == -1) {
+        fprintf(stderr, "Cannot set up stream server: %d, %s\n",
+                errno, strerror(errno));
+        close(fd);
+        return;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr; // The listening socket.
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    ev.data.ptr = &event_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev);
+    listen_fd = fd;
+    thread = std::thread(&StreamServer::run, this);
+}
+
+StreamServer::~StreamServer()
+{
+    if (thread.joinable()) {
+        stopping = true;
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) {}
+        thread.join();
+    }
+    for (std::unique_ptr<Client> &client : clients)
+        close(client->fd);
+    if (listen_fd != -1) {
+        close(listen_fd);
+        if (endpoint.unix_socket)
+            unlink(endpoint.address.c_str());
+    }
+    if (epoll_fd != -1)
+        close(epoll_fd);
+    if (event_fd != -1)
+        close(event_fd);
+}
+
+void StreamServer::offer(const Frame &frame)
+{
+    if (listen_fd == -1 || frame.image.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (frame.camera >= latest.size())
+            latest.resize(frame.camera + 1);
+        Latest &l = latest[frame.camera];
+        l.frame = frame; // Shares the buffer; the previous one goes back.
+        l.capture_ns = frame.stamps[STAGE_DRIVER] ? frame.stamps[STAGE_DRIVER]
+                                                  : monotonic_ns();
+        ++l.count;
+        ++offered;
+    }
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0) {}
+}
+
+void StreamServer::accept_clients()
+{
+    for (;;) {
+        sockaddr_storage addr;
+        socklen_t length = sizeof(addr);
+        int fd = accept4(listen_fd, reinterpret_cast<sockaddr*>(&addr),
+                         &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (clients.size() >= config.max_clients) {
+            close(fd);
+            ++refused;
+            continue;
+        }
+        std::unique_ptr<Client> client(new Client());
+        client->fd = fd;
+        // Clients without acks are paced by the socket: keep it shallow so
+        // they get a newer frame rather than one queued long ago.
+        int buffer = socket_buffer;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+        if (addr.ss_family == AF_INET || addr.ss_family == AF_INET6) {
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            char host[INET6_ADDRSTRLEN] = "";
+            int port;
+            if (addr.ss_family == AF_INET) {
+                sockaddr_in *in = reinterpret_cast<sockaddr_in*>(&addr);
+                inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+                port = ntohs(in->sin_port);
+            } else {
+                sockaddr_in6 *in = reinterpret_cast<sockaddr_in6*>(&addr);
+                inet_ntop(AF_INET6, &in->sin6_addr, host, sizeof(host));
+                port = ntohs(in->sin6_port);
+            }
+            client->peer = std::string(host) + ":" + std::to_string(port);
+        } else {
+            client->peer = "unix:" + std::to_string(fd);
+        }
+        if (config.max_fps > 0)
+            client->interval_ns = static_cast<int64_t>(1e9 / config.max_fps);
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = client.get();
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        clients.push_back(std::move(client));
+        ++accepted;
+    }
+}
+
+bool StreamServer::read_client(Client &client)
+{
+    for (;;) {
+        uint8_t scratch[64];
+        uint8_t *dst = scratch;
+        size_t room = sizeof(scratch);
+        if (client.hello_bytes < sizeof(client.hello)) {
+            dst = reinterpret_cast<uint8_t*>(&client.hello) +
+                  client.hello_bytes;
+            room = sizeof(client.hello) - client.hello_bytes;
+        }
+        ssize_t n = recv(client.fd, dst, room, MSG_DONTWAIT);
+        if (n == 0)
+            return false;
+        if (n == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (dst == scratch) {
+            // After the hello, a byte per frame the client is done with.
+            if (client.credits >= 0)
+                client.credits += n;
+            continue;
+        }
+        client.hello_bytes += n;
+        if (client.hello_bytes < sizeof(client.hello) ||
+            client.hello.magic != VCAP_HELLO_MAGIC)
+            continue;
+        if (client.hello.max_mfps > 0) {
+            // The client may lower the server's limit, not raise it.
+            int64_t asked = static_cast<int64_t>(1e12 /
+                                                 client.hello.max_mfps);
+            client.interval_ns = std::max(client.interval_ns.load(), asked);
+        }
+        if (client.hello.window > 0) {
+            // Frames sent before the hello count against the window.
+            long used = client.frames + (client.total ? 1 : 0);
+            client.credits = std::max(0L, static_cast<long>(
+                client.hello.window) - used);
+        }
+    }
+}
+
+bool StreamServer::start_frame(Client &client, int64_t now)
+{
+    if ((client.interval_ns && now < client.next_ns) || client.credits == 0)
+        return false;
+    unsigned long count = 0;
+    int64_t capture_ns = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const size_t n = latest.size();
+        client.seen.resize(n, 0);
+        // Round the cameras so each gets its turn under a rate limit.
+        for (size_t k = 1; k <= n; ++k) {
+            const unsigned int c = (client.camera + k) % n;
+            if (latest[c].count > client.seen[c]) {
+                client.frame = latest[c].frame;
+                capture_ns = latest[c].capture_ns;
+                count = latest[c].count;
+                client.camera = c;
+                break;
+            }
+        }
+    }
+    if (count == 0)
+        return false;
+    if (client.credits > 0)
+        --client.credits;
+    unsigned long &seen = client.seen[client.camera];
+    if (seen)
+        client.skipped += count - seen - 1;
+    seen = count;
+
+    const cv::Mat &image = client.frame.image;
+    const size_t raw_bytes = image.total() * image.elemSize();
+    StreamHeader &h = client.header;
+    h.magic = VCAP_STREAM_MAGIC;
+    h.codec = CODEC_NONE;
+    h.rows = image.rows;
+    h.cols = image.cols;
+    h.type = image.type();
+    h.bytes = raw_bytes;
+    h.sequence = client.frame.sequence;
+    h.camera = client.frame.camera;
+    h.view = client.frame.view;
+    h.pad = 0;
+    h.timestamp_us = static_cast<int64_t>(client.frame.timestamp.tv_sec) *
+                     1000000 + client.frame.timestamp.tv_usec;
+    h.capture_ns = capture_ns;
+    h.skipped = client.skipped;
+    client.payload = image.data;
+
+    size_t coded = 0;
+    if (config.codec != CODEC_NONE && image.type() == CV_8UC1) {
+        size_t bound = codec_bound(config.codec, raw_bytes);
+        if (client.coded.size() < bound)
+            client.coded.resize(bound);
+        coded = encode_frame(config.codec, image, client.coded.data(),
+                             bound);
+    }
+    if (coded > 0) {
+        h.codec = config.codec;
+        h.bytes = coded;
+        client.payload = client.coded.data();
+    } else if (!image.isContinuous()) {
+        // A view into a wider frame: rows are gathered into one block.
+        const size_t row_bytes = image.cols * image.elemSize();
+        if (client.coded.size() < raw_bytes)
+            client.coded.resize(raw_bytes);
+        for (int r = 0; r < image.rows; ++r)
+            memcpy(&client.coded[r * row_bytes], image.ptr(r), row_bytes);
+        client.payload = client.coded.data();
+    }
+    if (h.codec != CODEC_NONE || !image.isContinuous())
+        client.frame.clear(); // The buffer isn't needed any more.
+    client.sent = 0;
+    client.total = sizeof(h) + h.bytes;
+    client.busy = true;
+    client.next_ns = std::max(client.next_ns + client.interval_ns, now);
+    return true;
+}
+
+bool StreamServer::send_frame(Client &client)
+{
+    const size_t header_bytes = sizeof(client.header);
+    while (client.sent < client.total) {
+        iovec iov[2];
+        int n = 0;
+        if (client.sent < header_bytes) {
+            iov[n].iov_base = reinterpret_cast<uint8_t*>(&client.header) +
+                              client.sent;
+            iov[n++].iov_len = header_bytes - client.sent;
+            iov[n].iov_base = const_cast<uint8_t*>(client.payload);
+            iov[n++].iov_len = client.header.bytes;
+        } else {
+            iov[n].iov_base = const_cast<uint8_t*>(client.payload) +
+                              (client.sent - header_bytes);
+            iov[n++].iov_len = client.total - client.sent;
+        }
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t ret = sendmsg(client.fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!client.writable_wait) {
+                epoll_event ev;
+                ev.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+                ev.data.ptr = &client;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &ev);
+                client.writable_wait = true;
+            }
+            return true;
+        }
+        if (ret == -1)
+            return false;
+        client.sent += ret;
+    }
+    client.bytes += client.total;
+    ++client.frames;
+    client.frame.clear();
+    client.total = 0;
+    client.busy = false;
+    if (client.writable_wait) {
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = &client;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client.fd, &ev);
+        client.writable_wait = false;
+    }
+    return true;
+}
+
+bool StreamServer::pump(Client &client, int64_t now, int &timeout_ms)
+{
+    // Send until the socket is full or nothing new is due.
+    for (;;) {
+        if (client.total == 0 && !start_frame(client, now))
+            break;
+        if (!send_frame(client))
+            return false;
+        if (client.total != 0)
+            return true; // Picked up again on EPOLLOUT.
+    }
+    if (client.interval_ns && client.next_ns > now) {
+        int wait = static_cast<int>((client.next_ns - now) / 1000000) + 1;
+        timeout_ms = timeout_ms < 0 ? wait : std::min(timeout_ms, wait);
+    }
+    return true;
+}
+
+void StreamServer::run()
+{
+    epoll_event events[max_events];
+    int timeout_ms = -1;
+    while (!stopping) {
+        int n = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+        std::vector<Client*> gone;
+        for (int i = 0; i < n; ++i) {
+            void *ptr = events[i].data.ptr;
+            if (!ptr) {
+                accept_clients();
+            } else if (ptr == &event_fd) {
+                uint64_t count;
+                if (read(event_fd, &count, sizeof(count)) < 0) {}
+            } else {
+                Client *client = static_cast<Client*>(ptr);
+                bool ok = !(events[i].events & (EPOLLERR | EPOLLHUP));
+                if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP)))
+                    ok = read_client(*client);
+                if (!ok)
+                    gone.push_back(client);
+            }
+        }
+        if (!gone.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Client *client : gone) {
+                for (size_t i = 0; i < clients.size(); ++i) {
+                    if (clients[i].get() == client) {
+                        close(client->fd); // Also leaves the epoll set.
+                        clients.erase(clients.begin() + i);
+                        break;
+                    }
+                }
+            }
+        }
+        // Only this thread adds or removes clients, so no lock is needed
+        // to walk them.
+        timeout_ms = -1;
+        const int64_t now = monotonic_ns();
+        for (size_t i = 0; i < clients.size(); ) {
+            if (pump(*clients[i], now, timeout_ms)) {
+                ++i;
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            close(clients[i]->fd);
+            clients.erase(clients.begin() + i);
+        }
+    }
+}
+
+StreamStatus StreamServer::status()
+{
+    StreamStatus s;
+    s.endpoint = endpoint_name(endpoint);
+    s.codec = config.codec;
+    std::lock_guard<std::mutex> lock(mutex);
+    s.offered = offered;
+    s.accepted = accepted;
+    s.refused = refused;
+    for (const std::unique_ptr<Client> &client : clients) {
+        StreamClientStatus c;
+        c.peer = client->peer;
+        c.max_fps = client->interval_ns ? 1e9 / client->interval_ns : 0;
+        c.frames = client->frames;
+        c.skipped = client->skipped;
+        c.bytes = client->bytes;
+        c.sending = client->busy;
+        s.clients.push_back(c);
+    }
+    return s;
+}
@@ -1,12 +1,31 @@
 #include <VideoCap.hpp>
 
+#include <chrono>
 
-VideoCapture::VideoCapture()
+static int mat_type_of(uint32_t fourcc)
+{
+    // What the rest of the pipeline knows how to handle.
+    switch (fourcc) {
+    case V4L2_PIX_FMT_GREY:
+        return CV_8UC1;
+    case V4L2_PIX_FMT_Y16:
+        return CV_16UC1;
+    default:
+        return -1;
+    }
+}
+
+VideoCapture::VideoCapture(const std::string &dev_name, unsigned int pool_size,
+                           io_method io, bool hugepages, bool lock_buffers)
+: dev_name(dev_name), io(io), hugepages(hugepages), lock_buffers(lock_buffers),
+  pool_size(pool_size), leased(0), leased_peak(0),
+  starved_count(0), lease_count(0), timeout_count(0), error_count(0),
+  corrupt_count(0), restart_count(0)
 {
-    dev_name = "/dev/video0";
     open_device();
     init_device();
-    start_capturing();
+    if (!start_capturing())
+        exit(EXIT_FAILURE);
 }
 
 void VideoCapture::capture(bool fpsSwitch)
@@ -15,12 +34,12 @@ void VideoCapture::capture(bool fpsSwitch)
     if (fpsSwitch)
         switch_fps();
     init_device();
-    start_capturing();
+    if (!start_capturing())
+        exit(EXIT_FAILURE);
 }
 
 void VideoCapture::release()
 {
-    cv::destroyAllWindows();
     uninit_device();
     close_device();
 }
@@ -32,6 +51,13 @@ void VideoCapture::errno_exit(const char *s)
     exit(EXIT_FAILURE);
 }
 
+void VideoCapture::report_error(const char *s)
+{
+    ++error_count;
+    fprintf(stderr, "%s: %s error %d, %s\n", dev_name.c_str(), s, errno,
+            strerror(errno));
+}
+
 int VideoCapture::xioctl(int fh, int request, void *arg)
 {
     int r;
@@ -46,28 +72,41 @@ void VideoCapture::open_device()
 {
     struct stat st;
 
-    if (-1 == stat(dev_name, &st)) {
+    if (-1 == stat(dev_name.c_str(), &st)) {
         fprintf(stderr, "Cannot identify '%s': %d, %s\n",
-                dev_name, errno, strerror(errno));
+                dev_name.c_str(), errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
     if (!S_ISCHR(st.st_mode)) {
-        fprintf(stderr, "%s is no device\n", dev_name);
+        fprintf(stderr, "%s is no device\n", dev_name.c_str());
         exit(EXIT_FAILURE);
     }
 
-    fd = open(dev_name , O_RDWR | O_NONBLOCK, 0);
+    fd = open(dev_name.c_str(), O_RDWR | O_NONBLOCK, 0);
 
     if (fd == -1) {
         fprintf(stderr, "Cannot open '%s' : %d, %s\n",
-                dev_name, errno, strerror(errno));
+                dev_name.c_str(), errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        errno_exit("epoll_create1");
+    struct epoll_event ev;
+    CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        errno_exit("epoll_ctl");
 }
 
 void VideoCapture::close_device()
 {
+    if (-1 == close(epoll_fd))
+        errno_exit("close");
+    epoll_fd = -1;
     if (-1 == close(fd))
         errno_exit("close");
     fd = -1;
@@ -78,13 +117,11 @@ void VideoCapture::init_device()
     struct v4l2_capability cap;
     struct v4l2_cropcap cropcap;
     struct v4l2_crop crop;
-    struct v4l2_format fmt;
-    unsigned int min;
 
     if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
         if (EINVAL == errno) {
             fprintf(stderr, "%s is no V4L2 device\n",
-                    dev_name);
+                    dev_name.c_str());
             exit(EXIT_FAILURE);
         } else {
             errno_exit("VIDIOC_QUERYCAP");
@@ -92,9 +129,24 @@ void VideoCapture::init_device()
     }
     if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
         fprintf(stderr, "%s is no video capture device \n",
-                dev_name);
+                dev_name.c_str());
         exit(EXIT_FAILURE);
     }
+    if (io == IO_METHOD_READ && !(cap.capabilities & V4L2_CAP_READWRITE)) {
+        fprintf(stderr, "%s does not support read i/o, using mmap\n",
+                dev_name.c_str());
+        io = IO_METHOD_MMAP;
+    }
+    if (io != IO_METHOD_READ && !(cap.capabilities & V4L2_CAP_STREAMING)) {
+        if (!(cap.capabilities & V4L2_CAP_READWRITE)) {
+            fprintf(stderr, "%s does not support streaming or read i/o\n",
+                    dev_name.c_str());
+            exit(EXIT_FAILURE);
+        }
+        fprintf(stderr, "%s does not support streaming i/o, using read\n",
+                dev_name.c_str());
+        io = IO_METHOD_READ;
+    }
 
     CLEAR(cropcap);
 
@@ -113,6 +165,13 @@ void VideoCapture::init_device()
             }
         }
     }
+    if (!set_format())
+        exit(EXIT_FAILURE);
+}
+
+bool VideoCapture::set_format()
+{
+    struct v4l2_format fmt;
 
     CLEAR(fmt);
     // The settings below are for a LI OV-580 OV7251 stereo camera.
@@ -120,63 +179,108 @@ void VideoCapture::init_device()
     //std::cout << "FORCE FORMAT: " << force_format << std::endl;
     if (force_format) {
         // fprintf(stderr, "SET PARAMETERS FOR OV580\r\n");
-        fmt.fmt.pix.width = 1280;
-        fmt.fmt.pix.height = 480;
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
+        fmt.fmt.pix.width = width; // 1280x480 GREY unless reconfigured.
+        fmt.fmt.pix.height = height;
+        fmt.fmt.pix.pixelformat = pixelformat;
         fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
-        if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1)
-            errno_exit("VIDIOC_S_FMT");
+        if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
+            report_error("VIDIOC_S_FMT");
+            return false;
+        }
     } else {
-        if (xioctl(fd, VIDIOC_G_FMT, &fmt) == -1)
-            errno_exit("VIDIOC_G_FMT");
+        if (xioctl(fd, VIDIOC_G_FMT, &fmt) == -1) {
+            report_error("VIDIOC_G_FMT");
+            return false;
+        }
+    }
+    if (!set_rate())
+        return false;
+    /*
+    std::cout << fmt.fmt.pix.pixelformat << std::endl;
+    */
+    width = fmt.fmt.pix.width;
+    height = fmt.fmt.pix.height;
+    if (mat_type_of(fmt.fmt.pix.pixelformat) < 0) {
+        fprintf(stderr, "%s gave pixel format %s, reading it as GREY\n",
+                dev_name.c_str(), fourcc_name(fmt.fmt.pix.pixelformat).c_str());
+        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
     }
+    pixelformat = fmt.fmt.pix.pixelformat;
+    mat_type = mat_type_of(pixelformat);
+    image_bytes = static_cast<size_t>(width) * height *
+                  (mat_type == CV_16UC1 ? 2 : 1);
+    size_t buffer_size = fmt.fmt.pix.sizeimage;
+    if (buffer_size < image_bytes)
+        buffer_size = image_bytes;
+
+    switch (io) {
+    case IO_METHOD_READ:
+        return init_read(buffer_size);
+    case IO_METHOD_USERPTR:
+        return init_userp(buffer_size);
+    case IO_METHOD_MMAP:
+    default:
+        return init_mmap();
+    }
+}
+
+bool VideoCapture::set_rate()
+{
     struct v4l2_streamparm parm;
 
+    CLEAR(parm);
     parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     parm.parm.capture.timeperframe.numerator = 1;
     parm.parm.capture.timeperframe.denominator = fps;
 
     if (-1 == xioctl(fd, VIDIOC_S_PARM, &parm)) {
-        errno_exit("VIDIOC_S_PARM");
+        report_error("VIDIOC_S_PARM");
+        return false;
     }
-    /*
-    std::cout << fmt.fmt.pix.width << std::endl;
-    std::cout << fmt.fmt.pix.height << std::endl;
-    std::cout << fmt.fmt.pix.pixelformat << std::endl;
-    */
-    init_mmap();
+    // The driver rounds to a rate it has.
+    const struct v4l2_fract &t = parm.parm.capture.timeperframe;
+    if (t.numerator > 0 && t.denominator > 0 &&
+        static_cast<int>(t.denominator / t.numerator) != fps) {
+        fps = t.denominator / t.numerator;
+        fprintf(stderr, "%s runs at %d fps\n", dev_name.c_str(), fps);
+    }
+    return true;
 }
 
-void VideoCapture::init_mmap()
+bool VideoCapture::init_mmap()
 {
     struct v4l2_requestbuffers req;
 
     CLEAR(req);
 
-    req.count = 500; // Originally 4.
+    req.count = pool_size; // Originally 4.
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
 
     if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
-        if (EINVAL == errno) {
-            fprintf(stderr, "%s does not support memory mapping\n", dev_name);
-            exit(EXIT_FAILURE);
-        } else {
-            errno_exit("VIDIOC_REQBUFS");
-        }
+        if (EINVAL == errno)
+            fprintf(stderr, "%s does not support memory mapping\n",
+                    dev_name.c_str());
+        else
+            report_error("VIDIOC_REQBUFS");
+        return false;
     }
 
     if (req.count < 2) {
-        fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
-        exit(EXIT_FAILURE);
+        fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name.c_str());
+        return false;
     }
+    if (req.count < pool_size)
+        fprintf(stderr, "%s granted %u of %u buffers\n",
+                dev_name.c_str(), req.count, pool_size);
 
     buffers = static_cast<buffer*>(calloc(req.count, sizeof(*buffers)));
+    held.assign(req.count, 0);
 
     if (!buffers) {
         fprintf(stderr, "Out of memory\n");
-        exit(EXIT_FAILURE);
+        return false;
     }
 
     for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
@@ -188,86 +292,352 @@ void VideoCapture::init_mmap()
         buf.memory = V4L2_MEMORY_MMAP;
         buf.index = n_buffers;
 
-        if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1)
-            errno_exit("VIDIOC_QUERYBUF");
+        // On failure, n_buffers counts the ones mapped for free_buffers().
+        if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) {
+            report_error("VIDIOC_QUERYBUF");
+            return false;
+        }
 
         buffers[n_buffers].length = buf.length;
         buffers[n_buffers].start = mmap(NULL, buf.length,
                                         PROT_READ | PROT_WRITE,
                                         MAP_SHARED,
                                         fd, buf.m.offset);
-        if (buffers[n_buffers].start == MAP_FAILED)
-            errno_exit("mmap");
+        if (buffers[n_buffers].start == MAP_FAILED) {
+            report_error("mmap");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool VideoCapture::init_userp(size_t buffer_size)
+{
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+
+    req.count = pool_size;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+        if (EINVAL == errno) {
+            fprintf(stderr, "%s does not support user pointer i/o, "
+                    "using mmap\n", dev_name.c_str());
+            io = IO_METHOD_MMAP;
+            return init_mmap();
+        }
+        report_error("VIDIOC_REQBUFS");
+        return false;
+    }
+
+    // The driver only tracks 'count' buffers at a time, so there is no
+    // point in having more of our own.
+    if (req.count < 2) {
+        fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name.c_str());
+        return false;
+    }
+    if (req.count < pool_size)
+        fprintf(stderr, "%s granted %u of %u buffers\n",
+                dev_name.c_str(), req.count, pool_size);
+    if ((arena.empty() || arena.buffer_stride() < buffer_size ||
+         arena.count() < req.count) &&
+        !arena.allocate(buffer_size, req.count, hugepages, lock_buffers))
+        return false;
+
+    buffers = static_cast<buffer*>(calloc(req.count, sizeof(*buffers)));
+    held.assign(req.count, 0);
+
+    if (!buffers) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+
+    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+        buffers[n_buffers].start = arena.buffer(n_buffers);
+        buffers[n_buffers].length = arena.buffer_stride(); // Whole pages.
+    }
+    return true;
+}
+
+bool VideoCapture::init_read(size_t buffer_size)
+{
+    // One spare buffer, read into and thrown away while every other one is
+    // leased, so a readable device isn't left to spin on.
+    if ((arena.empty() || arena.buffer_stride() < buffer_size ||
+         arena.count() < pool_size + 1) &&
+        !arena.allocate(buffer_size, pool_size + 1, hugepages, lock_buffers))
+        return false;
+
+    buffers = static_cast<buffer*>(calloc(pool_size + 1, sizeof(*buffers)));
+    held.assign(pool_size, 0);
+
+    if (!buffers) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
     }
+
+    free_list.clear();
+    for (n_buffers = 0; n_buffers <= pool_size; ++n_buffers) {
+        buffers[n_buffers].start = arena.buffer(n_buffers);
+        buffers[n_buffers].length = buffer_size;
+    }
+    n_buffers = pool_size;
+    for (unsigned int i = pool_size; i > 0; --i)
+        free_list.push_back(i - 1);
+    return true;
 }
 
 void VideoCapture::uninit_device()
 {
     enum v4l2_buf_type type;
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    // STREAMOFF returns every buffer to the dequeued state, so any lease
+    // still alive after this point belongs to a stale generation.
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (io != IO_METHOD_READ)
         if (xioctl(fd, VIDIOC_STREAMOFF, &type) == -1)
             errno_exit("VIDIOC_STREAMOFF");
+    if (leased > 0)
+        fprintf(stderr, "%u frame leases still held at release\n",
+                leased.load());
+    free_buffers(false);
+}
+
+void VideoCapture::free_buffers(bool keep_arena)
+{
+    ++generation;
+    leased = 0;
+    held.clear();
+    free_list.clear();
 
     unsigned int i;
 
-    for (i = 0; i < n_buffers; ++i)
-        if (munmap(buffers[i].start, buffers[i].length) == -1)
-            errno_exit("munmap");
+    if (io == IO_METHOD_MMAP) {
+        for (i = 0; i < n_buffers; ++i)
+            if (munmap(buffers[i].start, buffers[i].length) == -1)
+                errno_exit("munmap");
+    } else if (!keep_arena) {
+        arena.free();
+    }
 
     free(buffers);
+    buffers = NULL;
+    n_buffers = 0;
 }
 
-void VideoCapture::start_capturing()
+bool VideoCapture::start_capturing()
 {
     unsigned int i;
     enum v4l2_buf_type type;
 
-    for (i = 0; i < n_buffers; ++i) {
-        struct v4l2_buffer buf;
+    if (io == IO_METHOD_READ)
+        return true; // Nothing to queue, the first read() starts the capture.
 
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
-
-        if (xioctl(fd, VIDIOC_QBUF, &buf) == -1)
-            errno_exit("VIDIOC_QBUF");
-    }
+    for (i = 0; i < n_buffers; ++i)
+        if (!held[i] && queue_buffer(i) == -1) { // Leased ones come later.
+            report_error("VIDIOC_QBUF");
+            return false;
+        }
     type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (xioctl(fd, VIDIOC_STREAMON, &type))
-        errno_exit("VIDIOC_STREAMON");
+    if (xioctl(fd, VIDIOC_STREAMON, &type)) {
+        report_error("VIDIOC_STREAMON");
+        return false;
+    }
+    return true;
 }
 
-int VideoCapture::read(cv::Mat *frame)
+int VideoCapture::queue_buffer(unsigned int index)
 {
-    for (;;) {
-        fd_set fds; // Bit string of file descriptors.
-        struct timeval tv;
-        int r;
+    struct v4l2_buffer buf;
 
-        FD_ZERO(&fds); // Initializes file descriptor set &fds to be zero.
-        FD_SET(fd, &fds); // Sets bit for file descriptor fd in &fds.
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.index = index;
+    if (io == IO_METHOD_USERPTR) {
+        buf.memory = V4L2_MEMORY_USERPTR;
+        buf.m.userptr = reinterpret_cast<unsigned long>(buffers[index].start);
+        buf.length = buffers[index].length;
+    } else {
+        buf.memory = V4L2_MEMORY_MMAP;
+    }
+    return xioctl(fd, VIDIOC_QBUF, &buf);
+}
 
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
+int VideoCapture::wait_ready()
+{
+    struct epoll_event ev;
+    int r = epoll_wait(epoll_fd, &ev, 1, timeout_ms);
 
-        /* The select() function indicates which of the specified file
-        descriptors is ready for reading, ready for writing, or  has an error
-        condition pending. */
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
+    if (r == -1) {
+        if (errno != EINTR) // Interrupted system call.
+            report_error("epoll_wait");
+        return 0;
+    }
+    if (r == 0) {
+        ++timeout_count;
+        ++timeouts_in_row;
+        fprintf(stderr, "%s: no frame for %d ms\n", dev_name.c_str(),
+                timeout_ms);
+        if (timeouts_in_row % restart_after == 0)
+            restart_stream();
+        return 0;
+    }
+    timeouts_in_row = 0;
+    if (!(ev.events & EPOLLIN)) {
+        // EPOLLERR alone: nothing is queued (every buffer is leased) or the
+        // device went away. Don't spin on it.
+        if (ev.events & EPOLLHUP) {
+            errno = ENODEV;
+            report_error("epoll_wait");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return 0;
+    }
+    return 1;
+}
 
-        if (r == -1) {
-            if (errno == EINTR) // Interrupted system call.
-                continue;
-            errno_exit("select");
+bool VideoCapture::reconfigure(const StreamFormat &format)
+{
+    typedef std::chrono::steady_clock clock;
+    const unsigned int want_width = format.width ? format.width : width;
+    const unsigned int want_height = format.height ? format.height : height;
+    const uint32_t want_fourcc = format.fourcc ? format.fourcc : pixelformat;
+    if (mat_type_of(want_fourcc) < 0) {
+        fprintf(stderr, "Pixel format %s is not supported, use GREY or Y16\n",
+                fourcc_name(want_fourcc).c_str());
+        return false;
+    }
+    const bool new_format = want_width != width || want_height != height ||
+                            want_fourcc != pixelformat;
+
+    std::unique_lock<std::mutex> lock(pool_mutex);
+    // Buffers have to be given back to the driver before S_FMT, and the
+    // frames in flight point into them. Wait for them while the stream
+    // still runs (requeue() queues them as usual) and change nothing if
+    // they aren't all back in time.
+    if (new_format &&
+        !returned.wait_for(lock, std::chrono::seconds(2),
+                           [this] { return leased == 0; })) {
+        fprintf(stderr, "%s: %u frame leases still held, not "
+                "reconfiguring\n", dev_name.c_str(), leased.load());
+        return false;
+    }
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    const clock::time_point off = clock::now();
+    if (io != IO_METHOD_READ && xioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
+        report_error("VIDIOC_STREAMOFF");
+        return false;
+    }
+    const int old_fps = fps;
+    if (format.fps > 0)
+        fps = format.fps;
+
+    bool reused = !new_format;
+    if (!new_format) {
+        // Drivers refuse S_PARM while streaming, but the buffers can stay.
+        if (!set_rate()) {
+            fps = old_fps;
+            set_rate();
+            if (!start_capturing())
+                fprintf(stderr, "%s: stream stays off\n", dev_name.c_str());
+            return false;
         }
-        if (r == 0) {
-            fprintf(stderr, "select timeout \n");
-            exit(EXIT_FAILURE);
+    } else {
+        const unsigned int old_width = width, old_height = height;
+        const uint32_t old_fourcc = pixelformat;
+        const void *before = arena.empty() ? NULL : arena.buffer(0);
+        width = want_width;
+        height = want_height;
+        pixelformat = want_fourcc;
+        if (!renew_buffers()) {
+            // Every lease is back, so nothing points into the buffers and
+            // the old format can be set up again from scratch.
+            fprintf(stderr, "%s: cannot switch format, restoring %ux%u %s\n",
+                    dev_name.c_str(), old_width, old_height,
+                    fourcc_name(old_fourcc).c_str());
+            width = old_width;
+            height = old_height;
+            pixelformat = old_fourcc;
+            fps = old_fps;
+            if (!renew_buffers() || !start_capturing())
+                fprintf(stderr, "%s: stream stays off\n", dev_name.c_str());
+            return false;
         }
-        if (process_frame(frame))
-            break;
+        reused = io != IO_METHOD_MMAP && before != NULL &&
+                 !arena.empty() && arena.buffer(0) == before;
+    }
+    if (!start_capturing()) {
+        fprintf(stderr, "%s: stream stays off\n", dev_name.c_str());
+        return false;
+    }
+    const double off_ms = std::chrono::duration<double, std::milli>(
+        clock::now() - off).count();
+
+    std::cout << dev_name << ": " << width << "x" << height << " "
+              << fourcc_name(pixelformat) << " at " << fps << " fps, "
+              << (reused ? "buffers reused" : "new buffers")
+              << ", stream off for " << off_ms << " ms" << std::endl;
+    if (width != want_width || height != want_height)
+        fprintf(stderr, "%s adjusted the size to %ux%u\n", dev_name.c_str(),
+                width, height);
+    return true;
+}
+
+bool VideoCapture::renew_buffers()
+{
+    free_buffers(true);
+    if (io != IO_METHOD_READ) {
+        struct v4l2_requestbuffers req;
+        CLEAR(req);
+        req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR
+                                             : V4L2_MEMORY_MMAP;
+        if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+            report_error("VIDIOC_REQBUFS");
+            return false;
+        }
+    }
+    if (set_format())
+        return true;
+    free_buffers(true); // Whatever set_format() got before it failed.
+    return false;
+}
+
+void VideoCapture::restart_stream()
+{
+    // Buffers held by frames stay dequeued; requeue() queues them as usual
+    // once they are let go, since the generation doesn't change.
+    if (io == IO_METHOD_READ)
+        return; // No stream to restart.
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    fprintf(stderr, "%s: restarting stream\n", dev_name.c_str());
+    if (xioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
+        report_error("VIDIOC_STREAMOFF");
+        return;
     }
+    for (unsigned int i = 0; i < n_buffers; ++i) {
+        if (held[i])
+            continue;
+        if (queue_buffer(i) == -1)
+            report_error("VIDIOC_QBUF");
+    }
+    if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) {
+        report_error("VIDIOC_STREAMON");
+        return;
+    }
+    ++restart_count;
+}
+
+int VideoCapture::read(cv::Mat *frame)
+{
+    if (!wait_ready())
+        return 0;
+    if (!process_frame(frame))
+        return 0;
     return !(frame->data == NULL);
 }
 
@@ -276,15 +646,25 @@ int VideoCapture::process_frame(cv::Mat *frame)
     struct v4l2_buffer buf;
     CLEAR(buf);
 
+    if (io == IO_METHOD_READ) {
+        if (::read(fd, buffers[n_buffers].start,
+                   buffers[n_buffers].length) == -1)
+            return 0;
+        frame->data = static_cast<uchar*>(buffers[n_buffers].start);
+        return 1;
+    }
+
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    buf.memory = io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR
+                                         : V4L2_MEMORY_MMAP;
 
     if (xioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
         switch (errno) {
         case EAGAIN: //Resource temporarily unavailable.
             return 0;
         default:
-            errno_exit("VIDIOC_DQBUF");
+            report_error("VIDIOC_DQBUF");
+            return 0;
         }
     }
     assert(buf.index < n_buffers);
@@ -299,7 +679,7 @@ int VideoCapture::process_frame(cv::Mat *frame)
     // Write buffer data into opencv mat.
     frame->data = static_cast<uchar*>(buffers[buf.index].start);
 
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
+    if (-1 == queue_buffer(buf.index))
             errno_exit("VIDIOC_QBUF");
 
     return 1;
@@ -307,35 +687,34 @@ int VideoCapture::process_frame(cv::Mat *frame)
 
 int VideoCapture::read(Frame &frame)
 {
-    for (;;) {
-        fd_set fds; // Bit string of file descriptors.
-        struct timeval tv;
-        int r;
-
-        FD_ZERO(&fds); // Initializes file descriptor set &fds to be zero.
-        FD_SET(fd, &fds); // Sets bit for file descriptor fd in &fds.
-
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
-
-        /* The select() function indicates which of the specified file
-        descriptors is ready for reading, ready for writing, or  has an error
-        condition pending. */
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
+    frame.clear();
+    if (!wait_ready())
+        return 0;
+    int r;
+    do {
+        r = process_frame(frame);
+    } while (r < 0);
+    return r;
+}
 
-        if (r == -1) {
-            if (errno == EINTR) // Interrupted system call.
-                continue;
-            errno_exit("select");
-        }
-        if (r == 0) {
-            fprintf(stderr, "select timeout \n");
-            exit(EXIT_FAILURE);
-        }
-        if (process_frame(frame))
+size_t VideoCapture::read_batch(std::vector<Frame> &frames, size_t max)
+{
+    frames.clear();
+    if (max == 0 || !wait_ready())
+        return 0;
+    // Everything the driver has finished goes out in one go; the last
+    // DQBUF's EAGAIN ends the batch.
+    frames.resize(max);
+    size_t n = 0;
+    while (n < max) {
+        int r = process_frame(frames[n]);
+        if (r == 0)
             break;
+        if (r > 0)
+            ++n;
     }
-    return 1;
+    frames.resize(n);
+    return n;
 }
 
 int VideoCapture::process_frame(Frame &frame)
@@ -344,36 +723,122 @@ int VideoCapture::process_frame(Frame &frame)
     frame.clear();
     CLEAR(buf);
 
+    if (io == IO_METHOD_READ)
+        return read_frame(frame);
+
     buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    buf.memory = io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR
+                                         : V4L2_MEMORY_MMAP;
 
     if (xioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
         switch (errno) {
         case EAGAIN: //Resource temporarily unavailable.
             return 0;
         default:
-            errno_exit("VIDIOC_DQBUF");
+            // EIO is a lost or damaged transfer, anything else (e.g. the
+            // camera being unplugged) is for the caller to notice in events().
+            report_error("VIDIOC_DQBUF");
+            return 0;
         }
     }
     assert(buf.index < n_buffers);
 
-    // if (buf.flags & V4L2_BUF_FLAG_ERROR)
-    //     std::cout << "BUFF FLAG ERROR" << std::endl;
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        // Partially written frame, give it straight back.
+        ++corrupt_count;
+        if (-1 == queue_buffer(buf.index))
+            report_error("VIDIOC_QBUF");
+        return -1;
+    }
 
-    // Output timestamps, when first data byte was captured.
-    // struct timeval tv = buf.timestamp;
-    // std::cout << tv.tv_sec << "." << tv.tv_usec << std::endl;
+    // Point the opencv mat at the buffer, which stays dequeued until the
+    // lease is dropped by the last consumer of the frame.
+    frame.image = cv::Mat(height, width, mat_type, buffers[buf.index].start);
+    frame.timestamp = buf.timestamp; // When the first byte was captured.
+    frame.sequence = buf.sequence;
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        frame.stamps[STAGE_DRIVER] = timeval_ns(buf.timestamp);
+    frame.lease = lease_buffer(buf.index);
 
-    // Write buffer data into opencv mat.
-    frame.image.data = static_cast<uchar*>(buffers[buf.index].start);
-    frame.timestamp = buf.timestamp;
+    return 1;
+}
 
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+int VideoCapture::read_frame(Frame &frame)
+{
+    unsigned int index = n_buffers; // The discard buffer.
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        if (!free_list.empty()) {
+            index = free_list.back();
+            free_list.pop_back();
+        }
+    }
+    ssize_t n = ::read(fd, buffers[index].start, buffers[index].length);
+    int r = 1;
+    if (n == -1) {
+        if (errno != EAGAIN)
+            report_error("read");
+        r = 0;
+    } else if (static_cast<size_t>(n) < image_bytes) {
+        ++corrupt_count; // Short frame.
+        r = -1;
+    } else if (index == n_buffers) {
+        ++starved_count; // Read only to drain it, as the driver would drop it.
+        r = -1;
+    }
+    if (r != 1) {
+        if (index != n_buffers) {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            free_list.push_back(index);
+        }
+        return r;
+    }
 
+    // read() gives no driver timestamp; take our own, on the same clock.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    frame.image = cv::Mat(height, width, mat_type, buffers[index].start);
+    frame.timestamp.tv_sec = ts.tv_sec;
+    frame.timestamp.tv_usec = ts.tv_nsec / 1000;
+    frame.sequence = read_sequence++;
+    frame.stamps[STAGE_DRIVER] = timeval_ns(frame.timestamp);
+    frame.lease = lease_buffer(index);
     return 1;
 }
 
+std::shared_ptr<FrameLease> VideoCapture::lease_buffer(unsigned int index)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool_mutex);
+        held[index] = 1;
+    }
+    unsigned int count = ++leased;
+    unsigned int peak = leased_peak;
+    while (count > peak && !leased_peak.compare_exchange_weak(peak, count)) {}
+    // With every buffer leased the driver has nowhere to put the next frame,
+    // and drops it until a consumer lets go of one.
+    if (count >= n_buffers)
+        ++starved_count;
+    ++lease_count;
+    return std::make_shared<FrameLease>(this, index, generation);
+}
+
+void VideoCapture::requeue(unsigned int index, unsigned int gen)
+{
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    if (gen != generation || fd == -1)
+        return;
+
+    held[index] = 0;
+    if (--leased == 0)
+        returned.notify_all();
+    if (io == IO_METHOD_READ)
+        free_list.push_back(index);
+    else if (-1 == queue_buffer(index))
+        report_error("VIDIOC_QBUF");
+}
+
 void VideoCapture::switch_fps()
 {
     if (fps == 60) {
@@ -385,3 +850,33 @@ void VideoCapture::switch_fps()
 }
 
 int VideoCapture::get_fps() {return fps;}
+
+PoolStatus VideoCapture::pool_status()
+{
+    PoolStatus status;
+    status.size = n_buffers;
+    status.leased = leased;
+    status.peak = leased_peak;
+    status.starved = starved_count;
+    status.leases = lease_count;
+    return status;
+}
+
+SourceEvents VideoCapture::events()
+{
+    SourceEvents events;
+    events.timeouts = timeout_count;
+    events.errors = error_count;
+    events.corrupt = corrupt_count;
+    events.restarts = restart_count;
+    return events;
+}
+
+std::string VideoCapture::describe()
+{
+    return "V4L2 " + dev_name + ", " + std::to_string(width) + "x" +
+           std::to_string(height) + " " + fourcc_name(pixelformat) + ", " +
+           std::to_string(fps) + " fps, " + std::to_string(n_buffers) + " " +
+           io_method_name(io) + " buffers" +
+           (io == IO_METHOD_MMAP ? "" : " (" + arena.describe() + ")");
+}
@@ -0,0 +1,91 @@
+#include <WorkPool.hpp>
+
+#include <RealTime.hpp>
+
+// Which pool and worker the calling thread is, if any.
+static thread_local const WorkPool *current_pool = nullptr;
+static thread_local unsigned int current_worker = 0;
+
+WorkPool::WorkPool(unsigned int threads, const std::vector<int> &cpus)
+: queued(0), stolen(0), next(0)
+{
+    if (threads == 0)
+        threads = 1;
+    for (unsigned int i = 0; i < threads; ++i)
+        workers.push_back(std::unique_ptr<Worker>(new Worker()));
+    // Every deque exists before the first worker may try to steal.
+    for (unsigned int i = 0; i < threads; ++i) {
+        workers[i]->thread = std::thread(&WorkPool::run, this, i);
+        if (!cpus.empty())
+            pin_thread(workers[i]->thread, cpus[i % cpus.size()]);
+    }
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::unique_ptr<Worker> &worker : workers)
+        worker->thread.join();
+}
+
+void WorkPool::post(std::function<void()> task)
+{
+    unsigned int i = current_pool == this ? current_worker
+                                          : next++ % workers.size();
+    {
+        std::lock_guard<std::mutex> lock(workers[i]->mutex);
+        workers[i]->tasks.push_back(std::move(task));
+    }
+    ++queued;
+    // Taking the lock orders this against a worker about to sleep.
+    { std::lock_guard<std::mutex> lock(sleep_mutex); }
+    wake.notify_one();
+}
+
+bool WorkPool::take(unsigned int self, std::function<void()> &task)
+{
+    {
+        Worker &own = *workers[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            --queued;
+            return true;
+        }
+    }
+    for (size_t k = 1; k < workers.size(); ++k) {
+        Worker &victim = *workers[(self + k) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queued;
+            ++stolen;
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::run(unsigned int self)
+{
+    current_pool = this;
+    current_worker = self;
+    std::function<void()> task;
+    while (true) {
+        if (take(self, task)) {
+            task();
+            task = nullptr; // Drops what the task captured before sleeping.
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
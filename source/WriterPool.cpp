@@ -0,0 +1,227 @@
+#include <WriterPool.hpp>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include <opencv2/imgcodecs.hpp>
+
+bool PgmSink::encode(WriteJob &job)
+{
+    const struct timeval &tv = job.frame.timestamp;
+    long ts = tv.tv_sec*1e6 + tv.tv_usec;
+    std::string fName = pgm_name(ts, job.sequence, job.frame.camera,
+                                 job.frame.view);
+    if (!cv::imwrite(fName, job.frame.image)) {
+        fprintf(stderr, "Cannot write '%s'\n", fName.c_str());
+        return false;
+    }
+    job.bytes = job.frame.image.total() * job.frame.image.elemSize();
+    return true;
+}
+
+bool RecordSink::encode(WriteJob &job)
+{
+    const cv::Mat &image = job.frame.image;
+    frame_codec c = codec;
+    size_t bound = RecordWriter::record_bound(image, c);
+    if (job.buffer.size() < bound)
+        job.buffer.resize(bound);
+
+    auto t0 = std::chrono::steady_clock::now();
+    job.bytes = RecordWriter::encode_record(job.frame, job.sequence,
+                                            job.buffer.data(), c);
+    auto t1 = std::chrono::steady_clock::now();
+    if (job.bytes == 0) {
+        fprintf(stderr, "Cannot encode frame %lu\n",
+                static_cast<unsigned long>(job.sequence));
+        return false;
+    }
+    const RecordHeader *header =
+        reinterpret_cast<const RecordHeader*>(job.buffer.data());
+    stats.add(header->raw_bytes, header->payload_bytes,
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  t1 - t0).count());
+    return true;
+}
+
+bool RecordSink::commit(WriteJob &job)
+{
+    return recorder.append_record(job.buffer.data());
+}
+
+WriterPool::WriterPool(FrameSink &sink, std::atomic_ulong &written,
+                       unsigned int n_workers, const std::vector<int> &cpus,
+                       unsigned int depth, PipelineStats *pipeline)
+: sink(sink), written(written), pipeline(pipeline),
+  workers(new Worker[n_workers > 0 ? n_workers : 1]),
+  started(std::chrono::steady_clock::now()), pending(0), failed(0)
+{
+    if (n_workers == 0)
+        n_workers = 1;
+    if (depth == 0)
+        depth = 4 * n_workers;
+    slots.resize(depth);
+    states.assign(depth, SLOT_FREE);
+
+    for (unsigned int i = 0; i < n_workers; ++i) {
+        workers[i].frames = 0;
+        workers[i].bytes = 0;
+        workers[i].busy_ns = 0;
+        workers[i].cpu = -1;
+        threads.push_back(std::thread(&WriterPool::run, this, i));
+        if (!cpus.empty()) {
+            int cpu = cpus[i % cpus.size()];
+            if (pin_thread(threads.back(), cpu))
+                workers[i].cpu = cpu;
+        }
+    }
+}
+
+WriterPool::~WriterPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    // Workers finish whatever was submitted before they see 'stopping'.
+    work_ready.notify_all();
+    slot_freed.notify_all();
+    for (std::thread &t : threads)
+        t.join();
+    std::lock_guard<std::mutex> lock(commit_mutex);
+    sink.flush();
+}
+
+bool WriterPool::submit(Frame &&frame)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    const size_t depth = slots.size();
+    slot_freed.wait(lock, [&] {
+        return states[next_submit % depth] == SLOT_FREE || stopping;
+    });
+    if (stopping)
+        return false;
+    WriteJob &job = slots[next_submit % depth];
+    job.frame = std::move(frame);
+    job.sequence = next_submit;
+    job.bytes = 0;
+    states[next_submit % depth] = SLOT_QUEUED;
+    ++next_submit;
+    ++pending;
+    lock.unlock();
+    work_ready.notify_one();
+    return true;
+}
+
+void WriterPool::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    slot_freed.wait(lock, [&] { return next_commit == next_submit; });
+    lock.unlock();
+    std::lock_guard<std::mutex> commit_lock(commit_mutex);
+    sink.flush();
+}
+
+void WriterPool::run(unsigned int id)
+{
+    Worker &worker = workers[id];
+    const size_t depth = slots.size();
+
+    for (;;) {
+        std::unique_lock<std::mutex> lock(mutex);
+        work_ready.wait(lock, [&] {
+            return next_take < next_submit || stopping;
+        });
+        if (next_take == next_submit)
+            return;
+        uint64_t seq = next_take++;
+        WriteJob &job = slots[seq % depth];
+        lock.unlock();
+
+        auto t0 = std::chrono::steady_clock::now();
+        if (!sink.encode(job))
+            job.bytes = 0;
+        auto t1 = std::chrono::steady_clock::now();
+        if (pipeline)
+            pipeline->stamp(job.frame, STAGE_ENCODE);
+        worker.busy_ns += std::chrono::duration_cast<
+            std::chrono::nanoseconds>(t1 - t0).count();
+        worker.frames += 1;
+        worker.bytes += job.bytes;
+
+        lock.lock();
+        states[seq % depth] = SLOT_DONE;
+        lock.unlock();
+        commit_ready(worker);
+    }
+}
+
+void WriterPool::commit_ready(Worker &worker)
+{
+    // Whoever holds commit_mutex commits every finished frame at the head of
+    // the sequence, including those finished by other workers meanwhile.
+    // A worker that finds it taken leaves its frame to the current holder,
+    // which re-checks the head after each commit.
+    std::unique_lock<std::mutex> commit_lock(commit_mutex, std::try_to_lock);
+    const size_t depth = slots.size();
+
+    while (commit_lock.owns_lock()) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (next_commit < next_take &&
+               states[next_commit % depth] == SLOT_DONE) {
+            WriteJob &job = slots[next_commit % depth];
+            lock.unlock();
+
+            auto t0 = std::chrono::steady_clock::now();
+            if (job.bytes > 0 && sink.commit(job)) {
+                written += 1;
+                if (pipeline)
+                    pipeline->stamp(job.frame, STAGE_WRITE);
+            } else if (failed++ == 0) {
+                // The sink reported the cause; later ones are only counted.
+                fprintf(stderr, "Frame %lu was not written, see 'workers' "
+                        "for the frames lost\n",
+                        static_cast<unsigned long>(job.sequence));
+            }
+            job.frame.clear(); // Releases the lease on the frame buffer.
+            auto t1 = std::chrono::steady_clock::now();
+            worker.busy_ns += std::chrono::duration_cast<
+                std::chrono::nanoseconds>(t1 - t0).count();
+
+            lock.lock();
+            states[next_commit % depth] = SLOT_FREE;
+            ++next_commit;
+            --pending;
+            slot_freed.notify_all();
+        }
+        lock.unlock();
+        commit_lock.unlock();
+        // A frame may have finished between the last check and unlocking
+        // commit_mutex; its worker could have failed the try_lock, so look
+        // once more before leaving.
+        lock.lock();
+        bool more = next_commit < next_take &&
+                    states[next_commit % depth] == SLOT_DONE;
+        lock.unlock();
+        if (more)
+            commit_lock.try_lock();
+    }
+}
+
+std::vector<WorkerStats> WriterPool::stats()
+{
+    std::vector<WorkerStats> result;
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - started).count();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        WorkerStats s;
+        s.frames = workers[i].frames;
+        s.bytes = workers[i].bytes;
+        s.busy_s = workers[i].busy_ns * 1e-9;
+        s.elapsed_s = elapsed;
+        s.cpu = workers[i].cpu;
+        result.push_back(s);
+    }
+    return result;
+}
@@ -2,8 +2,482 @@
 
 using namespace std;
 
+// Long options without a short form.
+enum {
+    OPT_WRITER_CPUS = 256,
+    OPT_DISK,
+    OPT_IO_DEPTH,
+    OPT_HISTORY_MB,
+    OPT_HISTORY_S,
+    OPT_STATS,
+    OPT_CAMERAS,
+    OPT_GROUP_MS,
+    OPT_READER_CPUS,
+    OPT_PREVIEW_FPS,
+    OPT_PREVIEW_SCALE,
+    OPT_NO_PREVIEW,
+    OPT_STEREO,
+    OPT_IO,
+    OPT_HUGEPAGES,
+    OPT_MLOCK,
+    OPT_RING_MB,
+    OPT_OVERLOAD,
+    OPT_WRITE_CPUS,
+    OPT_PREVIEW_CPUS,
+    OPT_RT_PRIORITY,
+    OPT_MLOCKALL,
+    OPT_JITTER_TEST,
+    OPT_LOAD,
+    OPT_RECTIFY,
+    OPT_CALIBRATION,
+    OPT_RECTIFY_THREADS,
+    OPT_STAGES,
+    OPT_STAGE_THREADS,
+    OPT_STAGE_CPUS,
+    OPT_STAGE_QUEUE,
+    OPT_GATE,
+    OPT_GATE_LEVEL,
+    OPT_GATE_PRE,
+    OPT_GATE_POST,
+    OPT_GATE_KEEP,
+    OPT_GATE_LOG,
+    OPT_BUS,
+    OPT_BUS_SLOTS,
+    OPT_STREAM,
+    OPT_STREAM_CODEC,
+    OPT_STREAM_FPS,
+    OPT_STREAM_CLIENTS,
+    OPT_CONTROL,
+};
+
+static void usage(const char *prog)
+{
+    cout << "Usage: " << prog << " [options]\n"
+         << "  -d, --device PATH      V4L2 device (default /dev/video0), repeat\n"
+         << "                         to capture several cameras at once\n"
+         << "      --cameras N        Number of synthetic cameras (default 1)\n"
+         << "      --group-ms MS      Timestamp tolerance of a multi-camera\n"
+         << "                         group (default half a frame period)\n"
+         << "      --reader-cpus LIST Pin camera readers to CPUs\n"
+         << "      --ring-mb N        Memory for frames queued per camera\n"
+         << "                         (default 256)\n"
+         << "      --overload POLICY  When a ring fills: block (default),\n"
+         << "                         drop-newest, drop-oldest, decimate[:K]\n"
+         << "  -b, --buffers N        Frame buffers to allocate (default 500)\n"
+         << "      --io METHOD        V4L2 buffers: mmap (default), userptr\n"
+         << "                         or read\n"
+         << "      --hugepages        Put our frame buffers on huge pages\n"
+         << "      --mlock            Fault in and lock our frame buffers\n"
+         << "  -s, --synthetic WxH    Generate frames instead of capturing\n"
+         << "  -f, --fps N            Synthetic rate, 0 for unthrottled\n"
+         << "  -j, --jitter US        Synthetic timing jitter, microseconds\n"
+         << "  -p, --pattern NAME     gradient, checker, noise or bar\n"
+         << "  -r, --replay DIR       Replay .pgm frames recorded in DIR\n"
+         << "  -m, --max-speed        Replay as fast as frames can be read\n"
+         << "  -l, --loop             Restart the replay when it ends\n"
+         << "  -o, --output FORMAT    pgm (default) or vcap\n"
+         << "  -R, --record BASE      Recording prefix for vcap output\n"
+         << "  -S, --segment-mb N     vcap segment size (default 1024)\n"
+         << "  -D, --direct           Write vcap segments with O_DIRECT\n"
+         << "  -c, --codec CODEC      vcap compression: none, fast or high\n"
+         << "      --disk BACKEND     vcap writes: sync, threads or uring\n"
+         << "      --io-depth N       vcap writes in flight (default 4)\n"
+         << "      --history-mb N     Keep N MB of frames from before 'start'\n"
+         << "      --history-s SEC    Keep frames from the last SEC seconds\n"
+         << "      --stats            Time every pipeline stage from the start\n"
+         << "      --preview-fps N    Display rate (default 30)\n"
+         << "      --preview-scale S  Display size, e.g. 0.5 (default 1)\n"
+         << "      --no-preview       Don't display frames (headless)\n"
+         << "      --stereo MODE      Write left/right halves as separate\n"
+         << "                         frames: off, view or copy\n"
+         << "      --rectify MODE     Rectify frames: off, replace (write only\n"
+         << "                         the rectified frame) or both\n"
+         << "      --calibration FILE Stereo calibration to rectify with\n"
+         << "      --rectify-threads N\n"
+         << "                         Rectify workers besides the write\n"
+         << "                         thread (default 3)\n"
+         << "      --stages SPEC      Processing stages, e.g.\n"
+         << "                         'rectify>split;brightness'\n"
+         << "      --stage-threads N  Workers running the stages (default 2)\n"
+         << "      --stage-cpus LIST  Pin stage workers to CPUs\n"
+         << "      --stage-queue N    Frames queued per stage (default 8)\n"
+         << "      --gate PCT         Write only frames where PCT% of the\n"
+         << "                         frame changed ('start' takes)\n"
+         << "      --gate-level N     Grey levels that count as a change\n"
+         << "                         (default 8)\n"
+         << "      --gate-pre N       Frames written ahead of a change (10)\n"
+         << "      --gate-post N      Frames written after a change (50)\n"
+         << "      --gate-keep FPS    Least rate written without change\n"
+         << "                         (default 1, 0 for none)\n"
+         << "      --gate-log FILE    Log every gate decision as CSV\n"
+         << "      --bus NAME         Publish frames to shared memory for\n"
+         << "                         other processes (see vcap_bus)\n"
+         << "      --bus-slots N      Frames the bus holds (default 32)\n"
+         << "      --stream ENDPOINT  Stream live frames on [ADDR:]PORT or\n"
+         << "                         unix:PATH (see vcap_recv)\n"
+         << "      --stream-codec C   Stream compression: none, fast or high\n"
+         << "      --stream-fps N     Frames a second per client at most\n"
+         << "      --stream-clients N Clients at once (default 8)\n"
+         << "      --control ENDPOINT Take commands and serve metrics on\n"
+         << "                         unix:PATH or [ADDR:]PORT (ADDR\n"
+         << "                         defaults to 127.0.0.1)\n"
+         << "  -w, --writers N        Writer threads (default 2)\n"
+         << "      --writer-cpus LIST Pin writers to CPUs, e.g. 2,3 or 2-5\n"
+         << "      --write-cpus LIST  Pin the write thread to CPUs\n"
+         << "      --preview-cpus LIST\n"
+         << "                         Pin the preview thread to CPUs\n"
+         << "      --rt-priority N    Run camera readers as SCHED_FIFO N\n"
+         << "      --mlockall         Lock all memory, current and future\n"
+         << "      --jitter-test SEC  Time frame dequeues for SEC seconds idle\n"
+         << "                         and SEC under CPU load, then exit\n"
+         << "      --load N           Load threads of the jitter test\n"
+         << "                         (default one per CPU)\n"
+         << "  -h, --help             Show this message\n";
+}
+
 int main(int argc, char *argv[])
 {
-    CaptureApplication run;
+    static const struct option long_options[] = {
+        {"device", required_argument, 0, 'd'},
+        {"cameras", required_argument, 0, OPT_CAMERAS},
+        {"group-ms", required_argument, 0, OPT_GROUP_MS},
+        {"reader-cpus", required_argument, 0, OPT_READER_CPUS},
+        {"ring-mb", required_argument, 0, OPT_RING_MB},
+        {"overload", required_argument, 0, OPT_OVERLOAD},
+        {"buffers", required_argument, 0, 'b'},
+        {"io", required_argument, 0, OPT_IO},
+        {"hugepages", no_argument, 0, OPT_HUGEPAGES},
+        {"mlock", no_argument, 0, OPT_MLOCK},
+        {"synthetic", required_argument, 0, 's'},
+        {"fps", required_argument, 0, 'f'},
+        {"jitter", required_argument, 0, 'j'},
+        {"pattern", required_argument, 0, 'p'},
+        {"replay", required_argument, 0, 'r'},
+        {"max-speed", no_argument, 0, 'm'},
+        {"loop", no_argument, 0, 'l'},
+        {"output", required_argument, 0, 'o'},
+        {"record", required_argument, 0, 'R'},
+        {"segment-mb", required_argument, 0, 'S'},
+        {"direct", no_argument, 0, 'D'},
+        {"codec", required_argument, 0, 'c'},
+        {"disk", required_argument, 0, OPT_DISK},
+        {"io-depth", required_argument, 0, OPT_IO_DEPTH},
+        {"history-mb", required_argument, 0, OPT_HISTORY_MB},
+        {"history-s", required_argument, 0, OPT_HISTORY_S},
+        {"stats", no_argument, 0, OPT_STATS},
+        {"preview-fps", required_argument, 0, OPT_PREVIEW_FPS},
+        {"preview-scale", required_argument, 0, OPT_PREVIEW_SCALE},
+        {"no-preview", no_argument, 0, OPT_NO_PREVIEW},
+        {"stereo", required_argument, 0, OPT_STEREO},
+        {"rectify", required_argument, 0, OPT_RECTIFY},
+        {"calibration", required_argument, 0, OPT_CALIBRATION},
+        {"rectify-threads", required_argument, 0, OPT_RECTIFY_THREADS},
+        {"stages", required_argument, 0, OPT_STAGES},
+        {"stage-threads", required_argument, 0, OPT_STAGE_THREADS},
+        {"stage-cpus", required_argument, 0, OPT_STAGE_CPUS},
+        {"stage-queue", required_argument, 0, OPT_STAGE_QUEUE},
+        {"gate", required_argument, 0, OPT_GATE},
+        {"gate-level", required_argument, 0, OPT_GATE_LEVEL},
+        {"gate-pre", required_argument, 0, OPT_GATE_PRE},
+        {"gate-post", required_argument, 0, OPT_GATE_POST},
+        {"gate-keep", required_argument, 0, OPT_GATE_KEEP},
+        {"gate-log", required_argument, 0, OPT_GATE_LOG},
+        {"bus", required_argument, 0, OPT_BUS},
+        {"bus-slots", required_argument, 0, OPT_BUS_SLOTS},
+        {"stream", required_argument, 0, OPT_STREAM},
+        {"stream-codec", required_argument, 0, OPT_STREAM_CODEC},
+        {"stream-fps", required_argument, 0, OPT_STREAM_FPS},
+        {"stream-clients", required_argument, 0, OPT_STREAM_CLIENTS},
+        {"control", required_argument, 0, OPT_CONTROL},
+        {"writers", required_argument, 0, 'w'},
+        {"writer-cpus", required_argument, 0, OPT_WRITER_CPUS},
+        {"write-cpus", required_argument, 0, OPT_WRITE_CPUS},
+        {"preview-cpus", required_argument, 0, OPT_PREVIEW_CPUS},
+        {"rt-priority", required_argument, 0, OPT_RT_PRIORITY},
+        {"mlockall", no_argument, 0, OPT_MLOCKALL},
+        {"jitter-test", required_argument, 0, OPT_JITTER_TEST},
+        {"load", required_argument, 0, OPT_LOAD},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    CaptureConfig config;
+    std::string calibration;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "d:b:s:f:j:p:r:mlo:R:S:Dc:w:h",
+                            long_options, NULL)) != -1) {
+        switch (c) {
+        case 'd':
+            config.source.kind = SOURCE_V4L2;
+            config.source.device = optarg;
+            config.devices.push_back(optarg);
+            break;
+        case OPT_CAMERAS:
+            config.cameras = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_GROUP_MS:
+            config.group_ms = atof(optarg);
+            break;
+        case OPT_READER_CPUS:
+            if (!parse_cpu_list(optarg, config.reader_cpus)) {
+                cerr << "Invalid CPU list '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_RING_MB:
+            config.ring_bytes = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case OPT_OVERLOAD:
+            if (!parse_overload(optarg, config.overload,
+                                config.decimate_every)) {
+                cerr << "Unknown overload policy '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'b':
+            config.source.buffers = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_IO:
+            if (!parse_io_method(optarg, config.source.io)) {
+                cerr << "Unknown i/o method '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_HUGEPAGES:
+            config.source.hugepages = true;
+            break;
+        case OPT_MLOCK:
+            config.source.lock_buffers = true;
+            break;
+        case 's':
+            config.source.kind = SOURCE_SYNTHETIC;
+            if (sscanf(optarg, "%ux%u", &config.source.width,
+                       &config.source.height) != 2 ||
+                config.source.width == 0 || config.source.height == 0) {
+                cerr << "Invalid frame size '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            config.source.fps = atoi(optarg);
+            break;
+        case 'j':
+            config.source.jitter_us = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            if (!parse_pattern(optarg, config.source.pattern)) {
+                cerr << "Unknown pattern '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            config.source.kind = SOURCE_REPLAY;
+            config.source.replay_dir = optarg;
+            break;
+        case 'm':
+            config.source.replay_max_speed = true;
+            break;
+        case 'l':
+            config.source.replay_loop = true;
+            break;
+        case 'o':
+            if (string(optarg) == "vcap") {
+                config.output = OUTPUT_VCAP;
+            } else if (string(optarg) != "pgm") {
+                cerr << "Unknown output format '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            config.output = OUTPUT_VCAP;
+            config.recording.base = optarg;
+            break;
+        case 'S':
+            config.recording.segment_bytes = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case 'D':
+            config.recording.direct_io = true;
+            break;
+        case 'c':
+            if (!parse_codec(optarg, config.recording.codec)) {
+                cerr << "Unknown codec '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_DISK:
+            if (!parse_backend(optarg, config.recording.backend)) {
+                cerr << "Unknown disk backend '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_IO_DEPTH:
+            config.recording.io_depth = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_HISTORY_MB:
+            config.history_bytes = strtoul(optarg, NULL, 10) << 20;
+            break;
+        case OPT_HISTORY_S:
+            config.history_seconds = atof(optarg);
+            break;
+        case OPT_STATS:
+            config.stats = true;
+            break;
+        case OPT_PREVIEW_FPS:
+            config.preview.fps = atof(optarg);
+            break;
+        case OPT_PREVIEW_SCALE:
+            config.preview.scale = atof(optarg);
+            break;
+        case OPT_NO_PREVIEW:
+            config.preview.enabled = false;
+            break;
+        case OPT_STEREO:
+            if (!parse_stereo(optarg, config.stereo)) {
+                cerr << "Unknown stereo mode '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_RECTIFY:
+            if (!parse_rectify(optarg, config.rectify)) {
+                cerr << "Unknown rectify mode '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_CALIBRATION:
+            calibration = optarg;
+            break;
+        case OPT_RECTIFY_THREADS:
+            config.rectify_threads = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_STAGES: {
+            stage_branches branches;
+            if (!parse_stages(optarg, branches)) {
+                cerr << "Invalid stages '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            config.stages = optarg;
+            // Naming a stage turns it on, in its default mode.
+            if (uses_stage(branches, "rectify") &&
+                config.rectify == RECTIFY_OFF)
+                config.rectify = RECTIFY_REPLACE;
+            if (uses_stage(branches, "split") && config.stereo == STEREO_OFF)
+                config.stereo = STEREO_COPY;
+            break;
+        }
+        case OPT_STAGE_THREADS:
+            config.stage_threads = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_STAGE_CPUS:
+            if (!parse_cpu_list(optarg, config.stage_cpus)) {
+                cerr << "Invalid CPU list '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_STAGE_QUEUE:
+            config.stage_queue = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_GATE:
+            config.gate.threshold = atof(optarg);
+            if (config.gate.threshold < 0 || config.gate.threshold > 100) {
+                cerr << "Gate must be 0 to 100 percent" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_GATE_LEVEL:
+            config.gate.level = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_GATE_PRE:
+            config.gate.pre = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_GATE_POST:
+            config.gate.post = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_GATE_KEEP:
+            config.gate.keep_fps = atof(optarg);
+            break;
+        case OPT_GATE_LOG:
+            config.gate.log = optarg;
+            break;
+        case OPT_BUS:
+            config.bus = optarg;
+            break;
+        case OPT_BUS_SLOTS:
+            config.bus_slots = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_STREAM:
+            config.stream.endpoint = optarg;
+            break;
+        case OPT_STREAM_CODEC:
+            if (!parse_codec(optarg, config.stream.codec)) {
+                cerr << "Unknown codec '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            config.stream.codec = available_codec(config.stream.codec);
+            break;
+        case OPT_STREAM_FPS:
+            config.stream.max_fps = atof(optarg);
+            break;
+        case OPT_STREAM_CLIENTS:
+            config.stream.max_clients = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_CONTROL:
+            config.control = optarg;
+            break;
+        case 'w':
+            config.writer_threads = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_WRITER_CPUS:
+            if (!parse_cpu_list(optarg, config.writer_cpus)) {
+                cerr << "Invalid CPU list '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_WRITE_CPUS:
+            if (!parse_cpu_list(optarg, config.write_cpus)) {
+                cerr << "Invalid CPU list '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_PREVIEW_CPUS:
+            if (!parse_cpu_list(optarg, config.preview.cpus)) {
+                cerr << "Invalid CPU list '" << optarg << "'" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_RT_PRIORITY:
+            config.reader_priority = atoi(optarg);
+            if (config.reader_priority < 0 || config.reader_priority > 99) {
+                cerr << "Priority must be 1-99, or 0 for none" << endl;
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_MLOCKALL:
+            config.lock_memory = true;
+            break;
+        case OPT_JITTER_TEST:
+            config.jitter_seconds = atof(optarg);
+            break;
+        case OPT_LOAD:
+            config.jitter_load = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (config.rectify != RECTIFY_OFF) {
+        if (calibration.empty()) {
+            cerr << "Rectifying needs a --calibration file" << endl;
+            return EXIT_FAILURE;
+        }
+        if (!load_calibration(calibration, config.calibration))
+            return EXIT_FAILURE;
+    }
+
+    CaptureApplication run(config);
     return 0;
 }